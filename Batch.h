@@ -0,0 +1,805 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define MID_BATCH_FORK 1
+#endif
+#if defined(__linux__)
+#include <csignal>
+#include <sys/prctl.h>
+#endif
+
+#include "Image.h"
+#include "Simd.h"
+#include "ThreadPool.h"
+
+// Batch conversion in forked worker processes. A file that crashes the loader only takes down its
+// worker: the supervisor sees the job still marked running under the dead pid, queues it again or
+// quarantines it, and forks a replacement. Workers stay alive across jobs, so process start-up is
+// paid once per worker, and decoded textures are shared between them through a mapped segment.
+// Finished jobs are recorded in a journal, so a batch that is interrupted resumes where it stopped.
+namespace Mid
+{
+	struct BatchJob
+	{
+		std::string input;
+		std::string output;
+	};
+
+	struct BatchOptions
+	{
+		// worker processes, 0 for one per hardware thread
+		int workers = 0;
+		// threads of each worker's pool, 0 to split the hardware threads between the workers
+		int threads = 0;
+		// runs of a job that may crash before it is quarantined
+		int attempts = 2;
+		// size of the shared decoded-texture segment, 0 for none
+		size_t cache_bytes = (size_t)1 << 30;
+		// completion records, <list>.journal when empty
+		std::string journal;
+		// seconds between progress lines
+		int progress_seconds = 30;
+	};
+
+	// One job per line: "input output", tab-separated when the paths contain spaces. Blank lines
+	// and lines starting with # are skipped.
+	inline bool ReadBatchJobs(const std::string& path, std::vector<BatchJob>& jobs, std::string& err)
+	{
+		FILE* fp = fopen(path.c_str(), "rb");
+		if (fp == nullptr)
+		{
+			err = "cannot open " + path;
+			return false;
+		}
+		std::string line;
+		int line_no = 0;
+		bool ok = true;
+		for (int c = fgetc(fp); ok; c = fgetc(fp))
+		{
+			if (c != '\n' && c != EOF)
+			{
+				line.push_back((char)c);
+				continue;
+			}
+			line_no++;
+			while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) line.pop_back();
+			size_t begin = line.find_first_not_of(" \t");
+			if (begin != std::string::npos && line[begin] != '#')
+			{
+				size_t sep = line.find('\t', begin);
+				if (sep == std::string::npos) sep = line.find(' ', begin);
+				size_t second = sep == std::string::npos ? sep : line.find_first_not_of(" \t", sep);
+				if (second == std::string::npos)
+				{
+					err = path + ":" + std::to_string(line_no) + ": expected input and output";
+					ok = false;
+				}
+				else
+				{
+					jobs.push_back({ line.substr(begin, sep - begin), line.substr(second) });
+				}
+			}
+			line.clear();
+			if (c == EOF) break;
+		}
+		fclose(fp);
+		return ok;
+	}
+
+	// Anonymous shared mapping, made before fork so every worker sees the same pages.
+	class SharedSegment
+	{
+	public:
+		SharedSegment(size_t size)
+		{
+#if defined(MID_BATCH_FORK)
+			if (size == 0) return;
+			void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (p != MAP_FAILED)
+			{
+				base = (uint8_t*)p;
+				bytes = size;
+			}
+#else
+			if (size == 0) return;
+			local.resize(size);
+			base = local.data();
+			bytes = size;
+#endif
+		}
+
+		~SharedSegment()
+		{
+#if defined(MID_BATCH_FORK)
+			if (base != nullptr) munmap(base, bytes);
+#endif
+		}
+
+		SharedSegment(const SharedSegment&) = delete;
+		SharedSegment& operator=(const SharedSegment&) = delete;
+
+		uint8_t* data() const { return base; }
+		size_t size() const { return bytes; }
+
+	private:
+		uint8_t* base = nullptr;
+		size_t bytes = 0;
+#if !defined(MID_BATCH_FORK)
+		std::vector<uint8_t> local;
+#endif
+	};
+
+	static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<int32_t>::is_always_lock_free,
+		"batch state lives in memory shared between processes");
+
+	// Decoded source textures shared by all workers. Entries are claimed with a CAS on the key of an
+	// open-addressed table, their bytes come from a bump allocator, and they are published with a
+	// release store of the state; once ready an entry is never written again. A worker that finds
+	// an entry still being written, or the segment full, simply decodes for itself.
+	class SharedImageCache
+	{
+	public:
+		SharedImageCache(SharedSegment& segment) : segment(segment)
+		{
+			if (segment.size() < sizeof(Header) + sizeof(Entry) * num_entries) return;
+			header = new (segment.data()) Header();
+			entries = (Entry*)(segment.data() + sizeof(Header));
+			for (size_t i = 0; i < num_entries; i++) new (&entries[i]) Entry();
+			data_begin = sizeof(Header) + sizeof(Entry) * num_entries;
+		}
+
+		bool fetch(const std::string& path, Image& img) const
+		{
+			if (header == nullptr) return false;
+			uint64_t key = key_of(path);
+			for (size_t probe = 0; probe < num_entries; probe++)
+			{
+				const Entry& e = entries[(key + probe) % num_entries];
+				uint64_t k = e.key.load(std::memory_order_acquire);
+				if (k == 0) return false;
+				if (k != key) continue;
+				if (e.state.load(std::memory_order_acquire) != Ready) return false;
+				const uint8_t* p = segment.data() + e.offset;
+				if (e.path_size != path.size() || memcmp(p, path.data(), path.size()) != 0) continue;
+				p += e.path_size;
+				img.width = e.width;
+				img.height = e.height;
+				img.mimeType = e.mime;
+				img.pixels.assign(p, p + e.pixels_size);
+				p += e.pixels_size;
+				img.code.assign(p, p + e.code_size);
+				img.source = path;
+				return true;
+			}
+			return false;
+		}
+
+		void publish(const std::string& path, const Image& img)
+		{
+			if (header == nullptr || img.width < 0 || img.mimeType.size() >= sizeof(Entry::mime)) return;
+			uint64_t key = key_of(path);
+			for (size_t probe = 0; probe < num_entries; probe++)
+			{
+				Entry& e = entries[(key + probe) % num_entries];
+				uint64_t expected = 0;
+				if (!e.key.compare_exchange_strong(expected, key, std::memory_order_acq_rel) && expected == key) return;
+				if (expected != 0) continue;
+
+				uint64_t size = path.size() + img.pixels.size() + img.code.size();
+				uint64_t offset = data_begin + header->used.fetch_add((size + 15) & ~(uint64_t)15, std::memory_order_relaxed);
+				if (offset + size > segment.size())
+				{
+					e.state.store(Failed, std::memory_order_release);
+					return;
+				}
+				uint8_t* p = segment.data() + offset;
+				memcpy(p, path.data(), path.size());
+				memcpy(p + path.size(), img.pixels.data(), img.pixels.size());
+				memcpy(p + path.size() + img.pixels.size(), img.code.data(), img.code.size());
+				e.offset = offset;
+				e.path_size = path.size();
+				e.pixels_size = img.pixels.size();
+				e.code_size = img.code.size();
+				e.width = img.width;
+				e.height = img.height;
+				snprintf(e.mime, sizeof(e.mime), "%s", img.mimeType.c_str());
+				e.state.store(Ready, std::memory_order_release);
+				return;
+			}
+		}
+
+	private:
+		enum { Writing = 0, Ready = 1, Failed = 2 };
+		static const size_t num_entries = 8192;
+
+		struct Header
+		{
+			std::atomic<uint64_t> used{ 0 };
+		};
+
+		struct Entry
+		{
+			std::atomic<uint64_t> key{ 0 };
+			std::atomic<int32_t> state{ Writing };
+			int32_t width = 0;
+			int32_t height = 0;
+			char mime[16] = {};
+			uint64_t offset = 0;
+			uint64_t path_size = 0;
+			uint64_t pixels_size = 0;
+			uint64_t code_size = 0;
+		};
+
+		static uint64_t key_of(const std::string& path)
+		{
+			return Simd().crc64(0, (const unsigned char*)path.data(), path.size()) | 1;
+		}
+
+		SharedSegment& segment;
+		Header* header = nullptr;
+		Entry* entries = nullptr;
+		uint64_t data_begin = 0;
+	};
+
+	inline uint64_t HashFile(const std::string& path)
+	{
+		uint64_t hash = 0;
+		FILE* fp = fopen(path.c_str(), "rb");
+		if (fp == nullptr) return hash;
+		std::vector<unsigned char> buf((size_t)1 << 20);
+		for (size_t n = fread(buf.data(), 1, buf.size(), fp); n > 0; n = fread(buf.data(), 1, buf.size(), fp))
+		{
+			hash = Simd().crc64(hash, buf.data(), n);
+		}
+		fclose(fp);
+		return hash;
+	}
+
+	// Size and modification time; while both match the journal, the input is not hashed again.
+	inline bool FileStamp(const std::string& path, uint64_t& size, int64_t& mtime)
+	{
+		std::error_code ec;
+		size = (uint64_t)std::filesystem::file_size(path, ec);
+		if (ec) return false;
+		mtime = (int64_t)std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+		return !ec;
+	}
+
+	inline std::string FormatDuration(double seconds)
+	{
+		long long s = (long long)(seconds + 0.5);
+		char text[32];
+		if (s >= 3600) snprintf(text, sizeof(text), "%lldh%02lldm%02llds", s / 3600, s / 60 % 60, s % 60);
+		else if (s >= 60) snprintf(text, sizeof(text), "%lldm%02llds", s / 60, s % 60);
+		else snprintf(text, sizeof(text), "%llds", s);
+		return text;
+	}
+
+	// One finished job: "status hash size mtime output_size micros exit input output", tab-separated.
+	struct JournalRecord
+	{
+		// done, failed or quarantined
+		std::string status;
+		uint64_t hash = 0;
+		uint64_t size = 0;
+		int64_t mtime = 0;
+		uint64_t output_size = 0;
+		int64_t micros = 0;
+		int exit_code = 0;
+		std::string input;
+		std::string output;
+	};
+
+	// Append-only log of finished jobs, shared by the supervisor and the workers through one
+	// O_APPEND descriptor. Every record is a single write() followed by fsync(), so records from
+	// different workers never interleave and a record that was read back was on disk. A torn last
+	// line left by an interrupted write is ignored when the journal is read.
+	class BatchJournal
+	{
+	public:
+		~BatchJournal()
+		{
+#if defined(MID_BATCH_FORK)
+			if (fd >= 0) close(fd);
+#else
+			if (fp != nullptr) fclose(fp);
+#endif
+		}
+
+		bool open(const std::string& path, std::string& err)
+		{
+			FILE* in = fopen(path.c_str(), "rb");
+			if (in != nullptr)
+			{
+				std::string line;
+				for (int c = fgetc(in); c != EOF; c = fgetc(in))
+				{
+					if (c != '\n')
+					{
+						line.push_back((char)c);
+						continue;
+					}
+					JournalRecord record;
+					if (parse(line, record))
+					{
+						if (record.status == "done")
+						{
+							history_micros += record.micros;
+							history_count++;
+						}
+						records[record.input] = record;
+					}
+					line.clear();
+				}
+				fclose(in);
+			}
+#if defined(MID_BATCH_FORK)
+			fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+			if (fd < 0)
+#else
+			fp = fopen(path.c_str(), "ab");
+			if (fp == nullptr)
+#endif
+			{
+				err = "cannot open " + path;
+				return false;
+			}
+			return true;
+		}
+
+		// Latest record of an input, or null.
+		const JournalRecord* find(const std::string& input) const
+		{
+			auto iter = records.find(input);
+			return iter == records.end() ? nullptr : &iter->second;
+		}
+
+		void append(const JournalRecord& record) const
+		{
+			char head[192];
+			snprintf(head, sizeof(head), "%s\t%016llx\t%llu\t%lld\t%llu\t%lld\t%d\t", record.status.c_str(), (unsigned long long)record.hash,
+				(unsigned long long)record.size, (long long)record.mtime, (unsigned long long)record.output_size, (long long)record.micros, record.exit_code);
+			std::string line = head + record.input + "\t" + record.output + "\n";
+#if defined(MID_BATCH_FORK)
+			if (fd < 0) return;
+			if (write(fd, line.data(), line.size()) == (ssize_t)line.size()) fsync(fd);
+#else
+			if (fp == nullptr) return;
+			fwrite(line.data(), 1, line.size(), fp);
+			fflush(fp);
+#endif
+		}
+
+		// Run time of the jobs completed by earlier runs.
+		int64_t history_micros = 0;
+		size_t history_count = 0;
+
+	private:
+		static bool parse(const std::string& line, JournalRecord& record)
+		{
+			std::vector<std::string> fields;
+			size_t begin = 0;
+			for (size_t i = 0; i <= line.size(); i++)
+			{
+				if (i < line.size() && line[i] != '\t') continue;
+				fields.push_back(line.substr(begin, i - begin));
+				begin = i + 1;
+			}
+			if (fields.size() != 9) return false;
+			record.status = fields[0];
+			record.hash = strtoull(fields[1].c_str(), nullptr, 16);
+			record.size = strtoull(fields[2].c_str(), nullptr, 10);
+			record.mtime = strtoll(fields[3].c_str(), nullptr, 10);
+			record.output_size = strtoull(fields[4].c_str(), nullptr, 10);
+			record.micros = strtoll(fields[5].c_str(), nullptr, 10);
+			record.exit_code = atoi(fields[6].c_str());
+			record.input = fields[7];
+			record.output = fields[8];
+			return true;
+		}
+
+		std::unordered_map<std::string, JournalRecord> records;
+#if defined(MID_BATCH_FORK)
+		int fd = -1;
+#else
+		FILE* fp = nullptr;
+#endif
+	};
+
+	enum class BatchState : int32_t
+	{
+		Pending,
+		Running,
+		Done,
+		Failed,
+		Quarantined,
+		// done by an earlier run, per the journal
+		Skipped,
+	};
+
+	// Per-job record in the shared control segment.
+	struct BatchSlot
+	{
+		std::atomic<int32_t> state{ (int32_t)BatchState::Pending };
+		std::atomic<int32_t> attempts{ 0 };
+		// owner that took the job from the ring, 0 while nobody has
+		std::atomic<int32_t> worker{ 0 };
+		std::atomic<int32_t> exit_code{ 0 };
+		std::atomic<int64_t> micros{ 0 };
+	};
+
+	// Job indices from the supervisor (the only producer) to the workers. A worker takes the job at
+	// head by setting its slot's owner from 0 with a CAS, so every push of a job has exactly one
+	// owner, also when that worker dies right after; whoever gets there first then moves head past
+	// the entry. A job is in the ring at most once at a time, so capacity equal to the job count
+	// never overflows.
+	struct JobRing
+	{
+		std::atomic<uint64_t> head{ 0 };
+		std::atomic<uint64_t> tail{ 0 };
+		std::atomic<int32_t> closed{ 0 };
+		std::atomic<uint64_t> finished{ 0 };
+		uint64_t capacity = 0;
+
+		std::atomic<int32_t>* entries() { return (std::atomic<int32_t>*)(this + 1); }
+
+		void push(int32_t job)
+		{
+			uint64_t t = tail.load(std::memory_order_relaxed);
+			entries()[t % capacity].store(job, std::memory_order_relaxed);
+			tail.store(t + 1, std::memory_order_release);
+		}
+
+		// Next job, now owned by owner (non-zero), or -1 once the ring is closed and empty. The owner
+		// is recorded by the same CAS that takes the job, so the supervisor can tell which jobs a
+		// dead worker held without racing the others.
+		int32_t pop(BatchSlot* slots, int32_t owner)
+		{
+			for (;;)
+			{
+				uint64_t h = head.load(std::memory_order_acquire);
+				if (h < tail.load(std::memory_order_acquire))
+				{
+					int32_t job = entries()[h % capacity].load(std::memory_order_relaxed);
+					int32_t unowned = 0;
+					bool taken = job >= 0 && slots[job].worker.compare_exchange_strong(unowned, owner, std::memory_order_acq_rel);
+					// fails when another worker already moved head, taker or not
+					head.compare_exchange_strong(h, h + 1, std::memory_order_acq_rel);
+					if (taken) return job;
+					continue;
+				}
+				if (closed.load(std::memory_order_acquire)) return -1;
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+
+		bool contains(int32_t job)
+		{
+			uint64_t t = tail.load(std::memory_order_acquire);
+			for (uint64_t i = head.load(std::memory_order_acquire); i < t; i++)
+			{
+				if (entries()[i % capacity].load(std::memory_order_relaxed) == job) return true;
+			}
+			return false;
+		}
+	};
+
+	typedef std::function<int(const BatchJob& job, ThreadPool& pool, ImageCache& image_cache)> BatchConvertFunc;
+
+	// Runs every job the journal does not already list as done and prints a summary; returns 0
+	// when all of them converted. Jobs whose worker crashed options.attempts times are listed in
+	// <list_path>.quarantine. The convert function must write its output under a temporary name
+	// and rename it, so an output without a done record is never mistaken for a finished one.
+	inline int RunBatch(const std::vector<BatchJob>& jobs, const std::string& list_path, const BatchOptions& options, const BatchConvertFunc& convert)
+	{
+		auto start = std::chrono::steady_clock::now();
+		size_t num_jobs = jobs.size();
+
+		BatchJournal journal;
+		{
+			std::string err;
+			if (!journal.open(options.journal.empty() ? list_path + ".journal" : options.journal, err))
+			{
+				printf("batch: %s\n", err.c_str());
+				return 1;
+			}
+		}
+
+		// done earlier: same output, output still there at the recorded size, and the same input
+		// (by stamp, or by hash when the stamp changed)
+		std::vector<bool> skip(num_jobs, false);
+		size_t num_skipped = 0;
+		for (size_t j = 0; j < num_jobs; j++)
+		{
+			const JournalRecord* record = journal.find(jobs[j].input);
+			std::error_code ec;
+			if (record != nullptr && record->status == "done" && record->output == jobs[j].output
+				&& std::filesystem::file_size(jobs[j].output, ec) == record->output_size && !ec)
+			{
+				uint64_t size = 0;
+				int64_t mtime = 0;
+				if (FileStamp(jobs[j].input, size, mtime) && size == record->size && (mtime == record->mtime || HashFile(jobs[j].input) == record->hash))
+				{
+					skip[j] = true;
+					num_skipped++;
+					continue;
+				}
+			}
+			std::filesystem::remove(jobs[j].output + ".tmp", ec);
+		}
+		size_t num_run = num_jobs - num_skipped;
+
+		int hardware = std::max((int)std::thread::hardware_concurrency(), 1);
+		int num_workers = options.workers > 0 ? options.workers : hardware;
+		num_workers = std::max(std::min(num_workers, (int)num_run), 1);
+		int threads = options.threads > 0 ? options.threads : std::max(hardware / num_workers, 1);
+		int attempts = std::max(options.attempts, 1);
+
+		size_t slots_offset = sizeof(JobRing) + sizeof(std::atomic<int32_t>) * std::max(num_jobs, (size_t)1);
+		slots_offset = (slots_offset + alignof(BatchSlot) - 1) / alignof(BatchSlot) * alignof(BatchSlot);
+		size_t control_size = slots_offset + sizeof(BatchSlot) * num_jobs;
+		SharedSegment control(control_size);
+		SharedSegment textures(options.cache_bytes);
+		if (control.data() == nullptr)
+		{
+			printf("batch: cannot map %zu bytes of shared memory\n", control_size);
+			return 1;
+		}
+		JobRing* ring = new (control.data()) JobRing();
+		ring->capacity = std::max(num_jobs, (size_t)1);
+		for (size_t i = 0; i < ring->capacity; i++) new (&ring->entries()[i]) std::atomic<int32_t>(-1);
+		BatchSlot* slots = (BatchSlot*)((char*)control.data() + slots_offset);
+		for (size_t i = 0; i < num_jobs; i++) new (&slots[i]) BatchSlot();
+		SharedImageCache shared_images(textures);
+
+		// mean run time from the journal, then from this run as well
+		auto print_eta = [&](size_t remaining)
+		{
+			int64_t micros = journal.history_micros;
+			size_t count = journal.history_count;
+			for (size_t j = 0; j < num_jobs; j++)
+			{
+				if (slots[j].state.load(std::memory_order_acquire) != (int32_t)BatchState::Done) continue;
+				micros += slots[j].micros.load();
+				count++;
+			}
+			size_t finished = (size_t)ring->finished.load() - num_skipped;
+			double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (count == 0)
+			{
+				printf("batch: %zu of %zu to run, %zu done earlier\n", remaining, num_jobs, num_skipped);
+				return;
+			}
+			double eta = remaining * (micros * 1e-6 / count) / num_workers;
+			printf("batch: %zu of %zu done (%zu earlier), %zu left, %.2f files/s, ETA %s\n", num_skipped + finished, num_jobs, num_skipped, remaining,
+				elapsed > 0.0 ? finished / elapsed : 0.0, FormatDuration(eta).c_str());
+			fflush(stdout);
+		};
+
+		auto run_job = [&](int32_t j, int pid, ThreadPool& pool)
+		{
+			BatchSlot& slot = slots[j];
+			slot.attempts.fetch_add(1);
+			slot.state.store((int32_t)BatchState::Running, std::memory_order_release);
+
+			auto job_start = std::chrono::steady_clock::now();
+			ImageCache image_cache;
+			image_cache.fetch = [&](const std::string& path, Image& img) { return shared_images.fetch(path, img); };
+			image_cache.publish = [&](const std::string& path, const Image& img) { shared_images.publish(path, img); };
+			int code = convert(jobs[j], pool, image_cache);
+			fflush(stdout);
+
+			JournalRecord record;
+			record.status = code == 0 ? "done" : "failed";
+			record.micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - job_start).count();
+			record.exit_code = code;
+			record.input = jobs[j].input;
+			record.output = jobs[j].output;
+			FileStamp(record.input, record.size, record.mtime);
+			record.hash = HashFile(record.input);
+			std::error_code ec;
+			uintmax_t output_size = std::filesystem::file_size(record.output, ec);
+			record.output_size = ec ? 0 : (uint64_t)output_size;
+			journal.append(record);
+
+			slot.micros.store(record.micros);
+			slot.exit_code.store(code);
+			slot.state.store((int32_t)(code == 0 ? BatchState::Done : BatchState::Failed), std::memory_order_release);
+			ring->finished.fetch_add(1, std::memory_order_acq_rel);
+		};
+
+		for (size_t i = 0; i < num_jobs; i++)
+		{
+			if (skip[i])
+			{
+				slots[i].state.store((int32_t)BatchState::Skipped);
+				ring->finished.fetch_add(1);
+			}
+			else
+			{
+				ring->push((int32_t)i);
+			}
+		}
+		print_eta(num_run);
+		auto last_progress = std::chrono::steady_clock::now();
+
+#if defined(MID_BATCH_FORK)
+		auto spawn = [&]()
+		{
+			fflush(stdout);
+			pid_t pid = fork();
+			if (pid == 0)
+			{
+#if defined(__linux__)
+				// workers go down with a preempted supervisor instead of racing its restart
+				prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+				ThreadPool pool(threads);
+				int self = (int)getpid();
+				for (int32_t j = ring->pop(slots, self); j >= 0; j = ring->pop(slots, self)) run_job(j, self, pool);
+				fflush(stdout);
+				_exit(0);
+			}
+			return pid;
+		};
+
+		// pid of each worker index, 0 once it has exited
+		std::vector<pid_t> workers(num_workers, 0);
+		int alive = 0;
+		for (int w = 0; w < num_workers; w++)
+		{
+			workers[w] = spawn();
+			if (workers[w] > 0) alive++;
+			else workers[w] = 0;
+		}
+		if (alive == 0)
+		{
+			printf("batch: cannot fork workers\n");
+			return 1;
+		}
+
+		while (alive > 0)
+		{
+			if (ring->finished.load(std::memory_order_acquire) >= num_jobs) ring->closed.store(1, std::memory_order_release);
+			auto now = std::chrono::steady_clock::now();
+			if (options.progress_seconds > 0 && !ring->closed.load() && now - last_progress >= std::chrono::seconds(options.progress_seconds))
+			{
+				print_eta(num_jobs - (size_t)ring->finished.load());
+				last_progress = now;
+			}
+
+			int status = 0;
+			pid_t pid = waitpid(-1, &status, ring->closed.load() ? 0 : WNOHANG);
+			if (pid == 0)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				continue;
+			}
+			if (pid < 0) break;
+			auto iter = std::find(workers.begin(), workers.end(), pid);
+			if (iter == workers.end()) continue;
+			int w = (int)(iter - workers.begin());
+			workers[w] = 0;
+			alive--;
+
+			for (size_t j = 0; j < num_jobs; j++)
+			{
+				BatchSlot& slot = slots[j];
+				if (slot.worker.load(std::memory_order_acquire) != (int32_t)pid) continue;
+				int32_t state = slot.state.load(std::memory_order_acquire);
+
+				// taken from the ring but never marked running: the worker died in between. The
+				// entry may still be at head, where the next worker takes it once it is unowned.
+				if (state == (int32_t)BatchState::Pending)
+				{
+					slot.worker.store(0, std::memory_order_release);
+					if (!ring->contains((int32_t)j)) ring->push((int32_t)j);
+					continue;
+				}
+
+				// a job still running under this pid is what killed the worker
+				if (state != (int32_t)BatchState::Running) continue;
+				char reason[64];
+				if (WIFSIGNALED(status)) snprintf(reason, sizeof(reason), "signal %d", WTERMSIG(status));
+				else snprintf(reason, sizeof(reason), "exit %d", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+				if (slot.attempts.load() < attempts)
+				{
+					printf("batch: %s crashed the worker (%s), retrying\n", jobs[j].input.c_str(), reason);
+					slot.state.store((int32_t)BatchState::Pending);
+					slot.worker.store(0, std::memory_order_release);
+					ring->push((int32_t)j);
+				}
+				else
+				{
+					printf("batch: %s crashed the worker (%s), quarantined\n", jobs[j].input.c_str(), reason);
+					slot.exit_code.store(WIFSIGNALED(status) ? 128 + WTERMSIG(status) : 1);
+					JournalRecord record;
+					record.status = "quarantined";
+					record.exit_code = slot.exit_code.load();
+					record.input = jobs[j].input;
+					record.output = jobs[j].output;
+					FileStamp(record.input, record.size, record.mtime);
+					journal.append(record);
+					slot.state.store((int32_t)BatchState::Quarantined);
+					ring->finished.fetch_add(1, std::memory_order_acq_rel);
+				}
+			}
+
+			if (!ring->closed.load() && ring->finished.load(std::memory_order_acquire) < num_jobs)
+			{
+				workers[w] = spawn();
+				if (workers[w] > 0) alive++;
+				else workers[w] = 0;
+			}
+		}
+#else
+		{
+			ThreadPool pool(threads);
+			ring->closed.store(1);
+			for (int32_t j = ring->pop(slots, 1); j >= 0; j = ring->pop(slots, 1)) run_job(j, 1, pool);
+		}
+#endif
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		size_t counts[6] = { 0, 0, 0, 0, 0, 0 };
+		double job_seconds = 0.0;
+		uintmax_t bytes_in = 0;
+		uintmax_t bytes_out = 0;
+		std::vector<std::string> quarantined;
+		for (size_t j = 0; j < num_jobs; j++)
+		{
+			BatchState state = (BatchState)slots[j].state.load();
+			counts[(int)state]++;
+			if (state == BatchState::Quarantined) quarantined.push_back(jobs[j].input + "\t" + jobs[j].output);
+			if (state == BatchState::Failed) printf("batch: %s failed (exit %d)\n", jobs[j].input.c_str(), slots[j].exit_code.load());
+			if (state != BatchState::Done) continue;
+			job_seconds += slots[j].micros.load() * 1e-6;
+			std::error_code ec;
+			uintmax_t size = std::filesystem::file_size(jobs[j].input, ec);
+			if (!ec) bytes_in += size;
+			size = std::filesystem::file_size(jobs[j].output, ec);
+			if (!ec) bytes_out += size;
+		}
+
+		if (!quarantined.empty())
+		{
+			std::string path = list_path + ".quarantine";
+			FILE* fp = fopen(path.c_str(), "wb");
+			if (fp != nullptr)
+			{
+				for (size_t i = 0; i < quarantined.size(); i++) fprintf(fp, "%s\n", quarantined[i].c_str());
+				fclose(fp);
+				printf("batch: quarantined jobs listed in %s\n", path.c_str());
+			}
+		}
+
+		size_t done = counts[(int)BatchState::Done];
+		printf("batch: %zu done, %zu failed, %zu quarantined, %zu done earlier of %zu in %.2fs with %d workers x %d threads\n",
+			done, counts[(int)BatchState::Failed], counts[(int)BatchState::Quarantined], num_skipped, num_jobs, seconds, num_workers, threads);
+		if (seconds > 0.0 && done > 0)
+		{
+			printf("batch: %.2f files/s, %.1f MB/s in, %.1f MB/s out, %.2fs per file\n",
+				done / seconds, bytes_in / seconds / 1e6, bytes_out / seconds / 1e6, job_seconds / done);
+		}
+		return done + num_skipped == num_jobs ? 0 : 1;
+	}
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <cfloat>
+#include <algorithm>
+#include <vector>
+#include <glm.hpp>
+#include <gtc/quaternion.hpp>
+#include <gtc/matrix_transform.hpp>
+#include <gtx/matrix_decompose.hpp>
+
+#include "ThreadPool.h"
+
+namespace Mid
+{
+	struct AABB
+	{
+		glm::vec3 min_v = glm::vec3(FLT_MAX);
+		glm::vec3 max_v = glm::vec3(-FLT_MAX);
+
+		bool valid() const { return min_v.x <= max_v.x; }
+
+		void add(const glm::vec3& p)
+		{
+			min_v = glm::min(min_v, p);
+			max_v = glm::max(max_v, p);
+		}
+
+		void merge(const AABB& other)
+		{
+			if (!other.valid()) return;
+			min_v = glm::min(min_v, other.min_v);
+			max_v = glm::max(max_v, other.max_v);
+		}
+
+		AABB transformed(const glm::mat4& mat) const;
+	};
+
+	AABB AABB::transformed(const glm::mat4& mat) const
+	{
+		AABB ret;
+		if (!valid()) return ret;
+		for (int i = 0; i < 8; i++)
+		{
+			glm::vec3 corner = { (i & 1) ? max_v.x : min_v.x, (i & 2) ? max_v.y : min_v.y, (i & 4) ? max_v.z : min_v.z };
+			ret.add(glm::vec3(mat * glm::vec4(corner, 1.0f)));
+		}
+		return ret;
+	}
+
+	// Bind-space bounds of every joint: each vertex influencing joint j with weight > epsilon is
+	// brought into the joint's space by its inverse bind matrix. Results are merged into joint_bounds,
+	// so several meshes bound to the same skeleton accumulate into one set.
+	inline void ComputeJointBounds(ThreadPool& pool, const glm::vec3* points, size_t num_points,
+		const glm::u16vec4* joints, const glm::vec4* weights,
+		const std::vector<glm::mat4>& inv_bind, float epsilon, std::vector<AABB>& joint_bounds)
+	{
+		size_t num_joints = inv_bind.size();
+		joint_bounds.resize(num_joints);
+
+		const size_t chunk_size = 4096;
+		size_t num_chunks = (num_points + chunk_size - 1) / chunk_size;
+		std::vector<std::vector<AABB>> partials(num_chunks);
+
+		pool.parallel_for(num_chunks, [&](size_t c)
+			{
+				std::vector<AABB>& part = partials[c];
+				part.resize(num_joints);
+				size_t begin = c * chunk_size;
+				size_t end = std::min(begin + chunk_size, num_points);
+				for (size_t i = begin; i < end; i++)
+				{
+					for (int k = 0; k < 4; k++)
+					{
+						unsigned j = joints[i][k];
+						if (weights[i][k] <= epsilon || j >= num_joints) continue;
+						part[j].add(glm::vec3(inv_bind[j] * glm::vec4(points[i], 1.0f)));
+					}
+				}
+			});
+
+		for (size_t c = 0; c < num_chunks; c++)
+		{
+			for (size_t j = 0; j < num_joints; j++)
+			{
+				joint_bounds[j].merge(partials[c][j]);
+			}
+		}
+	}
+
+	// Joint tracks of one SkelAnimation, already remapped to skeleton joint order.
+	// A joint whose track index is -1 stays at its rest transform.
+	struct ClipSamples
+	{
+		std::vector<double> trans_times;
+		std::vector<std::vector<glm::vec3>> translations;
+		std::vector<double> rot_times;
+		std::vector<std::vector<glm::quat>> rotations;
+		std::vector<double> scale_times;
+		std::vector<std::vector<glm::vec3>> scales;
+		std::vector<int> track_of_joint;
+	};
+
+	// Value of one track at t, or fallback where a sample has no entry for the track.
+	inline glm::vec3 SampleTrack(const std::vector<double>& times, const std::vector<std::vector<glm::vec3>>& values, int track, double t, const glm::vec3& fallback)
+	{
+		auto get = [&](size_t k) { return track >= 0 && (size_t)track < values[k].size() ? values[k][track] : fallback; };
+		size_t k = std::upper_bound(times.begin(), times.end(), t) - times.begin();
+		if (k == 0) return get(0);
+		if (k >= times.size()) return get(times.size() - 1);
+		float f = (float)((t - times[k - 1]) / (times[k] - times[k - 1]));
+		return glm::mix(get(k - 1), get(k), f);
+	}
+
+	inline glm::quat SampleTrack(const std::vector<double>& times, const std::vector<std::vector<glm::quat>>& values, int track, double t, const glm::quat& fallback)
+	{
+		auto get = [&](size_t k) { return track >= 0 && (size_t)track < values[k].size() ? values[k][track] : fallback; };
+		size_t k = std::upper_bound(times.begin(), times.end(), t) - times.begin();
+		if (k == 0) return get(0);
+		if (k >= times.size()) return get(times.size() - 1);
+		float f = (float)((t - times[k - 1]) / (times[k] - times[k - 1]));
+		return glm::slerp(get(k - 1), get(k), f);
+	}
+
+	// Skeleton-space box enclosing every joint's bind-space box over the whole clip.
+	// parents[] must list parents before children, as USD requires for Skeleton.joints.
+	// The pose is evaluated at every key time and at substeps points between two keys, in
+	// parallel, one joint hierarchy walk per sample. Between two samples a joint box moves along
+	// a curve (rotations sweep arcs), so each pair of neighbouring boxes is merged and padded by
+	// half the distance its corners moved, which covers the arc's bulge beyond the chord.
+	inline AABB ComputeClipBounds(ThreadPool& pool, const ClipSamples& clip,
+		const std::vector<int>& parents, const std::vector<glm::mat4>& rest_local,
+		const std::vector<AABB>& joint_bounds, int substeps = 4)
+	{
+		std::vector<double> keys = clip.trans_times;
+		keys.insert(keys.end(), clip.rot_times.begin(), clip.rot_times.end());
+		keys.insert(keys.end(), clip.scale_times.begin(), clip.scale_times.end());
+		std::sort(keys.begin(), keys.end());
+		keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+		std::vector<double> times;
+		for (size_t k = 0; k < keys.size(); k++)
+		{
+			times.push_back(keys[k]);
+			if (k + 1 == keys.size()) break;
+			for (int s = 1; s < substeps; s++)
+			{
+				times.push_back(keys[k] + (keys[k + 1] - keys[k]) * s / substeps);
+			}
+		}
+
+		size_t num_joints = parents.size();
+		size_t num_bounds = std::min(num_joints, joint_bounds.size());
+		std::vector<glm::vec3> rest_trans(num_joints);
+		std::vector<glm::quat> rest_rot(num_joints);
+		std::vector<glm::vec3> rest_scale(num_joints);
+		for (size_t j = 0; j < num_joints; j++)
+		{
+			glm::vec3 skew;
+			glm::vec4 persp;
+			glm::decompose(rest_local[j], rest_scale[j], rest_rot[j], rest_trans[j], skew, persp);
+		}
+
+		// joint boxes of each sample, num_bounds per sample
+		std::vector<AABB> pose_bounds(times.size() * num_bounds);
+		pool.parallel_for(times.size(), [&](size_t k)
+			{
+				double t = times[k];
+				std::vector<glm::mat4> skel_mats(num_joints);
+				for (size_t j = 0; j < num_joints; j++)
+				{
+					glm::mat4 local = rest_local[j];
+					int track = j < clip.track_of_joint.size() ? clip.track_of_joint[j] : -1;
+					if (track >= 0)
+					{
+						glm::vec3 trans = clip.trans_times.size() > 0 ? SampleTrack(clip.trans_times, clip.translations, track, t, rest_trans[j]) : rest_trans[j];
+						glm::quat rot = clip.rot_times.size() > 0 ? SampleTrack(clip.rot_times, clip.rotations, track, t, rest_rot[j]) : rest_rot[j];
+						glm::vec3 scale = clip.scale_times.size() > 0 ? SampleTrack(clip.scale_times, clip.scales, track, t, rest_scale[j]) : rest_scale[j];
+						local = glm::translate(glm::mat4(1.0f), trans) * glm::mat4_cast(rot) * glm::scale(glm::mat4(1.0f), scale);
+					}
+					int parent = parents[j];
+					skel_mats[j] = parent >= 0 && (size_t)parent < j ? skel_mats[parent] * local : local;
+					if (j < num_bounds)
+					{
+						pose_bounds[k * num_bounds + j] = joint_bounds[j].transformed(skel_mats[j]);
+					}
+				}
+			});
+
+		AABB ret;
+		for (size_t k = 0; k < times.size(); k++)
+		{
+			for (size_t j = 0; j < num_bounds; j++)
+			{
+				const AABB& box = pose_bounds[k * num_bounds + j];
+				ret.merge(box);
+				if (k + 1 == times.size() || !box.valid()) continue;
+
+				const AABB& next = pose_bounds[(k + 1) * num_bounds + j];
+				glm::vec3 moved = glm::max(glm::abs(next.min_v - box.min_v), glm::abs(next.max_v - box.max_v));
+				float pad = 0.5f * glm::length(moved);
+				AABB swept = box;
+				swept.merge(next);
+				swept.min_v -= glm::vec3(pad);
+				swept.max_v += glm::vec3(pad);
+				ret.merge(swept);
+			}
+		}
+		return ret;
+	}
+}
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <tiny_gltf.h>
+
+#include "Simd.h"
+
+// Single place where payloads are appended to the output buffer.
+namespace Mid
+{
+	template<typename T> struct ComponentTraits;
+	template<> struct ComponentTraits<float> { static constexpr int component_type = TINYGLTF_COMPONENT_TYPE_FLOAT; };
+	template<> struct ComponentTraits<int8_t> { static constexpr int component_type = TINYGLTF_COMPONENT_TYPE_BYTE; };
+	template<> struct ComponentTraits<uint8_t> { static constexpr int component_type = TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE; };
+	template<> struct ComponentTraits<int16_t> { static constexpr int component_type = TINYGLTF_COMPONENT_TYPE_SHORT; };
+	template<> struct ComponentTraits<uint16_t> { static constexpr int component_type = TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT; };
+	template<> struct ComponentTraits<uint32_t> { static constexpr int component_type = TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT; };
+
+	template<int N> struct TypeTraits;
+	template<> struct TypeTraits<1> { static constexpr int type = TINYGLTF_TYPE_SCALAR; };
+	template<> struct TypeTraits<2> { static constexpr int type = TINYGLTF_TYPE_VEC2; };
+	template<> struct TypeTraits<3> { static constexpr int type = TINYGLTF_TYPE_VEC3; };
+	template<> struct TypeTraits<4> { static constexpr int type = TINYGLTF_TYPE_VEC4; };
+	template<> struct TypeTraits<16> { static constexpr int type = TINYGLTF_TYPE_MAT4; };
+
+	// Appends payloads to one buffer of the model and creates their bufferViews and accessors.
+	// Every payload starts on a 4-byte boundary, which satisfies both accessor component alignment
+	// and the vertex attribute stride rule for 1- and 2-byte streams.
+	// A payload byte-identical to an earlier one with the same target reuses that bufferView and
+	// its bytes are dropped again. The lookup only covers views emitted through this writer, so it
+	// must not outlive a pass that rewrites bufferViews (PruneUnusedData).
+	class BufferWriter
+	{
+	public:
+		BufferWriter(tinygltf::Model& model, int buffer = 0) : model(model), buffer(buffer) {}
+
+		static constexpr size_t alignment = 4;
+
+		// Raw bytes as a new bufferView; returns its index.
+		int emit_view(const void* data, size_t length, int target = 0, int stride = 0);
+
+		// count elements of N components each; ElemT is any tightly packed element type of that
+		// size (glm vectors, matrices, or the component type itself). With bounds, min/max are
+		// computed while copying.
+		template<typename ComponentT, int N, bool Normalized = false, typename ElemT>
+		int emit_accessor(const ElemT* data, size_t count, int target = 0, bool bounds = false);
+
+		template<typename ComponentT, int N, bool Normalized = false, typename ElemT>
+		int emit_accessor(const std::vector<ElemT>& data, int target = 0, bool bounds = false)
+		{
+			return emit_accessor<ComponentT, N, Normalized>(data.data(), data.size(), target, bounds);
+		}
+
+		// Vertex attribute whose N components do not fill a multiple of 4 bytes (quantized VEC3
+		// positions): data holds Stride components per element, the ones past N being padding, and
+		// the view gets the matching byteStride. Bounds cover the first N components.
+		template<typename ComponentT, int N, int Stride, bool Normalized = false>
+		int emit_padded_accessor(const ComponentT* data, size_t count, int target = TINYGLTF_TARGET_ARRAY_BUFFER, bool bounds = false);
+
+		// Sparse accessor of count elements, zero except at the strictly increasing indices.
+		template<typename ComponentT, int N, typename ElemT>
+		int emit_sparse_accessor(size_t count, const std::vector<uint32_t>& indices, const std::vector<ElemT>& values, bool bounds = false);
+
+	private:
+		tinygltf::Model& model;
+		int buffer;
+
+		// payload hash -> views holding it
+		std::unordered_map<uint64_t, std::vector<int>> views_by_hash;
+		size_t reserve_start = 0;
+
+		size_t reserve(size_t length);
+		int commit_view(size_t offset, size_t length, int target, int stride = 0);
+
+		template<typename ComponentT, int N>
+		static void copy_with_bounds(uint8_t* dst, const ComponentT* src, size_t count, std::vector<double>& min_values, std::vector<double>& max_values);
+	};
+
+	size_t BufferWriter::reserve(size_t length)
+	{
+		std::vector<unsigned char>& data = model.buffers[buffer].data;
+		reserve_start = data.size();
+		size_t offset = (data.size() + alignment - 1) / alignment * alignment;
+		data.resize(offset + length);
+		return offset;
+	}
+
+	// Turns bytes just written at offset by reserve() into a bufferView, or gives them back if an
+	// identical view already exists.
+	int BufferWriter::commit_view(size_t offset, size_t length, int target, int stride)
+	{
+		std::vector<unsigned char>& data = model.buffers[buffer].data;
+		const uint8_t* bytes = data.data() + offset;
+		uint64_t hash = Simd().crc64(0, bytes, length);
+		std::vector<int>& candidates = views_by_hash[hash];
+		for (int id : candidates)
+		{
+			const tinygltf::BufferView& view = model.bufferViews[id];
+			if (view.byteLength == length && view.target == target && view.byteStride == (size_t)stride && memcmp(data.data() + view.byteOffset, bytes, length) == 0)
+			{
+				data.resize(reserve_start);
+				return id;
+			}
+		}
+
+		int view_id = (int)model.bufferViews.size();
+		candidates.push_back(view_id);
+		tinygltf::BufferView view;
+		view.buffer = buffer;
+		view.byteOffset = offset;
+		view.byteLength = length;
+		view.target = target;
+		view.byteStride = stride;
+		model.bufferViews.push_back(view);
+		return view_id;
+	}
+
+	int BufferWriter::emit_view(const void* data, size_t length, int target, int stride)
+	{
+		size_t offset = reserve(length);
+		if (length > 0) memcpy(model.buffers[buffer].data.data() + offset, data, length);
+		return commit_view(offset, length, target, stride);
+	}
+
+	template<typename ComponentT, int N>
+	void BufferWriter::copy_with_bounds(uint8_t* dst, const ComponentT* src, size_t count, std::vector<double>& min_values, std::vector<double>& max_values)
+	{
+		if (count == 0) return;
+		if constexpr (std::is_same<ComponentT, float>::value && N == 3)
+		{
+			memcpy(dst, src, count * sizeof(float) * 3);
+			float min_v[3], max_v[3];
+			Simd().minmax_vec3(src, count, min_v, max_v);
+			min_values = { min_v[0], min_v[1], min_v[2] };
+			max_values = { max_v[0], max_v[1], max_v[2] };
+		}
+		else
+		{
+			ComponentT min_v[N], max_v[N];
+			for (int j = 0; j < N; j++)
+			{
+				min_v[j] = src[j];
+				max_v[j] = src[j];
+			}
+			for (size_t i = 0; i < count; i++)
+			{
+				for (int j = 0; j < N; j++)
+				{
+					ComponentT v = src[i * N + j];
+					min_v[j] = v < min_v[j] ? v : min_v[j];
+					max_v[j] = v > max_v[j] ? v : max_v[j];
+				}
+				memcpy(dst + i * sizeof(ComponentT) * N, src + i * N, sizeof(ComponentT) * N);
+			}
+			min_values.assign(min_v, min_v + N);
+			max_values.assign(max_v, max_v + N);
+		}
+	}
+
+	template<typename ComponentT, int N, bool Normalized, typename ElemT>
+	int BufferWriter::emit_accessor(const ElemT* data, size_t count, int target, bool bounds)
+	{
+		static_assert(sizeof(ElemT) == sizeof(ComponentT) * N, "element size must match N components");
+		static_assert(!Normalized || std::is_integral<ComponentT>::value, "only integer components can be normalized");
+
+		tinygltf::Accessor acc;
+		size_t length = count * sizeof(ElemT);
+		if (bounds)
+		{
+			size_t offset = reserve(length);
+			copy_with_bounds<ComponentT, N>(model.buffers[buffer].data.data() + offset, (const ComponentT*)data, count, acc.minValues, acc.maxValues);
+			acc.bufferView = commit_view(offset, length, target);
+		}
+		else
+		{
+			acc.bufferView = emit_view(data, length, target);
+		}
+
+		acc.byteOffset = 0;
+		acc.componentType = ComponentTraits<ComponentT>::component_type;
+		acc.type = TypeTraits<N>::type;
+		acc.normalized = Normalized;
+		acc.count = count;
+
+		int acc_id = (int)model.accessors.size();
+		model.accessors.push_back(acc);
+		return acc_id;
+	}
+
+	template<typename ComponentT, int N, int Stride, bool Normalized>
+	int BufferWriter::emit_padded_accessor(const ComponentT* data, size_t count, int target, bool bounds)
+	{
+		static_assert(Stride > N && Stride * sizeof(ComponentT) % 4 == 0, "padded elements must fill a multiple of 4 bytes");
+		static_assert(!Normalized || std::is_integral<ComponentT>::value, "only integer components can be normalized");
+
+		tinygltf::Accessor acc;
+		if (bounds && count > 0)
+		{
+			ComponentT min_v[N], max_v[N];
+			for (int j = 0; j < N; j++)
+			{
+				min_v[j] = data[j];
+				max_v[j] = data[j];
+			}
+			for (size_t i = 0; i < count; i++)
+			{
+				for (int j = 0; j < N; j++)
+				{
+					ComponentT v = data[i * Stride + j];
+					min_v[j] = v < min_v[j] ? v : min_v[j];
+					max_v[j] = v > max_v[j] ? v : max_v[j];
+				}
+			}
+			acc.minValues.assign(min_v, min_v + N);
+			acc.maxValues.assign(max_v, max_v + N);
+		}
+
+		size_t length = count * Stride * sizeof(ComponentT);
+		size_t offset = reserve(length);
+		if (length > 0) memcpy(model.buffers[buffer].data.data() + offset, data, length);
+		acc.bufferView = commit_view(offset, length, target, (int)(Stride * sizeof(ComponentT)));
+
+		acc.byteOffset = 0;
+		acc.componentType = ComponentTraits<ComponentT>::component_type;
+		acc.type = TypeTraits<N>::type;
+		acc.normalized = Normalized;
+		acc.count = count;
+
+		int acc_id = (int)model.accessors.size();
+		model.accessors.push_back(acc);
+		return acc_id;
+	}
+
+	template<typename ComponentT, int N, typename ElemT>
+	int BufferWriter::emit_sparse_accessor(size_t count, const std::vector<uint32_t>& indices, const std::vector<ElemT>& values, bool bounds)
+	{
+		static_assert(sizeof(ElemT) == sizeof(ComponentT) * N, "element size must match N components");
+
+		tinygltf::Accessor acc;
+		acc.byteOffset = 0;
+		acc.componentType = ComponentTraits<ComponentT>::component_type;
+		acc.type = TypeTraits<N>::type;
+		acc.count = count;
+		acc.sparse.isSparse = true;
+		acc.sparse.count = (int)indices.size();
+
+		acc.sparse.indices.bufferView = emit_view(indices.data(), indices.size() * sizeof(uint32_t));
+		acc.sparse.indices.byteOffset = 0;
+		acc.sparse.indices.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT;
+
+		if (bounds && values.size() > 0)
+		{
+			size_t length = values.size() * sizeof(ElemT);
+			size_t offset = reserve(length);
+			copy_with_bounds<ComponentT, N>(model.buffers[buffer].data.data() + offset, (const ComponentT*)values.data(), values.size(), acc.minValues, acc.maxValues);
+			// elements without an entry are zero
+			if (indices.size() < count)
+			{
+				for (int j = 0; j < N; j++)
+				{
+					acc.minValues[j] = acc.minValues[j] < 0.0 ? acc.minValues[j] : 0.0;
+					acc.maxValues[j] = acc.maxValues[j] > 0.0 ? acc.maxValues[j] : 0.0;
+				}
+			}
+
+			acc.sparse.values.bufferView = commit_view(offset, length, 0);
+		}
+		else
+		{
+			acc.sparse.values.bufferView = emit_view(values.data(), values.size() * sizeof(ElemT));
+		}
+		acc.sparse.values.byteOffset = 0;
+
+		int acc_id = (int)model.accessors.size();
+		model.accessors.push_back(acc);
+		return acc_id;
+	}
+}
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <glm.hpp>
+#include <tiny_gltf.h>
+
+#include "ThreadPool.h"
+
+// Tessellation of UsdGeomBasisCurves into one line or ribbon primitive per prim.
+namespace Mid
+{
+	enum class CurveBasis { Linear, Bezier, Bspline, CatmullRom };
+	enum class CurveWrap { Nonperiodic, Periodic, Pinned };
+
+	struct CurveOptions
+	{
+		// points per cubic span
+		int segments = 8;
+		// flat triangle strips of the authored width instead of lines
+		bool ribbons = false;
+	};
+
+	// Per-vertex, per-curve or constant values, told apart by their count.
+	struct CurvePrimvar
+	{
+		const float* data = nullptr;
+		size_t size = 0;
+		int components = 1;
+	};
+
+	// All curves of a prim as one primitive: LINES with indices, a LINE_STRIP without them when the
+	// prim is a single open curve, or TRIANGLES for ribbons.
+	struct CurveBatch
+	{
+		int mode = TINYGLTF_MODE_LINE;
+		std::vector<glm::vec3> positions;
+		// ribbons only
+		std::vector<glm::vec3> normals;
+		std::vector<glm::u8vec4> colors;
+		std::vector<uint32_t> indices;
+	};
+
+	inline size_t CurveSpans(CurveBasis basis, CurveWrap wrap, size_t n)
+	{
+		switch (basis)
+		{
+		case CurveBasis::Linear:
+			return n < 2 ? 0 : (wrap == CurveWrap::Periodic ? n : n - 1);
+		case CurveBasis::Bezier:
+			if (wrap == CurveWrap::Periodic) return n < 3 ? 0 : n / 3;
+			return n < 4 ? 0 : (n - 1) / 3;
+		default:
+			if (wrap == CurveWrap::Periodic) return n < 3 ? 0 : n;
+			if (wrap == CurveWrap::Pinned) return n < 2 ? 0 : n - 1;
+			return n < 4 ? 0 : n - 3;
+		}
+	}
+
+	inline void CurveWeights(CurveBasis basis, float t, float w[4])
+	{
+		float t2 = t * t;
+		float t3 = t2 * t;
+		float s = 1.0f - t;
+		switch (basis)
+		{
+		case CurveBasis::Bezier:
+			w[0] = s * s * s;
+			w[1] = 3.0f * t * s * s;
+			w[2] = 3.0f * t2 * s;
+			w[3] = t3;
+			break;
+		case CurveBasis::Bspline:
+			w[0] = s * s * s / 6.0f;
+			w[1] = (3.0f * t3 - 6.0f * t2 + 4.0f) / 6.0f;
+			w[2] = (-3.0f * t3 + 3.0f * t2 + 3.0f * t + 1.0f) / 6.0f;
+			w[3] = t3 / 6.0f;
+			break;
+		default:
+			w[0] = 0.5f * (-t3 + 2.0f * t2 - t);
+			w[1] = 0.5f * (3.0f * t3 - 5.0f * t2 + 2.0f);
+			w[2] = 0.5f * (-3.0f * t3 + 4.0f * t2 + t);
+			w[3] = 0.5f * (t3 - t2);
+			break;
+		}
+	}
+
+	// Control vertices (into the curve's n vertices) and weights of the point at t of a span.
+	// Pinned curves get the phantom end vertices 2 * P0 - P1 and 2 * Pn-1 - Pn-2, folded into
+	// the weights of the real ones. Returns the number of pairs, at most 4.
+	inline int CurveStencil(CurveBasis basis, CurveWrap wrap, size_t n, size_t span, float t, uint32_t idx[4], float w[4])
+	{
+		if (basis == CurveBasis::Linear)
+		{
+			idx[0] = (uint32_t)(span % n);
+			idx[1] = (uint32_t)((span + 1) % n);
+			w[0] = 1.0f - t;
+			w[1] = t;
+			return t == 0.0f ? 1 : 2;
+		}
+
+		float bw[4];
+		CurveWeights(basis, t, bw);
+		int count = 0;
+		auto add = [&](int64_t i, float weight)
+		{
+			if (weight == 0.0f) return;
+			for (int k = 0; k < count; k++)
+			{
+				if (idx[k] == (uint32_t)i)
+				{
+					w[k] += weight;
+					return;
+				}
+			}
+			idx[count] = (uint32_t)i;
+			w[count] = weight;
+			count++;
+		};
+
+		int64_t base = basis == CurveBasis::Bezier ? (int64_t)span * 3 : (int64_t)span;
+		if (basis != CurveBasis::Bezier && wrap == CurveWrap::Pinned) base -= 1;
+		for (int k = 0; k < 4; k++)
+		{
+			int64_t i = base + k;
+			if (wrap == CurveWrap::Periodic)
+			{
+				add(i % (int64_t)n, bw[k]);
+			}
+			else if (i < 0)
+			{
+				add(0, 2.0f * bw[k]);
+				add(1, -bw[k]);
+			}
+			else if (i >= (int64_t)n)
+			{
+				add((int64_t)n - 1, 2.0f * bw[k]);
+				add((int64_t)n - 2, -bw[k]);
+			}
+			else
+			{
+				add(i, bw[k]);
+			}
+		}
+		return count;
+	}
+
+	// Evaluates every curve at options.segments points per span (linear curves keep their
+	// vertices) and writes it into one CurveBatch. Output ranges come from a serial prefix over
+	// the curves, then each curve is evaluated on its own task straight into the shared arrays.
+	// Ribbons lie across the tangent and up; there is no camera at export time to face.
+	inline void TessellateCurves(ThreadPool& pool, CurveBasis basis, CurveWrap wrap, const glm::vec3* points, size_t num_points,
+		const std::vector<int>& counts, const CurvePrimvar& widths, const CurvePrimvar& colors, const glm::vec3& up,
+		const CurveOptions& options, CurveBatch& out)
+	{
+		if (basis != CurveBasis::Bspline && basis != CurveBasis::CatmullRom && wrap == CurveWrap::Pinned) wrap = CurveWrap::Nonperiodic;
+		bool closed = wrap == CurveWrap::Periodic;
+		size_t segments = basis == CurveBasis::Linear ? 1 : (size_t)std::max(options.segments, 1);
+		size_t num_curves = counts.size();
+
+		// first control vertex, first output point and first index of each curve
+		std::vector<size_t> cv_offsets(num_curves + 1, 0);
+		std::vector<size_t> pt_offsets(num_curves + 1, 0);
+		std::vector<size_t> idx_offsets(num_curves + 1, 0);
+		for (size_t c = 0; c < num_curves; c++)
+		{
+			size_t n = (size_t)std::max(counts[c], 0);
+			size_t spans = cv_offsets[c] + n <= num_points ? CurveSpans(basis, wrap, n) : 0;
+			size_t m = spans == 0 ? 0 : (closed ? spans * segments : spans * segments + 1);
+			size_t lines = m == 0 ? 0 : (closed ? m : m - 1);
+			cv_offsets[c + 1] = cv_offsets[c] + n;
+			pt_offsets[c + 1] = pt_offsets[c] + m;
+			idx_offsets[c + 1] = idx_offsets[c] + (options.ribbons ? lines * 6 : lines * 2);
+		}
+
+		size_t num_out = pt_offsets[num_curves];
+		size_t verts_per_point = options.ribbons ? 2 : 1;
+		out.positions.assign(num_out * verts_per_point, glm::vec3(0.0f));
+		out.normals.assign(options.ribbons ? num_out * 2 : 0, glm::vec3(0.0f));
+		out.colors.assign(colors.data != nullptr ? num_out * verts_per_point : 0, glm::u8vec4(255));
+		out.indices.assign(idx_offsets[num_curves], 0);
+		out.mode = options.ribbons ? TINYGLTF_MODE_TRIANGLES : TINYGLTF_MODE_LINE;
+		if (!options.ribbons && num_curves == 1 && !closed && num_out > 0)
+		{
+			out.mode = TINYGLTF_MODE_LINE_STRIP;
+			out.indices.clear();
+		}
+
+		auto sample = [&](const CurvePrimvar& var, size_t curve, size_t cv_base, int count, const uint32_t* idx, const float* w, float* result)
+		{
+			for (int j = 0; j < var.components; j++) result[j] = 0.0f;
+			if (var.size == num_points)
+			{
+				for (int k = 0; k < count; k++)
+				{
+					for (int j = 0; j < var.components; j++) result[j] += w[k] * var.data[(cv_base + idx[k]) * var.components + j];
+				}
+			}
+			else if (var.size == num_curves)
+			{
+				for (int j = 0; j < var.components; j++) result[j] = var.data[curve * var.components + j];
+			}
+			else if (var.size > 0)
+			{
+				for (int j = 0; j < var.components; j++) result[j] = var.data[j];
+			}
+		};
+
+		pool.parallel_for(num_curves, [&](size_t c)
+			{
+				size_t m = pt_offsets[c + 1] - pt_offsets[c];
+				if (m == 0) return;
+				size_t n = cv_offsets[c + 1] - cv_offsets[c];
+				const glm::vec3* cvs = points + cv_offsets[c];
+
+				for (size_t j = 0; j < m; j++)
+				{
+					size_t span = std::min(j / segments, CurveSpans(basis, wrap, n) - 1);
+					float t = (float)(j - span * segments) / (float)segments;
+					uint32_t idx[4];
+					float w[4];
+					int count = CurveStencil(basis, wrap, n, span, t, idx, w);
+
+					glm::vec3 p(0.0f);
+					for (int k = 0; k < count; k++) p += w[k] * cvs[idx[k]];
+
+					size_t v = (pt_offsets[c] + j) * verts_per_point;
+					out.positions[v] = p;
+					if (colors.data != nullptr)
+					{
+						float col[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+						sample(colors, c, cv_offsets[c], count, idx, w, col);
+						glm::vec4 cv = glm::clamp(glm::vec4(col[0], col[1], col[2], 1.0f), 0.0f, 1.0f);
+						out.colors[v] = glm::u8vec4(cv * 255.0f + 0.5f);
+						if (options.ribbons) out.colors[v + 1] = out.colors[v];
+					}
+					if (options.ribbons)
+					{
+						// the width waits in the normal until the tangents are known
+						float width = 1.0f;
+						if (widths.data != nullptr) sample(widths, c, cv_offsets[c], count, idx, w, &width);
+						out.normals[v].x = width;
+					}
+				}
+
+				size_t i = idx_offsets[c];
+				size_t lines = closed ? m : m - 1;
+				if (!options.ribbons)
+				{
+					if (out.indices.empty()) return;
+					for (size_t j = 0; j < lines; j++)
+					{
+						out.indices[i++] = (uint32_t)(pt_offsets[c] + j);
+						out.indices[i++] = (uint32_t)(pt_offsets[c] + (j + 1) % m);
+					}
+					return;
+				}
+
+				// Centre points sit in the even slots; each one is replaced by its two edge points
+				// in order, so the previous centre (and the first one, for closed curves) is kept aside.
+				size_t base = pt_offsets[c] * 2;
+				glm::vec3 first = out.positions[base];
+				glm::vec3 prev = first;
+				for (size_t j = 0; j < m; j++)
+				{
+					glm::vec3 center = out.positions[base + j * 2];
+					glm::vec3 before = j > 0 ? prev : (closed ? out.positions[base + (m - 1) * 2] : center);
+					glm::vec3 after = j + 1 < m ? out.positions[base + (j + 1) * 2] : (closed ? first : center);
+					glm::vec3 tangent = after - before;
+					glm::vec3 side = glm::cross(tangent, up);
+					if (glm::dot(side, side) < 1e-12f * std::max(glm::dot(tangent, tangent), 1e-12f))
+					{
+						side = glm::cross(tangent, glm::vec3(up.y, up.z, up.x));
+					}
+					float len = glm::length(side);
+					side = len > 0.0f ? side / len : glm::vec3(1.0f, 0.0f, 0.0f);
+					glm::vec3 normal = glm::cross(side, tangent);
+					len = glm::length(normal);
+					normal = len > 0.0f ? normal / len : up;
+
+					float half_width = out.normals[base + j * 2].x * 0.5f;
+					out.positions[base + j * 2] = center - side * half_width;
+					out.positions[base + j * 2 + 1] = center + side * half_width;
+					out.normals[base + j * 2] = normal;
+					out.normals[base + j * 2 + 1] = normal;
+					prev = center;
+				}
+				for (size_t j = 0; j < lines; j++)
+				{
+					uint32_t a = (uint32_t)(base + j * 2);
+					uint32_t b = (uint32_t)(base + ((j + 1) % m) * 2);
+					out.indices[i++] = a;
+					out.indices[i++] = a + 1;
+					out.indices[i++] = b;
+					out.indices[i++] = a + 1;
+					out.indices[i++] = b + 1;
+					out.indices[i++] = b;
+				}
+			}, 16);
+	}
+}
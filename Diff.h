@@ -0,0 +1,854 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <tiny_gltf.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Draco.h"
+#include "ModelOps.h"
+#include "Simd.h"
+#include "ThreadPool.h"
+#include "Validate.h"
+
+// Semantic comparison of two converted files, for regression runs across options and versions.
+namespace Mid
+{
+	// Read-only view of a whole file, mapped rather than read so the loader touches pages on demand.
+	class MappedFile
+	{
+	public:
+		MappedFile() {}
+		~MappedFile() { close(); }
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool open(const std::string& path);
+		void close();
+
+		const unsigned char* data() const { return ptr; }
+		size_t size() const { return length; }
+
+	private:
+		const unsigned char* ptr = nullptr;
+		size_t length = 0;
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#endif
+	};
+
+	bool MappedFile::open(const std::string& path)
+	{
+		close();
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+		{
+			close();
+			return false;
+		}
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping == nullptr)
+		{
+			close();
+			return false;
+		}
+		ptr = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		length = (size_t)file_size.QuadPart;
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			::close(fd);
+			return false;
+		}
+		void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED) return false;
+		madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+		ptr = (const unsigned char*)p;
+		length = (size_t)st.st_size;
+#endif
+		return ptr != nullptr;
+	}
+
+	void MappedFile::close()
+	{
+#ifdef _WIN32
+		if (ptr != nullptr) UnmapViewOfFile(ptr);
+		if (mapping != nullptr) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (ptr != nullptr) munmap((void*)ptr, length);
+#endif
+		ptr = nullptr;
+		length = 0;
+	}
+
+	// Embedded images are kept as their encoded bytes; the diff compares those, not pixels.
+	inline bool KeepEncodedImage(tinygltf::Image* image, const int, std::string*, std::string*, int, int, const unsigned char* bytes, int size, void*)
+	{
+		image->image.assign(bytes, bytes + size);
+		image->as_is = true;
+		return true;
+	}
+
+	// Loads a binary .glb, or a JSON .gltf with embedded or relative buffers, such as the converter
+	// itself writes.
+	inline bool LoadGltfMapped(const std::string& path, tinygltf::Model& model, std::string& err)
+	{
+		MappedFile file;
+		if (!file.open(path))
+		{
+			err = "cannot map " + path;
+			return false;
+		}
+		tinygltf::TinyGLTF loader;
+		loader.SetImageLoader(KeepEncodedImage, nullptr);
+		std::string warn;
+		if (file.size() >= 4 && memcmp(file.data(), "glTF", 4) == 0)
+		{
+			return loader.LoadBinaryFromMemory(&model, &err, &warn, file.data(), (unsigned int)file.size());
+		}
+		size_t slash = path.find_last_of("/\\");
+		std::string base_dir = slash == std::string::npos ? "." : path.substr(0, slash);
+		return loader.LoadASCIIFromString(&model, &err, &warn, (const char*)file.data(), (unsigned int)file.size(), base_dir);
+	}
+
+	// Replaces KHR_draco_mesh_compression on every primitive by plain accessors over the decoded
+	// streams, so compressed and uncompressed files compare like any other. Primitives are decoded
+	// in parallel; those whose stream cannot be decoded are reported as not comparable.
+	inline void DecodeDracoPrimitives(tinygltf::Model& model, const std::string& file_label, ThreadPool& pool, std::vector<std::string>& problems)
+	{
+		struct Job
+		{
+			int mesh;
+			int prim;
+			std::vector<uint32_t> indices;
+			size_t num_points = 0;
+			std::vector<DracoAttribute> attribs;
+			std::string error;
+		};
+		std::vector<Job> jobs;
+		for (size_t m = 0; m < model.meshes.size(); m++)
+		{
+			for (size_t p = 0; p < model.meshes[m].primitives.size(); p++)
+			{
+				if (model.meshes[m].primitives[p].extensions.count("KHR_draco_mesh_compression") > 0) jobs.push_back({ (int)m, (int)p });
+			}
+		}
+		if (jobs.empty()) return;
+
+		pool.parallel_for(jobs.size(), [&](size_t j)
+			{
+				Job& job = jobs[j];
+				const tinygltf::Value& ext = model.meshes[job.mesh].primitives[job.prim].extensions.at("KHR_draco_mesh_compression");
+				const tinygltf::Value& view_id = ext.Get("bufferView");
+				if (!view_id.IsInt() || view_id.Get<int>() < 0 || view_id.Get<int>() >= (int)model.bufferViews.size())
+				{
+					job.error = "no valid bufferView";
+					return;
+				}
+				const tinygltf::BufferView& view = model.bufferViews[view_id.Get<int>()];
+				if (view.buffer < 0 || view.buffer >= (int)model.buffers.size() || view.byteOffset + view.byteLength > model.buffers[view.buffer].data.size())
+				{
+					job.error = "bufferView is out of range";
+					return;
+				}
+				if (!DecodeDracoMesh(model.buffers[view.buffer].data.data() + view.byteOffset, view.byteLength, job.indices, job.num_points, job.attribs))
+				{
+					job.error = "stream cannot be decoded";
+				}
+			});
+
+		tinygltf::Buffer decoded;
+		int buffer_id = (int)model.buffers.size();
+		auto add_view = [&](const void* data, size_t size)
+		{
+			while (decoded.data.size() % 4 != 0) decoded.data.push_back(0);
+			tinygltf::BufferView view;
+			view.buffer = buffer_id;
+			view.byteOffset = decoded.data.size();
+			view.byteLength = size;
+			decoded.data.insert(decoded.data.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+			model.bufferViews.push_back(view);
+			return (int)model.bufferViews.size() - 1;
+		};
+
+		for (size_t j = 0; j < jobs.size(); j++)
+		{
+			Job& job = jobs[j];
+			tinygltf::Primitive& prim = model.meshes[job.mesh].primitives[job.prim];
+			std::string label = file_label + ": mesh " + std::to_string(job.mesh) + " primitive " + std::to_string(job.prim) + ": KHR_draco_mesh_compression ";
+			if (job.error.empty() && prim.indices >= 0 && prim.indices < (int)model.accessors.size())
+			{
+				tinygltf::Accessor& acc = model.accessors[prim.indices];
+				if (acc.count != job.indices.size())
+				{
+					job.error = "decodes to " + std::to_string(job.indices.size()) + " indices, the accessor has " + std::to_string(acc.count);
+				}
+				else
+				{
+					acc.bufferView = add_view(job.indices.data(), job.indices.size() * 4);
+					acc.byteOffset = 0;
+					acc.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT;
+				}
+			}
+			const tinygltf::Value& attributes = prim.extensions.at("KHR_draco_mesh_compression").Get("attributes");
+			for (const std::string& name : attributes.Keys())
+			{
+				if (!job.error.empty()) break;
+				auto acc_iter = prim.attributes.find(name);
+				const tinygltf::Value& id = attributes.Get(name);
+				const DracoAttribute* att = nullptr;
+				for (size_t a = 0; a < job.attribs.size() && id.IsInt(); a++)
+				{
+					if (job.attribs[a].unique_id == id.Get<int>()) att = &job.attribs[a];
+				}
+				if (acc_iter == prim.attributes.end() || acc_iter->second < 0 || acc_iter->second >= (int)model.accessors.size() || att == nullptr)
+				{
+					job.error = "attribute " + name + " has no decoded stream";
+					break;
+				}
+				tinygltf::Accessor& acc = model.accessors[acc_iter->second];
+				if (acc.count != job.num_points || tinygltf::GetNumComponentsInType(acc.type) != att->num_components)
+				{
+					job.error = "attribute " + name + " does not match its accessor";
+					break;
+				}
+				if (att->quantization_bits > 0)
+				{
+					acc.bufferView = add_view(att->values.data(), att->values.size() * sizeof(float));
+					acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
+					acc.normalized = false;
+				}
+				else
+				{
+					// integer streams keep the accessor's component type, and with it its normalization
+					int size = tinygltf::GetComponentSizeInBytes(acc.componentType);
+					if (size != 1 && size != 2 && size != 4)
+					{
+						job.error = "attribute " + name + " has an unusable component type";
+						break;
+					}
+					std::vector<uint8_t> bytes(att->int_values.size() * size);
+					for (size_t i = 0; i < att->int_values.size(); i++) memcpy(bytes.data() + i * size, &att->int_values[i], size);
+					acc.bufferView = add_view(bytes.data(), bytes.size());
+				}
+				acc.byteOffset = 0;
+			}
+			if (!job.error.empty())
+			{
+				problems.push_back(label + job.error + ", primitive not compared");
+				continue;
+			}
+			prim.extensions.erase("KHR_draco_mesh_compression");
+		}
+		model.buffers.push_back(std::move(decoded));
+	}
+
+	// Relative above 1, absolute below.
+	inline bool NearlyEqual(double a, double b, double tolerance)
+	{
+		if (a == b) return true;
+		double scale = std::max(1.0, std::max(std::fabs(a), std::fabs(b)));
+		return std::fabs(a - b) <= tolerance * scale;
+	}
+
+	inline bool NearlyEqual(const std::vector<double>& a, const std::vector<double>& b, double tolerance)
+	{
+		if (a.size() != b.size()) return false;
+		for (size_t i = 0; i < a.size(); i++)
+		{
+			if (!NearlyEqual(a[i], b[i], tolerance)) return false;
+		}
+		return true;
+	}
+
+	// Decodes an accessor after checking it is readable; returns false (and reports) otherwise.
+	inline bool ReadAccessorChecked(const tinygltf::Model& model, int acc_id, const std::string& label,
+		std::vector<float>& values, std::vector<std::string>& diffs)
+	{
+		if (acc_id < 0 || acc_id >= (int)model.accessors.size())
+		{
+			diffs.push_back(label + ": accessor " + std::to_string(acc_id) + " does not exist");
+			return false;
+		}
+		std::vector<std::string> errors;
+		ValidateAccessor(model, acc_id, errors);
+		if (errors.size() > 0)
+		{
+			diffs.push_back(label + ": " + errors[0]);
+			return false;
+		}
+		values = ReadAccessor(model, acc_id);
+		return true;
+	}
+
+	// Same for an index accessor, read as integers so indices above 2^24 keep their value.
+	inline bool ReadIndicesChecked(const tinygltf::Model& model, int acc_id, const std::string& label,
+		std::vector<uint32_t>& indices, std::vector<std::string>& diffs)
+	{
+		if (acc_id < 0 || acc_id >= (int)model.accessors.size())
+		{
+			diffs.push_back(label + ": accessor " + std::to_string(acc_id) + " does not exist");
+			return false;
+		}
+		const tinygltf::Accessor& acc = model.accessors[acc_id];
+		if (acc.type != TINYGLTF_TYPE_SCALAR || (acc.componentType != TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE &&
+			acc.componentType != TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT && acc.componentType != TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT))
+		{
+			diffs.push_back(label + ": componentType " + std::to_string(acc.componentType) + " is not an unsigned integer scalar");
+			return false;
+		}
+		std::vector<std::string> errors;
+		ValidateAccessor(model, acc_id, errors);
+		if (errors.size() > 0)
+		{
+			diffs.push_back(label + ": " + errors[0]);
+			return false;
+		}
+		indices = ReadIndices(model, acc);
+		return true;
+	}
+
+	inline void CompareValues(const std::vector<float>& a, const std::vector<float>& b, int num_comp, double tolerance,
+		const std::string& label, std::vector<std::string>& diffs)
+	{
+		if (a.size() != b.size())
+		{
+			diffs.push_back(label + ": " + std::to_string(a.size() / num_comp) + " vs " + std::to_string(b.size() / num_comp) + " elements");
+			return;
+		}
+		size_t num_diff = 0;
+		size_t first = 0;
+		double max_diff = 0.0;
+		for (size_t i = 0; i < a.size(); i++)
+		{
+			if (NearlyEqual(a[i], b[i], tolerance)) continue;
+			if (num_diff == 0) first = i;
+			num_diff++;
+			max_diff = std::max(max_diff, std::isnan(a[i] - b[i]) ? INFINITY : (double)std::fabs(a[i] - b[i]));
+		}
+		if (num_diff > 0)
+		{
+			diffs.push_back(label + ": " + std::to_string(num_diff) + " of " + std::to_string(a.size()) + " values differ, first at element " +
+				std::to_string(first / num_comp) + ", max |d| = " + std::to_string(max_diff));
+		}
+	}
+
+	inline void CompareAccessors(const tinygltf::Model& a, int acc_a, const tinygltf::Model& b, int acc_b, double tolerance,
+		const std::string& label, std::vector<std::string>& diffs)
+	{
+		std::vector<float> values_a, values_b;
+		if (!ReadAccessorChecked(a, acc_a, label + " (a)", values_a, diffs)) return;
+		if (!ReadAccessorChecked(b, acc_b, label + " (b)", values_b, diffs)) return;
+		if (a.accessors[acc_a].type != b.accessors[acc_b].type)
+		{
+			diffs.push_back(label + ": accessor type " + std::to_string(a.accessors[acc_a].type) + " vs " + std::to_string(b.accessors[acc_b].type));
+			return;
+		}
+		CompareValues(values_a, values_b, tinygltf::GetNumComponentsInType(a.accessors[acc_a].type), tolerance, label, diffs);
+	}
+
+	inline void CompareIndices(const tinygltf::Model& a, int acc_a, const tinygltf::Model& b, int acc_b, const std::string& label, std::vector<std::string>& diffs)
+	{
+		std::vector<uint32_t> indices_a, indices_b;
+		if (!ReadIndicesChecked(a, acc_a, label + " (a)", indices_a, diffs)) return;
+		if (!ReadIndicesChecked(b, acc_b, label + " (b)", indices_b, diffs)) return;
+		if (indices_a.size() != indices_b.size())
+		{
+			diffs.push_back(label + ": " + std::to_string(indices_a.size()) + " vs " + std::to_string(indices_b.size()) + " elements");
+			return;
+		}
+		size_t num_diff = 0;
+		size_t first = 0;
+		for (size_t i = 0; i < indices_a.size(); i++)
+		{
+			if (indices_a[i] == indices_b[i]) continue;
+			if (num_diff == 0) first = i;
+			num_diff++;
+		}
+		if (num_diff > 0)
+		{
+			diffs.push_back(label + ": " + std::to_string(num_diff) + " of " + std::to_string(indices_a.size()) + " values differ, first at element " +
+				std::to_string(first) + " (" + std::to_string(indices_a[first]) + " vs " + std::to_string(indices_b[first]) + ")");
+		}
+	}
+
+	// KHR_materials_variants mappings as sorted (variant, material) pairs, so the grouping and
+	// order of the mappings do not matter.
+	inline std::vector<std::pair<int, int>> VariantMappings(const tinygltf::Value& ext)
+	{
+		std::vector<std::pair<int, int>> pairs;
+		const tinygltf::Value& mappings = ext.Get("mappings");
+		for (size_t i = 0; i < mappings.ArrayLen(); i++)
+		{
+			const tinygltf::Value& mapping = mappings.Get((int)i);
+			int material = mapping.Get("material").GetNumberAsInt();
+			const tinygltf::Value& variants = mapping.Get("variants");
+			for (size_t j = 0; j < variants.ArrayLen(); j++) pairs.push_back({ variants.Get((int)j).GetNumberAsInt(), material });
+		}
+		std::sort(pairs.begin(), pairs.end());
+		return pairs;
+	}
+
+	inline void CompareExtensions(const tinygltf::ExtensionMap& ea, const tinygltf::ExtensionMap& eb, const std::string& label, std::vector<std::string>& diffs)
+	{
+		for (auto iter = ea.begin(); iter != ea.end(); iter++)
+		{
+			auto other = eb.find(iter->first);
+			if (other == eb.end())
+			{
+				diffs.push_back(label + ": extension " + iter->first + " only in a");
+			}
+			else if (iter->first == "KHR_materials_variants")
+			{
+				if (VariantMappings(iter->second) != VariantMappings(other->second)) diffs.push_back(label + ": KHR_materials_variants mappings differ");
+			}
+			else if (!(iter->second == other->second))
+			{
+				diffs.push_back(label + ": extension " + iter->first + " differs");
+			}
+		}
+		for (auto iter = eb.begin(); iter != eb.end(); iter++)
+		{
+			if (ea.count(iter->first) == 0) diffs.push_back(label + ": extension " + iter->first + " only in b");
+		}
+	}
+
+	// Triangles of a primitive as flat corner records (every attribute, in name order), rotated so
+	// the smallest corner leads and sorted. Two primitives that differ only in vertex order, index
+	// order or triangle rotation produce the same soup. Sorting keys are quantized to 16x the
+	// tolerance, so values straddling a quantization step can still be reported as a difference.
+	inline bool TriangleSoup(const tinygltf::Model& model, const tinygltf::Primitive& prim, double tolerance,
+		std::vector<float>& soup, size_t& corner_size)
+	{
+		std::vector<std::vector<float>> streams;
+		std::vector<int> widths;
+		size_t num_verts = 0;
+		std::vector<std::string> errors;
+		for (auto iter = prim.attributes.begin(); iter != prim.attributes.end(); iter++)
+		{
+			std::vector<float> values;
+			if (!ReadAccessorChecked(model, iter->second, iter->first, values, errors)) return false;
+			int width = tinygltf::GetNumComponentsInType(model.accessors[iter->second].type);
+			if (streams.size() > 0 && values.size() / width != num_verts) return false;
+			num_verts = values.size() / width;
+			streams.push_back(std::move(values));
+			widths.push_back(width);
+		}
+
+		std::vector<uint32_t> indices;
+		if (prim.indices >= 0)
+		{
+			if (!ReadIndicesChecked(model, prim.indices, "indices", indices, errors)) return false;
+		}
+		else
+		{
+			for (size_t i = 0; i < num_verts; i++) indices.push_back((uint32_t)i);
+		}
+
+		corner_size = 0;
+		for (size_t s = 0; s < widths.size(); s++) corner_size += widths[s];
+		size_t tri_size = corner_size * 3;
+		size_t num_tris = indices.size() / 3;
+		double quantum = tolerance > 0.0 ? tolerance * 16.0 : 0.0;
+
+		std::vector<float> corners(num_tris * tri_size);
+		for (size_t t = 0; t < num_tris; t++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				uint32_t v = indices[t * 3 + c];
+				if (v >= num_verts) return false;
+				float* dst = corners.data() + t * tri_size + c * corner_size;
+				for (size_t s = 0; s < streams.size(); s++)
+				{
+					memcpy(dst, streams[s].data() + v * widths[s], widths[s] * sizeof(float));
+					dst += widths[s];
+				}
+			}
+		}
+
+		auto key_less = [&](const float* x, const float* y, size_t n)
+		{
+			for (size_t i = 0; i < n; i++)
+			{
+				double kx = quantum > 0.0 ? std::floor(x[i] / quantum) : x[i];
+				double ky = quantum > 0.0 ? std::floor(y[i] / quantum) : y[i];
+				if (kx != ky) return kx < ky;
+			}
+			return false;
+		};
+
+		std::vector<float> tri(tri_size);
+		for (size_t t = 0; t < num_tris; t++)
+		{
+			float* src = corners.data() + t * tri_size;
+			int lead = 0;
+			for (int c = 1; c < 3; c++)
+			{
+				if (key_less(src + c * corner_size, src + lead * corner_size, corner_size)) lead = c;
+			}
+			for (int c = 0; c < 3; c++)
+			{
+				memcpy(tri.data() + c * corner_size, src + ((lead + c) % 3) * corner_size, corner_size * sizeof(float));
+			}
+			memcpy(src, tri.data(), tri_size * sizeof(float));
+		}
+
+		std::vector<size_t> order(num_tris);
+		for (size_t t = 0; t < num_tris; t++) order[t] = t;
+		std::sort(order.begin(), order.end(), [&](size_t x, size_t y)
+			{
+				return key_less(corners.data() + x * tri_size, corners.data() + y * tri_size, tri_size);
+			});
+
+		soup.resize(corners.size());
+		for (size_t t = 0; t < num_tris; t++)
+		{
+			memcpy(soup.data() + t * tri_size, corners.data() + order[t] * tri_size, tri_size * sizeof(float));
+		}
+		return true;
+	}
+
+	inline void ComparePrimitives(const tinygltf::Model& a, const tinygltf::Primitive& pa, const tinygltf::Model& b, const tinygltf::Primitive& pb,
+		double tolerance, const std::string& label, std::vector<std::string>& diffs)
+	{
+		if (pa.mode != pb.mode) diffs.push_back(label + ": mode " + std::to_string(pa.mode) + " vs " + std::to_string(pb.mode));
+		if (pa.material != pb.material) diffs.push_back(label + ": material " + std::to_string(pa.material) + " vs " + std::to_string(pb.material));
+		if (pa.targets.size() != pb.targets.size()) diffs.push_back(label + ": " + std::to_string(pa.targets.size()) + " vs " + std::to_string(pb.targets.size()) + " morph targets");
+		CompareExtensions(pa.extensions, pb.extensions, label, diffs);
+
+		bool same_names = pa.attributes.size() == pb.attributes.size();
+		for (auto iter = pa.attributes.begin(); iter != pa.attributes.end() && same_names; iter++)
+		{
+			same_names = pb.attributes.count(iter->first) > 0;
+		}
+		if (!same_names)
+		{
+			std::string names_a, names_b;
+			for (auto iter = pa.attributes.begin(); iter != pa.attributes.end(); iter++) names_a += " " + iter->first;
+			for (auto iter = pb.attributes.begin(); iter != pb.attributes.end(); iter++) names_b += " " + iter->first;
+			diffs.push_back(label + ": attributes" + names_a + " vs" + names_b);
+			return;
+		}
+
+		// same layout first; fall back to comparing triangle soups when vertices or triangles were reordered
+		std::vector<std::string> direct;
+		for (auto iter = pa.attributes.begin(); iter != pa.attributes.end(); iter++)
+		{
+			CompareAccessors(a, iter->second, b, pb.attributes.at(iter->first), tolerance, label + " " + iter->first, direct);
+		}
+		if ((pa.indices >= 0) != (pb.indices >= 0))
+		{
+			direct.push_back(label + ": indexed vs non-indexed");
+		}
+		else if (pa.indices >= 0)
+		{
+			CompareIndices(a, pa.indices, b, pb.indices, label + " indices", direct);
+		}
+		for (size_t t = 0; t < pa.targets.size() && t < pb.targets.size(); t++)
+		{
+			for (auto iter = pa.targets[t].begin(); iter != pa.targets[t].end(); iter++)
+			{
+				auto other = pb.targets[t].find(iter->first);
+				if (other == pb.targets[t].end())
+				{
+					diffs.push_back(label + " target " + std::to_string(t) + ": " + iter->first + " only in a");
+					continue;
+				}
+				CompareAccessors(a, iter->second, b, other->second, tolerance, label + " target " + std::to_string(t) + " " + iter->first, diffs);
+			}
+		}
+		if (direct.empty()) return;
+
+		bool triangles_a = pa.mode == -1 || pa.mode == TINYGLTF_MODE_TRIANGLES;
+		std::vector<float> soup_a, soup_b;
+		size_t corner_a = 0, corner_b = 0;
+		if (triangles_a && pa.mode == pb.mode && TriangleSoup(a, pa, tolerance, soup_a, corner_a) && TriangleSoup(b, pb, tolerance, soup_b, corner_b))
+		{
+			if (soup_a.size() != soup_b.size())
+			{
+				diffs.push_back(label + ": " + std::to_string(soup_a.size() / (corner_a * 3)) + " vs " + std::to_string(soup_b.size() / (corner_b * 3)) + " triangles");
+			}
+			else
+			{
+				CompareValues(soup_a, soup_b, (int)(corner_a * 3), tolerance, label + " triangles (reordered)", diffs);
+			}
+			return;
+		}
+		diffs.insert(diffs.end(), direct.begin(), direct.end());
+	}
+
+	inline void CompareMaterials(const tinygltf::Material& ma, const tinygltf::Material& mb, double tolerance, const std::string& label, std::vector<std::string>& diffs)
+	{
+		if (ma.name != mb.name) diffs.push_back(label + ": name '" + ma.name + "' vs '" + mb.name + "'");
+		if (ma.alphaMode != mb.alphaMode) diffs.push_back(label + ": alphaMode " + ma.alphaMode + " vs " + mb.alphaMode);
+		if (ma.doubleSided != mb.doubleSided) diffs.push_back(label + ": doubleSided differs");
+		if (!NearlyEqual(ma.alphaCutoff, mb.alphaCutoff, tolerance)) diffs.push_back(label + ": alphaCutoff differs");
+		if (!NearlyEqual(ma.emissiveFactor, mb.emissiveFactor, tolerance)) diffs.push_back(label + ": emissiveFactor differs");
+
+		const tinygltf::PbrMetallicRoughness& pa = ma.pbrMetallicRoughness;
+		const tinygltf::PbrMetallicRoughness& pb = mb.pbrMetallicRoughness;
+		if (!NearlyEqual(pa.baseColorFactor, pb.baseColorFactor, tolerance)) diffs.push_back(label + ": baseColorFactor differs");
+		if (!NearlyEqual(pa.metallicFactor, pb.metallicFactor, tolerance)) diffs.push_back(label + ": metallicFactor differs");
+		if (!NearlyEqual(pa.roughnessFactor, pb.roughnessFactor, tolerance)) diffs.push_back(label + ": roughnessFactor differs");
+
+		std::pair<int, int> textures[] = {
+			{ pa.baseColorTexture.index, pb.baseColorTexture.index },
+			{ pa.metallicRoughnessTexture.index, pb.metallicRoughnessTexture.index },
+			{ ma.normalTexture.index, mb.normalTexture.index },
+			{ ma.occlusionTexture.index, mb.occlusionTexture.index },
+			{ ma.emissiveTexture.index, mb.emissiveTexture.index },
+		};
+		const char* texture_names[] = { "baseColorTexture", "metallicRoughnessTexture", "normalTexture", "occlusionTexture", "emissiveTexture" };
+		for (int i = 0; i < 5; i++)
+		{
+			if (textures[i].first != textures[i].second)
+				diffs.push_back(label + ": " + texture_names[i] + " " + std::to_string(textures[i].first) + " vs " + std::to_string(textures[i].second));
+		}
+
+		std::vector<std::string> ext_a, ext_b;
+		for (auto iter = ma.extensions.begin(); iter != ma.extensions.end(); iter++) ext_a.push_back(iter->first);
+		for (auto iter = mb.extensions.begin(); iter != mb.extensions.end(); iter++) ext_b.push_back(iter->first);
+		if (ext_a != ext_b) diffs.push_back(label + ": extensions differ");
+	}
+
+	inline uint64_t ImageHash(const tinygltf::Model& model, const tinygltf::Image& image)
+	{
+		if (image.bufferView >= 0 && image.bufferView < (int)model.bufferViews.size())
+		{
+			const tinygltf::BufferView& view = model.bufferViews[image.bufferView];
+			if (view.buffer >= 0 && view.buffer < (int)model.buffers.size() && view.byteOffset + view.byteLength <= model.buffers[view.buffer].data.size())
+				return Simd().crc64(0, model.buffers[view.buffer].data.data() + view.byteOffset, view.byteLength);
+		}
+		return Simd().crc64(0, image.image.data(), image.image.size());
+	}
+
+	// Animations are matched by name, channels within them by (node, path), so reordering either is
+	// not reported. Sampler keys and values are compared numerically.
+	inline void CompareAnimations(const tinygltf::Model& a, const tinygltf::Animation& aa, const tinygltf::Model& b, const tinygltf::Animation& ab,
+		double tolerance, const std::string& label, std::vector<std::string>& diffs)
+	{
+		auto channel_map = [](const tinygltf::Animation& anim)
+		{
+			std::map<std::pair<int, std::string>, int> ret;
+			for (size_t i = 0; i < anim.channels.size(); i++)
+			{
+				ret[{ anim.channels[i].target_node, anim.channels[i].target_path }] = anim.channels[i].sampler;
+			}
+			return ret;
+		};
+		std::map<std::pair<int, std::string>, int> channels_a = channel_map(aa);
+		std::map<std::pair<int, std::string>, int> channels_b = channel_map(ab);
+
+		for (auto iter = channels_a.begin(); iter != channels_a.end(); iter++)
+		{
+			std::string channel_label = label + " node " + std::to_string(iter->first.first) + " " + iter->first.second;
+			auto other = channels_b.find(iter->first);
+			if (other == channels_b.end())
+			{
+				diffs.push_back(channel_label + ": only in a");
+				continue;
+			}
+			if (iter->second < 0 || iter->second >= (int)aa.samplers.size() || other->second < 0 || other->second >= (int)ab.samplers.size())
+			{
+				diffs.push_back(channel_label + ": sampler does not exist");
+				continue;
+			}
+			const tinygltf::AnimationSampler& sa = aa.samplers[iter->second];
+			const tinygltf::AnimationSampler& sb = ab.samplers[other->second];
+			if (sa.interpolation != sb.interpolation) diffs.push_back(channel_label + ": interpolation " + sa.interpolation + " vs " + sb.interpolation);
+			CompareAccessors(a, sa.input, b, sb.input, tolerance, channel_label + " times", diffs);
+			CompareAccessors(a, sa.output, b, sb.output, tolerance, channel_label + " values", diffs);
+		}
+		for (auto iter = channels_b.begin(); iter != channels_b.end(); iter++)
+		{
+			if (channels_a.count(iter->first) == 0)
+				diffs.push_back(label + " node " + std::to_string(iter->first.first) + " " + iter->first.second + ": only in b");
+		}
+	}
+
+	// Compares structure and contents of two models. Each comparison runs as its own pool job and
+	// reports into its own slot, so the differences come out in a stable order. Returns true when
+	// nothing differs beyond tolerance.
+	inline bool DiffModels(const tinygltf::Model& a, const tinygltf::Model& b, ThreadPool& pool, double tolerance, std::vector<std::string>& diffs)
+	{
+		size_t num_diffs = diffs.size();
+		auto compare_count = [&](const char* what, size_t na, size_t nb)
+		{
+			if (na != nb) diffs.push_back(std::string(what) + ": " + std::to_string(na) + " vs " + std::to_string(nb));
+		};
+		compare_count("nodes", a.nodes.size(), b.nodes.size());
+		compare_count("meshes", a.meshes.size(), b.meshes.size());
+		compare_count("materials", a.materials.size(), b.materials.size());
+		compare_count("textures", a.textures.size(), b.textures.size());
+		compare_count("images", a.images.size(), b.images.size());
+		compare_count("skins", a.skins.size(), b.skins.size());
+		compare_count("animations", a.animations.size(), b.animations.size());
+		// variant names, which the primitives' KHR_materials_variants mappings index into
+		CompareExtensions(a.extensions, b.extensions, "model", diffs);
+
+		std::vector<std::function<void(std::vector<std::string>&)>> jobs;
+
+		for (size_t i = 0; i < std::min(a.nodes.size(), b.nodes.size()); i++)
+		{
+			jobs.push_back([&, i](std::vector<std::string>& out)
+				{
+					const tinygltf::Node& na = a.nodes[i];
+					const tinygltf::Node& nb = b.nodes[i];
+					std::string label = "node " + std::to_string(i) + " '" + na.name + "'";
+					if (na.name != nb.name) out.push_back(label + ": name vs '" + nb.name + "'");
+					if (na.mesh != nb.mesh) out.push_back(label + ": mesh " + std::to_string(na.mesh) + " vs " + std::to_string(nb.mesh));
+					if (na.skin != nb.skin) out.push_back(label + ": skin " + std::to_string(na.skin) + " vs " + std::to_string(nb.skin));
+					std::vector<int> children_a = na.children, children_b = nb.children;
+					std::sort(children_a.begin(), children_a.end());
+					std::sort(children_b.begin(), children_b.end());
+					if (children_a != children_b) out.push_back(label + ": children differ");
+					glm::mat4 ma = NodeLocalMatrix(na), mb = NodeLocalMatrix(nb);
+					for (int k = 0; k < 16; k++)
+					{
+						if (!NearlyEqual(ma[k / 4][k % 4], mb[k / 4][k % 4], tolerance))
+						{
+							out.push_back(label + ": local transform differs");
+							break;
+						}
+					}
+					if (!NearlyEqual(na.weights, nb.weights, tolerance)) out.push_back(label + ": morph weights differ");
+				});
+		}
+
+		for (size_t i = 0; i < std::min(a.meshes.size(), b.meshes.size()); i++)
+		{
+			const tinygltf::Mesh& ma = a.meshes[i];
+			const tinygltf::Mesh& mb = b.meshes[i];
+			std::string label = "mesh " + std::to_string(i) + " '" + ma.name + "'";
+			if (ma.primitives.size() != mb.primitives.size())
+			{
+				diffs.push_back(label + ": " + std::to_string(ma.primitives.size()) + " vs " + std::to_string(mb.primitives.size()) + " primitives");
+			}
+			if (!NearlyEqual(ma.weights, mb.weights, tolerance)) diffs.push_back(label + ": default morph weights differ");
+			for (size_t j = 0; j < std::min(ma.primitives.size(), mb.primitives.size()); j++)
+			{
+				jobs.push_back([&, i, j, label](std::vector<std::string>& out)
+					{
+						ComparePrimitives(a, a.meshes[i].primitives[j], b, b.meshes[i].primitives[j], tolerance, label + " primitive " + std::to_string(j), out);
+					});
+			}
+		}
+
+		for (size_t i = 0; i < std::min(a.materials.size(), b.materials.size()); i++)
+		{
+			CompareMaterials(a.materials[i], b.materials[i], tolerance, "material " + std::to_string(i), diffs);
+		}
+
+		for (size_t i = 0; i < std::min(a.images.size(), b.images.size()); i++)
+		{
+			jobs.push_back([&, i](std::vector<std::string>& out)
+				{
+					if (a.images[i].mimeType != b.images[i].mimeType)
+						out.push_back("image " + std::to_string(i) + ": mimeType " + a.images[i].mimeType + " vs " + b.images[i].mimeType);
+					else if (ImageHash(a, a.images[i]) != ImageHash(b, b.images[i]))
+						out.push_back("image " + std::to_string(i) + ": encoded bytes differ");
+				});
+		}
+
+		for (size_t i = 0; i < std::min(a.skins.size(), b.skins.size()); i++)
+		{
+			jobs.push_back([&, i](std::vector<std::string>& out)
+				{
+					std::string label = "skin " + std::to_string(i);
+					if (a.skins[i].joints != b.skins[i].joints) out.push_back(label + ": joints differ");
+					if ((a.skins[i].inverseBindMatrices >= 0) != (b.skins[i].inverseBindMatrices >= 0))
+						out.push_back(label + ": inverseBindMatrices only in one file");
+					else if (a.skins[i].inverseBindMatrices >= 0)
+						CompareAccessors(a, a.skins[i].inverseBindMatrices, b, b.skins[i].inverseBindMatrices, tolerance, label + " inverseBindMatrices", out);
+				});
+		}
+
+		std::map<std::string, int> anims_b;
+		for (size_t i = 0; i < b.animations.size(); i++) anims_b[b.animations[i].name] = (int)i;
+		for (size_t i = 0; i < a.animations.size(); i++)
+		{
+			std::string label = "animation '" + a.animations[i].name + "'";
+			auto iter = anims_b.find(a.animations[i].name);
+			if (iter == anims_b.end())
+			{
+				diffs.push_back(label + ": only in a");
+				continue;
+			}
+			int j = iter->second;
+			jobs.push_back([&, i, j, label](std::vector<std::string>& out)
+				{
+					CompareAnimations(a, a.animations[i], b, b.animations[j], tolerance, label, out);
+				});
+		}
+
+		std::vector<std::vector<std::string>> job_diffs(jobs.size());
+		pool.parallel_for(jobs.size(), [&](size_t i) { jobs[i](job_diffs[i]); });
+
+		for (size_t i = 0; i < job_diffs.size(); i++)
+		{
+			diffs.insert(diffs.end(), job_diffs[i].begin(), job_diffs[i].end());
+		}
+		return diffs.size() == num_diffs;
+	}
+
+	// Entry point for --diff: 0 when the files match, 1 when they differ or a Draco primitive cannot
+	// be decoded, 2 when one cannot be read.
+	inline int DiffFiles(const std::string& path_a, const std::string& path_b, ThreadPool& pool, double tolerance)
+	{
+		tinygltf::Model models[2];
+		std::string errs[2];
+		bool loaded[2];
+		const std::string* paths[2] = { &path_a, &path_b };
+		pool.parallel_for(2, [&](size_t i) { loaded[i] = LoadGltfMapped(*paths[i], models[i], errs[i]); });
+		for (int i = 0; i < 2; i++)
+		{
+			if (!loaded[i])
+			{
+				printf("diff: cannot load %s: %s\n", paths[i]->c_str(), errs[i].c_str());
+				return 2;
+			}
+		}
+
+		std::vector<std::string> diffs;
+		DecodeDracoPrimitives(models[0], "a", pool, diffs);
+		DecodeDracoPrimitives(models[1], "b", pool, diffs);
+		bool decoded = diffs.empty();
+		bool same = DiffModels(models[0], models[1], pool, tolerance, diffs) && decoded;
+		for (size_t i = 0; i < diffs.size(); i++)
+		{
+			printf("diff: %s\n", diffs[i].c_str());
+		}
+		if (same) printf("diff: no differences (tolerance %g)\n", tolerance);
+		return same ? 0 : 1;
+	}
+}
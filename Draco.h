@@ -0,0 +1,896 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <tiny_gltf.h>
+
+#include "BufferWriter.h"
+#include "ModelOps.h"
+#include "ThreadPool.h"
+
+// KHR_draco_mesh_compression encoder writing Draco bitstream 2.2: sequential connectivity,
+// quantized or integer attributes with delta prediction, and rANS-coded symbols. The decoder
+// below reads back exactly that subset, for the round-trip check and for --diff.
+namespace Mid
+{
+	struct DracoOptions
+	{
+		// 0 stores indices and values uncompressed; 1-10 entropy-code them, higher levels spending
+		// more rANS precision
+		int level = 7;
+		int position_bits = 11;
+		int normal_bits = 10;
+		int texcoord_bits = 10;
+		int generic_bits = 8;
+	};
+
+	// Little-endian byte sink with Draco's varint encoding.
+	struct DracoBuffer
+	{
+		std::vector<uint8_t> data;
+
+		void put_u8(uint8_t v) { data.push_back(v); }
+		void put_bytes(const void* p, size_t size)
+		{
+			const uint8_t* b = (const uint8_t*)p;
+			data.insert(data.end(), b, b + size);
+		}
+		void put_u32(uint32_t v) { for (int i = 0; i < 4; i++) put_u8((uint8_t)(v >> (i * 8))); }
+		void put_i32(int32_t v) { put_u32((uint32_t)v); }
+		void put_f32(float v) { put_bytes(&v, 4); }
+		void put_varint(uint64_t v)
+		{
+			while (v >= 0x80)
+			{
+				put_u8((uint8_t)(v | 0x80));
+				v >>= 7;
+			}
+			put_u8((uint8_t)v);
+		}
+	};
+
+	inline int MostSignificantBit(uint32_t v)
+	{
+		int ret = 0;
+		while (v >>= 1) ret++;
+		return ret;
+	}
+
+	// Draco's raw rANS symbol scheme. Returns false when the alphabet is too large for the coder,
+	// in which case the caller stores the values uncompressed.
+	inline bool DracoEncodeSymbols(const uint32_t* symbols, size_t count, int level, DracoBuffer& out)
+	{
+		uint32_t max_symbol = 0;
+		for (size_t i = 0; i < count; i++) max_symbol = std::max(max_symbol, symbols[i]);
+		std::vector<uint64_t> freq((size_t)max_symbol + 1, 0);
+		for (size_t i = 0; i < count; i++) freq[symbols[i]]++;
+		uint32_t num_unique = 0;
+		for (size_t i = 0; i < freq.size(); i++) num_unique += freq[i] > 0 ? 1 : 0;
+
+		// the decoder derives the precision from this length: clamp(3 * length / 2, 12, 20) bits
+		int bit_length = MostSignificantBit(num_unique) + 1;
+		if (level < 4) bit_length -= 2;
+		else if (level < 6) bit_length -= 1;
+		else if (level > 9) bit_length += 2;
+		else if (level > 7) bit_length += 1;
+		bit_length = std::min(std::max(1, bit_length), 18);
+		int precision_bits = std::min(std::max(12, 3 * bit_length / 2), 20);
+		uint32_t precision = 1u << precision_bits;
+		if (num_unique > precision) return false;
+
+		// probabilities summing to exactly precision, none of a used symbol rounded to zero
+		std::vector<uint32_t> prob(freq.size(), 0);
+		int64_t total = 0;
+		for (size_t i = 0; i < freq.size(); i++)
+		{
+			if (freq[i] == 0) continue;
+			prob[i] = (uint32_t)std::max<uint64_t>(1, (freq[i] * precision + count / 2) / count);
+			total += prob[i];
+		}
+		std::vector<uint32_t> by_prob;
+		for (size_t i = 0; i < prob.size(); i++)
+		{
+			if (prob[i] > 0) by_prob.push_back((uint32_t)i);
+		}
+		std::sort(by_prob.begin(), by_prob.end(), [&](uint32_t a, uint32_t b) { return prob[a] > prob[b] || (prob[a] == prob[b] && a < b); });
+		int64_t error = (int64_t)precision - total;
+		if (error > 0) prob[by_prob[0]] += (uint32_t)error;
+		while (error < 0)
+		{
+			for (size_t i = 0; i < by_prob.size() && error < 0; i++)
+			{
+				uint32_t& p = prob[by_prob[i]];
+				uint32_t take = (uint32_t)std::min<int64_t>(-error, std::max<int64_t>(1, p / 2));
+				take = std::min(take, p - 1);
+				p -= take;
+				error += take;
+			}
+		}
+
+		out.put_u8(1); // raw scheme
+		out.put_u8((uint8_t)bit_length);
+
+		out.put_varint(prob.size());
+		for (size_t i = 0; i < prob.size(); i++)
+		{
+			uint32_t p = prob[i];
+			if (p == 0)
+			{
+				// run of zero probabilities up to the next used symbol, which always exists
+				uint32_t offset = 0;
+				while (offset < 63 && prob[i + offset + 1] == 0) offset++;
+				out.put_u8((uint8_t)((offset << 2) | 3));
+				i += offset;
+				continue;
+			}
+			int extra_bytes = p >= (1u << 14) ? 2 : (p >= (1u << 6) ? 1 : 0);
+			out.put_u8((uint8_t)((p << 2) | extra_bytes));
+			for (int b = 0; b < extra_bytes; b++) out.put_u8((uint8_t)(p >> (8 * (b + 1) - 2)));
+		}
+
+		std::vector<uint32_t> cum(prob.size(), 0);
+		for (size_t i = 1; i < prob.size(); i++) cum[i] = cum[i - 1] + prob[i - 1];
+
+		// encoded back to front so the decoder reads symbols in order
+		const uint32_t l_base = precision * 4;
+		std::vector<uint8_t> bytes;
+		uint32_t state = l_base;
+		for (size_t i = count; i-- > 0;)
+		{
+			uint32_t p = prob[symbols[i]];
+			while (state >= (l_base / precision) * 256 * p)
+			{
+				bytes.push_back((uint8_t)(state & 0xff));
+				state >>= 8;
+			}
+			state = (state / p) * precision + state % p + cum[symbols[i]];
+		}
+		state -= l_base;
+		if (state < (1u << 6))
+		{
+			bytes.push_back((uint8_t)state);
+		}
+		else if (state < (1u << 14))
+		{
+			uint32_t v = (1u << 14) + state;
+			bytes.push_back((uint8_t)v);
+			bytes.push_back((uint8_t)(v >> 8));
+		}
+		else if (state < (1u << 22))
+		{
+			uint32_t v = (2u << 22) + state;
+			for (int b = 0; b < 3; b++) bytes.push_back((uint8_t)(v >> (8 * b)));
+		}
+		else
+		{
+			uint32_t v = (3u << 30) + state;
+			for (int b = 0; b < 4; b++) bytes.push_back((uint8_t)(v >> (8 * b)));
+		}
+
+		out.put_varint(bytes.size());
+		out.put_bytes(bytes.data(), bytes.size());
+		return true;
+	}
+
+	// One point attribute; float values are quantized to quantization_bits, integer ones are
+	// stored as given.
+	struct DracoAttribute
+	{
+		int unique_id = 0;
+		int attribute_type = 4;
+		int data_type = 9;
+		int num_components = 0;
+		bool normalized = false;
+		int quantization_bits = 0;
+		std::vector<float> values;
+		std::vector<int32_t> int_values;
+	};
+
+	// Delta prediction with the wrap transform, as Draco applies it to sequentially coded attributes.
+	inline void DracoEncodeIntegerValues(const std::vector<int32_t>& values, int num_components, int level, DracoBuffer& out)
+	{
+		out.put_u8((uint8_t)(int8_t)0); // PREDICTION_DIFFERENCE
+		out.put_u8((uint8_t)(int8_t)1); // PREDICTION_TRANSFORM_WRAP
+
+		int32_t min_value = values[0];
+		int32_t max_value = values[0];
+		for (size_t i = 1; i < values.size(); i++)
+		{
+			min_value = std::min(min_value, values[i]);
+			max_value = std::max(max_value, values[i]);
+		}
+		int32_t max_dif = 1 + max_value - min_value;
+		int32_t max_correction = max_dif / 2;
+		int32_t min_correction = -max_correction;
+		if ((max_dif & 1) == 0) max_correction -= 1;
+
+		std::vector<uint32_t> symbols(values.size());
+		for (size_t i = 0; i < values.size(); i++)
+		{
+			int32_t predicted = i < (size_t)num_components ? 0 : values[i - num_components];
+			predicted = std::min(std::max(predicted, min_value), max_value);
+			int32_t corr = values[i] - predicted;
+			if (corr < min_correction) corr += max_dif;
+			else if (corr > max_correction) corr -= max_dif;
+			symbols[i] = corr >= 0 ? (uint32_t)corr << 1 : ((uint32_t)(-(corr + 1)) << 1) | 1;
+		}
+
+		DracoBuffer coded;
+		if (level > 0 && DracoEncodeSymbols(symbols.data(), symbols.size(), level, coded))
+		{
+			out.put_u8(1);
+			out.put_bytes(coded.data.data(), coded.data.size());
+		}
+		else
+		{
+			uint32_t max_symbol = 0;
+			for (size_t i = 0; i < symbols.size(); i++) max_symbol = std::max(max_symbol, symbols[i]);
+			int num_bytes = MostSignificantBit(max_symbol) / 8 + 1;
+			out.put_u8(0);
+			out.put_u8((uint8_t)num_bytes);
+			for (size_t i = 0; i < symbols.size(); i++)
+			{
+				for (int b = 0; b < num_bytes; b++) out.put_u8((uint8_t)(symbols[i] >> (8 * b)));
+			}
+		}
+
+		out.put_i32(min_value);
+		out.put_i32(max_value);
+	}
+
+	// Encodes a triangle mesh of num_points points, every attribute holding one value per point.
+	inline std::vector<uint8_t> EncodeDracoMesh(const std::vector<uint32_t>& indices, size_t num_points, const std::vector<DracoAttribute>& attribs, int level)
+	{
+		DracoBuffer out;
+		out.put_bytes("DRACO", 5);
+		out.put_u8(2);
+		out.put_u8(2);
+		out.put_u8(1); // triangular mesh
+		out.put_u8(0); // sequential encoding
+		out.put_u8(0);
+		out.put_u8(0); // flags
+
+		size_t num_faces = indices.size() / 3;
+		out.put_varint(num_faces);
+		out.put_varint(num_points);
+
+		// compressed indices: sign-magnitude deltas from the previous index
+		size_t connectivity_start = out.data.size();
+		bool compressed = false;
+		if (level > 0)
+		{
+			std::vector<uint32_t> symbols(indices.size());
+			int32_t last = 0;
+			for (size_t i = 0; i < indices.size(); i++)
+			{
+				int32_t diff = (int32_t)indices[i] - last;
+				symbols[i] = ((uint32_t)std::abs(diff) << 1) | (diff < 0 ? 1 : 0);
+				last = (int32_t)indices[i];
+			}
+			DracoBuffer coded;
+			coded.put_u8(0);
+			if (DracoEncodeSymbols(symbols.data(), symbols.size(), level, coded))
+			{
+				out.put_bytes(coded.data.data(), coded.data.size());
+				compressed = true;
+			}
+		}
+		if (!compressed)
+		{
+			out.put_u8(1);
+			for (size_t i = 0; i < indices.size(); i++)
+			{
+				if (num_points < 256) out.put_u8((uint8_t)indices[i]);
+				else if (num_points < (1 << 16)) out.put_bytes(&indices[i], 2);
+				else if (num_points < (1 << 21)) out.put_varint(indices[i]);
+				else out.put_u32(indices[i]);
+			}
+		}
+
+		out.put_u8(1); // one attributes decoder
+		out.put_varint(attribs.size());
+		for (size_t i = 0; i < attribs.size(); i++)
+		{
+			out.put_u8((uint8_t)attribs[i].attribute_type);
+			out.put_u8((uint8_t)attribs[i].data_type);
+			out.put_u8((uint8_t)attribs[i].num_components);
+			out.put_u8(attribs[i].normalized ? 1 : 0);
+			out.put_varint(i); // unique id
+		}
+		for (size_t i = 0; i < attribs.size(); i++)
+		{
+			out.put_u8(attribs[i].quantization_bits > 0 ? 2 : 1); // quantization or integer decoder
+		}
+
+		std::vector<std::vector<float>> min_values(attribs.size());
+		std::vector<float> ranges(attribs.size(), 0.0f);
+		for (size_t a = 0; a < attribs.size(); a++)
+		{
+			const DracoAttribute& att = attribs[a];
+			int nc = att.num_components;
+			if (att.quantization_bits == 0)
+			{
+				DracoEncodeIntegerValues(att.int_values, nc, level, out);
+				continue;
+			}
+
+			std::vector<float> min_v(att.values.begin(), att.values.begin() + nc);
+			std::vector<float> max_v = min_v;
+			for (size_t i = 0; i < num_points; i++)
+			{
+				for (int c = 0; c < nc; c++)
+				{
+					float v = att.values[i * nc + c];
+					min_v[c] = std::min(min_v[c], v);
+					max_v[c] = std::max(max_v[c], v);
+				}
+			}
+			float range = 0.0f;
+			for (int c = 0; c < nc; c++) range = std::max(range, max_v[c] - min_v[c]);
+			if (range == 0.0f) range = 1.0f;
+
+			int32_t max_quantized = (int32_t)((1u << att.quantization_bits) - 1);
+			float inverse_delta = (float)max_quantized / range;
+			std::vector<int32_t> quantized(num_points * nc);
+			for (size_t i = 0; i < quantized.size(); i++)
+			{
+				float v = (att.values[i] - min_v[i % nc]) * inverse_delta;
+				quantized[i] = (int32_t)std::floor(v + 0.5f);
+			}
+			DracoEncodeIntegerValues(quantized, nc, level, out);
+			min_values[a] = min_v;
+			ranges[a] = range;
+		}
+
+		// transform data follows all values in bitstream 2.x
+		for (size_t a = 0; a < attribs.size(); a++)
+		{
+			if (attribs[a].quantization_bits == 0) continue;
+			for (size_t c = 0; c < min_values[a].size(); c++) out.put_f32(min_values[a][c]);
+			out.put_f32(ranges[a]);
+			out.put_u8((uint8_t)attribs[a].quantization_bits);
+		}
+
+		// decoders reject a face count larger than a third of the bytes after it
+		if (compressed && out.data.size() - connectivity_start < num_faces * 3)
+		{
+			return EncodeDracoMesh(indices, num_points, attribs, 0);
+		}
+		return out.data;
+	}
+
+	// Little-endian reader over a Draco stream; ok drops to false on the first read past the end.
+	struct DracoReader
+	{
+		const uint8_t* data = nullptr;
+		size_t size = 0;
+		size_t pos = 0;
+		bool ok = true;
+
+		size_t remaining() const { return size - pos; }
+		uint8_t get_u8()
+		{
+			if (pos >= size)
+			{
+				ok = false;
+				return 0;
+			}
+			return data[pos++];
+		}
+		uint32_t get_u32()
+		{
+			uint32_t v = 0;
+			for (int i = 0; i < 4; i++) v |= (uint32_t)get_u8() << (i * 8);
+			return v;
+		}
+		float get_f32()
+		{
+			uint32_t v = get_u32();
+			float f;
+			memcpy(&f, &v, 4);
+			return f;
+		}
+		uint64_t get_varint()
+		{
+			uint64_t v = 0;
+			for (int shift = 0; shift < 64; shift += 7)
+			{
+				uint8_t b = get_u8();
+				v |= (uint64_t)(b & 0x7f) << shift;
+				if ((b & 0x80) == 0) break;
+			}
+			return v;
+		}
+	};
+
+	// Inverse of DracoEncodeSymbols, following Draco's raw rANS symbol decoder.
+	inline bool DracoDecodeSymbols(DracoReader& in, size_t count, uint32_t* symbols)
+	{
+		if (count == 0) return true;
+		if (in.get_u8() != 1) return false; // only the raw scheme
+		int bit_length = in.get_u8();
+		if (bit_length < 1 || bit_length > 18) return false;
+		int precision_bits = std::min(std::max(12, 3 * bit_length / 2), 20);
+		uint32_t precision = 1u << precision_bits;
+
+		// one probability byte covers at most a run of 64 unused symbols
+		uint64_t num_symbols = in.get_varint();
+		if (num_symbols > (uint64_t)in.remaining() * 64) return false;
+		std::vector<uint32_t> prob((size_t)num_symbols, 0);
+		for (size_t i = 0; i < prob.size() && in.ok; i++)
+		{
+			uint8_t token = in.get_u8();
+			int extra_bytes = token & 3;
+			if (extra_bytes == 3)
+			{
+				size_t offset = token >> 2;
+				if (i + offset >= prob.size()) return false;
+				i += offset;
+				continue;
+			}
+			uint32_t p = token >> 2;
+			for (int b = 0; b < extra_bytes; b++) p |= (uint32_t)in.get_u8() << (8 * (b + 1) - 2);
+			prob[i] = p;
+		}
+		std::vector<uint32_t> cum(prob.size() + 1, 0);
+		for (size_t i = 0; i < prob.size(); i++) cum[i + 1] = cum[i] + prob[i];
+		if (cum.back() != precision) return false;
+
+		uint64_t num_bytes = in.get_varint();
+		if (!in.ok || num_bytes == 0 || num_bytes > in.remaining()) return false;
+		const uint8_t* bytes = in.data + in.pos;
+		in.pos += (size_t)num_bytes;
+
+		size_t offset = (size_t)num_bytes;
+		int prefix = bytes[offset - 1] >> 6;
+		if (offset < (size_t)prefix + 1) return false;
+		offset -= prefix + 1;
+		uint32_t state = 0;
+		for (int b = 0; b <= prefix; b++) state |= (uint32_t)bytes[offset + b] << (8 * b);
+		state &= (1u << (8 * (prefix + 1) - 2)) - 1;
+		const uint32_t l_base = precision * 4;
+		state += l_base;
+		if (state >= l_base * 256) return false;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			while (state < l_base && offset > 0) state = state * 256 + bytes[--offset];
+			uint32_t quotient = state / precision;
+			uint32_t rem = state % precision;
+			size_t s = std::upper_bound(cum.begin(), cum.end(), rem) - cum.begin() - 1;
+			state = quotient * prob[s] + rem - cum[s];
+			symbols[i] = (uint32_t)s;
+		}
+		return true;
+	}
+
+	// Inverse of DracoEncodeIntegerValues: difference prediction with the wrap transform only.
+	inline bool DracoDecodeIntegerValues(DracoReader& in, size_t count, int num_components, std::vector<int32_t>& values)
+	{
+		if ((int8_t)in.get_u8() != 0 || (int8_t)in.get_u8() != 1) return false;
+
+		std::vector<uint32_t> symbols(count);
+		if (in.get_u8() != 0)
+		{
+			if (!DracoDecodeSymbols(in, count, symbols.data())) return false;
+		}
+		else
+		{
+			int num_bytes = in.get_u8();
+			if (num_bytes < 1 || num_bytes > 4 || count * num_bytes > in.remaining()) return false;
+			for (size_t i = 0; i < count; i++)
+			{
+				uint32_t v = 0;
+				for (int b = 0; b < num_bytes; b++) v |= (uint32_t)in.get_u8() << (8 * b);
+				symbols[i] = v;
+			}
+		}
+
+		int32_t min_value = (int32_t)in.get_u32();
+		int32_t max_value = (int32_t)in.get_u32();
+		if (!in.ok || max_value < min_value) return false;
+		int32_t max_dif = 1 + max_value - min_value;
+
+		values.resize(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			int32_t corr = (symbols[i] & 1) ? -(int32_t)(symbols[i] >> 1) - 1 : (int32_t)(symbols[i] >> 1);
+			int32_t predicted = i < (size_t)num_components ? 0 : values[i - num_components];
+			predicted = std::min(std::max(predicted, min_value), max_value);
+			int32_t v = predicted + corr;
+			if (v > max_value) v -= max_dif;
+			else if (v < min_value) v += max_dif;
+			values[i] = v;
+		}
+		return true;
+	}
+
+	// Decodes the subset of bitstream 2.2 EncodeDracoMesh writes: sequential connectivity and
+	// integer or quantized attributes with difference prediction. Edgebreaker streams and other
+	// prediction schemes are rejected rather than misread; attribs[i].unique_id is the id the
+	// extension's attribute map refers to.
+	inline bool DecodeDracoMesh(const uint8_t* data, size_t size, std::vector<uint32_t>& indices, size_t& num_points, std::vector<DracoAttribute>& attribs)
+	{
+		DracoReader in;
+		in.data = data;
+		in.size = size;
+		if (size < 11 || memcmp(data, "DRACO", 5) != 0) return false;
+		in.pos = 5;
+		if (in.get_u8() != 2 || in.get_u8() != 2) return false;
+		if (in.get_u8() != 1 || in.get_u8() != 0) return false; // sequential triangular mesh
+		if (in.get_u8() != 0 || in.get_u8() != 0) return false; // no metadata
+
+		uint64_t num_faces = in.get_varint();
+		num_points = (size_t)in.get_varint();
+		if (!in.ok || num_faces > in.remaining() / 3 || num_points > ((size_t)1 << 31)) return false;
+
+		indices.resize((size_t)num_faces * 3);
+		uint8_t connectivity = in.get_u8();
+		if (connectivity == 0)
+		{
+			std::vector<uint32_t> symbols(indices.size());
+			if (!DracoDecodeSymbols(in, symbols.size(), symbols.data())) return false;
+			int32_t last = 0;
+			for (size_t i = 0; i < symbols.size(); i++)
+			{
+				int32_t diff = (int32_t)(symbols[i] >> 1);
+				last += (symbols[i] & 1) ? -diff : diff;
+				indices[i] = (uint32_t)last;
+			}
+		}
+		else if (connectivity == 1)
+		{
+			for (size_t i = 0; i < indices.size() && in.ok; i++)
+			{
+				if (num_points < 256) indices[i] = in.get_u8();
+				else if (num_points < (1 << 16)) indices[i] = in.get_u8() | ((uint32_t)in.get_u8() << 8);
+				else if (num_points < (1 << 21)) indices[i] = (uint32_t)in.get_varint();
+				else indices[i] = in.get_u32();
+			}
+		}
+		else
+		{
+			return false;
+		}
+		for (size_t i = 0; i < indices.size(); i++)
+		{
+			if (indices[i] >= num_points) return false;
+		}
+
+		if (in.get_u8() != 1) return false;
+		uint64_t num_attribs = in.get_varint();
+		if (!in.ok || num_attribs > in.remaining()) return false;
+		attribs.assign((size_t)num_attribs, DracoAttribute());
+		for (size_t a = 0; a < attribs.size(); a++)
+		{
+			attribs[a].attribute_type = in.get_u8();
+			attribs[a].data_type = in.get_u8();
+			attribs[a].num_components = in.get_u8();
+			attribs[a].normalized = in.get_u8() != 0;
+			attribs[a].unique_id = (int)in.get_varint();
+			if (attribs[a].num_components < 1 || attribs[a].num_components > 4) return false;
+		}
+		std::vector<uint8_t> decoders(attribs.size());
+		for (size_t a = 0; a < attribs.size(); a++)
+		{
+			decoders[a] = in.get_u8();
+			if (decoders[a] != 1 && decoders[a] != 2) return false;
+		}
+		for (size_t a = 0; a < attribs.size(); a++)
+		{
+			if (!DracoDecodeIntegerValues(in, num_points * attribs[a].num_components, attribs[a].num_components, attribs[a].int_values)) return false;
+		}
+		for (size_t a = 0; a < attribs.size(); a++)
+		{
+			if (decoders[a] != 2) continue;
+			DracoAttribute& att = attribs[a];
+			float min_v[4];
+			for (int c = 0; c < att.num_components; c++) min_v[c] = in.get_f32();
+			float range = in.get_f32();
+			att.quantization_bits = in.get_u8();
+			if (att.quantization_bits < 1 || att.quantization_bits > 30) return false;
+			float delta = range / (float)((1u << att.quantization_bits) - 1);
+			att.values.resize(att.int_values.size());
+			for (size_t i = 0; i < att.values.size(); i++)
+			{
+				att.values[i] = (float)att.int_values[i] * delta + min_v[i % att.num_components];
+			}
+			att.int_values.clear();
+		}
+		return in.ok && in.pos == in.size;
+	}
+
+	// Round-trips grid meshes at every level through EncodeDracoMesh and DecodeDracoMesh, and
+	// random skewed alphabets through the symbol coder, reporting failures to out. Indices and
+	// integer streams must come back exactly, floats within half a quantization step.
+	inline bool CheckDracoRoundTrip(FILE* out)
+	{
+		uint64_t seed = 0x9E3779B97F4A7C15ull;
+		auto next = [&seed]()
+		{
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			return seed;
+		};
+
+		bool ok = true;
+		for (int level = 0; level <= 10; level++)
+		{
+			int width = 3 + level * 13, height = 2 + level * 7;
+			size_t num_points = (size_t)width * height;
+			std::vector<uint32_t> indices;
+			for (int y = 0; y + 1 < height; y++)
+			{
+				for (int x = 0; x + 1 < width; x++)
+				{
+					uint32_t v = (uint32_t)(y * width + x);
+					uint32_t quad[6] = { v, v + 1, v + width, v + 1, v + width + 1, v + width };
+					indices.insert(indices.end(), quad, quad + 6);
+				}
+			}
+
+			// POSITION, NORMAL, TEXCOORD_0, JOINTS_0, WEIGHTS_0
+			std::vector<DracoAttribute> attribs(5);
+			int types[5] = { 0, 1, 3, 4, 4 };
+			int components[5] = { 3, 3, 2, 4, 4 };
+			int bits[5] = { 14, 10, 12, 0, 8 };
+			for (int a = 0; a < 5; a++)
+			{
+				attribs[a].attribute_type = types[a];
+				attribs[a].num_components = components[a];
+				attribs[a].quantization_bits = bits[a];
+				if (bits[a] == 0) attribs[a].data_type = 4;
+			}
+			for (size_t i = 0; i < num_points; i++)
+			{
+				float x = (float)(i % width), y = (float)(i / width);
+				float noise = (float)(next() % 1000) * 0.001f;
+				attribs[0].values.insert(attribs[0].values.end(), { x * 0.1f, y * 0.1f, noise * 0.05f });
+				attribs[1].values.insert(attribs[1].values.end(), { noise * 0.2f, 0.0f, 1.0f });
+				attribs[2].values.insert(attribs[2].values.end(), { x / width, y / height });
+				for (int c = 0; c < 4; c++) attribs[3].int_values.push_back((int32_t)(next() % (level == 10 ? 300 : 40)));
+				attribs[4].values.insert(attribs[4].values.end(), { 1.0f - noise, noise, 0.0f, 0.0f });
+			}
+
+			std::vector<uint8_t> encoded = EncodeDracoMesh(indices, num_points, attribs, level);
+			std::vector<uint32_t> decoded_indices;
+			size_t decoded_points = 0;
+			std::vector<DracoAttribute> decoded;
+			if (!DecodeDracoMesh(encoded.data(), encoded.size(), decoded_indices, decoded_points, decoded))
+			{
+				fprintf(out, "draco level %d: stream does not decode\n", level);
+				ok = false;
+				continue;
+			}
+			bool level_ok = decoded_indices == indices && decoded_points == num_points && decoded.size() == attribs.size();
+			for (size_t a = 0; a < attribs.size() && level_ok; a++)
+			{
+				const DracoAttribute& src = attribs[a];
+				const DracoAttribute& dst = decoded[a];
+				level_ok = dst.unique_id == (int)a && dst.attribute_type == src.attribute_type && dst.num_components == src.num_components &&
+					dst.quantization_bits == src.quantization_bits && dst.int_values == src.int_values && dst.values.size() == src.values.size();
+				if (!level_ok || src.values.empty()) continue;
+				float range = 0.0f;
+				for (int c = 0; c < src.num_components; c++)
+				{
+					float mn = src.values[c], mx = src.values[c];
+					for (size_t i = c; i < src.values.size(); i += src.num_components)
+					{
+						mn = std::min(mn, src.values[i]);
+						mx = std::max(mx, src.values[i]);
+					}
+					range = std::max(range, mx - mn);
+				}
+				// half a step, plus float rounding in the encoder's scaling
+				range = range > 0.0f ? range : 1.0f;
+				float max_error = range / (float)((1u << src.quantization_bits) - 1) * 0.5f + range * 1e-6f;
+				for (size_t i = 0; i < src.values.size() && level_ok; i++)
+				{
+					level_ok = std::fabs(src.values[i] - dst.values[i]) <= max_error;
+				}
+			}
+			fprintf(out, "draco level %d: %zu points, %zu bytes, %s\n", level, num_points, encoded.size(), level_ok ? "ok" : "FAILED");
+			ok = ok && level_ok;
+		}
+
+		bool symbols_ok = true;
+		for (int t = 0; t < 200; t++)
+		{
+			size_t count = 1 + next() % 5000;
+			uint32_t alphabet = 1 + (uint32_t)(next() % (t & 1 ? 70000 : 300));
+			std::vector<uint32_t> symbols(count);
+			for (size_t i = 0; i < count; i++)
+			{
+				uint32_t r = (uint32_t)(next() % alphabet);
+				symbols[i] = next() % 4 ? r % 7 : r;
+			}
+			int level = (int)(next() % 11);
+			DracoBuffer coded;
+			if (!DracoEncodeSymbols(symbols.data(), count, level, coded)) continue;
+			DracoReader in;
+			in.data = coded.data.data();
+			in.size = coded.data.size();
+			std::vector<uint32_t> decoded(count);
+			if (!DracoDecodeSymbols(in, count, decoded.data()) || decoded != symbols || in.pos != in.size)
+			{
+				fprintf(out, "draco symbols: stream %d (%zu symbols, level %d) does not round-trip\n", t, count, level);
+				symbols_ok = false;
+			}
+		}
+		fprintf(out, "draco symbols: %s\n", symbols_ok ? "ok" : "FAILED");
+		return ok && symbols_ok;
+	}
+
+	// Reads an unsigned integer scalar accessor exactly (ReadAccessor goes through float, which
+	// loses indices above 2^24), resolving sparse storage.
+	inline std::vector<uint32_t> ReadIndices(const tinygltf::Model& model, const tinygltf::Accessor& acc)
+	{
+		std::vector<uint32_t> ret(acc.count, 0);
+		int size = tinygltf::GetComponentSizeInBytes(acc.componentType);
+		if (acc.bufferView >= 0)
+		{
+			const tinygltf::BufferView& view = model.bufferViews[acc.bufferView];
+			const uint8_t* base = model.buffers[view.buffer].data.data() + view.byteOffset + acc.byteOffset;
+			size_t stride = view.byteStride > 0 ? view.byteStride : (size_t)size;
+			for (size_t i = 0; i < acc.count; i++)
+			{
+				uint32_t v = 0;
+				memcpy(&v, base + i * stride, size);
+				ret[i] = v;
+			}
+		}
+		if (acc.sparse.isSparse)
+		{
+			const tinygltf::BufferView& view_idx = model.bufferViews[acc.sparse.indices.bufferView];
+			const tinygltf::BufferView& view_val = model.bufferViews[acc.sparse.values.bufferView];
+			const uint8_t* p_idx = model.buffers[view_idx.buffer].data.data() + view_idx.byteOffset + acc.sparse.indices.byteOffset;
+			const uint8_t* p_val = model.buffers[view_val.buffer].data.data() + view_val.byteOffset + acc.sparse.values.byteOffset;
+			int idx_size = tinygltf::GetComponentSizeInBytes(acc.sparse.indices.componentType);
+			for (int i = 0; i < acc.sparse.count; i++)
+			{
+				uint32_t idx = 0, v = 0;
+				memcpy(&idx, p_idx + i * idx_size, idx_size);
+				memcpy(&v, p_val + i * size, size);
+				if (idx < acc.count) ret[idx] = v;
+			}
+		}
+		return ret;
+	}
+
+	// Replaces the streams of every indexed triangle primitive without morph targets by one
+	// KHR_draco_mesh_compression bufferView. Primitives are encoded in parallel and emitted in
+	// model order; the accessors keep their counts and bounds but lose their bufferViews, so run
+	// PruneUnusedData() afterwards.
+	inline void CompressDraco(tinygltf::Model& model, BufferWriter& writer, ThreadPool& pool, const DracoOptions& options)
+	{
+		struct Job
+		{
+			int mesh;
+			int prim;
+			std::vector<std::string> semantics;
+			std::vector<uint8_t> encoded;
+		};
+		// accessors referenced by more than one primitive cannot lose their bufferView
+		std::vector<int> acc_refs(model.accessors.size(), 0);
+		for (size_t m = 0; m < model.meshes.size(); m++)
+		{
+			for (const tinygltf::Primitive& prim : model.meshes[m].primitives)
+			{
+				if (prim.indices >= 0) acc_refs[prim.indices]++;
+				for (auto iter = prim.attributes.begin(); iter != prim.attributes.end(); iter++) acc_refs[iter->second]++;
+				for (size_t t = 0; t < prim.targets.size(); t++)
+				{
+					for (auto iter = prim.targets[t].begin(); iter != prim.targets[t].end(); iter++) acc_refs[iter->second]++;
+				}
+			}
+		}
+
+		std::vector<Job> jobs;
+		for (size_t m = 0; m < model.meshes.size(); m++)
+		{
+			for (size_t p = 0; p < model.meshes[m].primitives.size(); p++)
+			{
+				const tinygltf::Primitive& prim = model.meshes[m].primitives[p];
+				if (prim.mode != TINYGLTF_MODE_TRIANGLES && prim.mode != -1) continue;
+				if (prim.indices < 0 || prim.targets.size() > 0 || prim.attributes.count("POSITION") == 0) continue;
+				const tinygltf::Accessor& idx_acc = model.accessors[prim.indices];
+				bool plain = idx_acc.bufferView >= 0 && !idx_acc.sparse.isSparse && acc_refs[prim.indices] == 1;
+				for (auto iter = prim.attributes.begin(); iter != prim.attributes.end(); iter++)
+				{
+					const tinygltf::Accessor& acc = model.accessors[iter->second];
+					if (acc.bufferView < 0 || acc.sparse.isSparse || acc_refs[iter->second] != 1) plain = false;
+				}
+				if (!plain) continue;
+				jobs.push_back({ (int)m, (int)p, {}, {} });
+			}
+		}
+
+		pool.parallel_for(jobs.size(), [&](size_t j)
+			{
+				Job& job = jobs[j];
+				const tinygltf::Primitive& prim = model.meshes[job.mesh].primitives[job.prim];
+				size_t num_points = model.accessors[prim.attributes.at("POSITION")].count;
+				std::vector<uint32_t> indices = ReadIndices(model, model.accessors[prim.indices]);
+				if (num_points == 0 || indices.size() < 3) return;
+
+				std::vector<DracoAttribute> attribs;
+				for (auto iter = prim.attributes.begin(); iter != prim.attributes.end(); iter++)
+				{
+					const std::string& name = iter->first;
+					const tinygltf::Accessor& acc = model.accessors[iter->second];
+					if (acc.count != num_points) return;
+
+					DracoAttribute att;
+					att.num_components = tinygltf::GetNumComponentsInType(acc.type);
+					if (name == "POSITION") att.attribute_type = 0;
+					else if (name == "NORMAL") att.attribute_type = 1;
+					else if (name.compare(0, 6, "COLOR_") == 0) att.attribute_type = 2;
+					else if (name.compare(0, 9, "TEXCOORD_") == 0) att.attribute_type = 3;
+
+					// integer streams keep their stored values, normalized or not
+					std::vector<float> values = ReadAccessor(model, iter->second, false);
+					if (acc.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT)
+					{
+						att.data_type = 9;
+						att.quantization_bits = att.attribute_type == 0 ? options.position_bits :
+							att.attribute_type == 1 || name == "TANGENT" ? options.normal_bits :
+							att.attribute_type == 3 ? options.texcoord_bits : options.generic_bits;
+						att.values = std::move(values);
+					}
+					else
+					{
+						switch (acc.componentType)
+						{
+						case TINYGLTF_COMPONENT_TYPE_BYTE: att.data_type = 1; break;
+						case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE: att.data_type = 2; break;
+						case TINYGLTF_COMPONENT_TYPE_SHORT: att.data_type = 3; break;
+						case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: att.data_type = 4; break;
+						default: att.data_type = 6; break;
+						}
+						att.normalized = acc.normalized;
+						att.int_values.assign(values.begin(), values.end());
+					}
+					attribs.push_back(std::move(att));
+					job.semantics.push_back(name);
+				}
+				job.encoded = EncodeDracoMesh(indices, num_points, attribs, options.level);
+			});
+
+		bool used = false;
+		for (size_t j = 0; j < jobs.size(); j++)
+		{
+			Job& job = jobs[j];
+			if (job.encoded.empty()) continue;
+			tinygltf::Primitive& prim = model.meshes[job.mesh].primitives[job.prim];
+
+			tinygltf::Value::Object attributes;
+			for (size_t a = 0; a < job.semantics.size(); a++)
+			{
+				attributes[job.semantics[a]] = tinygltf::Value((int)a);
+				tinygltf::Accessor& acc = model.accessors[prim.attributes[job.semantics[a]]];
+				acc.bufferView = -1;
+				acc.byteOffset = 0;
+			}
+			model.accessors[prim.indices].bufferView = -1;
+			model.accessors[prim.indices].byteOffset = 0;
+
+			tinygltf::Value::Object ext;
+			ext["bufferView"] = tinygltf::Value(writer.emit_view(job.encoded.data(), job.encoded.size()));
+			ext["attributes"] = tinygltf::Value(attributes);
+			prim.extensions["KHR_draco_mesh_compression"] = tinygltf::Value(ext);
+			used = true;
+		}
+
+		if (used)
+		{
+			model.extensionsUsed.push_back("KHR_draco_mesh_compression");
+			model.extensionsRequired.push_back("KHR_draco_mesh_compression");
+		}
+	}
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <vector>
+
+// Prefix code construction shared by the texture encoders.
+namespace Mid
+{
+	// Huffman code lengths limited to max_length. A code with fewer than two used symbols is padded
+	// to two, since the decoder only accepts complete codes.
+	inline void HuffmanCodeLengths(std::vector<uint32_t> counts, int max_length, std::vector<uint8_t>& lengths)
+	{
+		size_t n = counts.size();
+		int num_used = 0;
+		for (size_t i = 0; i < n; i++) num_used += counts[i] > 0 ? 1 : 0;
+		for (size_t i = 0; i < n && num_used < 2; i++)
+		{
+			if (counts[i] == 0)
+			{
+				counts[i] = 1;
+				num_used++;
+			}
+		}
+
+		struct Node
+		{
+			int left, right;
+		};
+		typedef std::pair<uint64_t, int> Entry;
+
+		for (;;)
+		{
+			// leaves are nodes 0..n-1, ties break on the node index to keep the output deterministic
+			std::vector<Node> nodes(n, { -1, -1 });
+			std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+			for (size_t i = 0; i < n; i++)
+			{
+				if (counts[i] > 0) queue.push({ counts[i], (int)i });
+			}
+			while (queue.size() > 1)
+			{
+				Entry a = queue.top();
+				queue.pop();
+				Entry b = queue.top();
+				queue.pop();
+				nodes.push_back({ a.second, b.second });
+				queue.push({ a.first + b.first, (int)nodes.size() - 1 });
+			}
+
+			// children are created before their parents, so one reverse sweep assigns all depths
+			std::vector<int> depth(nodes.size(), 0);
+			int max_depth = 0;
+			for (size_t i = nodes.size(); i-- > n;)
+			{
+				depth[nodes[i].left] = depth[i] + 1;
+				depth[nodes[i].right] = depth[i] + 1;
+			}
+			lengths.assign(n, 0);
+			for (size_t i = 0; i < n; i++)
+			{
+				if (counts[i] == 0) continue;
+				lengths[i] = (uint8_t)depth[i];
+				max_depth = std::max(max_depth, depth[i]);
+			}
+			if (max_depth <= max_length) return;
+
+			// flatten the distribution until the tree fits
+			for (size_t i = 0; i < n; i++)
+			{
+				if (counts[i] > 0) counts[i] = (counts[i] + 1) / 2;
+			}
+		}
+	}
+}
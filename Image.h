@@ -1,12 +1,19 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <functional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <stb_image.h>
 #include <stb_image_write.h>
 #include <glm.hpp>
 
+#include "Jpeg.h"
+#include "ThreadPool.h"
+#include "WebP.h"
+
 namespace Mid
 {
 	struct Image
@@ -16,7 +23,12 @@ namespace Mid
 		int width = -1;
 		int height = -1;
 		std::vector<uint8_t> pixels;
+		// file bytes in mimeType; the Create* functions only fill pixels, encode() produces this
 		std::vector<uint8_t> code;
+		// EXT_texture_webp variant, empty unless encode_webp() ran
+		std::vector<uint8_t> webp;
+		// file code was read from by Load(), for linking it instead of copying
+		std::string source;
 
 		glm::u8vec4 Get(int x, int y) const;
 		glm::u8vec4 Get(int x, int y, int width, int height) const;
@@ -38,22 +50,71 @@ namespace Mid
 
 		}
 
-		void encode_jpeg()
+		void encode_jpeg(const JpegOptions& options, ThreadPool& pool)
 		{
 			this->mimeType = "image/jpeg";
+			code = EncodeJpeg(pixels.data(), this->width, this->height, options, pool);
+		}
 
-			stbi_write_jpg_to_func([](void* context, void* data, int size)
-				{
-					std::vector<uint8_t>* buf = (std::vector<uint8_t>*)context;
-					size_t offset = buf->size();
-					buf->resize(offset + size);
-					memcpy(buf->data() + offset, data, size);
-				}, &code, this->width, this->height, 4, pixels.data(), 80);
+		// PNG or JPEG as chosen by mimeType, unless the file bytes are already there (Load)
+		void encode(const JpegOptions& jpeg_options, ThreadPool& pool)
+		{
+			if (!code.empty()) return;
+			if (mimeType == "image/png") encode_png();
+			else encode_jpeg(jpeg_options, pool);
+		}
+
+		void encode_webp(int quality)
+		{
+			webp = EncodeWebP(pixels.data(), width, height, quality);
 		}
 
 		void CreateRGBA(const Image& img_rgb, const Image& img_a);
 		void CreateMR(const Image& img_metallic, const Image& img_roughness);
 		void CreateSG(const Image& img_specular, const Image& img_roughness, float roughness);
+
+		// Box-filters the pixels by halving until neither side exceeds max_size. The file bytes
+		// no longer match and are dropped, so encode() writes the smaller image.
+		void Downsample(int max_size);
+	};
+
+	// Source textures by path, decoded once for every conversion that runs in the process.
+	class ImageCache
+	{
+	public:
+		const Image& load(const std::string& fn)
+		{
+			auto iter = images.find(fn);
+			if (iter != images.end()) return iter->second;
+			Image& img = images[fn];
+			if (!fetch || !fetch(fn, img))
+			{
+				img.Load(fn.c_str());
+				if (publish) publish(fn, img);
+			}
+			return img;
+		}
+
+		// Forgets a file so that the next load() reads it again (--watch, after it changed).
+		void invalidate(const std::string& fn)
+		{
+			images.erase(fn);
+		}
+
+		// every file loaded so far
+		std::vector<std::string> paths() const
+		{
+			std::vector<std::string> result;
+			for (auto& entry : images) result.push_back(entry.first);
+			return result;
+		}
+
+		// optional level shared with other processes, consulted before decoding
+		std::function<bool(const std::string&, Image&)> fetch;
+		std::function<void(const std::string&, const Image&)> publish;
+
+	private:
+		std::unordered_map<std::string, Image> images;
 	};
 
 	glm::u8vec4 Image::Get(int x, int y) const
@@ -131,6 +192,7 @@ namespace Mid
 		this->code.resize(size);
 		fread(this->code.data(), 1, size, fp);
 		fclose(fp);
+		this->source = filename;
 	}
 
 	void Image::CreateRGBA(const Image& img_rgb, const Image& img_a)
@@ -158,14 +220,7 @@ namespace Mid
 			}
 		}
 
-		if (img_a.width >= 0 && img_a.height >= 0)
-		{
-			encode_png();
-		}
-		else
-		{
-			encode_jpeg();
-		}
+		this->mimeType = img_a.width >= 0 && img_a.height >= 0 ? "image/png" : "image/jpeg";
 	}
 
 	void Image::CreateMR(const Image& img_metallic, const Image& img_roughness)
@@ -202,8 +257,7 @@ namespace Mid
 			}
 		}
 
-		encode_jpeg();
-		
+		this->mimeType = "image/jpeg";
 	}
 
 	void Image::CreateSG(const Image& img_specular, const Image& img_roughness, float roughness)
@@ -232,8 +286,48 @@ namespace Mid
 			}
 		}
 
-		encode_png();
+		this->mimeType = "image/png";
 	}
 
 
+
+	void Image::Downsample(int max_size)
+	{
+		int factor = 1;
+		while (max_size > 0 && std::max(this->width, this->height) > max_size * factor) factor *= 2;
+		if (factor == 1) return;
+
+		int w = (this->width + factor - 1) / factor;
+		int h = (this->height + factor - 1) / factor;
+		std::vector<uint8_t> out((size_t)w * h * 4);
+		for (int y = 0; y < h; y++)
+		{
+			int y1 = std::min((y + 1) * factor, this->height);
+			for (int x = 0; x < w; x++)
+			{
+				int x1 = std::min((x + 1) * factor, this->width);
+				uint32_t sum[4] = { 0, 0, 0, 0 };
+				for (int sy = y * factor; sy < y1; sy++)
+				{
+					const uint8_t* p = this->pixels.data() + ((size_t)sy * this->width + x * factor) * 4;
+					for (int sx = x * factor; sx < x1; sx++, p += 4)
+					{
+						sum[0] += p[0];
+						sum[1] += p[1];
+						sum[2] += p[2];
+						sum[3] += p[3];
+					}
+				}
+				uint32_t count = (uint32_t)((y1 - y * factor) * (x1 - x * factor));
+				uint8_t* q = out.data() + ((size_t)y * w + x) * 4;
+				for (int c = 0; c < 4; c++) q[c] = (uint8_t)((sum[c] + count / 2) / count);
+			}
+		}
+		this->width = w;
+		this->height = h;
+		this->pixels.swap(out);
+		this->code.clear();
+		this->webp.clear();
+		this->source.clear();
+	}
 }
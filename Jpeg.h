@@ -0,0 +1,664 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "Huffman.h"
+#include "Simd.h"
+#include "ThreadPool.h"
+
+// Baseline JPEG encoder: color conversion, DCT and quantization through the Simd() kernels,
+// selectable chroma subsampling, Huffman tables optimized per image, and restart intervals so
+// stripes of MCU rows are entropy-coded in parallel. Besides a fixed quality, the quality can be
+// searched for a PSNR, SSIM or file size target.
+namespace Mid
+{
+	struct JpegOptions
+	{
+		enum class Target
+		{
+			Quality,
+			Psnr,
+			Ssim,
+			Bytes,
+		};
+
+		// IJG quality scale 1-100, used as is with Target::Quality
+		int quality = 80;
+		// 444, 422 or 420
+		int subsampling = 420;
+		Target target = Target::Quality;
+		// dB for Psnr (RGB), 0-1 for Ssim (luma), a file size for Bytes
+		double target_value = 0.0;
+	};
+
+	// "psnr:40", "ssim:0.98" or "bytes:200000".
+	inline bool ParseJpegTarget(const std::string& spec, JpegOptions& options)
+	{
+		size_t colon = spec.find(':');
+		if (colon == std::string::npos) return false;
+		std::string kind = spec.substr(0, colon);
+		double value = atof(spec.c_str() + colon + 1);
+		if (kind == "psnr") options.target = JpegOptions::Target::Psnr;
+		else if (kind == "ssim") options.target = JpegOptions::Target::Ssim;
+		else if (kind == "bytes") options.target = JpegOptions::Target::Bytes;
+		else return false;
+		options.target_value = value;
+		return value > 0.0;
+	}
+
+	// natural index of the k-th coefficient in zigzag order
+	static const uint8_t jpeg_zigzag[64] = {
+		0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+		12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+		35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+		58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63 };
+
+	// ITU T.81 Annex K tables in natural order
+	static const uint8_t jpeg_luma_quant[64] = {
+		16, 11, 10, 16, 24, 40, 51, 61,
+		12, 12, 14, 19, 26, 58, 60, 55,
+		14, 13, 16, 24, 40, 57, 69, 56,
+		14, 17, 22, 29, 51, 87, 80, 62,
+		18, 22, 37, 56, 68, 109, 103, 77,
+		24, 35, 55, 64, 81, 104, 113, 92,
+		49, 64, 78, 87, 103, 121, 120, 101,
+		72, 92, 95, 98, 112, 100, 103, 99 };
+	static const uint8_t jpeg_chroma_quant[64] = {
+		17, 18, 24, 47, 99, 99, 99, 99,
+		18, 21, 26, 66, 99, 99, 99, 99,
+		24, 26, 56, 99, 99, 99, 99, 99,
+		47, 66, 99, 99, 99, 99, 99, 99,
+		99, 99, 99, 99, 99, 99, 99, 99,
+		99, 99, 99, 99, 99, 99, 99, 99,
+		99, 99, 99, 99, 99, 99, 99, 99,
+		99, 99, 99, 99, 99, 99, 99, 99 };
+
+	// Luma (0) and chroma (1) tables for an IJG quality, natural order.
+	inline void JpegQuantTables(int quality, uint16_t tables[2][64])
+	{
+		quality = std::min(std::max(quality, 1), 100);
+		int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+		for (int i = 0; i < 64; i++)
+		{
+			tables[0][i] = (uint16_t)std::min(std::max((jpeg_luma_quant[i] * scale + 50) / 100, 1), 255);
+			tables[1][i] = (uint16_t)std::min(std::max((jpeg_chroma_quant[i] * scale + 50) / 100, 1), 255);
+		}
+	}
+
+	struct JpegHuffman
+	{
+		// number of codes of each length 1-16, and the symbols in code order
+		uint8_t bits[16];
+		std::vector<uint8_t> values;
+		uint16_t code[256];
+		uint8_t size[256];
+	};
+
+	// Optimal table for the symbol counts, limited to 16 bits. A dummy symbol takes the all-ones
+	// code, which JPEG reserves.
+	inline void JpegBuildHuffman(const uint32_t* counts, JpegHuffman& h)
+	{
+		std::vector<uint32_t> freq(counts, counts + 256);
+		freq.push_back(1);
+		std::vector<uint8_t> lengths;
+		HuffmanCodeLengths(freq, 16, lengths);
+
+		// the dummy must sit among the longest codes to be last in canonical order
+		int max_length = *std::max_element(lengths.begin(), lengths.end());
+		if (lengths[256] != max_length)
+		{
+			for (int i = 255; i >= 0; i--)
+			{
+				if (lengths[i] == max_length)
+				{
+					std::swap(lengths[i], lengths[256]);
+					break;
+				}
+			}
+		}
+
+		memset(h.bits, 0, sizeof(h.bits));
+		memset(h.code, 0, sizeof(h.code));
+		memset(h.size, 0, sizeof(h.size));
+		h.values.clear();
+		uint16_t code = 0;
+		for (int length = 1; length <= 16; length++)
+		{
+			for (int i = 0; i < 256; i++)
+			{
+				if (lengths[i] != length) continue;
+				h.bits[length - 1]++;
+				h.values.push_back((uint8_t)i);
+				h.code[i] = code++;
+				h.size[i] = (uint8_t)length;
+			}
+			if (lengths[256] == length) code++;
+			code <<= 1;
+		}
+	}
+
+	// MSB-first entropy-coded segment with 0xFF byte stuffing.
+	struct JpegBitWriter
+	{
+		std::vector<uint8_t> data;
+		uint32_t acc = 0;
+		int used = 0;
+
+		void put(uint32_t bits, int count)
+		{
+			acc = (acc << count) | (bits & ((1u << count) - 1));
+			used += count;
+			while (used >= 8)
+			{
+				uint8_t byte = (uint8_t)(acc >> (used - 8));
+				data.push_back(byte);
+				if (byte == 0xff) data.push_back(0);
+				used -= 8;
+			}
+			acc &= (1u << used) - 1;
+		}
+
+		// pads the last byte with one bits
+		void flush()
+		{
+			if (used > 0) put((1u << (8 - used)) - 1, 8 - used);
+		}
+	};
+
+	struct JpegComponent
+	{
+		int h = 1;
+		int v = 1;
+		int blocks_x = 0;
+		int blocks_y = 0;
+		// coefficients of every block in raster order, scaled by 8, and their quantized values
+		std::vector<int16_t> dct;
+		std::vector<int16_t> quantized;
+	};
+
+	// The image color-converted and transformed once; every quality the search tries only
+	// requantizes.
+	struct JpegSource
+	{
+		const uint8_t* rgba = nullptr;
+		int width = 0;
+		int height = 0;
+		int mcus_x = 0;
+		int mcus_y = 0;
+		int max_h = 1;
+		int max_v = 1;
+		JpegComponent comps[3];
+		// level-shifted luma at full resolution, blocks_x * 8 wide, for SSIM
+		std::vector<int16_t> luma;
+	};
+
+	inline int JpegBitSize(int value)
+	{
+		int size = 0;
+		value = abs(value);
+		while (value > 0)
+		{
+			size++;
+			value >>= 1;
+		}
+		return size;
+	}
+
+	inline void JpegPrepare(JpegSource& src, const uint8_t* rgba, int width, int height, int subsampling, ThreadPool& pool)
+	{
+		src.rgba = rgba;
+		src.width = width;
+		src.height = height;
+		src.max_h = subsampling == 444 ? 1 : 2;
+		src.max_v = subsampling == 420 ? 2 : 1;
+		src.mcus_x = (width + 8 * src.max_h - 1) / (8 * src.max_h);
+		src.mcus_y = (height + 8 * src.max_v - 1) / (8 * src.max_v);
+		for (int c = 0; c < 3; c++)
+		{
+			JpegComponent& comp = src.comps[c];
+			comp.h = c == 0 ? src.max_h : 1;
+			comp.v = c == 0 ? src.max_v : 1;
+			comp.blocks_x = src.mcus_x * comp.h;
+			comp.blocks_y = src.mcus_y * comp.v;
+		}
+
+		// full resolution planes padded to whole MCUs by repeating the last column and row
+		int pw = src.mcus_x * 8 * src.max_h;
+		int ph = src.mcus_y * 8 * src.max_v;
+		src.luma.resize((size_t)pw * ph);
+		std::vector<int16_t> cb((size_t)pw * ph), cr((size_t)pw * ph);
+		pool.parallel_for(ph, [&](size_t y)
+			{
+				size_t row = y * pw;
+				int sy = std::min((int)y, height - 1);
+				Simd().rgba_to_ycbcr(rgba + (size_t)sy * width * 4, width, src.luma.data() + row, cb.data() + row, cr.data() + row);
+				for (int x = width; x < pw; x++)
+				{
+					src.luma[row + x] = src.luma[row + width - 1];
+					cb[row + x] = cb[row + width - 1];
+					cr[row + x] = cr[row + width - 1];
+				}
+			}, 16);
+
+		// chroma averaged over max_h x max_v pixels
+		int cw = pw / src.max_h, ch = ph / src.max_v;
+		int n_shift = (src.max_h == 2 ? 1 : 0) + (src.max_v == 2 ? 1 : 0);
+		std::vector<int16_t> chroma[2];
+		const std::vector<int16_t>* full[2] = { &cb, &cr };
+		for (int c = 0; c < 2; c++)
+		{
+			if (n_shift == 0)
+			{
+				chroma[c] = *full[c];
+				continue;
+			}
+			chroma[c].resize((size_t)cw * ch);
+			pool.parallel_for(ch, [&](size_t y)
+				{
+					for (int x = 0; x < cw; x++)
+					{
+						int sum = 0;
+						for (int dy = 0; dy < src.max_v; dy++)
+							for (int dx = 0; dx < src.max_h; dx++)
+								sum += (*full[c])[(y * src.max_v + dy) * pw + x * src.max_h + dx];
+						chroma[c][y * cw + x] = (int16_t)((sum + (1 << (n_shift - 1))) >> n_shift);
+					}
+				}, 16);
+		}
+
+		const std::vector<int16_t>* planes[3] = { &src.luma, &chroma[0], &chroma[1] };
+		for (int c = 0; c < 3; c++)
+		{
+			JpegComponent& comp = src.comps[c];
+			const std::vector<int16_t>& plane = *planes[c];
+			int stride = comp.blocks_x * 8;
+			comp.dct.resize((size_t)comp.blocks_x * comp.blocks_y * 64);
+			pool.parallel_for(comp.blocks_y, [&](size_t by)
+				{
+					std::vector<int16_t> blocks((size_t)comp.blocks_x * 64);
+					for (int bx = 0; bx < comp.blocks_x; bx++)
+					{
+						for (int r = 0; r < 8; r++)
+						{
+							memcpy(blocks.data() + bx * 64 + r * 8, plane.data() + (by * 8 + r) * stride + bx * 8, 8 * sizeof(int16_t));
+						}
+					}
+					Simd().fdct8x8(blocks.data(), comp.blocks_x, comp.dct.data() + by * comp.blocks_x * 64);
+				}, 4);
+		}
+	}
+
+	inline void JpegQuantize(JpegSource& src, const uint16_t tables[2][64], ThreadPool& pool)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			JpegComponent& comp = src.comps[c];
+			float divisors[64];
+			for (int i = 0; i < 64; i++) divisors[i] = 8.0f * tables[c == 0 ? 0 : 1][i];
+			comp.quantized.resize(comp.dct.size());
+			size_t row = (size_t)comp.blocks_x * 64;
+			pool.parallel_for(comp.blocks_y, [&](size_t by)
+				{
+					Simd().quantize(comp.dct.data() + by * row, comp.blocks_x, divisors, comp.quantized.data() + by * row);
+				}, 8);
+		}
+	}
+
+	// Entropy-codes MCU rows [row_begin, row_end) as one restart interval. Without a writer it
+	// only counts the symbols of the DC luma, AC luma, DC chroma and AC chroma tables.
+	inline void JpegCodeRows(const JpegSource& src, int row_begin, int row_end, const JpegHuffman* tables, JpegBitWriter* bw, uint32_t(*counts)[256])
+	{
+		auto emit = [&](int table, int symbol)
+		{
+			if (bw) bw->put(tables[table].code[symbol], tables[table].size[symbol]);
+			else counts[table][symbol]++;
+		};
+		auto emit_bits = [&](int value, int size)
+		{
+			if (bw && size > 0) bw->put((uint32_t)(value < 0 ? value - 1 : value), size);
+		};
+
+		int pred[3] = { 0, 0, 0 };
+		for (int my = row_begin; my < row_end; my++)
+		{
+			for (int mx = 0; mx < src.mcus_x; mx++)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					const JpegComponent& comp = src.comps[c];
+					int dc_table = c == 0 ? 0 : 2;
+					for (int v = 0; v < comp.v; v++)
+					{
+						for (int h = 0; h < comp.h; h++)
+						{
+							size_t block = (size_t)(my * comp.v + v) * comp.blocks_x + mx * comp.h + h;
+							const int16_t* q = comp.quantized.data() + block * 64;
+
+							int diff = q[0] - pred[c];
+							pred[c] = q[0];
+							int size = JpegBitSize(diff);
+							emit(dc_table, size);
+							emit_bits(diff, size);
+
+							int run = 0;
+							for (int k = 1; k < 64; k++)
+							{
+								int value = q[jpeg_zigzag[k]];
+								if (value == 0)
+								{
+									run++;
+									continue;
+								}
+								for (; run > 15; run -= 16) emit(dc_table + 1, 0xf0);
+								size = JpegBitSize(value);
+								emit(dc_table + 1, (run << 4) | size);
+								emit_bits(value, size);
+								run = 0;
+							}
+							if (run > 0) emit(dc_table + 1, 0x00);
+						}
+					}
+				}
+			}
+		}
+		if (bw) bw->flush();
+	}
+
+	inline std::vector<uint8_t> JpegWrite(const JpegSource& src, const uint16_t quant[2][64], ThreadPool& pool)
+	{
+		// about 16 stripes per image; fixed by the image size so the bytes never depend on the
+		// thread count
+		int rows = std::max(1, src.mcus_y / 16);
+		rows = std::max(1, std::min(rows, 65535 / src.mcus_x));
+		int num_segments = (src.mcus_y + rows - 1) / rows;
+
+		std::vector<std::vector<uint32_t>> segment_counts(num_segments);
+		pool.parallel_for(num_segments, [&](size_t i)
+			{
+				segment_counts[i].assign(4 * 256, 0);
+				uint32_t(*counts)[256] = (uint32_t(*)[256])segment_counts[i].data();
+				JpegCodeRows(src, (int)i * rows, std::min((int)(i + 1) * rows, src.mcus_y), nullptr, nullptr, counts);
+			});
+		uint32_t counts[4][256] = {};
+		for (int i = 0; i < num_segments; i++)
+		{
+			for (int j = 0; j < 4 * 256; j++) counts[j / 256][j % 256] += segment_counts[i][j];
+		}
+		JpegHuffman tables[4];
+		for (int t = 0; t < 4; t++) JpegBuildHuffman(counts[t], tables[t]);
+
+		std::vector<JpegBitWriter> segments(num_segments);
+		pool.parallel_for(num_segments, [&](size_t i)
+			{
+				JpegCodeRows(src, (int)i * rows, std::min((int)(i + 1) * rows, src.mcus_y), tables, &segments[i], nullptr);
+			});
+
+		std::vector<uint8_t> out;
+		auto put_u8 = [&](int v) { out.push_back((uint8_t)v); };
+		auto put_u16 = [&](int v)
+		{
+			put_u8(v >> 8);
+			put_u8(v & 0xff);
+		};
+
+		put_u16(0xffd8);
+		// JFIF 1.01, no density, no thumbnail
+		put_u16(0xffe0);
+		put_u16(16);
+		for (char ch : std::string("JFIF")) put_u8(ch);
+		put_u8(0);
+		put_u16(0x0101);
+		put_u8(0);
+		put_u16(1);
+		put_u16(1);
+		put_u16(0);
+
+		put_u16(0xffdb);
+		put_u16(2 + 2 * 65);
+		for (int t = 0; t < 2; t++)
+		{
+			put_u8(t);
+			for (int k = 0; k < 64; k++) put_u8(quant[t][jpeg_zigzag[k]]);
+		}
+
+		put_u16(0xffc0);
+		put_u16(8 + 3 * 3);
+		put_u8(8);
+		put_u16(src.height);
+		put_u16(src.width);
+		put_u8(3);
+		for (int c = 0; c < 3; c++)
+		{
+			put_u8(c + 1);
+			put_u8((src.comps[c].h << 4) | src.comps[c].v);
+			put_u8(c == 0 ? 0 : 1);
+		}
+
+		int dht_length = 2;
+		for (int t = 0; t < 4; t++) dht_length += 17 + (int)tables[t].values.size();
+		put_u16(0xffc4);
+		put_u16(dht_length);
+		for (int t = 0; t < 4; t++)
+		{
+			// class (DC 0, AC 1) and destination (luma 0, chroma 1)
+			put_u8(((t & 1) << 4) | (t >> 1));
+			for (int i = 0; i < 16; i++) put_u8(tables[t].bits[i]);
+			for (size_t i = 0; i < tables[t].values.size(); i++) put_u8(tables[t].values[i]);
+		}
+
+		put_u16(0xffdd);
+		put_u16(4);
+		put_u16(rows * src.mcus_x);
+
+		put_u16(0xffda);
+		put_u16(6 + 2 * 3);
+		put_u8(3);
+		for (int c = 0; c < 3; c++)
+		{
+			put_u8(c + 1);
+			put_u8(c == 0 ? 0x00 : 0x11);
+		}
+		put_u8(0);
+		put_u8(63);
+		put_u8(0);
+
+		for (int i = 0; i < num_segments; i++)
+		{
+			if (i > 0) put_u16(0xffd0 + (i - 1) % 8);
+			out.insert(out.end(), segments[i].data.begin(), segments[i].data.end());
+		}
+		put_u16(0xffd9);
+		return out;
+	}
+
+	// Decodes the quantized coefficients the way a viewer would (nearest chroma upsampling) and
+	// compares with the source: PSNR over RGB, and mean SSIM of luma over 8x8 windows at a stride
+	// of 4.
+	inline void JpegMeasure(const JpegSource& src, const uint16_t quant[2][64], ThreadPool& pool, double& psnr, double& ssim)
+	{
+		static const std::vector<float> basis = []()
+		{
+			// basis[x * 8 + u] = C(u) / 2 * cos((2x + 1) u pi / 16)
+			std::vector<float> b(64);
+			for (int x = 0; x < 8; x++)
+				for (int u = 0; u < 8; u++)
+					b[x * 8 + u] = (float)((u == 0 ? sqrt(0.5) : 1.0) * 0.5 * cos((2 * x + 1) * u * 3.14159265358979323846 / 16.0));
+			return b;
+		}();
+
+		std::vector<uint8_t> planes[3];
+		for (int c = 0; c < 3; c++)
+		{
+			const JpegComponent& comp = src.comps[c];
+			const uint16_t* table = quant[c == 0 ? 0 : 1];
+			int stride = comp.blocks_x * 8;
+			planes[c].resize((size_t)stride * comp.blocks_y * 8);
+			pool.parallel_for(comp.blocks_y, [&](size_t by)
+				{
+					for (int bx = 0; bx < comp.blocks_x; bx++)
+					{
+						const int16_t* q = comp.quantized.data() + (by * comp.blocks_x + bx) * 64;
+						float tmp[64];
+						for (int v = 0; v < 8; v++)
+						{
+							for (int x = 0; x < 8; x++)
+							{
+								float sum = 0.0f;
+								for (int u = 0; u < 8; u++) sum += basis[x * 8 + u] * (float)(q[v * 8 + u] * table[v * 8 + u]);
+								tmp[v * 8 + x] = sum;
+							}
+						}
+						for (int y = 0; y < 8; y++)
+						{
+							for (int x = 0; x < 8; x++)
+							{
+								float sum = 128.0f;
+								for (int v = 0; v < 8; v++) sum += basis[y * 8 + v] * tmp[v * 8 + x];
+								planes[c][(by * 8 + y) * stride + bx * 8 + x] = (uint8_t)std::min(std::max((int)floorf(sum + 0.5f), 0), 255);
+							}
+						}
+					}
+				}, 4);
+		}
+
+		int luma_stride = src.comps[0].blocks_x * 8;
+		int chroma_stride = src.comps[1].blocks_x * 8;
+		std::vector<double> row_error(src.height, 0.0);
+		pool.parallel_for(src.height, [&](size_t y)
+			{
+				double error = 0.0;
+				for (int x = 0; x < src.width; x++)
+				{
+					float l = planes[0][y * luma_stride + x];
+					size_t ci = (y / src.max_v) * chroma_stride + x / src.max_h;
+					float cb = planes[1][ci] - 128.0f, cr = planes[2][ci] - 128.0f;
+					float rgb[3] = { l + 1.402f * cr, l - 0.344136f * cb - 0.714136f * cr, l + 1.772f * cb };
+					const uint8_t* p = src.rgba + (y * src.width + x) * 4;
+					for (int k = 0; k < 3; k++)
+					{
+						double d = std::min(std::max(floorf(rgb[k] + 0.5f), 0.0f), 255.0f) - p[k];
+						error += d * d;
+					}
+				}
+				row_error[y] = error;
+			}, 16);
+		double sse = 0.0;
+		for (int y = 0; y < src.height; y++) sse += row_error[y];
+		double mse = sse / (3.0 * src.width * src.height);
+		psnr = mse > 0.0 ? 10.0 * log10(255.0 * 255.0 / mse) : 99.0;
+
+		const double c1 = (0.01 * 255) * (0.01 * 255), c2 = (0.03 * 255) * (0.03 * 255);
+		int windows_y = src.height >= 8 ? (src.height - 8) / 4 + 1 : 0;
+		int windows_x = src.width >= 8 ? (src.width - 8) / 4 + 1 : 0;
+		if (windows_x == 0 || windows_y == 0)
+		{
+			ssim = psnr >= 99.0 ? 1.0 : 1.0 - mse / (255.0 * 255.0);
+			return;
+		}
+		std::vector<double> row_ssim(windows_y, 0.0);
+		pool.parallel_for(windows_y, [&](size_t wy)
+			{
+				double total = 0.0;
+				for (int wx = 0; wx < windows_x; wx++)
+				{
+					double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+					for (int y = 0; y < 8; y++)
+					{
+						for (int x = 0; x < 8; x++)
+						{
+							size_t i = (wy * 4 + y) * luma_stride + wx * 4 + x;
+							double a = src.luma[i] + 128.0, b = planes[0][i];
+							sa += a;
+							sb += b;
+							saa += a * a;
+							sbb += b * b;
+							sab += a * b;
+						}
+					}
+					double ma = sa / 64, mb = sb / 64;
+					double va = saa / 64 - ma * ma, vb = sbb / 64 - mb * mb, cov = sab / 64 - ma * mb;
+					total += (2 * ma * mb + c1) * (2 * cov + c2) / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+				}
+				row_ssim[wy] = total;
+			}, 8);
+		double total = 0.0;
+		for (int i = 0; i < windows_y; i++) total += row_ssim[i];
+		ssim = total / ((double)windows_x * windows_y);
+	}
+
+	// Encodes the RGB of RGBA8 pixels; alpha is dropped. Returns an empty vector for sizes JPEG
+	// cannot store.
+	inline std::vector<uint8_t> EncodeJpeg(const uint8_t* rgba, int width, int height, const JpegOptions& options, ThreadPool& pool)
+	{
+		if (width <= 0 || height <= 0 || width > 65535 || height > 65535) return {};
+
+		JpegSource src;
+		JpegPrepare(src, rgba, width, height, options.subsampling, pool);
+		uint16_t quant[2][64];
+		auto encode_at = [&](int quality)
+		{
+			JpegQuantTables(quality, quant);
+			JpegQuantize(src, quant, pool);
+			return JpegWrite(src, quant, pool);
+		};
+
+		switch (options.target)
+		{
+		case JpegOptions::Target::Bytes:
+		{
+			// highest quality that fits, or quality 1 when nothing does
+			std::vector<uint8_t> best;
+			int lo = 1, hi = 100;
+			while (lo <= hi)
+			{
+				int mid = (lo + hi) / 2;
+				std::vector<uint8_t> code = encode_at(mid);
+				if (code.size() <= options.target_value)
+				{
+					best = std::move(code);
+					lo = mid + 1;
+				}
+				else
+				{
+					hi = mid - 1;
+				}
+			}
+			return best.empty() ? encode_at(1) : best;
+		}
+		case JpegOptions::Target::Psnr:
+		case JpegOptions::Target::Ssim:
+		{
+			// lowest quality that reaches the target, or 100 when none does
+			int found = 100;
+			int lo = 1, hi = 100;
+			while (lo <= hi)
+			{
+				int mid = (lo + hi) / 2;
+				JpegQuantTables(mid, quant);
+				JpegQuantize(src, quant, pool);
+				double psnr, ssim;
+				JpegMeasure(src, quant, pool, psnr, ssim);
+				double metric = options.target == JpegOptions::Target::Psnr ? psnr : ssim;
+				if (metric >= options.target_value)
+				{
+					found = mid;
+					hi = mid - 1;
+				}
+				else
+				{
+					lo = mid + 1;
+				}
+			}
+			return encode_at(found);
+		}
+		default:
+			return encode_at(options.quality);
+		}
+	}
+}
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <glm.hpp>
+
+#include "Simd.h"
+#include "ThreadPool.h"
+
+// Per-mesh stream operations that run on the triangulated streams before they are emitted.
+namespace Mid
+{
+	struct FaceKey
+	{
+		int v[3];
+		bool operator==(const FaceKey& other) const
+		{
+			return v[0] == other.v[0] && v[1] == other.v[1] && v[2] == other.v[2];
+		}
+	};
+
+	struct FaceKeyHash
+	{
+		size_t operator()(const FaceKey& key) const
+		{
+			uint64_t h = (uint64_t)(uint32_t)key.v[0] * 0x9E3779B97F4A7C15ull;
+			h ^= (uint64_t)(uint32_t)key.v[1] * 0xC2B2AE3D27D4EB4Full + (h << 6) + (h >> 2);
+			h ^= (uint64_t)(uint32_t)key.v[2] * 0x165667B19E3779F9ull + (h << 6) + (h >> 2);
+			return (size_t)h;
+		}
+	};
+
+	// Drops triangles that reference a missing vertex, repeat an index, have zero area or repeat an
+	// earlier triangle. Duplicates are compared up to rotation, so opposite windings are both kept.
+	inline void RemoveDegenerateFaces(ThreadPool& pool, std::vector<glm::ivec3>& faces, const glm::vec3* points, size_t num_points)
+	{
+		size_t num_faces = faces.size();
+		std::vector<uint8_t> degenerate(num_faces, 0);
+
+		const size_t chunk_size = 4096;
+		size_t num_chunks = (num_faces + chunk_size - 1) / chunk_size;
+		pool.parallel_for(num_chunks, [&](size_t c)
+			{
+				size_t begin = c * chunk_size;
+				size_t end = std::min(begin + chunk_size, num_faces);
+				size_t run_begin = begin;
+				for (size_t i = begin; i <= end; i++)
+				{
+					bool bad = false;
+					if (i < end)
+					{
+						const glm::ivec3& f = faces[i];
+						bad = f.x < 0 || f.y < 0 || f.z < 0 || f.x >= (int)num_points || f.y >= (int)num_points || f.z >= (int)num_points
+							|| f.x == f.y || f.y == f.z || f.z == f.x;
+					}
+					if (i == end || bad)
+					{
+						Simd().mark_degenerate(faces.data(), run_begin, i, points, degenerate.data());
+						if (bad) degenerate[i] = 1;
+						run_begin = i + 1;
+					}
+				}
+			});
+
+		std::unordered_set<FaceKey, FaceKeyHash> face_set;
+		face_set.reserve(num_faces);
+		size_t count = 0;
+		for (size_t i = 0; i < num_faces; i++)
+		{
+			if (degenerate[i]) continue;
+			const glm::ivec3& f = faces[i];
+			FaceKey key;
+			if (f.x < f.y && f.x < f.z) key = { { f.x, f.y, f.z } };
+			else if (f.y < f.z) key = { { f.y, f.z, f.x } };
+			else key = { { f.z, f.x, f.y } };
+			if (!face_set.insert(key).second) continue;
+			faces[count] = f;
+			count++;
+		}
+		faces.resize(count);
+	}
+
+	// Renumbers vertices so that only the ones faces reference remain, keeping their relative order.
+	// Returns false if every vertex is referenced; otherwise new_to_old maps each kept vertex to its source.
+	inline bool CompactVertices(std::vector<glm::ivec3>& faces, size_t num_verts, std::vector<int>& new_to_old)
+	{
+		std::vector<int> old_to_new(num_verts, -1);
+		for (size_t i = 0; i < faces.size(); i++)
+		{
+			old_to_new[faces[i].x] = 0;
+			old_to_new[faces[i].y] = 0;
+			old_to_new[faces[i].z] = 0;
+		}
+
+		new_to_old.clear();
+		for (size_t i = 0; i < num_verts; i++)
+		{
+			if (old_to_new[i] < 0) continue;
+			old_to_new[i] = (int)new_to_old.size();
+			new_to_old.push_back((int)i);
+		}
+		if (new_to_old.size() == num_verts) return false;
+
+		for (size_t i = 0; i < faces.size(); i++)
+		{
+			faces[i] = { old_to_new[faces[i].x], old_to_new[faces[i].y], old_to_new[faces[i].z] };
+		}
+		return true;
+	}
+
+	// Fingerprint of per-vertex attributes, chained through hash.
+	inline uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 0)
+	{
+		return Simd().crc64(hash, (const unsigned char*)data, size);
+	}
+
+	// Tolerance weld of a vertex-interpolated mesh. Vertices are bucketed into a grid of cell size
+	// epsilon, and each one looks through its own and the 26 neighbouring cells in parallel for the
+	// lowest-index vertex within epsilon that has the same attribute hash and that same(i, j) accepts.
+	// Returns, per vertex, the vertex it is merged into (itself if none); chains are resolved, so a
+	// merged cluster can span more than epsilon. An epsilon of 0 merges exactly coincident positions.
+	template<typename SameFunc>
+	inline std::vector<int> WeldVertices(ThreadPool& pool, const glm::vec3* points, size_t num_points,
+		const uint64_t* attrib_hashes, float epsilon, SameFunc&& same)
+	{
+		float cell_size = epsilon > 0.0f ? epsilon : 1.0f;
+		int range = epsilon > 0.0f ? 1 : 0;
+
+		auto cell_of = [&](const glm::vec3& p)
+		{
+			if (epsilon > 0.0f) return glm::ivec3(glm::floor(p / cell_size));
+			int32_t bits[3];
+			memcpy(bits, &p.x, sizeof(int32_t));
+			memcpy(bits + 1, &p.y, sizeof(int32_t));
+			memcpy(bits + 2, &p.z, sizeof(int32_t));
+			return glm::ivec3(bits[0], bits[1], bits[2]);
+		};
+
+		auto cell_key = [](const glm::ivec3& c)
+		{
+			uint64_t h = (uint64_t)(uint32_t)c.x * 0x9E3779B97F4A7C15ull;
+			h ^= (uint64_t)(uint32_t)c.y * 0xC2B2AE3D27D4EB4Full + (h << 6) + (h >> 2);
+			h ^= (uint64_t)(uint32_t)c.z * 0x165667B19E3779F9ull + (h << 6) + (h >> 2);
+			return h;
+		};
+
+		std::vector<std::pair<uint64_t, int>> sorted(num_points);
+		pool.parallel_for(num_points, [&](size_t i)
+			{
+				sorted[i] = { cell_key(cell_of(points[i])), (int)i };
+			}, 4096);
+		std::sort(sorted.begin(), sorted.end());
+
+		std::unordered_map<uint64_t, std::pair<size_t, size_t>> cells;
+		for (size_t i = 0; i < num_points;)
+		{
+			size_t j = i;
+			while (j < num_points && sorted[j].first == sorted[i].first) j++;
+			cells[sorted[i].first] = { i, j };
+			i = j;
+		}
+
+		float eps2 = epsilon * epsilon;
+		std::vector<int> rep(num_points);
+		pool.parallel_for(num_points, [&](size_t i)
+			{
+				const glm::vec3& p = points[i];
+				glm::ivec3 c = cell_of(p);
+				int best = (int)i;
+				for (int dz = -range; dz <= range; dz++)
+				{
+					for (int dy = -range; dy <= range; dy++)
+					{
+						for (int dx = -range; dx <= range; dx++)
+						{
+							auto iter = cells.find(cell_key(c + glm::ivec3(dx, dy, dz)));
+							if (iter == cells.end()) continue;
+							for (size_t k = iter->second.first; k < iter->second.second; k++)
+							{
+								int j = sorted[k].second;
+								if (j >= best || attrib_hashes[j] != attrib_hashes[i]) continue;
+								glm::vec3 d = points[j] - p;
+								if (glm::dot(d, d) > eps2) continue;
+								if (!same((int)i, j)) continue;
+								best = j;
+							}
+						}
+					}
+				}
+				rep[i] = best;
+			}, 256);
+
+		for (size_t i = 0; i < num_points; i++)
+		{
+			rep[i] = rep[rep[i]];
+		}
+		return rep;
+	}
+
+	// Vertex clustering down to about max_faces triangles, for previews. Vertices are snapped to a
+	// grid and each cell collapses onto its lowest-index vertex, so no stream has to be resampled.
+	// The first grid has as many cells across as a surface needs to keep about max_faces triangles
+	// (two per occupied cell); it is coarsened until the triangles that still have three distinct
+	// corners fit. Returns, per vertex, the vertex it is merged into, like WeldVertices().
+	inline std::vector<int> ClusterVertices(ThreadPool& pool, const glm::vec3* points, size_t num_points,
+		const std::vector<glm::ivec3>& faces, size_t max_faces)
+	{
+		std::vector<int> rep(num_points);
+		for (size_t i = 0; i < num_points; i++) rep[i] = (int)i;
+		if (faces.size() <= max_faces || num_points == 0) return rep;
+
+		glm::vec3 min_v = points[0];
+		glm::vec3 max_v = points[0];
+		for (size_t i = 1; i < num_points; i++)
+		{
+			min_v = glm::min(min_v, points[i]);
+			max_v = glm::max(max_v, points[i]);
+		}
+		glm::vec3 extent = max_v - min_v;
+		float size = std::max(extent.x, std::max(extent.y, extent.z));
+		if (!(size > 0.0f)) return rep;
+
+		float cells = std::min(std::sqrt(std::max((float)max_faces * 0.5f, 1.0f)), 1048575.0f);
+		std::vector<uint64_t> keys(num_points);
+		std::unordered_map<uint64_t, int> first;
+		for (int attempt = 0; attempt < 32; attempt++)
+		{
+			float scale = cells / size;
+			pool.parallel_for(num_points, [&](size_t i)
+				{
+					glm::vec3 c = glm::clamp((points[i] - min_v) * scale, 0.0f, cells);
+					keys[i] = (uint64_t)c.x | ((uint64_t)c.y << 21) | ((uint64_t)c.z << 42);
+				}, 4096);
+
+			first.clear();
+			for (size_t i = 0; i < num_points; i++)
+			{
+				rep[i] = first.emplace(keys[i], (int)i).first->second;
+			}
+
+			size_t count = 0;
+			for (size_t i = 0; i < faces.size(); i++)
+			{
+				int a = rep[faces[i].x];
+				int b = rep[faces[i].y];
+				int c = rep[faces[i].z];
+				if (a != b && b != c && c != a) count++;
+			}
+			if (count <= max_faces || cells <= 1.0f) break;
+			cells = std::max(cells * 0.75f, 1.0f);
+		}
+		return rep;
+	}
+
+	// Applies a CompactVertices() remap to one per-vertex stream. Streams that are empty or not
+	// sized per vertex are left alone.
+	template<typename T>
+	inline void GatherStream(std::vector<T>& stream, const std::vector<int>& new_to_old, size_t num_verts)
+	{
+		if (stream.size() != num_verts) return;
+		std::vector<T> out(new_to_old.size());
+		for (size_t i = 0; i < new_to_old.size(); i++)
+		{
+			out[i] = stream[new_to_old[i]];
+		}
+		stream.swap(out);
+	}
+}
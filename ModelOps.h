@@ -0,0 +1,525 @@
+#pragma once
+
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <glm.hpp>
+#include <gtc/quaternion.hpp>
+#include <gtc/matrix_transform.hpp>
+#include <tiny_gltf.h>
+
+#include "BufferWriter.h"
+#include "ThreadPool.h"
+
+// Whole-model passes that run on the finished tinygltf::Model, after the prim walks.
+namespace Mid
+{
+	// Decodes any accessor into floats (count * components), resolving sparse storage.
+	// Integer components are converted as-is unless the accessor is normalized and normalize is set.
+	inline std::vector<float> ReadAccessor(const tinygltf::Model& model, int acc_id, bool normalize = true)
+	{
+		const tinygltf::Accessor& acc = model.accessors[acc_id];
+		const bool normalized = acc.normalized && normalize;
+		int num_comp = tinygltf::GetNumComponentsInType(acc.type);
+		int comp_size = tinygltf::GetComponentSizeInBytes(acc.componentType);
+		std::vector<float> ret(acc.count * num_comp, 0.0f);
+
+		auto read_comp = [&](const uint8_t* p) -> float
+		{
+			switch (acc.componentType)
+			{
+			case TINYGLTF_COMPONENT_TYPE_FLOAT:
+			{
+				float v;
+				memcpy(&v, p, 4);
+				return v;
+			}
+			case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+				return normalized ? (float)p[0] / 255.0f : (float)p[0];
+			case TINYGLTF_COMPONENT_TYPE_BYTE:
+				return normalized ? std::max((float)(int8_t)p[0] / 127.0f, -1.0f) : (float)(int8_t)p[0];
+			case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+			{
+				uint16_t v;
+				memcpy(&v, p, 2);
+				return normalized ? (float)v / 65535.0f : (float)v;
+			}
+			case TINYGLTF_COMPONENT_TYPE_SHORT:
+			{
+				int16_t v;
+				memcpy(&v, p, 2);
+				return normalized ? std::max((float)v / 32767.0f, -1.0f) : (float)v;
+			}
+			case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+			{
+				uint32_t v;
+				memcpy(&v, p, 4);
+				return (float)v;
+			}
+			}
+			return 0.0f;
+		};
+
+		if (acc.bufferView >= 0)
+		{
+			const tinygltf::BufferView& view = model.bufferViews[acc.bufferView];
+			const uint8_t* base = model.buffers[view.buffer].data.data() + view.byteOffset + acc.byteOffset;
+			size_t stride = view.byteStride > 0 ? view.byteStride : (size_t)(num_comp * comp_size);
+			for (size_t i = 0; i < acc.count; i++)
+			{
+				for (int j = 0; j < num_comp; j++)
+				{
+					ret[i * num_comp + j] = read_comp(base + i * stride + j * comp_size);
+				}
+			}
+		}
+
+		if (acc.sparse.isSparse)
+		{
+			const tinygltf::BufferView& view_idx = model.bufferViews[acc.sparse.indices.bufferView];
+			const tinygltf::BufferView& view_val = model.bufferViews[acc.sparse.values.bufferView];
+			const uint8_t* p_idx = model.buffers[view_idx.buffer].data.data() + view_idx.byteOffset + acc.sparse.indices.byteOffset;
+			const uint8_t* p_val = model.buffers[view_val.buffer].data.data() + view_val.byteOffset + acc.sparse.values.byteOffset;
+			int idx_size = tinygltf::GetComponentSizeInBytes(acc.sparse.indices.componentType);
+			for (int i = 0; i < acc.sparse.count; i++)
+			{
+				uint32_t idx = 0;
+				if (idx_size == 1)
+				{
+					idx = p_idx[i];
+				}
+				else if (idx_size == 2)
+				{
+					uint16_t v;
+					memcpy(&v, p_idx + i * 2, 2);
+					idx = v;
+				}
+				else
+				{
+					memcpy(&idx, p_idx + i * 4, 4);
+				}
+				if (idx >= acc.count) continue;
+				for (int j = 0; j < num_comp; j++)
+				{
+					ret[idx * num_comp + j] = read_comp(p_val + (i * num_comp + j) * comp_size);
+				}
+			}
+		}
+		return ret;
+	}
+
+	inline glm::mat4 NodeLocalMatrix(const tinygltf::Node& node)
+	{
+		if (node.matrix.size() == 16)
+		{
+			glm::mat4 mat;
+			for (int i = 0; i < 16; i++) mat[i / 4][i % 4] = (float)node.matrix[i];
+			return mat;
+		}
+		glm::mat4 mat(1.0f);
+		if (node.translation.size() == 3)
+		{
+			mat = glm::translate(mat, glm::vec3((float)node.translation[0], (float)node.translation[1], (float)node.translation[2]));
+		}
+		if (node.rotation.size() == 4)
+		{
+			mat = mat * glm::mat4_cast(glm::quat((float)node.rotation[3], (float)node.rotation[0], (float)node.rotation[1], (float)node.rotation[2]));
+		}
+		if (node.scale.size() == 3)
+		{
+			mat = glm::scale(mat, glm::vec3((float)node.scale[0], (float)node.scale[1], (float)node.scale[2]));
+		}
+		return mat;
+	}
+
+	inline std::vector<glm::mat4> NodeWorldMatrices(const tinygltf::Model& model)
+	{
+		size_t num_nodes = model.nodes.size();
+		std::vector<int> parents(num_nodes, -1);
+		for (size_t i = 0; i < num_nodes; i++)
+		{
+			for (size_t j = 0; j < model.nodes[i].children.size(); j++)
+			{
+				parents[model.nodes[i].children[j]] = (int)i;
+			}
+		}
+
+		std::vector<glm::mat4> world(num_nodes);
+		std::vector<bool> done(num_nodes, false);
+		std::function<void(int)> eval = [&](int i)
+		{
+			if (done[i]) return;
+			glm::mat4 local = NodeLocalMatrix(model.nodes[i]);
+			if (parents[i] >= 0)
+			{
+				eval(parents[i]);
+				world[i] = world[parents[i]] * local;
+			}
+			else
+			{
+				world[i] = local;
+			}
+			done[i] = true;
+		};
+		for (size_t i = 0; i < num_nodes; i++) eval((int)i);
+		return world;
+	}
+
+	// Skins whose joints no animation channel drives are baked into the rest pose, and morph targets
+	// whose node has no "weights" channel are folded in at their current weights. The JOINTS/WEIGHTS
+	// streams, skins and targets that become unused are removed; run PruneUnusedData() afterwards
+	// to drop the orphaned buffer data. Baked streams are appended through writer.
+	inline void BakeStaticDeformers(tinygltf::Model& model, BufferWriter& writer, ThreadPool& pool)
+	{
+		std::unordered_set<int> animated_nodes;
+		std::unordered_set<int> weighted_nodes;
+		for (size_t i = 0; i < model.animations.size(); i++)
+		{
+			const auto& anim = model.animations[i];
+			for (size_t j = 0; j < anim.channels.size(); j++)
+			{
+				const auto& channel = anim.channels[j];
+				if (channel.target_path == "weights")
+				{
+					weighted_nodes.insert(channel.target_node);
+				}
+				else
+				{
+					animated_nodes.insert(channel.target_node);
+				}
+			}
+		}
+
+		std::vector<int> mesh_users(model.meshes.size(), 0);
+		for (size_t i = 0; i < model.nodes.size(); i++)
+		{
+			if (model.nodes[i].mesh >= 0) mesh_users[model.nodes[i].mesh]++;
+		}
+
+		std::vector<bool> skin_animated(model.skins.size(), false);
+		for (size_t i = 0; i < model.skins.size(); i++)
+		{
+			for (size_t j = 0; j < model.skins[i].joints.size(); j++)
+			{
+				if (animated_nodes.count(model.skins[i].joints[j]) > 0) skin_animated[i] = true;
+			}
+		}
+
+		std::vector<glm::mat4> world = NodeWorldMatrices(model);
+
+		for (size_t i = 0; i < model.nodes.size(); i++)
+		{
+			tinygltf::Node& node = model.nodes[i];
+			if (node.mesh < 0 || mesh_users[node.mesh] != 1) continue;
+			tinygltf::Mesh& mesh = model.meshes[node.mesh];
+
+			bool bake_morphs = weighted_nodes.count((int)i) == 0;
+			bool bake_skin = node.skin >= 0 && !skin_animated[node.skin];
+			if (!bake_skin && !bake_morphs) continue;
+
+			std::vector<double> weights = node.weights.size() > 0 ? node.weights : mesh.weights;
+
+			for (size_t p = 0; p < mesh.primitives.size(); p++)
+			{
+				tinygltf::Primitive& prim = mesh.primitives[p];
+				auto iter_pos = prim.attributes.find("POSITION");
+				if (iter_pos == prim.attributes.end()) continue;
+				auto iter_norm = prim.attributes.find("NORMAL");
+				bool has_norm = iter_norm != prim.attributes.end();
+
+				// targets that stay animated hold bind-space deltas, so their skin stays too
+				bool morphed = bake_morphs && prim.targets.size() > 0;
+				bool skinned = bake_skin && prim.attributes.count("JOINTS_0") > 0 && prim.attributes.count("WEIGHTS_0") > 0
+					&& (prim.targets.empty() || morphed);
+				if (!morphed && !skinned) continue;
+
+				std::vector<float> pos = ReadAccessor(model, iter_pos->second);
+				std::vector<float> norm;
+				if (has_norm) norm = ReadAccessor(model, iter_norm->second);
+				size_t num_verts = pos.size() / 3;
+
+				if (morphed)
+				{
+					for (size_t t = 0; t < prim.targets.size(); t++)
+					{
+						float w = t < weights.size() ? (float)weights[t] : 0.0f;
+						if (w == 0.0f) continue;
+						auto& target = prim.targets[t];
+						if (target.count("POSITION") > 0)
+						{
+							std::vector<float> delta = ReadAccessor(model, target["POSITION"]);
+							pool.parallel_for(pos.size(), [&](size_t k) { pos[k] += w * delta[k]; }, 4096);
+						}
+						if (has_norm && target.count("NORMAL") > 0)
+						{
+							std::vector<float> delta = ReadAccessor(model, target["NORMAL"]);
+							pool.parallel_for(norm.size(), [&](size_t k) { norm[k] += w * delta[k]; }, 4096);
+						}
+					}
+					prim.targets.clear();
+				}
+
+				if (skinned)
+				{
+					const tinygltf::Skin& skin = model.skins[node.skin];
+					std::vector<float> ibm = ReadAccessor(model, skin.inverseBindMatrices);
+					std::vector<glm::mat4> joint_mats(skin.joints.size());
+					glm::mat4 mesh_inv = glm::inverse(world[i]);
+					for (size_t j = 0; j < skin.joints.size(); j++)
+					{
+						glm::mat4 inv_bind;
+						for (int k = 0; k < 16; k++) inv_bind[k / 4][k % 4] = ibm[j * 16 + k];
+						joint_mats[j] = mesh_inv * world[skin.joints[j]] * inv_bind;
+					}
+
+					std::vector<float> joints = ReadAccessor(model, prim.attributes["JOINTS_0"]);
+					std::vector<float> jweights = ReadAccessor(model, prim.attributes["WEIGHTS_0"]);
+
+					pool.parallel_for(num_verts, [&](size_t v)
+						{
+							glm::mat4 mat(0.0f);
+							for (int k = 0; k < 4; k++)
+							{
+								size_t j = (size_t)joints[v * 4 + k];
+								float w = jweights[v * 4 + k];
+								if (w == 0.0f || j >= joint_mats.size()) continue;
+								mat = mat + joint_mats[j] * w;
+							}
+							glm::vec4 p = mat * glm::vec4(pos[v * 3], pos[v * 3 + 1], pos[v * 3 + 2], 1.0f);
+							pos[v * 3] = p.x;
+							pos[v * 3 + 1] = p.y;
+							pos[v * 3 + 2] = p.z;
+							if (has_norm)
+							{
+								glm::mat3 mat_norm = glm::transpose(glm::inverse(glm::mat3(mat)));
+								glm::vec3 n = mat_norm * glm::vec3(norm[v * 3], norm[v * 3 + 1], norm[v * 3 + 2]);
+								norm[v * 3] = n.x;
+								norm[v * 3 + 1] = n.y;
+								norm[v * 3 + 2] = n.z;
+							}
+						}, 1024);
+
+					prim.attributes.erase("JOINTS_0");
+					prim.attributes.erase("WEIGHTS_0");
+				}
+
+				if (has_norm)
+				{
+					pool.parallel_for(num_verts, [&](size_t v)
+						{
+							glm::vec3 n = { norm[v * 3], norm[v * 3 + 1], norm[v * 3 + 2] };
+							float len = glm::length(n);
+							if (len > 0.0f) n = n / len;
+							norm[v * 3] = n.x;
+							norm[v * 3 + 1] = n.y;
+							norm[v * 3 + 2] = n.z;
+						}, 4096);
+					prim.attributes["NORMAL"] = writer.emit_accessor<float, 3>((const glm::vec3*)norm.data(), num_verts, TINYGLTF_TARGET_ARRAY_BUFFER);
+				}
+				prim.attributes["POSITION"] = writer.emit_accessor<float, 3>((const glm::vec3*)pos.data(), num_verts, TINYGLTF_TARGET_ARRAY_BUFFER, true);
+			}
+
+			if (bake_morphs)
+			{
+				bool targets_left = false;
+				for (size_t p = 0; p < mesh.primitives.size(); p++)
+				{
+					if (mesh.primitives[p].targets.size() > 0) targets_left = true;
+				}
+				if (!targets_left)
+				{
+					mesh.weights.clear();
+					node.weights.clear();
+				}
+			}
+
+			if (bake_skin)
+			{
+				bool skinned_left = false;
+				for (size_t p = 0; p < mesh.primitives.size(); p++)
+				{
+					if (mesh.primitives[p].attributes.count("JOINTS_0") > 0) skinned_left = true;
+				}
+				if (!skinned_left) node.skin = -1;
+			}
+		}
+
+		// drop skins no node uses any more and renumber the rest
+		std::vector<bool> skin_used(model.skins.size(), false);
+		for (size_t i = 0; i < model.nodes.size(); i++)
+		{
+			if (model.nodes[i].skin >= 0) skin_used[model.nodes[i].skin] = true;
+		}
+		for (size_t i = 0; i < model.skins.size(); i++)
+		{
+			if (skin_animated[i]) skin_used[i] = true;
+		}
+
+		std::vector<int> skin_remap(model.skins.size(), -1);
+		std::vector<tinygltf::Skin> skins;
+		for (size_t i = 0; i < model.skins.size(); i++)
+		{
+			if (!skin_used[i]) continue;
+			skin_remap[i] = (int)skins.size();
+			skins.push_back(model.skins[i]);
+		}
+		model.skins = skins;
+
+		for (size_t i = 0; i < model.nodes.size(); i++)
+		{
+			if (model.nodes[i].skin >= 0) model.nodes[i].skin = skin_remap[model.nodes[i].skin];
+		}
+
+		for (size_t i = 0; i < model.animations.size(); i++)
+		{
+			auto& anim = model.animations[i];
+			if (!anim.extras.IsObject() || !anim.extras.Has("skin")) continue;
+			tinygltf::Value::Object extras = anim.extras.Get<tinygltf::Value::Object>();
+			int skin_idx = extras["skin"].GetNumberAsInt();
+			if (skin_idx >= 0 && skin_idx < (int)skin_remap.size())
+			{
+				extras["skin"] = tinygltf::Value(skin_remap[skin_idx]);
+				anim.extras = tinygltf::Value(extras);
+			}
+		}
+	}
+
+	// Removes accessors and bufferViews nothing refers to and repacks buffer 0 without the holes.
+	inline void PruneUnusedData(tinygltf::Model& model)
+	{
+		std::vector<bool> acc_used(model.accessors.size(), false);
+		auto use_acc = [&](int idx) { if (idx >= 0) acc_used[idx] = true; };
+
+		for (size_t i = 0; i < model.meshes.size(); i++)
+		{
+			for (size_t j = 0; j < model.meshes[i].primitives.size(); j++)
+			{
+				const auto& prim = model.meshes[i].primitives[j];
+				for (auto iter = prim.attributes.begin(); iter != prim.attributes.end(); iter++) use_acc(iter->second);
+				use_acc(prim.indices);
+				for (size_t k = 0; k < prim.targets.size(); k++)
+				{
+					for (auto iter = prim.targets[k].begin(); iter != prim.targets[k].end(); iter++) use_acc(iter->second);
+				}
+			}
+		}
+		for (size_t i = 0; i < model.skins.size(); i++) use_acc(model.skins[i].inverseBindMatrices);
+		for (size_t i = 0; i < model.animations.size(); i++)
+		{
+			for (size_t j = 0; j < model.animations[i].samplers.size(); j++)
+			{
+				use_acc(model.animations[i].samplers[j].input);
+				use_acc(model.animations[i].samplers[j].output);
+			}
+		}
+
+		std::vector<int> acc_remap(model.accessors.size(), -1);
+		std::vector<tinygltf::Accessor> accessors;
+		for (size_t i = 0; i < model.accessors.size(); i++)
+		{
+			if (!acc_used[i]) continue;
+			acc_remap[i] = (int)accessors.size();
+			accessors.push_back(model.accessors[i]);
+		}
+		model.accessors = accessors;
+
+		auto remap_acc = [&](int& idx) { if (idx >= 0) idx = acc_remap[idx]; };
+		for (size_t i = 0; i < model.meshes.size(); i++)
+		{
+			for (size_t j = 0; j < model.meshes[i].primitives.size(); j++)
+			{
+				auto& prim = model.meshes[i].primitives[j];
+				for (auto iter = prim.attributes.begin(); iter != prim.attributes.end(); iter++) remap_acc(iter->second);
+				remap_acc(prim.indices);
+				for (size_t k = 0; k < prim.targets.size(); k++)
+				{
+					for (auto iter = prim.targets[k].begin(); iter != prim.targets[k].end(); iter++) remap_acc(iter->second);
+				}
+			}
+		}
+		for (size_t i = 0; i < model.skins.size(); i++) remap_acc(model.skins[i].inverseBindMatrices);
+		for (size_t i = 0; i < model.animations.size(); i++)
+		{
+			for (size_t j = 0; j < model.animations[i].samplers.size(); j++)
+			{
+				remap_acc(model.animations[i].samplers[j].input);
+				remap_acc(model.animations[i].samplers[j].output);
+			}
+		}
+
+		std::vector<bool> view_used(model.bufferViews.size(), false);
+		auto use_view = [&](int idx) { if (idx >= 0) view_used[idx] = true; };
+		for (size_t i = 0; i < model.accessors.size(); i++)
+		{
+			const auto& acc = model.accessors[i];
+			use_view(acc.bufferView);
+			if (acc.sparse.isSparse)
+			{
+				use_view(acc.sparse.indices.bufferView);
+				use_view(acc.sparse.values.bufferView);
+			}
+		}
+		for (size_t i = 0; i < model.images.size(); i++) use_view(model.images[i].bufferView);
+
+		// KHR_draco_mesh_compression keeps its payload outside any accessor
+		auto for_each_extension_view = [&](const std::function<void(tinygltf::Value::Object&)>& func)
+		{
+			for (size_t m = 0; m < model.meshes.size(); m++)
+			{
+				for (size_t p = 0; p < model.meshes[m].primitives.size(); p++)
+				{
+					auto iter = model.meshes[m].primitives[p].extensions.find("KHR_draco_mesh_compression");
+					if (iter == model.meshes[m].primitives[p].extensions.end() || !iter->second.IsObject()) continue;
+					tinygltf::Value::Object obj = iter->second.Get<tinygltf::Value::Object>();
+					func(obj);
+					iter->second = tinygltf::Value(obj);
+				}
+			}
+		};
+		for_each_extension_view([&](tinygltf::Value::Object& obj)
+			{
+				if (obj.count("bufferView") && obj["bufferView"].IsInt()) use_view(obj["bufferView"].Get<int>());
+			});
+
+		std::vector<int> view_remap(model.bufferViews.size(), -1);
+		std::vector<tinygltf::BufferView> views;
+		std::vector<unsigned char> data;
+		const std::vector<unsigned char>& data_in = model.buffers[0].data;
+		for (size_t i = 0; i < model.bufferViews.size(); i++)
+		{
+			if (!view_used[i]) continue;
+			tinygltf::BufferView view = model.bufferViews[i];
+			size_t offset = (data.size() + 3) / 4 * 4;
+			data.resize(offset + view.byteLength);
+			memcpy(data.data() + offset, data_in.data() + view.byteOffset, view.byteLength);
+			view.byteOffset = offset;
+			view_remap[i] = (int)views.size();
+			views.push_back(view);
+		}
+		data.resize((data.size() + 3) / 4 * 4);
+		model.bufferViews = views;
+		model.buffers[0].data = data;
+
+		auto remap_view = [&](int& idx) { if (idx >= 0) idx = view_remap[idx]; };
+		for (size_t i = 0; i < model.accessors.size(); i++)
+		{
+			auto& acc = model.accessors[i];
+			remap_view(acc.bufferView);
+			if (acc.sparse.isSparse)
+			{
+				remap_view(acc.sparse.indices.bufferView);
+				remap_view(acc.sparse.values.bufferView);
+			}
+		}
+		for (size_t i = 0; i < model.images.size(); i++) remap_view(model.images[i].bufferView);
+		for_each_extension_view([&](tinygltf::Value::Object& obj)
+			{
+				if (!obj.count("bufferView") || !obj["bufferView"].IsInt()) return;
+				int idx = obj["bufferView"].Get<int>();
+				remap_view(idx);
+				obj["bufferView"] = tinygltf::Value(idx);
+			});
+	}
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <glm.hpp>
+
+#include "Bounds.h"
+#include "ThreadPool.h"
+
+// Spatial chunking and quantization of point clouds (UsdGeomPoints) exported as POINTS primitives.
+namespace Mid
+{
+	// Leaf of the point octree: order[begin, end) lists its points.
+	struct PointCell
+	{
+		size_t begin;
+		size_t end;
+	};
+
+	// Sorts the point indices into octree leaves of at most max_points each, or of max_depth
+	// levels below the root cube, and returns the leaves in Morton order.
+	// The tree is split one level at a time. Every cell that is split is cut into blocks; the
+	// blocks are counted and scattered in parallel, and offsets come from a serial prefix over
+	// the blocks, so the order is the same for any thread count. Only one extra index array is
+	// allocated besides order.
+	inline void BuildPointOctree(ThreadPool& pool, const glm::vec3* points, size_t count, size_t max_points, int max_depth,
+		std::vector<uint32_t>& order, std::vector<PointCell>& cells)
+	{
+		const size_t block = 65536;
+
+		order.resize(count);
+		cells.clear();
+		pool.parallel_for(count, [&](size_t i) { order[i] = (uint32_t)i; }, block);
+		if (count == 0) return;
+
+		size_t num_blocks = (count + block - 1) / block;
+		std::vector<AABB> block_bounds(num_blocks);
+		pool.parallel_for(num_blocks, [&](size_t b)
+			{
+				size_t end = std::min(count, (b + 1) * block);
+				for (size_t i = b * block; i < end; i++) block_bounds[b].add(points[i]);
+			});
+		AABB root;
+		for (size_t b = 0; b < num_blocks; b++) root.merge(block_bounds[b]);
+		glm::vec3 extent = root.valid() ? root.max_v - root.min_v : glm::vec3(0.0f);
+
+		struct Node
+		{
+			size_t begin;
+			size_t end;
+			glm::vec3 min_v;
+			float size;
+			int depth;
+		};
+		std::vector<Node> level = { { 0, count, root.valid() ? root.min_v : glm::vec3(0.0f), std::max(extent.x, std::max(extent.y, extent.z)), 0 } };
+		std::vector<uint32_t> scratch;
+
+		while (!level.empty())
+		{
+			std::vector<Node> split;
+			for (size_t i = 0; i < level.size(); i++)
+			{
+				const Node& node = level[i];
+				if (node.end - node.begin <= max_points || node.depth >= max_depth || !(node.size > 0.0f))
+				{
+					cells.push_back({ node.begin, node.end });
+				}
+				else
+				{
+					split.push_back(node);
+				}
+			}
+			if (split.empty()) break;
+			if (scratch.empty()) scratch.resize(count);
+
+			struct Work
+			{
+				size_t node;
+				size_t begin;
+				size_t end;
+				size_t offsets[8];
+			};
+			std::vector<Work> work;
+			for (size_t s = 0; s < split.size(); s++)
+			{
+				for (size_t b = split[s].begin; b < split[s].end; b += block)
+				{
+					work.push_back({ s, b, std::min(split[s].end, b + block), {} });
+				}
+			}
+
+			auto octant = [&](const Node& node, uint32_t idx)
+			{
+				glm::vec3 center = node.min_v + glm::vec3(node.size * 0.5f);
+				const glm::vec3& p = points[idx];
+				return (p.x >= center.x ? 1 : 0) | (p.y >= center.y ? 2 : 0) | (p.z >= center.z ? 4 : 0);
+			};
+
+			pool.parallel_for(work.size(), [&](size_t w)
+				{
+					Work& item = work[w];
+					for (int o = 0; o < 8; o++) item.offsets[o] = 0;
+					for (size_t i = item.begin; i < item.end; i++) item.offsets[octant(split[item.node], order[i])]++;
+				});
+
+			std::vector<Node> next;
+			size_t w_begin = 0;
+			for (size_t s = 0; s < split.size(); s++)
+			{
+				size_t w_end = w_begin;
+				while (w_end < work.size() && work[w_end].node == s) w_end++;
+
+				const Node& node = split[s];
+				float half = node.size * 0.5f;
+				size_t pos = node.begin;
+				for (int o = 0; o < 8; o++)
+				{
+					size_t child_begin = pos;
+					for (size_t w = w_begin; w < w_end; w++)
+					{
+						size_t n = work[w].offsets[o];
+						work[w].offsets[o] = pos;
+						pos += n;
+					}
+					if (pos > child_begin)
+					{
+						glm::vec3 child_min = node.min_v + glm::vec3((o & 1) ? half : 0.0f, (o & 2) ? half : 0.0f, (o & 4) ? half : 0.0f);
+						next.push_back({ child_begin, pos, child_min, half, node.depth + 1 });
+					}
+				}
+				w_begin = w_end;
+			}
+
+			pool.parallel_for(work.size(), [&](size_t w)
+				{
+					Work& item = work[w];
+					for (size_t i = item.begin; i < item.end; i++) scratch[item.offsets[octant(split[item.node], order[i])]++] = order[i];
+				});
+			pool.parallel_for(work.size(), [&](size_t w)
+				{
+					const Work& item = work[w];
+					std::copy(scratch.begin() + item.begin, scratch.begin() + item.end, order.begin() + item.begin);
+				});
+
+			level.swap(next);
+		}
+
+		std::sort(cells.begin(), cells.end(), [](const PointCell& a, const PointCell& b) { return a.begin < b.begin; });
+	}
+
+	// Positions of one cell as unsigned 16-bit steps from its minimum corner, 4 components per point
+	// with the last as padding; the node of the cell carries translation and scale
+	// (KHR_mesh_quantization).
+	struct QuantizedPoints
+	{
+		std::vector<uint16_t> positions;
+		glm::vec3 translation = glm::vec3(0.0f);
+		glm::vec3 scale = glm::vec3(1.0f);
+	};
+
+	inline void QuantizePoints(const glm::vec3* points, const uint32_t* indices, size_t count, QuantizedPoints& out)
+	{
+		AABB box;
+		for (size_t i = 0; i < count; i++) box.add(points[indices[i]]);
+		if (!box.valid()) box.add(glm::vec3(0.0f));
+
+		glm::vec3 extent = box.max_v - box.min_v;
+		out.translation = box.min_v;
+		out.scale = glm::vec3(extent.x > 0.0f ? extent.x / 65535.0f : 1.0f, extent.y > 0.0f ? extent.y / 65535.0f : 1.0f, extent.z > 0.0f ? extent.z / 65535.0f : 1.0f);
+
+		out.positions.resize(count * 4);
+		for (size_t i = 0; i < count; i++)
+		{
+			glm::vec3 q = glm::clamp((points[indices[i]] - out.translation) / out.scale + 0.5f, 0.0f, 65535.0f);
+			out.positions[i * 4] = (uint16_t)q.x;
+			out.positions[i * 4 + 1] = (uint16_t)q.y;
+			out.positions[i * 4 + 2] = (uint16_t)q.z;
+			out.positions[i * 4 + 3] = 0;
+		}
+	}
+}
@@ -0,0 +1,1225 @@
+#pragma once
+
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <glm.hpp>
+#include <crc64.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MID_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define MID_TARGET(isa)
+#else
+#include <cpuid.h>
+#define MID_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+// Runtime CPU dispatch for the vectorized kernels. Every kernel family has a scalar reference and
+// one entry per instruction set tier; SelectIsa() binds the table once at startup, and the rest of
+// the converter calls through Simd().
+namespace Mid
+{
+	enum class Isa
+	{
+		Scalar,
+		SSE4,   // SSE4.2 + PCLMUL
+		AVX2,
+		AVX512, // F + BW + VL
+	};
+
+	inline const char* IsaName(Isa isa)
+	{
+		switch (isa)
+		{
+		case Isa::SSE4: return "sse4";
+		case Isa::AVX2: return "avx2";
+		case Isa::AVX512: return "avx512";
+		default: return "scalar";
+		}
+	}
+
+	inline bool ParseIsa(const std::string& name, Isa& isa)
+	{
+		for (int i = (int)Isa::Scalar; i <= (int)Isa::AVX512; i++)
+		{
+			if (name == IsaName((Isa)i))
+			{
+				isa = (Isa)i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Highest tier both the CPU and the OS (saved register state) support.
+	inline Isa DetectIsa()
+	{
+#ifdef MID_SIMD_X86
+		unsigned int leaf1[4] = { 0 }, leaf7[4] = { 0 };
+#if defined(_MSC_VER) && !defined(__clang__)
+		int regs[4];
+		__cpuid(regs, 0);
+		int max_leaf = regs[0];
+		__cpuidex(regs, 1, 0);
+		memcpy(leaf1, regs, sizeof(regs));
+		if (max_leaf >= 7)
+		{
+			__cpuidex(regs, 7, 0);
+			memcpy(leaf7, regs, sizeof(regs));
+		}
+#else
+		if (!__get_cpuid(1, &leaf1[0], &leaf1[1], &leaf1[2], &leaf1[3])) return Isa::Scalar;
+		__get_cpuid_count(7, 0, &leaf7[0], &leaf7[1], &leaf7[2], &leaf7[3]);
+#endif
+		bool sse42 = (leaf1[2] >> 20) & 1;
+		bool pclmul = (leaf1[2] >> 1) & 1;
+		if (!sse42 || !pclmul) return Isa::Scalar;
+
+		bool osxsave = (leaf1[2] >> 27) & 1;
+		bool avx = (leaf1[2] >> 28) & 1;
+		if (!osxsave || !avx) return Isa::SSE4;
+
+		uint64_t xcr0;
+#if defined(_MSC_VER) && !defined(__clang__)
+		xcr0 = _xgetbv(0);
+#else
+		unsigned int eax, edx;
+		__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		xcr0 = ((uint64_t)edx << 32) | eax;
+#endif
+		bool avx2 = (leaf7[1] >> 5) & 1;
+		if (!avx2 || (xcr0 & 0x6) != 0x6) return Isa::SSE4;
+
+		bool avx512 = ((leaf7[1] >> 16) & 1) && ((leaf7[1] >> 30) & 1) && ((leaf7[1] >> 31) & 1);
+		if (!avx512 || (xcr0 & 0xE6) != 0xE6) return Isa::AVX2;
+		return Isa::AVX512;
+#else
+		return Isa::Scalar;
+#endif
+	}
+
+	struct SimdKernels
+	{
+		// crc-64-jones over l bytes, continuing from crc; same result as crc64().
+		uint64_t(*crc64)(uint64_t crc, const unsigned char* s, uint64_t l);
+		// Marks zero-area triangles in [begin, end), see IsDegenerate().
+		void(*mark_degenerate)(const glm::ivec3* faces, size_t begin, size_t end, const glm::vec3* points, uint8_t* degenerate);
+		// Component-wise min/max of count packed vec3; NaNs are skipped. Leaves FLT_MAX/-FLT_MAX when empty.
+		void(*minmax_vec3)(const float* data, size_t count, float* min_v, float* max_v);
+		// Number of NaN or infinite values among count floats.
+		size_t(*count_nonfinite)(const float* data, size_t count);
+		// Largest of count unsigned 32-bit values, 0 when empty.
+		uint32_t(*max_u32)(const uint32_t* data, size_t count);
+		// Level-shifted JPEG Y, Cb and Cr of count RGBA pixels.
+		void(*rgba_to_ycbcr)(const uint8_t* rgba, size_t count, int16_t* y, int16_t* cb, int16_t* cr);
+		// Integer forward DCT of count 8x8 blocks of level-shifted samples, columns first; the
+		// coefficients come out scaled by 8.
+		void(*fdct8x8)(const int16_t* blocks, size_t count, int16_t* coefs);
+		// count blocks of coefficients divided by the 64 divisors, rounded to nearest even.
+		void(*quantize)(const int16_t* coefs, size_t count, const float* divisors, int16_t* out);
+	};
+
+	// A triangle is zero-area when sin^2 of its corner angle at the first vertex is below this.
+	const float degenerate_sin2_epsilon = 1e-12f;
+
+	inline bool IsDegenerate(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+	{
+		glm::vec3 e1 = b - a;
+		glm::vec3 e2 = c - a;
+		glm::vec3 n = glm::cross(e1, e2);
+		return glm::dot(n, n) <= degenerate_sin2_epsilon * glm::dot(e1, e1) * glm::dot(e2, e2);
+	}
+
+	namespace simd_scalar
+	{
+		inline void mark_degenerate(const glm::ivec3* faces, size_t begin, size_t end, const glm::vec3* points, uint8_t* degenerate)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				degenerate[i] = IsDegenerate(points[faces[i].x], points[faces[i].y], points[faces[i].z]) ? 1 : 0;
+			}
+		}
+
+		inline void minmax_vec3(const float* data, size_t count, float* min_v, float* max_v)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				min_v[j] = FLT_MAX;
+				max_v[j] = -FLT_MAX;
+			}
+			for (size_t i = 0; i < count * 3; i++)
+			{
+				float v = data[i];
+				min_v[i % 3] = v < min_v[i % 3] ? v : min_v[i % 3];
+				max_v[i % 3] = v > max_v[i % 3] ? v : max_v[i % 3];
+			}
+		}
+
+		inline size_t count_nonfinite(const float* data, size_t count)
+		{
+			size_t ret = 0;
+			for (size_t i = 0; i < count; i++)
+			{
+				uint32_t bits;
+				memcpy(&bits, data + i, 4);
+				ret += (bits & 0x7f800000u) == 0x7f800000u ? 1 : 0;
+			}
+			return ret;
+		}
+
+		inline uint32_t max_u32(const uint32_t* data, size_t count)
+		{
+			uint32_t ret = 0;
+			for (size_t i = 0; i < count; i++)
+			{
+				ret = data[i] > ret ? data[i] : ret;
+			}
+			return ret;
+		}
+
+		// JFIF YCbCr in 16-bit fixed point, as libjpeg's jccolor.
+		inline void rgba_to_ycbcr(const uint8_t* rgba, size_t count, int16_t* y, int16_t* cb, int16_t* cr)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				int r = rgba[i * 4], g = rgba[i * 4 + 1], b = rgba[i * 4 + 2];
+				y[i] = (int16_t)(((19595 * r + 38470 * g + 7471 * b + 32768) >> 16) - 128);
+				cb[i] = (int16_t)((-11059 * r - 21709 * g + 32768 * b + 32767) >> 16);
+				cr[i] = (int16_t)((32768 * r - 27439 * g - 5329 * b + 32767) >> 16);
+			}
+		}
+
+		// One 1-D pass of libjpeg's jfdctint on d[0], d[stride], ... The first pass keeps two extra
+		// bits of precision, the second removes them.
+		template<int Pass>
+		inline void fdct_1d(int32_t* d, int stride)
+		{
+			const int shift = Pass == 0 ? 13 - 2 : 13 + 2;
+			const int32_t round = 1 << (shift - 1);
+			int32_t tmp0 = d[0] + d[7 * stride], tmp7 = d[0] - d[7 * stride];
+			int32_t tmp1 = d[stride] + d[6 * stride], tmp6 = d[stride] - d[6 * stride];
+			int32_t tmp2 = d[2 * stride] + d[5 * stride], tmp5 = d[2 * stride] - d[5 * stride];
+			int32_t tmp3 = d[3 * stride] + d[4 * stride], tmp4 = d[3 * stride] - d[4 * stride];
+
+			int32_t tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+			int32_t tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+			if (Pass == 0)
+			{
+				d[0] = (tmp10 + tmp11) * 4;
+				d[4 * stride] = (tmp10 - tmp11) * 4;
+			}
+			else
+			{
+				d[0] = (tmp10 + tmp11 + 2) >> 2;
+				d[4 * stride] = (tmp10 - tmp11 + 2) >> 2;
+			}
+			int32_t z1 = (tmp12 + tmp13) * 4433;
+			d[2 * stride] = (z1 + tmp13 * 6270 + round) >> shift;
+			d[6 * stride] = (z1 - tmp12 * 15137 + round) >> shift;
+
+			z1 = tmp4 + tmp7;
+			int32_t z2 = tmp5 + tmp6, z3 = tmp4 + tmp6, z4 = tmp5 + tmp7;
+			int32_t z5 = (z3 + z4) * 9633;
+			tmp4 *= 2446;
+			tmp5 *= 16819;
+			tmp6 *= 25172;
+			tmp7 *= 12299;
+			z1 *= -7373;
+			z2 *= -20995;
+			z3 = z3 * -16069 + z5;
+			z4 = z4 * -3196 + z5;
+			d[7 * stride] = (tmp4 + z1 + z3 + round) >> shift;
+			d[5 * stride] = (tmp5 + z2 + z4 + round) >> shift;
+			d[3 * stride] = (tmp6 + z2 + z3 + round) >> shift;
+			d[stride] = (tmp7 + z1 + z4 + round) >> shift;
+		}
+
+		inline void fdct8x8(const int16_t* blocks, size_t count, int16_t* coefs)
+		{
+			for (size_t b = 0; b < count; b++)
+			{
+				int32_t d[64];
+				for (int i = 0; i < 64; i++) d[i] = blocks[b * 64 + i];
+				for (int c = 0; c < 8; c++) fdct_1d<0>(d + c, 8);
+				for (int r = 0; r < 8; r++) fdct_1d<1>(d + r * 8, 1);
+				for (int i = 0; i < 64; i++) coefs[b * 64 + i] = (int16_t)d[i];
+			}
+		}
+
+		inline void quantize(const int16_t* coefs, size_t count, const float* divisors, int16_t* out)
+		{
+			for (size_t i = 0; i < count * 64; i++)
+			{
+				float q = std::nearbyint((float)coefs[i] / divisors[i % 64]);
+				out[i] = (int16_t)(q < -32768.0f ? -32768.0f : q > 32767.0f ? 32767.0f : q);
+			}
+		}
+	}
+
+#ifdef MID_SIMD_X86
+	// Folding constants for crc-64-jones in the bit-reflected domain (Intel's PCLMULQDQ CRC paper).
+	// Folding a 128-bit block forward by d bits multiplies its high half by x^(d+63) and its low half
+	// by x^(d-1) mod P; the extra x^-1 undoes the one-bit shift of a reflected carry-less product.
+	struct Crc64FoldConstants
+	{
+		uint64_t k128[2];
+		uint64_t k512[2];
+
+		static uint64_t reflect(uint64_t v)
+		{
+			uint64_t r = 0;
+			for (int i = 0; i < 64; i++)
+			{
+				r |= ((v >> i) & 1) << (63 - i);
+			}
+			return r;
+		}
+
+		static uint64_t xpow_mod(int n)
+		{
+			const uint64_t poly = 0xad93d23594c935a9ull;
+			uint64_t v = 1;
+			for (int i = 0; i < n; i++)
+			{
+				uint64_t carry = v >> 63;
+				v <<= 1;
+				if (carry) v ^= poly;
+			}
+			return reflect(v);
+		}
+
+		Crc64FoldConstants()
+		{
+			k128[0] = xpow_mod(128 + 63);
+			k128[1] = xpow_mod(128 - 1);
+			k512[0] = xpow_mod(512 + 63);
+			k512[1] = xpow_mod(512 - 1);
+		}
+	};
+
+	namespace simd_sse4
+	{
+		MID_TARGET("sse4.2,pclmul")
+		inline __m128i crc64_fold(__m128i acc, __m128i k, __m128i data)
+		{
+			__m128i hi = _mm_clmulepi64_si128(acc, k, 0x00);
+			__m128i lo = _mm_clmulepi64_si128(acc, k, 0x11);
+			return _mm_xor_si128(_mm_xor_si128(hi, lo), data);
+		}
+
+		// The input crc is folded into the first eight bytes, the bulk is reduced to one 128-bit
+		// block four lanes at a time, and that block plus the tail go through the table loop.
+		MID_TARGET("sse4.2,pclmul")
+		inline uint64_t crc64(uint64_t crc, const unsigned char* s, uint64_t l)
+		{
+			if (l < 64) return ::crc64(crc, s, l);
+
+			static const Crc64FoldConstants constants;
+			const __m128i k128 = _mm_loadu_si128((const __m128i*)constants.k128);
+			const __m128i k512 = _mm_loadu_si128((const __m128i*)constants.k512);
+
+			__m128i acc[4];
+			for (int i = 0; i < 4; i++)
+			{
+				acc[i] = _mm_loadu_si128((const __m128i*)(s + i * 16));
+			}
+			acc[0] = _mm_xor_si128(acc[0], _mm_set_epi64x(0, (long long)crc));
+
+			uint64_t pos = 64;
+			for (; pos + 64 <= l; pos += 64)
+			{
+				for (int i = 0; i < 4; i++)
+				{
+					acc[i] = crc64_fold(acc[i], k512, _mm_loadu_si128((const __m128i*)(s + pos + i * 16)));
+				}
+			}
+
+			__m128i folded = acc[0];
+			for (int i = 1; i < 4; i++)
+			{
+				folded = crc64_fold(folded, k128, acc[i]);
+			}
+			for (; pos + 16 <= l; pos += 16)
+			{
+				folded = crc64_fold(folded, k128, _mm_loadu_si128((const __m128i*)(s + pos)));
+			}
+
+			alignas(16) unsigned char block[16];
+			_mm_store_si128((__m128i*)block, folded);
+			return ::crc64(::crc64(0, block, 16), s + pos, l - pos);
+		}
+
+		MID_TARGET("sse4.2")
+		inline void mark_degenerate(const glm::ivec3* faces, size_t begin, size_t end, const glm::vec3* points, uint8_t* degenerate)
+		{
+			size_t i = begin;
+			for (; i + 4 <= end; i += 4)
+			{
+				alignas(16) float ax[4], ay[4], az[4], bx[4], by[4], bz[4], cx[4], cy[4], cz[4];
+				for (int k = 0; k < 4; k++)
+				{
+					const glm::vec3& a = points[faces[i + k].x];
+					const glm::vec3& b = points[faces[i + k].y];
+					const glm::vec3& c = points[faces[i + k].z];
+					ax[k] = a.x; ay[k] = a.y; az[k] = a.z;
+					bx[k] = b.x; by[k] = b.y; bz[k] = b.z;
+					cx[k] = c.x; cy[k] = c.y; cz[k] = c.z;
+				}
+				__m128 e1x = _mm_sub_ps(_mm_load_ps(bx), _mm_load_ps(ax));
+				__m128 e1y = _mm_sub_ps(_mm_load_ps(by), _mm_load_ps(ay));
+				__m128 e1z = _mm_sub_ps(_mm_load_ps(bz), _mm_load_ps(az));
+				__m128 e2x = _mm_sub_ps(_mm_load_ps(cx), _mm_load_ps(ax));
+				__m128 e2y = _mm_sub_ps(_mm_load_ps(cy), _mm_load_ps(ay));
+				__m128 e2z = _mm_sub_ps(_mm_load_ps(cz), _mm_load_ps(az));
+
+				__m128 nx = _mm_sub_ps(_mm_mul_ps(e1y, e2z), _mm_mul_ps(e1z, e2y));
+				__m128 ny = _mm_sub_ps(_mm_mul_ps(e1z, e2x), _mm_mul_ps(e1x, e2z));
+				__m128 nz = _mm_sub_ps(_mm_mul_ps(e1x, e2y), _mm_mul_ps(e1y, e2x));
+
+				__m128 n2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz));
+				__m128 l1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, e1x), _mm_mul_ps(e1y, e1y)), _mm_mul_ps(e1z, e1z));
+				__m128 l2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, e2x), _mm_mul_ps(e2y, e2y)), _mm_mul_ps(e2z, e2z));
+				__m128 limit = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(degenerate_sin2_epsilon), l1), l2);
+
+				int mask = _mm_movemask_ps(_mm_cmple_ps(n2, limit));
+				for (int k = 0; k < 4; k++)
+				{
+					degenerate[i + k] = (mask >> k) & 1;
+				}
+			}
+			simd_scalar::mark_degenerate(faces, i, end, points, degenerate);
+		}
+
+		// Four vertices are twelve floats, i.e. three registers whose lanes cycle through x, y, z;
+		// the lanes are folded back per component at the end.
+		MID_TARGET("sse4.2")
+		inline void minmax_vec3(const float* data, size_t count, float* min_v, float* max_v)
+		{
+			__m128 mn[3], mx[3];
+			for (int r = 0; r < 3; r++)
+			{
+				mn[r] = _mm_set1_ps(FLT_MAX);
+				mx[r] = _mm_set1_ps(-FLT_MAX);
+			}
+			size_t i = 0;
+			for (; i + 4 <= count; i += 4)
+			{
+				for (int r = 0; r < 3; r++)
+				{
+					__m128 v = _mm_loadu_ps(data + i * 3 + r * 4);
+					mn[r] = _mm_min_ps(v, mn[r]);
+					mx[r] = _mm_max_ps(v, mx[r]);
+				}
+			}
+			simd_scalar::minmax_vec3(data + i * 3, count - i, min_v, max_v);
+
+			float lanes_mn[12], lanes_mx[12];
+			for (int r = 0; r < 3; r++)
+			{
+				_mm_storeu_ps(lanes_mn + r * 4, mn[r]);
+				_mm_storeu_ps(lanes_mx + r * 4, mx[r]);
+			}
+			for (int k = 0; k < 12; k++)
+			{
+				min_v[k % 3] = lanes_mn[k] < min_v[k % 3] ? lanes_mn[k] : min_v[k % 3];
+				max_v[k % 3] = lanes_mx[k] > max_v[k % 3] ? lanes_mx[k] : max_v[k % 3];
+			}
+		}
+
+		MID_TARGET("sse4.2")
+		inline size_t count_nonfinite(const float* data, size_t count)
+		{
+			const __m128i exp_mask = _mm_set1_epi32(0x7f800000);
+			size_t ret = 0;
+			size_t i = 0;
+			for (; i + 4 <= count; i += 4)
+			{
+				__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i)), exp_mask);
+				int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, exp_mask)));
+				ret += (size_t)((mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1));
+			}
+			return ret + simd_scalar::count_nonfinite(data + i, count - i);
+		}
+
+		MID_TARGET("sse4.2")
+		inline uint32_t max_u32(const uint32_t* data, size_t count)
+		{
+			__m128i mx = _mm_setzero_si128();
+			size_t i = 0;
+			for (; i + 4 <= count; i += 4)
+			{
+				mx = _mm_max_epu32(mx, _mm_loadu_si128((const __m128i*)(data + i)));
+			}
+			alignas(16) uint32_t lanes[4];
+			_mm_store_si128((__m128i*)lanes, mx);
+			uint32_t ret = simd_scalar::max_u32(data + i, count - i);
+			return simd_scalar::max_u32(lanes, 4) > ret ? simd_scalar::max_u32(lanes, 4) : ret;
+		}
+
+		MID_TARGET("sse4.2")
+		inline __m128i ycbcr_dot(__m128i r, __m128i g, __m128i b, int cr, int cg, int cb, int bias)
+		{
+			__m128i sum = _mm_add_epi32(_mm_mullo_epi32(r, _mm_set1_epi32(cr)), _mm_mullo_epi32(g, _mm_set1_epi32(cg)));
+			sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_mullo_epi32(b, _mm_set1_epi32(cb)), _mm_set1_epi32(bias)));
+			return _mm_srai_epi32(sum, 16);
+		}
+
+		MID_TARGET("sse4.2")
+		inline void rgba_to_ycbcr(const uint8_t* rgba, size_t count, int16_t* y, int16_t* cb, int16_t* cr)
+		{
+			const __m128i mask = _mm_set1_epi32(0xff);
+			const __m128i shift = _mm_set1_epi32(128);
+			size_t i = 0;
+			for (; i + 8 <= count; i += 8)
+			{
+				__m128i yv[2], cbv[2], crv[2];
+				for (int h = 0; h < 2; h++)
+				{
+					__m128i px = _mm_loadu_si128((const __m128i*)(rgba + (i + h * 4) * 4));
+					__m128i r = _mm_and_si128(px, mask);
+					__m128i g = _mm_and_si128(_mm_srli_epi32(px, 8), mask);
+					__m128i b = _mm_and_si128(_mm_srli_epi32(px, 16), mask);
+					yv[h] = _mm_sub_epi32(ycbcr_dot(r, g, b, 19595, 38470, 7471, 32768), shift);
+					cbv[h] = ycbcr_dot(r, g, b, -11059, -21709, 32768, 32767);
+					crv[h] = ycbcr_dot(r, g, b, 32768, -27439, -5329, 32767);
+				}
+				_mm_storeu_si128((__m128i*)(y + i), _mm_packs_epi32(yv[0], yv[1]));
+				_mm_storeu_si128((__m128i*)(cb + i), _mm_packs_epi32(cbv[0], cbv[1]));
+				_mm_storeu_si128((__m128i*)(cr + i), _mm_packs_epi32(crv[0], crv[1]));
+			}
+			simd_scalar::rgba_to_ycbcr(rgba + i * 4, count - i, y + i, cb + i, cr + i);
+		}
+
+		MID_TARGET("sse4.2")
+		inline __m128i mul_const(__m128i v, int c)
+		{
+			return _mm_mullo_epi32(v, _mm_set1_epi32(c));
+		}
+
+		// simd_scalar::fdct_1d on eight vectors, one lane per row or column.
+		template<int Pass>
+		MID_TARGET("sse4.2")
+		inline void fdct_1d(__m128i* d)
+		{
+			constexpr int shift = Pass == 0 ? 13 - 2 : 13 + 2;
+			const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+			__m128i tmp0 = _mm_add_epi32(d[0], d[7]), tmp7 = _mm_sub_epi32(d[0], d[7]);
+			__m128i tmp1 = _mm_add_epi32(d[1], d[6]), tmp6 = _mm_sub_epi32(d[1], d[6]);
+			__m128i tmp2 = _mm_add_epi32(d[2], d[5]), tmp5 = _mm_sub_epi32(d[2], d[5]);
+			__m128i tmp3 = _mm_add_epi32(d[3], d[4]), tmp4 = _mm_sub_epi32(d[3], d[4]);
+
+			__m128i tmp10 = _mm_add_epi32(tmp0, tmp3), tmp13 = _mm_sub_epi32(tmp0, tmp3);
+			__m128i tmp11 = _mm_add_epi32(tmp1, tmp2), tmp12 = _mm_sub_epi32(tmp1, tmp2);
+			if (Pass == 0)
+			{
+				d[0] = _mm_slli_epi32(_mm_add_epi32(tmp10, tmp11), 2);
+				d[4] = _mm_slli_epi32(_mm_sub_epi32(tmp10, tmp11), 2);
+			}
+			else
+			{
+				const __m128i two = _mm_set1_epi32(2);
+				d[0] = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(tmp10, tmp11), two), 2);
+				d[4] = _mm_srai_epi32(_mm_add_epi32(_mm_sub_epi32(tmp10, tmp11), two), 2);
+			}
+			__m128i z1 = mul_const(_mm_add_epi32(tmp12, tmp13), 4433);
+			d[2] = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(z1, mul_const(tmp13, 6270)), round), shift);
+			d[6] = _mm_srai_epi32(_mm_add_epi32(_mm_sub_epi32(z1, mul_const(tmp12, 15137)), round), shift);
+
+			z1 = _mm_add_epi32(tmp4, tmp7);
+			__m128i z2 = _mm_add_epi32(tmp5, tmp6), z3 = _mm_add_epi32(tmp4, tmp6), z4 = _mm_add_epi32(tmp5, tmp7);
+			__m128i z5 = mul_const(_mm_add_epi32(z3, z4), 9633);
+			tmp4 = mul_const(tmp4, 2446);
+			tmp5 = mul_const(tmp5, 16819);
+			tmp6 = mul_const(tmp6, 25172);
+			tmp7 = mul_const(tmp7, 12299);
+			z1 = mul_const(z1, -7373);
+			z2 = mul_const(z2, -20995);
+			z3 = _mm_add_epi32(mul_const(z3, -16069), z5);
+			z4 = _mm_add_epi32(mul_const(z4, -3196), z5);
+			d[7] = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(tmp4, z1), _mm_add_epi32(z3, round)), shift);
+			d[5] = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(tmp5, z2), _mm_add_epi32(z4, round)), shift);
+			d[3] = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(tmp6, z2), _mm_add_epi32(z3, round)), shift);
+			d[1] = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(tmp7, z1), _mm_add_epi32(z4, round)), shift);
+		}
+
+		MID_TARGET("sse4.2")
+		inline void transpose4x4(__m128i* r)
+		{
+			__m128i t0 = _mm_unpacklo_epi32(r[0], r[1]), t1 = _mm_unpacklo_epi32(r[2], r[3]);
+			__m128i t2 = _mm_unpackhi_epi32(r[0], r[1]), t3 = _mm_unpackhi_epi32(r[2], r[3]);
+			r[0] = _mm_unpacklo_epi64(t0, t1);
+			r[1] = _mm_unpackhi_epi64(t0, t1);
+			r[2] = _mm_unpacklo_epi64(t2, t3);
+			r[3] = _mm_unpackhi_epi64(t2, t3);
+		}
+
+		// lo holds columns 0-3 and hi columns 4-7 of each row.
+		MID_TARGET("sse4.2")
+		inline void transpose8x8(__m128i* lo, __m128i* hi)
+		{
+			transpose4x4(lo);
+			transpose4x4(lo + 4);
+			transpose4x4(hi);
+			transpose4x4(hi + 4);
+			for (int k = 0; k < 4; k++)
+			{
+				__m128i t = lo[4 + k];
+				lo[4 + k] = hi[k];
+				hi[k] = t;
+			}
+		}
+
+		MID_TARGET("sse4.2")
+		inline void fdct8x8(const int16_t* blocks, size_t count, int16_t* coefs)
+		{
+			for (size_t b = 0; b < count; b++)
+			{
+				__m128i lo[8], hi[8];
+				for (int r = 0; r < 8; r++)
+				{
+					__m128i row = _mm_loadu_si128((const __m128i*)(blocks + b * 64 + r * 8));
+					lo[r] = _mm_cvtepi16_epi32(row);
+					hi[r] = _mm_cvtepi16_epi32(_mm_srli_si128(row, 8));
+				}
+				fdct_1d<0>(lo);
+				fdct_1d<0>(hi);
+				transpose8x8(lo, hi);
+				fdct_1d<1>(lo);
+				fdct_1d<1>(hi);
+				transpose8x8(lo, hi);
+				for (int r = 0; r < 8; r++)
+				{
+					_mm_storeu_si128((__m128i*)(coefs + b * 64 + r * 8), _mm_packs_epi32(lo[r], hi[r]));
+				}
+			}
+		}
+
+		MID_TARGET("sse4.2")
+		inline void quantize(const int16_t* coefs, size_t count, const float* divisors, int16_t* out)
+		{
+			for (size_t i = 0; i < count * 64; i += 8)
+			{
+				__m128i c = _mm_loadu_si128((const __m128i*)(coefs + i));
+				__m128 lo = _mm_div_ps(_mm_cvtepi32_ps(_mm_cvtepi16_epi32(c)), _mm_loadu_ps(divisors + i % 64));
+				__m128 hi = _mm_div_ps(_mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(c, 8))), _mm_loadu_ps(divisors + i % 64 + 4));
+				_mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+			}
+		}
+	}
+
+	namespace simd_avx2
+	{
+		MID_TARGET("avx2")
+		inline void mark_degenerate(const glm::ivec3* faces, size_t begin, size_t end, const glm::vec3* points, uint8_t* degenerate)
+		{
+			size_t i = begin;
+			for (; i + 8 <= end; i += 8)
+			{
+				alignas(32) float ax[8], ay[8], az[8], bx[8], by[8], bz[8], cx[8], cy[8], cz[8];
+				for (int k = 0; k < 8; k++)
+				{
+					const glm::vec3& a = points[faces[i + k].x];
+					const glm::vec3& b = points[faces[i + k].y];
+					const glm::vec3& c = points[faces[i + k].z];
+					ax[k] = a.x; ay[k] = a.y; az[k] = a.z;
+					bx[k] = b.x; by[k] = b.y; bz[k] = b.z;
+					cx[k] = c.x; cy[k] = c.y; cz[k] = c.z;
+				}
+				__m256 e1x = _mm256_sub_ps(_mm256_load_ps(bx), _mm256_load_ps(ax));
+				__m256 e1y = _mm256_sub_ps(_mm256_load_ps(by), _mm256_load_ps(ay));
+				__m256 e1z = _mm256_sub_ps(_mm256_load_ps(bz), _mm256_load_ps(az));
+				__m256 e2x = _mm256_sub_ps(_mm256_load_ps(cx), _mm256_load_ps(ax));
+				__m256 e2y = _mm256_sub_ps(_mm256_load_ps(cy), _mm256_load_ps(ay));
+				__m256 e2z = _mm256_sub_ps(_mm256_load_ps(cz), _mm256_load_ps(az));
+
+				__m256 nx = _mm256_sub_ps(_mm256_mul_ps(e1y, e2z), _mm256_mul_ps(e1z, e2y));
+				__m256 ny = _mm256_sub_ps(_mm256_mul_ps(e1z, e2x), _mm256_mul_ps(e1x, e2z));
+				__m256 nz = _mm256_sub_ps(_mm256_mul_ps(e1x, e2y), _mm256_mul_ps(e1y, e2x));
+
+				__m256 n2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny)), _mm256_mul_ps(nz, nz));
+				__m256 l1 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, e1x), _mm256_mul_ps(e1y, e1y)), _mm256_mul_ps(e1z, e1z));
+				__m256 l2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, e2x), _mm256_mul_ps(e2y, e2y)), _mm256_mul_ps(e2z, e2z));
+				__m256 limit = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(degenerate_sin2_epsilon), l1), l2);
+
+				int mask = _mm256_movemask_ps(_mm256_cmp_ps(n2, limit, _CMP_LE_OQ));
+				for (int k = 0; k < 8; k++)
+				{
+					degenerate[i + k] = (mask >> k) & 1;
+				}
+			}
+			simd_scalar::mark_degenerate(faces, i, end, points, degenerate);
+		}
+
+		MID_TARGET("avx2")
+		inline void minmax_vec3(const float* data, size_t count, float* min_v, float* max_v)
+		{
+			__m256 mn[3], mx[3];
+			for (int r = 0; r < 3; r++)
+			{
+				mn[r] = _mm256_set1_ps(FLT_MAX);
+				mx[r] = _mm256_set1_ps(-FLT_MAX);
+			}
+			size_t i = 0;
+			for (; i + 8 <= count; i += 8)
+			{
+				for (int r = 0; r < 3; r++)
+				{
+					__m256 v = _mm256_loadu_ps(data + i * 3 + r * 8);
+					mn[r] = _mm256_min_ps(v, mn[r]);
+					mx[r] = _mm256_max_ps(v, mx[r]);
+				}
+			}
+			simd_scalar::minmax_vec3(data + i * 3, count - i, min_v, max_v);
+
+			float lanes_mn[24], lanes_mx[24];
+			for (int r = 0; r < 3; r++)
+			{
+				_mm256_storeu_ps(lanes_mn + r * 8, mn[r]);
+				_mm256_storeu_ps(lanes_mx + r * 8, mx[r]);
+			}
+			for (int k = 0; k < 24; k++)
+			{
+				min_v[k % 3] = lanes_mn[k] < min_v[k % 3] ? lanes_mn[k] : min_v[k % 3];
+				max_v[k % 3] = lanes_mx[k] > max_v[k % 3] ? lanes_mx[k] : max_v[k % 3];
+			}
+		}
+
+		MID_TARGET("avx2")
+		inline size_t count_nonfinite(const float* data, size_t count)
+		{
+			const __m256i exp_mask = _mm256_set1_epi32(0x7f800000);
+			size_t ret = 0;
+			size_t i = 0;
+			for (; i + 8 <= count; i += 8)
+			{
+				__m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(data + i)), exp_mask);
+				unsigned mask = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, exp_mask)));
+				for (; mask != 0; mask &= mask - 1) ret++;
+			}
+			return ret + simd_scalar::count_nonfinite(data + i, count - i);
+		}
+
+		MID_TARGET("avx2")
+		inline uint32_t max_u32(const uint32_t* data, size_t count)
+		{
+			__m256i mx = _mm256_setzero_si256();
+			size_t i = 0;
+			for (; i + 8 <= count; i += 8)
+			{
+				mx = _mm256_max_epu32(mx, _mm256_loadu_si256((const __m256i*)(data + i)));
+			}
+			alignas(32) uint32_t lanes[8];
+			_mm256_store_si256((__m256i*)lanes, mx);
+			uint32_t ret = simd_scalar::max_u32(data + i, count - i);
+			return simd_scalar::max_u32(lanes, 8) > ret ? simd_scalar::max_u32(lanes, 8) : ret;
+		}
+
+		MID_TARGET("avx2")
+		inline __m256i ycbcr_dot(__m256i r, __m256i g, __m256i b, int cr, int cg, int cb, int bias)
+		{
+			__m256i sum = _mm256_add_epi32(_mm256_mullo_epi32(r, _mm256_set1_epi32(cr)), _mm256_mullo_epi32(g, _mm256_set1_epi32(cg)));
+			sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_mullo_epi32(b, _mm256_set1_epi32(cb)), _mm256_set1_epi32(bias)));
+			return _mm256_srai_epi32(sum, 16);
+		}
+
+		// 16 int32 lanes to 16 int16 in order; packs interleaves the 128-bit halves.
+		MID_TARGET("avx2")
+		inline __m256i pack_i32(__m256i a, __m256i b)
+		{
+			return _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+		}
+
+		MID_TARGET("avx2")
+		inline void rgba_to_ycbcr(const uint8_t* rgba, size_t count, int16_t* y, int16_t* cb, int16_t* cr)
+		{
+			const __m256i mask = _mm256_set1_epi32(0xff);
+			const __m256i shift = _mm256_set1_epi32(128);
+			size_t i = 0;
+			for (; i + 16 <= count; i += 16)
+			{
+				__m256i yv[2], cbv[2], crv[2];
+				for (int h = 0; h < 2; h++)
+				{
+					__m256i px = _mm256_loadu_si256((const __m256i*)(rgba + (i + h * 8) * 4));
+					__m256i r = _mm256_and_si256(px, mask);
+					__m256i g = _mm256_and_si256(_mm256_srli_epi32(px, 8), mask);
+					__m256i b = _mm256_and_si256(_mm256_srli_epi32(px, 16), mask);
+					yv[h] = _mm256_sub_epi32(ycbcr_dot(r, g, b, 19595, 38470, 7471, 32768), shift);
+					cbv[h] = ycbcr_dot(r, g, b, -11059, -21709, 32768, 32767);
+					crv[h] = ycbcr_dot(r, g, b, 32768, -27439, -5329, 32767);
+				}
+				_mm256_storeu_si256((__m256i*)(y + i), pack_i32(yv[0], yv[1]));
+				_mm256_storeu_si256((__m256i*)(cb + i), pack_i32(cbv[0], cbv[1]));
+				_mm256_storeu_si256((__m256i*)(cr + i), pack_i32(crv[0], crv[1]));
+			}
+			simd_scalar::rgba_to_ycbcr(rgba + i * 4, count - i, y + i, cb + i, cr + i);
+		}
+
+		MID_TARGET("avx2")
+		inline __m256i mul_const(__m256i v, int c)
+		{
+			return _mm256_mullo_epi32(v, _mm256_set1_epi32(c));
+		}
+
+		// simd_scalar::fdct_1d on eight vectors, one lane per row or column.
+		template<int Pass>
+		MID_TARGET("avx2")
+		inline void fdct_1d(__m256i* d)
+		{
+			constexpr int shift = Pass == 0 ? 13 - 2 : 13 + 2;
+			const __m256i round = _mm256_set1_epi32(1 << (shift - 1));
+			__m256i tmp0 = _mm256_add_epi32(d[0], d[7]), tmp7 = _mm256_sub_epi32(d[0], d[7]);
+			__m256i tmp1 = _mm256_add_epi32(d[1], d[6]), tmp6 = _mm256_sub_epi32(d[1], d[6]);
+			__m256i tmp2 = _mm256_add_epi32(d[2], d[5]), tmp5 = _mm256_sub_epi32(d[2], d[5]);
+			__m256i tmp3 = _mm256_add_epi32(d[3], d[4]), tmp4 = _mm256_sub_epi32(d[3], d[4]);
+
+			__m256i tmp10 = _mm256_add_epi32(tmp0, tmp3), tmp13 = _mm256_sub_epi32(tmp0, tmp3);
+			__m256i tmp11 = _mm256_add_epi32(tmp1, tmp2), tmp12 = _mm256_sub_epi32(tmp1, tmp2);
+			if (Pass == 0)
+			{
+				d[0] = _mm256_slli_epi32(_mm256_add_epi32(tmp10, tmp11), 2);
+				d[4] = _mm256_slli_epi32(_mm256_sub_epi32(tmp10, tmp11), 2);
+			}
+			else
+			{
+				const __m256i two = _mm256_set1_epi32(2);
+				d[0] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(tmp10, tmp11), two), 2);
+				d[4] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_sub_epi32(tmp10, tmp11), two), 2);
+			}
+			__m256i z1 = mul_const(_mm256_add_epi32(tmp12, tmp13), 4433);
+			d[2] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(z1, mul_const(tmp13, 6270)), round), shift);
+			d[6] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_sub_epi32(z1, mul_const(tmp12, 15137)), round), shift);
+
+			z1 = _mm256_add_epi32(tmp4, tmp7);
+			__m256i z2 = _mm256_add_epi32(tmp5, tmp6), z3 = _mm256_add_epi32(tmp4, tmp6), z4 = _mm256_add_epi32(tmp5, tmp7);
+			__m256i z5 = mul_const(_mm256_add_epi32(z3, z4), 9633);
+			tmp4 = mul_const(tmp4, 2446);
+			tmp5 = mul_const(tmp5, 16819);
+			tmp6 = mul_const(tmp6, 25172);
+			tmp7 = mul_const(tmp7, 12299);
+			z1 = mul_const(z1, -7373);
+			z2 = mul_const(z2, -20995);
+			z3 = _mm256_add_epi32(mul_const(z3, -16069), z5);
+			z4 = _mm256_add_epi32(mul_const(z4, -3196), z5);
+			d[7] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(tmp4, z1), _mm256_add_epi32(z3, round)), shift);
+			d[5] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(tmp5, z2), _mm256_add_epi32(z4, round)), shift);
+			d[3] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(tmp6, z2), _mm256_add_epi32(z3, round)), shift);
+			d[1] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(tmp7, z1), _mm256_add_epi32(z4, round)), shift);
+		}
+
+		MID_TARGET("avx2")
+		inline void transpose8x8(__m256i* r)
+		{
+			__m256i t[8], u[8];
+			for (int k = 0; k < 8; k += 2)
+			{
+				t[k] = _mm256_unpacklo_epi32(r[k], r[k + 1]);
+				t[k + 1] = _mm256_unpackhi_epi32(r[k], r[k + 1]);
+			}
+			for (int k = 0; k < 8; k += 4)
+			{
+				u[k] = _mm256_unpacklo_epi64(t[k], t[k + 2]);
+				u[k + 1] = _mm256_unpackhi_epi64(t[k], t[k + 2]);
+				u[k + 2] = _mm256_unpacklo_epi64(t[k + 1], t[k + 3]);
+				u[k + 3] = _mm256_unpackhi_epi64(t[k + 1], t[k + 3]);
+			}
+			for (int k = 0; k < 4; k++)
+			{
+				r[k] = _mm256_permute2x128_si256(u[k], u[k + 4], 0x20);
+				r[k + 4] = _mm256_permute2x128_si256(u[k], u[k + 4], 0x31);
+			}
+		}
+
+		MID_TARGET("avx2")
+		inline void fdct8x8(const int16_t* blocks, size_t count, int16_t* coefs)
+		{
+			for (size_t b = 0; b < count; b++)
+			{
+				__m256i v[8];
+				for (int r = 0; r < 8; r++)
+				{
+					v[r] = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(blocks + b * 64 + r * 8)));
+				}
+				fdct_1d<0>(v);
+				transpose8x8(v);
+				fdct_1d<1>(v);
+				transpose8x8(v);
+				for (int r = 0; r < 8; r += 2)
+				{
+					_mm256_storeu_si256((__m256i*)(coefs + b * 64 + r * 8), pack_i32(v[r], v[r + 1]));
+				}
+			}
+		}
+
+		MID_TARGET("avx2")
+		inline void quantize(const int16_t* coefs, size_t count, const float* divisors, int16_t* out)
+		{
+			for (size_t i = 0; i < count * 64; i += 16)
+			{
+				__m256i c = _mm256_loadu_si256((const __m256i*)(coefs + i));
+				__m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(c)));
+				__m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(c, 1)));
+				lo = _mm256_div_ps(lo, _mm256_loadu_ps(divisors + i % 64));
+				hi = _mm256_div_ps(hi, _mm256_loadu_ps(divisors + i % 64 + 8));
+				_mm256_storeu_si256((__m256i*)(out + i), pack_i32(_mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi)));
+			}
+		}
+	}
+
+#if defined(__GNUC__) && !defined(__clang__)
+	// GCC's own _mm512_undefined_*() trips this warning inside some intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+	namespace simd_avx512
+	{
+		MID_TARGET("avx512f,avx512bw,avx512vl")
+		inline void mark_degenerate(const glm::ivec3* faces, size_t begin, size_t end, const glm::vec3* points, uint8_t* degenerate)
+		{
+			size_t i = begin;
+			for (; i + 16 <= end; i += 16)
+			{
+				alignas(64) float ax[16], ay[16], az[16], bx[16], by[16], bz[16], cx[16], cy[16], cz[16];
+				for (int k = 0; k < 16; k++)
+				{
+					const glm::vec3& a = points[faces[i + k].x];
+					const glm::vec3& b = points[faces[i + k].y];
+					const glm::vec3& c = points[faces[i + k].z];
+					ax[k] = a.x; ay[k] = a.y; az[k] = a.z;
+					bx[k] = b.x; by[k] = b.y; bz[k] = b.z;
+					cx[k] = c.x; cy[k] = c.y; cz[k] = c.z;
+				}
+				__m512 e1x = _mm512_sub_ps(_mm512_load_ps(bx), _mm512_load_ps(ax));
+				__m512 e1y = _mm512_sub_ps(_mm512_load_ps(by), _mm512_load_ps(ay));
+				__m512 e1z = _mm512_sub_ps(_mm512_load_ps(bz), _mm512_load_ps(az));
+				__m512 e2x = _mm512_sub_ps(_mm512_load_ps(cx), _mm512_load_ps(ax));
+				__m512 e2y = _mm512_sub_ps(_mm512_load_ps(cy), _mm512_load_ps(ay));
+				__m512 e2z = _mm512_sub_ps(_mm512_load_ps(cz), _mm512_load_ps(az));
+
+				__m512 nx = _mm512_sub_ps(_mm512_mul_ps(e1y, e2z), _mm512_mul_ps(e1z, e2y));
+				__m512 ny = _mm512_sub_ps(_mm512_mul_ps(e1z, e2x), _mm512_mul_ps(e1x, e2z));
+				__m512 nz = _mm512_sub_ps(_mm512_mul_ps(e1x, e2y), _mm512_mul_ps(e1y, e2x));
+
+				__m512 n2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(nx, nx), _mm512_mul_ps(ny, ny)), _mm512_mul_ps(nz, nz));
+				__m512 l1 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, e1x), _mm512_mul_ps(e1y, e1y)), _mm512_mul_ps(e1z, e1z));
+				__m512 l2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, e2x), _mm512_mul_ps(e2y, e2y)), _mm512_mul_ps(e2z, e2z));
+				__m512 limit = _mm512_mul_ps(_mm512_mul_ps(_mm512_set1_ps(degenerate_sin2_epsilon), l1), l2);
+
+				__mmask16 mask = _mm512_cmp_ps_mask(n2, limit, _CMP_LE_OQ);
+				_mm_storeu_si128((__m128i*)(degenerate + i), _mm_maskz_set1_epi8(mask, 1));
+			}
+			simd_scalar::mark_degenerate(faces, i, end, points, degenerate);
+		}
+
+		MID_TARGET("avx512f,avx512bw,avx512vl")
+		inline void minmax_vec3(const float* data, size_t count, float* min_v, float* max_v)
+		{
+			__m512 mn[3], mx[3];
+			for (int r = 0; r < 3; r++)
+			{
+				mn[r] = _mm512_set1_ps(FLT_MAX);
+				mx[r] = _mm512_set1_ps(-FLT_MAX);
+			}
+			size_t i = 0;
+			for (; i + 16 <= count; i += 16)
+			{
+				for (int r = 0; r < 3; r++)
+				{
+					__m512 v = _mm512_loadu_ps(data + i * 3 + r * 16);
+					mn[r] = _mm512_min_ps(v, mn[r]);
+					mx[r] = _mm512_max_ps(v, mx[r]);
+				}
+			}
+			simd_scalar::minmax_vec3(data + i * 3, count - i, min_v, max_v);
+
+			float lanes_mn[48], lanes_mx[48];
+			for (int r = 0; r < 3; r++)
+			{
+				_mm512_storeu_ps(lanes_mn + r * 16, mn[r]);
+				_mm512_storeu_ps(lanes_mx + r * 16, mx[r]);
+			}
+			for (int k = 0; k < 48; k++)
+			{
+				min_v[k % 3] = lanes_mn[k] < min_v[k % 3] ? lanes_mn[k] : min_v[k % 3];
+				max_v[k % 3] = lanes_mx[k] > max_v[k % 3] ? lanes_mx[k] : max_v[k % 3];
+			}
+		}
+
+		MID_TARGET("avx512f,avx512bw,avx512vl")
+		inline size_t count_nonfinite(const float* data, size_t count)
+		{
+			const __m512i exp_mask = _mm512_set1_epi32(0x7f800000);
+			size_t ret = 0;
+			size_t i = 0;
+			for (; i + 16 <= count; i += 16)
+			{
+				__m512i v = _mm512_and_si512(_mm512_loadu_si512(data + i), exp_mask);
+				unsigned mask = (unsigned)_mm512_cmpeq_epi32_mask(v, exp_mask);
+				for (; mask != 0; mask &= mask - 1) ret++;
+			}
+			return ret + simd_scalar::count_nonfinite(data + i, count - i);
+		}
+
+		MID_TARGET("avx512f,avx512bw,avx512vl")
+		inline uint32_t max_u32(const uint32_t* data, size_t count)
+		{
+			__m512i mx = _mm512_setzero_si512();
+			size_t i = 0;
+			for (; i + 16 <= count; i += 16)
+			{
+				mx = _mm512_max_epu32(mx, _mm512_loadu_si512(data + i));
+			}
+			alignas(64) uint32_t lanes[16];
+			_mm512_store_si512(lanes, mx);
+			uint32_t ret = simd_scalar::max_u32(data + i, count - i);
+			return simd_scalar::max_u32(lanes, 16) > ret ? simd_scalar::max_u32(lanes, 16) : ret;
+		}
+	}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+	inline SimdKernels MakeKernels(Isa isa)
+	{
+		SimdKernels k;
+		k.crc64 = ::crc64;
+		k.mark_degenerate = simd_scalar::mark_degenerate;
+		k.minmax_vec3 = simd_scalar::minmax_vec3;
+		k.count_nonfinite = simd_scalar::count_nonfinite;
+		k.max_u32 = simd_scalar::max_u32;
+		k.rgba_to_ycbcr = simd_scalar::rgba_to_ycbcr;
+		k.fdct8x8 = simd_scalar::fdct8x8;
+		k.quantize = simd_scalar::quantize;
+#ifdef MID_SIMD_X86
+		if (isa >= Isa::SSE4)
+		{
+			k.crc64 = simd_sse4::crc64;
+			k.mark_degenerate = simd_sse4::mark_degenerate;
+			k.minmax_vec3 = simd_sse4::minmax_vec3;
+			k.count_nonfinite = simd_sse4::count_nonfinite;
+			k.max_u32 = simd_sse4::max_u32;
+			k.rgba_to_ycbcr = simd_sse4::rgba_to_ycbcr;
+			k.fdct8x8 = simd_sse4::fdct8x8;
+			k.quantize = simd_sse4::quantize;
+		}
+		if (isa >= Isa::AVX2)
+		{
+			k.mark_degenerate = simd_avx2::mark_degenerate;
+			k.minmax_vec3 = simd_avx2::minmax_vec3;
+			k.count_nonfinite = simd_avx2::count_nonfinite;
+			k.max_u32 = simd_avx2::max_u32;
+			k.rgba_to_ycbcr = simd_avx2::rgba_to_ycbcr;
+			k.fdct8x8 = simd_avx2::fdct8x8;
+			k.quantize = simd_avx2::quantize;
+		}
+		if (isa >= Isa::AVX512)
+		{
+			k.mark_degenerate = simd_avx512::mark_degenerate;
+			k.minmax_vec3 = simd_avx512::minmax_vec3;
+			k.count_nonfinite = simd_avx512::count_nonfinite;
+			k.max_u32 = simd_avx512::max_u32;
+		}
+#endif
+		return k;
+	}
+
+	struct SimdState
+	{
+		Isa isa = Isa::Scalar;
+		SimdKernels kernels = MakeKernels(Isa::Scalar);
+	};
+
+	inline SimdState& GetSimdState()
+	{
+		static SimdState state;
+		return state;
+	}
+
+	inline const SimdKernels& Simd()
+	{
+		return GetSimdState().kernels;
+	}
+
+	inline Isa CurrentIsa()
+	{
+		return GetSimdState().isa;
+	}
+
+	// Binds the kernel table; a request above what the machine supports is clamped to DetectIsa().
+	// Call before any worker threads use the kernels.
+	inline Isa SelectIsa(Isa isa)
+	{
+		Isa detected = DetectIsa();
+		if (isa > detected) isa = detected;
+		GetSimdState().isa = isa;
+		GetSimdState().kernels = MakeKernels(isa);
+		return isa;
+	}
+
+	// Runs every kernel family under every supported tier against the scalar reference on
+	// synthetic data, reporting mismatches to out. Returns true when all of them agree.
+	inline bool CheckKernels(FILE* out)
+	{
+		uint64_t seed = 0x9E3779B97F4A7C15ull;
+		auto next = [&seed]()
+		{
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			return seed;
+		};
+
+		std::vector<unsigned char> bytes(4099);
+		for (size_t i = 0; i < bytes.size(); i++)
+		{
+			bytes[i] = (unsigned char)next();
+		}
+
+		std::vector<glm::vec3> points(1027);
+		for (size_t i = 0; i < points.size(); i++)
+		{
+			// a coarse grid so that collinear and coincident corners turn up
+			points[i] = glm::vec3((float)(next() % 7), (float)(next() % 7), (float)(next() % 7)) * 0.25f - glm::vec3(0.5f);
+		}
+		std::vector<glm::ivec3> faces(1029);
+		for (size_t i = 0; i < faces.size(); i++)
+		{
+			faces[i] = glm::ivec3((int)(next() % points.size()), (int)(next() % points.size()), (int)(next() % points.size()));
+		}
+
+		// random bit patterns hit NaN and infinity exponents about once in 256 values
+		std::vector<float> floats(2053);
+		std::vector<uint32_t> words(floats.size());
+		for (size_t i = 0; i < floats.size(); i++)
+		{
+			words[i] = (uint32_t)next();
+			memcpy(&floats[i], &words[i], 4);
+		}
+
+		// level-shifted samples, including the extremes, and the divisors of quality 1-100 tables
+		std::vector<int16_t> samples(37 * 64);
+		for (size_t i = 0; i < samples.size(); i++)
+		{
+			samples[i] = (int16_t)((i < 64 ? (i & 1 ? 127 : -128) : (int)(next() % 256)) - (i < 64 ? 0 : 128));
+		}
+		float divisors[64];
+		for (int i = 0; i < 64; i++)
+		{
+			divisors[i] = (float)(8 * (1 + next() % 255));
+		}
+
+		SimdKernels ref = MakeKernels(Isa::Scalar);
+		std::vector<uint8_t> ref_degenerate(faces.size());
+		ref.mark_degenerate(faces.data(), 0, faces.size(), points.data(), ref_degenerate.data());
+
+		bool ok = true;
+		Isa detected = DetectIsa();
+		for (int t = (int)Isa::Scalar; t <= (int)detected; t++)
+		{
+			Isa isa = (Isa)t;
+			SimdKernels k = MakeKernels(isa);
+			bool isa_ok = true;
+
+			for (size_t len = 0; len < bytes.size(); len += 1 + len / 3)
+			{
+				size_t start = len % 5;
+				if (start + len > bytes.size()) break;
+				uint64_t init = next();
+				if (k.crc64(init, bytes.data() + start, len) != ref.crc64(init, bytes.data() + start, len))
+				{
+					fprintf(out, "%s: crc64 mismatch at length %zu\n", IsaName(isa), len);
+					isa_ok = false;
+					break;
+				}
+			}
+
+			for (size_t begin = 0; begin < 5; begin++)
+			{
+				std::vector<uint8_t> degenerate(faces.size(), 2);
+				k.mark_degenerate(faces.data(), begin, faces.size(), points.data(), degenerate.data());
+				if (memcmp(degenerate.data() + begin, ref_degenerate.data() + begin, faces.size() - begin) != 0)
+				{
+					fprintf(out, "%s: mark_degenerate mismatch from face %zu\n", IsaName(isa), begin);
+					isa_ok = false;
+					break;
+				}
+			}
+
+			for (size_t count = 0; count <= points.size(); count += 1 + count / 2)
+			{
+				float mn[3], mx[3], ref_mn[3], ref_mx[3];
+				k.minmax_vec3((const float*)points.data(), count, mn, mx);
+				ref.minmax_vec3((const float*)points.data(), count, ref_mn, ref_mx);
+				if (mn[0] != ref_mn[0] || mn[1] != ref_mn[1] || mn[2] != ref_mn[2] ||
+					mx[0] != ref_mx[0] || mx[1] != ref_mx[1] || mx[2] != ref_mx[2])
+				{
+					fprintf(out, "%s: minmax_vec3 mismatch at count %zu\n", IsaName(isa), count);
+					isa_ok = false;
+					break;
+				}
+			}
+
+			for (size_t count = 0; count <= floats.size(); count += 1 + count / 2)
+			{
+				if (k.count_nonfinite(floats.data(), count) != ref.count_nonfinite(floats.data(), count))
+				{
+					fprintf(out, "%s: count_nonfinite mismatch at count %zu\n", IsaName(isa), count);
+					isa_ok = false;
+					break;
+				}
+				if (k.max_u32(words.data(), count) != ref.max_u32(words.data(), count))
+				{
+					fprintf(out, "%s: max_u32 mismatch at count %zu\n", IsaName(isa), count);
+					isa_ok = false;
+					break;
+				}
+			}
+
+			for (size_t count = 0; count <= 1000; count += 1 + count / 2)
+			{
+				std::vector<int16_t> planes(count * 6, 0), ref_planes(count * 6, 0);
+				k.rgba_to_ycbcr(bytes.data() + 3, count, planes.data(), planes.data() + count * 2, planes.data() + count * 4);
+				ref.rgba_to_ycbcr(bytes.data() + 3, count, ref_planes.data(), ref_planes.data() + count * 2, ref_planes.data() + count * 4);
+				if (planes != ref_planes)
+				{
+					fprintf(out, "%s: rgba_to_ycbcr mismatch at count %zu\n", IsaName(isa), count);
+					isa_ok = false;
+					break;
+				}
+			}
+
+			{
+				size_t count = samples.size() / 64;
+				std::vector<int16_t> coefs(samples.size()), ref_coefs(samples.size());
+				k.fdct8x8(samples.data(), count, coefs.data());
+				ref.fdct8x8(samples.data(), count, ref_coefs.data());
+				if (coefs != ref_coefs)
+				{
+					fprintf(out, "%s: fdct8x8 mismatch\n", IsaName(isa));
+					isa_ok = false;
+				}
+				std::vector<int16_t> quantized(samples.size()), ref_quantized(samples.size());
+				k.quantize(ref_coefs.data(), count, divisors, quantized.data());
+				ref.quantize(ref_coefs.data(), count, divisors, ref_quantized.data());
+				if (quantized != ref_quantized)
+				{
+					fprintf(out, "%s: quantize mismatch\n", IsaName(isa));
+					isa_ok = false;
+				}
+			}
+
+			fprintf(out, "%s: %s\n", IsaName(isa), isa_ok ? "ok" : "FAILED");
+			ok = ok && isa_ok;
+		}
+		return ok;
+	}
+}
@@ -0,0 +1,479 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <glm.hpp>
+
+#include "ThreadPool.h"
+
+// Export-time Catmull-Clark subdivision of polygon meshes, applied before triangulation.
+namespace Mid
+{
+	struct SubdivOptions
+	{
+		// fixed number of levels
+		int levels = 0;
+		// when non-zero, the most levels (up to max_levels) whose triangle count stays within this
+		size_t target_triangles = 0;
+
+		static constexpr int max_levels = 6;
+	};
+
+	// Number of levels to apply to a cage with the given face sizes.
+	inline int SubdivLevels(const SubdivOptions& options, const std::vector<int>& face_counts)
+	{
+		if (options.target_triangles == 0) return std::min(std::max(options.levels, 0), SubdivOptions::max_levels);
+
+		// every level-1 quad becomes 4 quads, 2 triangles each
+		size_t corners = 0;
+		for (size_t i = 0; i < face_counts.size(); i++)
+		{
+			if (face_counts[i] >= 3) corners += (size_t)face_counts[i];
+		}
+		int levels = 0;
+		size_t triangles = corners * 2;
+		while (levels < SubdivOptions::max_levels && triangles <= options.target_triangles)
+		{
+			levels++;
+			triangles *= 4;
+		}
+		return levels;
+	}
+
+	// One refinement level as a table of stencils, built once from the topology and applied to every
+	// stream. Fine vertex i is the sum of weights[k] * coarse[indices[k]] over k in
+	// [offsets[i], offsets[i + 1]); fine vertices are the coarse vertex points, then one face point per
+	// face, then one edge point per edge. Face-varying data uses fv_* the same way over face-vertex
+	// slots, interpolated linearly inside each face (OpenSubdiv's "linear all" face-varying rule), so
+	// UV seams need no extra topology.
+	// Boundary edges and vertices follow the crease rules with corners (vertices of a single face) kept
+	// in place, as for USD's default "edgeAndCorner" boundary interpolation. Non-manifold edges are
+	// treated as boundaries.
+	struct SubdivLevel
+	{
+		size_t num_coarse = 0;
+		size_t num_coarse_slots = 0;
+
+		std::vector<uint32_t> offsets;
+		std::vector<uint32_t> indices;
+		std::vector<float> weights;
+
+		std::vector<uint32_t> fv_offsets;
+		std::vector<uint32_t> fv_indices;
+		std::vector<float> fv_weights;
+
+		// refined topology, quads only
+		std::vector<int> face_counts;
+		std::vector<int> face_indices;
+
+		size_t num_fine() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+		size_t num_fine_slots() const { return fv_offsets.empty() ? 0 : fv_offsets.size() - 1; }
+	};
+
+	// Faces with fewer than 3 vertices or out-of-range indices are left out of the refined mesh.
+	inline void BuildSubdivLevel(ThreadPool& pool, size_t num_verts, const std::vector<int>& face_counts, const std::vector<int>& face_indices, SubdivLevel& level)
+	{
+		level.num_coarse = num_verts;
+		level.num_coarse_slots = face_indices.size();
+
+		// coarse faces kept, with the first slot of each
+		std::vector<uint32_t> face_slot;
+		std::vector<uint32_t> face_size;
+		{
+			size_t slot = 0;
+			for (size_t f = 0; f < face_counts.size(); f++)
+			{
+				size_t k = (size_t)std::max(face_counts[f], 0);
+				bool valid = k >= 3 && slot + k <= face_indices.size();
+				for (size_t j = 0; valid && j < k; j++)
+				{
+					valid = face_indices[slot + j] >= 0 && (size_t)face_indices[slot + j] < num_verts;
+				}
+				if (valid)
+				{
+					face_slot.push_back((uint32_t)slot);
+					face_size.push_back((uint32_t)k);
+				}
+				slot += k;
+			}
+		}
+		size_t num_faces = face_slot.size();
+
+		// corners of the kept faces, face by face; corner c belongs to face corner_face[c]
+		std::vector<uint32_t> face_corner(num_faces + 1, 0);
+		for (size_t f = 0; f < num_faces; f++) face_corner[f + 1] = face_corner[f] + face_size[f];
+		size_t num_corners = face_corner[num_faces];
+		std::vector<uint32_t> corner_face(num_corners);
+		for (size_t f = 0; f < num_faces; f++)
+		{
+			for (uint32_t c = face_corner[f]; c < face_corner[f + 1]; c++) corner_face[c] = (uint32_t)f;
+		}
+		auto corner_vert = [&](size_t c) { return (uint32_t)face_indices[face_slot[corner_face[c]] + (c - face_corner[corner_face[c]])]; };
+		auto next_corner = [&](size_t c) { size_t f = corner_face[c]; return c + 1 < face_corner[f + 1] ? c + 1 : (size_t)face_corner[f]; };
+		auto prev_corner = [&](size_t c) { size_t f = corner_face[c]; return c > face_corner[f] ? c - 1 : (size_t)face_corner[f + 1] - 1; };
+
+		// edges from the corner -> next corner sides, numbered in (min, max) vertex order
+		std::vector<std::pair<uint64_t, uint32_t>> sides(num_corners);
+		pool.parallel_for(num_corners, [&](size_t c)
+			{
+				uint64_t a = corner_vert(c);
+				uint64_t b = corner_vert(next_corner(c));
+				sides[c] = { std::min(a, b) << 32 | std::max(a, b), (uint32_t)c };
+			}, 4096);
+		std::sort(sides.begin(), sides.end());
+
+		std::vector<uint32_t> corner_edge(num_corners);
+		// corners bordering each edge, in sides[edge_side[e] .. edge_side[e + 1])
+		std::vector<uint32_t> edge_side;
+		for (size_t i = 0; i < num_corners; i++)
+		{
+			if (i == 0 || sides[i].first != sides[i - 1].first) edge_side.push_back((uint32_t)i);
+			corner_edge[sides[i].second] = (uint32_t)edge_side.size() - 1;
+		}
+		size_t num_edges = edge_side.size();
+		edge_side.push_back((uint32_t)num_corners);
+		auto edge_v0 = [&](size_t e) { return (uint32_t)(sides[edge_side[e]].first >> 32); };
+		auto edge_v1 = [&](size_t e) { return (uint32_t)(sides[edge_side[e]].first & 0xffffffffu); };
+		auto edge_smooth = [&](size_t e) { return edge_side[e + 1] - edge_side[e] == 2; };
+
+		// vertex -> corners and vertex -> edges
+		std::vector<uint32_t> vert_corner(num_verts + 1, 0);
+		std::vector<uint32_t> vert_edge(num_verts + 1, 0);
+		for (size_t c = 0; c < num_corners; c++) vert_corner[corner_vert(c) + 1]++;
+		for (size_t e = 0; e < num_edges; e++)
+		{
+			vert_edge[edge_v0(e) + 1]++;
+			vert_edge[edge_v1(e) + 1]++;
+		}
+		for (size_t v = 0; v < num_verts; v++)
+		{
+			vert_corner[v + 1] += vert_corner[v];
+			vert_edge[v + 1] += vert_edge[v];
+		}
+		std::vector<uint32_t> corners_of(num_corners);
+		std::vector<uint32_t> edges_of(num_edges * 2);
+		{
+			std::vector<uint32_t> fill(vert_corner.begin(), vert_corner.end() - 1);
+			for (size_t c = 0; c < num_corners; c++) corners_of[fill[corner_vert(c)]++] = (uint32_t)c;
+			fill.assign(vert_edge.begin(), vert_edge.end() - 1);
+			for (size_t e = 0; e < num_edges; e++)
+			{
+				edges_of[fill[edge_v0(e)]++] = (uint32_t)e;
+				edges_of[fill[edge_v1(e)]++] = (uint32_t)e;
+			}
+		}
+
+		enum VertexRule : uint8_t { Fixed, Smooth, Boundary };
+		auto vertex_rule = [&](size_t v)
+		{
+			size_t n_edges = vert_edge[v + 1] - vert_edge[v];
+			size_t n_faces = vert_corner[v + 1] - vert_corner[v];
+			size_t n_boundary = 0;
+			for (uint32_t i = vert_edge[v]; i < vert_edge[v + 1]; i++)
+			{
+				if (!edge_smooth(edges_of[i])) n_boundary++;
+			}
+			if (n_faces == 0) return Fixed;
+			if (n_boundary == 0) return n_edges == n_faces && n_edges >= 3 ? Smooth : Fixed;
+			return n_boundary == 2 && n_faces >= 2 ? Boundary : Fixed;
+		};
+
+		size_t num_fine = num_verts + num_faces + num_edges;
+		level.offsets.assign(num_fine + 1, 0);
+		pool.parallel_for(num_fine, [&](size_t i)
+			{
+				uint32_t size = 1;
+				if (i < num_verts)
+				{
+					VertexRule rule = vertex_rule(i);
+					if (rule == Boundary)
+					{
+						size = 3;
+					}
+					else if (rule == Smooth)
+					{
+						size = 1 + 2 * (vert_edge[i + 1] - vert_edge[i]);
+						for (uint32_t k = vert_corner[i]; k < vert_corner[i + 1]; k++) size += face_size[corner_face[corners_of[k]]];
+					}
+				}
+				else if (i < num_verts + num_faces)
+				{
+					size = face_size[i - num_verts];
+				}
+				else
+				{
+					size_t e = i - num_verts - num_faces;
+					size = 2;
+					if (edge_smooth(e))
+					{
+						size += face_size[corner_face[sides[edge_side[e]].second]] + face_size[corner_face[sides[edge_side[e] + 1].second]];
+					}
+				}
+				level.offsets[i + 1] = size;
+			}, 1024);
+		for (size_t i = 0; i < num_fine; i++) level.offsets[i + 1] += level.offsets[i];
+		level.indices.resize(level.offsets[num_fine]);
+		level.weights.resize(level.offsets[num_fine]);
+
+		pool.parallel_for(num_fine, [&](size_t i)
+			{
+				uint32_t* idx = level.indices.data() + level.offsets[i];
+				float* w = level.weights.data() + level.offsets[i];
+				auto add_face = [&](size_t f, float weight)
+				{
+					uint32_t k = face_size[f];
+					for (uint32_t j = 0; j < k; j++)
+					{
+						*idx++ = (uint32_t)face_indices[face_slot[f] + j];
+						*w++ = weight / (float)k;
+					}
+				};
+
+				if (i < num_verts)
+				{
+					VertexRule rule = vertex_rule(i);
+					if (rule == Smooth)
+					{
+						// (F + 2R + (n - 3)P) / n with F the mean face point and R the mean edge midpoint
+						float n = (float)(vert_edge[i + 1] - vert_edge[i]);
+						for (uint32_t k = vert_corner[i]; k < vert_corner[i + 1]; k++) add_face(corner_face[corners_of[k]], 1.0f / (n * n));
+						for (uint32_t k = vert_edge[i]; k < vert_edge[i + 1]; k++)
+						{
+							uint32_t e = edges_of[k];
+							*idx++ = edge_v0(e);
+							*w++ = 1.0f / (n * n);
+							*idx++ = edge_v1(e);
+							*w++ = 1.0f / (n * n);
+						}
+						*idx++ = (uint32_t)i;
+						*w++ = (n - 3.0f) / n;
+					}
+					else if (rule == Boundary)
+					{
+						*idx++ = (uint32_t)i;
+						*w++ = 0.75f;
+						for (uint32_t k = vert_edge[i]; k < vert_edge[i + 1]; k++)
+						{
+							uint32_t e = edges_of[k];
+							if (edge_smooth(e)) continue;
+							*idx++ = edge_v0(e) == (uint32_t)i ? edge_v1(e) : edge_v0(e);
+							*w++ = 0.125f;
+						}
+					}
+					else
+					{
+						*idx++ = (uint32_t)i;
+						*w++ = 1.0f;
+					}
+				}
+				else if (i < num_verts + num_faces)
+				{
+					add_face(i - num_verts, 1.0f);
+				}
+				else
+				{
+					size_t e = i - num_verts - num_faces;
+					bool smooth = edge_smooth(e);
+					float vw = smooth ? 0.25f : 0.5f;
+					*idx++ = edge_v0(e);
+					*w++ = vw;
+					*idx++ = edge_v1(e);
+					*w++ = vw;
+					if (smooth)
+					{
+						add_face(corner_face[sides[edge_side[e]].second], 0.25f);
+						add_face(corner_face[sides[edge_side[e] + 1].second], 0.25f);
+					}
+				}
+			}, 1024);
+
+		// each coarse corner becomes the quad (vertex, next edge, face, previous edge)
+		level.face_counts.assign(num_corners, 4);
+		level.face_indices.resize(num_corners * 4);
+		level.fv_offsets.resize(num_corners * 4 + 1);
+		level.fv_offsets[0] = 0;
+		for (size_t c = 0; c < num_corners; c++)
+		{
+			uint32_t k = face_size[corner_face[c]];
+			uint32_t* o = level.fv_offsets.data() + c * 4;
+			o[1] = o[0] + 1;
+			o[2] = o[1] + 2;
+			o[3] = o[2] + k;
+			o[4] = o[3] + 2;
+		}
+		level.fv_indices.resize(level.fv_offsets.back());
+		level.fv_weights.resize(level.fv_offsets.back());
+		pool.parallel_for(num_corners, [&](size_t c)
+			{
+				size_t f = corner_face[c];
+				size_t first = face_corner[f];
+				size_t cn = next_corner(c);
+				size_t cp = prev_corner(c);
+				auto slot = [&](size_t corner) { return (uint32_t)(face_slot[f] + (corner - first)); };
+
+				int* q = level.face_indices.data() + c * 4;
+				q[0] = (int)corner_vert(c);
+				q[1] = (int)(num_verts + num_faces + corner_edge[c]);
+				q[2] = (int)(num_verts + f);
+				q[3] = (int)(num_verts + num_faces + corner_edge[cp]);
+
+				uint32_t* idx = level.fv_indices.data() + level.fv_offsets[c * 4];
+				float* w = level.fv_weights.data() + level.fv_offsets[c * 4];
+				*idx++ = slot(c);
+				*w++ = 1.0f;
+				*idx++ = slot(c);
+				*w++ = 0.5f;
+				*idx++ = slot(cn);
+				*w++ = 0.5f;
+				uint32_t k = face_size[f];
+				for (uint32_t j = 0; j < k; j++)
+				{
+					*idx++ = face_slot[f] + j;
+					*w++ = 1.0f / (float)k;
+				}
+				*idx++ = slot(cp);
+				*w++ = 0.5f;
+				*idx++ = slot(c);
+				*w++ = 0.5f;
+			}, 1024);
+	}
+
+	// Applies a stencil table to a stream of float tuples (positions, normals, UVs, morph offsets),
+	// or of 8-bit colors.
+	template<typename T>
+	inline void ApplySubdivStencils(ThreadPool& pool, const std::vector<uint32_t>& offsets, const std::vector<uint32_t>& indices,
+		const std::vector<float>& weights, std::vector<T>& stream)
+	{
+		size_t num_fine = offsets.size() - 1;
+		std::vector<T> out(num_fine);
+		pool.parallel_for(num_fine, [&](size_t i)
+			{
+				if constexpr (std::is_same<T, glm::u8vec4>::value)
+				{
+					glm::vec4 sum(0.0f);
+					for (uint32_t k = offsets[i]; k < offsets[i + 1]; k++) sum += weights[k] * glm::vec4(stream[indices[k]]);
+					out[i] = glm::u8vec4(glm::clamp(sum + 0.5f, 0.0f, 255.0f));
+				}
+				else
+				{
+					static_assert(sizeof(T) % sizeof(float) == 0, "stream elements must be float tuples");
+					constexpr int n = (int)(sizeof(T) / sizeof(float));
+					float sum[n] = {};
+					for (uint32_t k = offsets[i]; k < offsets[i + 1]; k++)
+					{
+						const float* src = (const float*)&stream[indices[k]];
+						for (int j = 0; j < n; j++) sum[j] += weights[k] * src[j];
+					}
+					memcpy(&out[i], sum, sizeof(T));
+				}
+			}, 1024);
+		stream.swap(out);
+	}
+
+	// Per-vertex stream; one whose size does not match the coarse vertices is dropped.
+	template<typename T>
+	inline void RefineVertexStream(ThreadPool& pool, const SubdivLevel& level, std::vector<T>& stream)
+	{
+		if (stream.size() != level.num_coarse)
+		{
+			stream.clear();
+			return;
+		}
+		ApplySubdivStencils(pool, level.offsets, level.indices, level.weights, stream);
+	}
+
+	// Per face-vertex stream, in faceVertexIndices order.
+	template<typename T>
+	inline void RefineFaceVaryingStream(ThreadPool& pool, const SubdivLevel& level, std::vector<T>& stream)
+	{
+		if (stream.size() != level.num_coarse_slots)
+		{
+			stream.clear();
+			return;
+		}
+		ApplySubdivStencils(pool, level.fv_offsets, level.fv_indices, level.fv_weights, stream);
+	}
+
+	// A fine vertex is set when any vertex it is made from is (blend shape point lists).
+	inline void RefineVertexFlags(ThreadPool& pool, const SubdivLevel& level, std::vector<bool>& flags)
+	{
+		if (flags.size() != level.num_coarse)
+		{
+			flags.clear();
+			return;
+		}
+		size_t num_fine = level.num_fine();
+		std::vector<uint8_t> out(num_fine, 0);
+		pool.parallel_for(num_fine, [&](size_t i)
+			{
+				for (uint32_t k = level.offsets[i]; k < level.offsets[i + 1] && !out[i]; k++) out[i] = flags[level.indices[k]] ? 1 : 0;
+			}, 1024);
+		flags.assign(out.begin(), out.end());
+	}
+
+	// Skin influences are blended per joint with the vertex stencils; the 4 strongest are kept and
+	// renormalized.
+	inline void RefineSkinWeights(ThreadPool& pool, const SubdivLevel& level, std::vector<glm::u16vec4>& joints, std::vector<glm::vec4>& weights)
+	{
+		if (joints.size() != level.num_coarse || weights.size() != level.num_coarse)
+		{
+			joints.clear();
+			weights.clear();
+			return;
+		}
+		size_t num_fine = level.num_fine();
+		std::vector<glm::u16vec4> joints_out(num_fine);
+		std::vector<glm::vec4> weights_out(num_fine);
+		pool.parallel_for(num_fine, [&](size_t i)
+			{
+				const int max_joints = 32;
+				uint16_t ids[max_joints];
+				float sums[max_joints];
+				int count = 0;
+				for (uint32_t k = level.offsets[i]; k < level.offsets[i + 1]; k++)
+				{
+					uint32_t v = level.indices[k];
+					for (int j = 0; j < 4; j++)
+					{
+						float w = level.weights[k] * weights[v][j];
+						if (w == 0.0f) continue;
+						int m = 0;
+						while (m < count && ids[m] != joints[v][j]) m++;
+						if (m == count)
+						{
+							if (count == max_joints) continue;
+							ids[count] = joints[v][j];
+							sums[count] = 0.0f;
+							count++;
+						}
+						sums[m] += w;
+					}
+				}
+
+				glm::u16vec4 jo(0);
+				glm::vec4 wo(0.0f);
+				for (int j = 0; j < 4; j++)
+				{
+					int best = -1;
+					for (int m = 0; m < count; m++)
+					{
+						if (sums[m] > 0.0f && (best < 0 || sums[m] > sums[best])) best = m;
+					}
+					if (best < 0) break;
+					jo[j] = ids[best];
+					wo[j] = sums[best];
+					sums[best] = 0.0f;
+				}
+				float total = wo.x + wo.y + wo.z + wo.w;
+				if (total > 0.0f) wo = wo * (1.0f / total);
+				joints_out[i] = jo;
+				weights_out[i] = wo;
+			}, 1024);
+		joints.swap(joints_out);
+		weights.swap(weights_out);
+	}
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "Simd.h"
+#include "ThreadPool.h"
+
+// Textures written next to the .gltf instead of into its buffer. Files are named by the hash of
+// their bytes, so a texture shared by several materials, or already written by an earlier
+// conversion into the same directory, costs no I/O.
+namespace Mid
+{
+	inline std::string TextureFileName(const std::vector<uint8_t>& code, const std::string& mime_type)
+	{
+		const char* ext = "bin";
+		if (mime_type == "image/png") ext = "png";
+		else if (mime_type == "image/jpeg") ext = "jpg";
+		else if (mime_type == "image/webp") ext = "webp";
+		char name[64];
+		snprintf(name, sizeof(name), "%016llx.%s", (unsigned long long)Simd().crc64(0, code.data(), code.size()), ext);
+		return name;
+	}
+
+	// Copy-on-write clone of src into dst (FICLONE on btrfs/XFS), false where unsupported.
+	inline bool CloneFile(const std::string& src, const std::string& dst)
+	{
+#if defined(__linux__) && defined(FICLONE)
+		int fd_src = open(src.c_str(), O_RDONLY);
+		if (fd_src < 0) return false;
+		int fd_dst = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd_dst < 0)
+		{
+			close(fd_src);
+			return false;
+		}
+		bool ok = ioctl(fd_dst, FICLONE, fd_src) == 0;
+		close(fd_dst);
+		close(fd_src);
+		if (!ok) unlink(dst.c_str());
+		return ok;
+#else
+		(void)src;
+		(void)dst;
+		return false;
+#endif
+	}
+
+	// Name next to dst that no other thread or process picks at the same time: the pid tells
+	// conversions writing into one directory apart, the counter the tasks of this one.
+	inline std::string TempFileName(const std::filesystem::path& dst)
+	{
+		static std::atomic<uint64_t> counter(0);
+#ifdef _WIN32
+		int pid = _getpid();
+#else
+		int pid = (int)getpid();
+#endif
+		return dst.u8string() + ".tmp" + std::to_string(pid) + "." + std::to_string(counter++);
+	}
+
+	inline bool WriteBytes(const std::string& path, const std::vector<uint8_t>& code)
+	{
+		FILE* fp = fopen(path.c_str(), "wb");
+		if (fp == nullptr) return false;
+		bool ok = fwrite(code.data(), 1, code.size(), fp) == code.size();
+		return fclose(fp) == 0 && ok;
+	}
+
+	struct TextureFile
+	{
+		std::string name;
+		const std::vector<uint8_t>* code = nullptr;
+		// file the bytes were loaded from unchanged, empty for encoded textures
+		std::string source;
+	};
+
+	class TextureFileSet
+	{
+	public:
+		// Name under which the bytes will be written; the same bytes are only written once.
+		std::string add(const std::vector<uint8_t>& code, const std::string& mime_type, const std::string& source)
+		{
+			std::string name = TextureFileName(code, mime_type);
+			for (size_t i = 0; i < files.size(); i++)
+			{
+				if (files[i].name == name)
+				{
+					if (files[i].source.empty()) files[i].source = source;
+					return name;
+				}
+			}
+			TextureFile file;
+			file.name = name;
+			file.code = &code;
+			file.source = source;
+			files.push_back(file);
+			return name;
+		}
+
+		// One file per task. A file already present with the right size is kept; sources are
+		// hardlinked, then reflinked, and only copied through memory when both fail. Each file
+		// goes to a temporary name first so concurrent conversions into one directory never see
+		// a partial texture.
+		bool write(const std::string& dir, ThreadPool& pool, std::vector<std::string>& errors) const
+		{
+			std::vector<std::string> failed(files.size());
+			pool.parallel_for(files.size(), [&](size_t i) {
+				const TextureFile& file = files[i];
+				std::filesystem::path dst = std::filesystem::path(dir) / file.name;
+				std::error_code ec;
+				if (std::filesystem::file_size(dst, ec) == file.code->size() && !ec) return;
+
+				std::string tmp = TempFileName(dst);
+				std::filesystem::remove(tmp, ec);
+				bool ok = false;
+				if (!file.source.empty())
+				{
+					std::filesystem::create_hard_link(file.source, tmp, ec);
+					ok = !ec;
+					if (!ok) ok = CloneFile(file.source, tmp);
+				}
+				if (!ok) ok = WriteBytes(tmp, *file.code);
+				if (ok)
+				{
+					std::filesystem::rename(tmp, dst, ec);
+					ok = !ec;
+				}
+				if (!ok)
+				{
+					std::filesystem::remove(tmp, ec);
+					failed[i] = dst.u8string();
+				}
+			});
+			bool ok = true;
+			for (size_t i = 0; i < failed.size(); i++)
+			{
+				if (failed[i].empty()) continue;
+				errors.push_back("cannot write " + failed[i]);
+				ok = false;
+			}
+			return ok;
+		}
+
+		std::vector<TextureFile> files;
+	};
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Mid
+{
+	// Fixed set of worker threads shared by every parallel stage of the converter.
+	// parallel_for() blocks until all iterations are done; the calling thread helps.
+	// Stages must write each iteration's result to its own slot and merge in index order, so the
+	// output never depends on the thread count or on which thread ran which iteration.
+	class ThreadPool
+	{
+	public:
+		ThreadPool(int num_threads = 0);
+		~ThreadPool();
+
+		int num_threads() const { return (int)workers.size() + 1; }
+
+		// Non-zero seeds a random delay before every grain, to shake out scheduling dependencies.
+		void set_jitter(unsigned int seed) { jitter_seed = seed; }
+
+		template<typename Func>
+		void parallel_for(size_t count, Func&& func, size_t grain = 1);
+
+	private:
+		std::vector<std::thread> workers;
+
+		std::mutex submit_mtx;
+		std::mutex mtx;
+		std::condition_variable cv_job;
+		std::condition_variable cv_done;
+		bool quit = false;
+
+		uint64_t job_serial = 0;
+		std::function<void()> job;
+		size_t pending = 0;
+		unsigned int jitter_seed = 0;
+
+		void worker_main();
+		void jitter(size_t begin);
+
+		static bool& in_job()
+		{
+			static thread_local bool flag = false;
+			return flag;
+		}
+	};
+
+	ThreadPool::ThreadPool(int num_threads)
+	{
+		if (num_threads <= 0)
+		{
+			num_threads = (int)std::thread::hardware_concurrency();
+			if (num_threads <= 0) num_threads = 1;
+		}
+		for (int i = 1; i < num_threads; i++)
+		{
+			workers.emplace_back(&ThreadPool::worker_main, this);
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			quit = true;
+		}
+		cv_job.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			workers[i].join();
+		}
+	}
+
+	void ThreadPool::worker_main()
+	{
+		in_job() = true;
+		uint64_t serial = 0;
+		while (true)
+		{
+			std::function<void()> my_job;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				cv_job.wait(lock, [&]() { return quit || job_serial != serial; });
+				if (quit) return;
+				serial = job_serial;
+				my_job = job;
+			}
+			my_job();
+			bool last;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				pending--;
+				last = pending == 0;
+			}
+			if (last) cv_done.notify_all();
+		}
+	}
+
+	void ThreadPool::jitter(size_t begin)
+	{
+		static thread_local uint64_t state = 0;
+		if (state == 0)
+		{
+			state = ((uint64_t)jitter_seed << 32) ^ (uint64_t)std::hash<std::thread::id>()(std::this_thread::get_id()) ^ begin;
+			if (state == 0) state = 1;
+		}
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		std::this_thread::sleep_for(std::chrono::microseconds(state % 200));
+	}
+
+	template<typename Func>
+	void ThreadPool::parallel_for(size_t count, Func&& func, size_t grain)
+	{
+		if (count == 0) return;
+		if (grain < 1) grain = 1;
+
+		// nested calls from inside a job run inline
+		if (workers.empty() || count <= grain || in_job())
+		{
+			for (size_t i = 0; i < count; i++) func(i);
+			return;
+		}
+
+		std::atomic<size_t> next(0);
+		auto run = [&]()
+		{
+			while (true)
+			{
+				size_t begin = next.fetch_add(grain);
+				if (begin >= count) break;
+				if (jitter_seed != 0) jitter(begin);
+				size_t end = begin + grain;
+				if (end > count) end = count;
+				for (size_t i = begin; i < end; i++) func(i);
+			}
+		};
+
+		std::unique_lock<std::mutex> submit_lock(submit_mtx);
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			job = run;
+			pending = workers.size();
+			job_serial++;
+		}
+		cv_job.notify_all();
+
+		in_job() = true;
+		run();
+		in_job() = false;
+
+		// every worker picks up every job, so the captured state stays alive until all have left run()
+		std::unique_lock<std::mutex> lock(mtx);
+		cv_done.wait(lock, [&]() { return pending == 0; });
+		job = nullptr;
+	}
+}
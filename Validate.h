@@ -0,0 +1,449 @@
+#pragma once
+
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <tiny_gltf.h>
+
+#include "ModelOps.h"
+#include "Simd.h"
+#include "ThreadPool.h"
+
+// Structural checks on the finished model, cheap enough to run on every conversion.
+namespace Mid
+{
+	// Tolerance on the per-vertex sum of all WEIGHTS_n sets.
+	const float weight_sum_epsilon = 1e-2f;
+
+	// Decoded location of an accessor's tightly packed or strided elements; base is null when the
+	// accessor has no valid bufferView.
+	struct AccessorSpan
+	{
+		const uint8_t* base = nullptr;
+		size_t stride = 0;
+		size_t elem_size = 0;
+	};
+
+	inline AccessorSpan GetAccessorSpan(const tinygltf::Model& model, const tinygltf::Accessor& acc)
+	{
+		AccessorSpan span;
+		int num_comp = tinygltf::GetNumComponentsInType(acc.type);
+		int comp_size = tinygltf::GetComponentSizeInBytes(acc.componentType);
+		if (num_comp <= 0 || comp_size <= 0) return span;
+		if (acc.bufferView < 0 || acc.bufferView >= (int)model.bufferViews.size()) return span;
+		const tinygltf::BufferView& view = model.bufferViews[acc.bufferView];
+		if (view.buffer < 0 || view.buffer >= (int)model.buffers.size()) return span;
+		span.elem_size = (size_t)(num_comp * comp_size);
+		span.stride = view.byteStride > 0 ? view.byteStride : span.elem_size;
+		size_t end = acc.count > 0 ? acc.byteOffset + span.stride * (acc.count - 1) + span.elem_size : acc.byteOffset;
+		if (end > view.byteLength || view.byteOffset + view.byteLength > model.buffers[view.buffer].data.size()) return span;
+		span.base = model.buffers[view.buffer].data.data() + view.byteOffset + acc.byteOffset;
+		return span;
+	}
+
+	inline bool CheckRange(const tinygltf::Model& model, int view_id, size_t offset, size_t length, std::string& error)
+	{
+		if (view_id < 0 || view_id >= (int)model.bufferViews.size())
+		{
+			error = "bufferView " + std::to_string(view_id) + " does not exist";
+			return false;
+		}
+		const tinygltf::BufferView& view = model.bufferViews[view_id];
+		if (offset + length > view.byteLength)
+		{
+			error = "reads " + std::to_string(offset + length) + " bytes from bufferView " + std::to_string(view_id) + " of " + std::to_string(view.byteLength);
+			return false;
+		}
+		return true;
+	}
+
+	inline void ValidateBufferView(const tinygltf::Model& model, int view_id, std::vector<std::string>& errors)
+	{
+		const tinygltf::BufferView& view = model.bufferViews[view_id];
+		std::string prefix = "bufferView " + std::to_string(view_id) + ": ";
+		if (view.buffer < 0 || view.buffer >= (int)model.buffers.size())
+		{
+			errors.push_back(prefix + "buffer " + std::to_string(view.buffer) + " does not exist");
+			return;
+		}
+		size_t buffer_size = model.buffers[view.buffer].data.size();
+		if (view.byteOffset + view.byteLength > buffer_size)
+		{
+			errors.push_back(prefix + "range " + std::to_string(view.byteOffset) + "+" + std::to_string(view.byteLength) + " exceeds buffer size " + std::to_string(buffer_size));
+		}
+		if (view.byteStride != 0 && (view.byteStride < 4 || view.byteStride > 252 || view.byteStride % 4 != 0))
+		{
+			errors.push_back(prefix + "byteStride " + std::to_string(view.byteStride) + " is not a multiple of 4 in [4, 252]");
+		}
+	}
+
+	inline void ValidateAccessor(const tinygltf::Model& model, int acc_id, std::vector<std::string>& errors)
+	{
+		const tinygltf::Accessor& acc = model.accessors[acc_id];
+		std::string prefix = "accessor " + std::to_string(acc_id) + ": ";
+		int num_comp = tinygltf::GetNumComponentsInType(acc.type);
+		int comp_size = tinygltf::GetComponentSizeInBytes(acc.componentType);
+		if (num_comp <= 0 || comp_size <= 0)
+		{
+			errors.push_back(prefix + "invalid type or componentType");
+			return;
+		}
+		if (acc.count < 1)
+		{
+			errors.push_back(prefix + "count is 0");
+		}
+		if (acc.minValues.size() > 0 && acc.minValues.size() != (size_t)num_comp)
+		{
+			errors.push_back(prefix + "min has " + std::to_string(acc.minValues.size()) + " components");
+		}
+		if (acc.maxValues.size() > 0 && acc.maxValues.size() != (size_t)num_comp)
+		{
+			errors.push_back(prefix + "max has " + std::to_string(acc.maxValues.size()) + " components");
+		}
+
+		if (acc.bufferView >= 0)
+		{
+			std::string error;
+			if (acc.bufferView >= (int)model.bufferViews.size())
+			{
+				errors.push_back(prefix + "bufferView " + std::to_string(acc.bufferView) + " does not exist");
+				return;
+			}
+			const tinygltf::BufferView& view = model.bufferViews[acc.bufferView];
+			if (acc.byteOffset % comp_size != 0 || view.byteOffset % comp_size != 0)
+			{
+				errors.push_back(prefix + "data is not aligned to its " + std::to_string(comp_size) + "-byte component size");
+			}
+			size_t elem_size = (size_t)(num_comp * comp_size);
+			size_t stride = view.byteStride > 0 ? view.byteStride : elem_size;
+			if (stride < elem_size)
+			{
+				errors.push_back(prefix + "byteStride " + std::to_string(stride) + " is smaller than the element size " + std::to_string(elem_size));
+			}
+			size_t length = acc.count > 0 ? stride * (acc.count - 1) + elem_size : 0;
+			if (!CheckRange(model, acc.bufferView, acc.byteOffset, length, error))
+			{
+				errors.push_back(prefix + error);
+				return;
+			}
+
+			AccessorSpan span = GetAccessorSpan(model, acc);
+			if (span.base != nullptr && acc.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT)
+			{
+				size_t nonfinite = 0;
+				if (span.stride == span.elem_size && ((uintptr_t)span.base & 3) == 0)
+				{
+					nonfinite = Simd().count_nonfinite((const float*)span.base, acc.count * num_comp);
+				}
+				else
+				{
+					for (size_t i = 0; i < acc.count; i++)
+					{
+						nonfinite += Simd().count_nonfinite((const float*)(span.base + i * span.stride), num_comp);
+					}
+				}
+				if (nonfinite > 0)
+				{
+					errors.push_back(prefix + std::to_string(nonfinite) + " NaN or infinite values");
+				}
+			}
+		}
+
+		if (acc.sparse.isSparse)
+		{
+			int idx_type = acc.sparse.indices.componentType;
+			if (idx_type != TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE && idx_type != TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT && idx_type != TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT)
+			{
+				errors.push_back(prefix + "sparse indices componentType " + std::to_string(idx_type) + " is not an unsigned integer");
+				return;
+			}
+			if (acc.sparse.count < 1 || (size_t)acc.sparse.count > acc.count)
+			{
+				errors.push_back(prefix + "sparse count " + std::to_string(acc.sparse.count) + " is outside [1, " + std::to_string(acc.count) + "]");
+				return;
+			}
+			int idx_size = tinygltf::GetComponentSizeInBytes(idx_type);
+			std::string error;
+			if (!CheckRange(model, acc.sparse.indices.bufferView, acc.sparse.indices.byteOffset, (size_t)acc.sparse.count * idx_size, error) ||
+				!CheckRange(model, acc.sparse.values.bufferView, acc.sparse.values.byteOffset, (size_t)acc.sparse.count * num_comp * comp_size, error))
+			{
+				errors.push_back(prefix + "sparse " + error);
+				return;
+			}
+
+			const tinygltf::BufferView& view_idx = model.bufferViews[acc.sparse.indices.bufferView];
+			if (view_idx.buffer < 0 || view_idx.buffer >= (int)model.buffers.size() || view_idx.byteOffset + view_idx.byteLength > model.buffers[view_idx.buffer].data.size())
+				return;
+			const uint8_t* p_idx = model.buffers[view_idx.buffer].data.data() + view_idx.byteOffset + acc.sparse.indices.byteOffset;
+			int64_t prev = -1;
+			for (int i = 0; i < acc.sparse.count; i++)
+			{
+				uint32_t idx = 0;
+				memcpy(&idx, p_idx + (size_t)i * idx_size, idx_size);
+				if ((int64_t)idx <= prev)
+				{
+					errors.push_back(prefix + "sparse indices are not strictly increasing at " + std::to_string(i));
+					break;
+				}
+				if (idx >= acc.count)
+				{
+					errors.push_back(prefix + "sparse index " + std::to_string(idx) + " is past count " + std::to_string(acc.count));
+					break;
+				}
+				prev = idx;
+			}
+		}
+	}
+
+	// Largest index of an index accessor; the caller has validated its range.
+	inline uint32_t MaxIndex(const tinygltf::Model& model, const tinygltf::Accessor& acc)
+	{
+		AccessorSpan span = GetAccessorSpan(model, acc);
+		if (span.base == nullptr) return 0;
+		if (acc.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT && span.stride == 4 && ((uintptr_t)span.base & 3) == 0)
+		{
+			return Simd().max_u32((const uint32_t*)span.base, acc.count);
+		}
+		uint32_t ret = 0;
+		for (size_t i = 0; i < acc.count; i++)
+		{
+			uint32_t v = 0;
+			memcpy(&v, span.base + i * span.stride, span.elem_size);
+			ret = v > ret ? v : ret;
+		}
+		return ret;
+	}
+
+	inline void ValidatePrimitive(const tinygltf::Model& model, const std::string& prefix, const tinygltf::Primitive& prim,
+		int num_joints, std::vector<std::string>& errors)
+	{
+		auto valid_accessor = [&](int acc_id) { return acc_id >= 0 && acc_id < (int)model.accessors.size(); };
+
+		auto pos_iter = prim.attributes.find("POSITION");
+		if (pos_iter == prim.attributes.end() || !valid_accessor(pos_iter->second))
+		{
+			errors.push_back(prefix + "has no POSITION accessor");
+			return;
+		}
+		size_t num_verts = model.accessors[pos_iter->second].count;
+
+		// compressed streams are only checked for their layout, their contents are not decoded here
+		bool compressed = false;
+		auto draco_iter = prim.extensions.find("KHR_draco_mesh_compression");
+		if (draco_iter != prim.extensions.end())
+		{
+			compressed = true;
+			const tinygltf::Value& view = draco_iter->second.Get("bufferView");
+			if (!view.IsInt() || view.Get<int>() < 0 || view.Get<int>() >= (int)model.bufferViews.size())
+			{
+				errors.push_back(prefix + "KHR_draco_mesh_compression has no valid bufferView");
+			}
+			const tinygltf::Value& attributes = draco_iter->second.Get("attributes");
+			for (const std::string& name : attributes.Keys())
+			{
+				if (prim.attributes.count(name) == 0)
+				{
+					errors.push_back(prefix + "KHR_draco_mesh_compression attribute " + name + " is not a primitive attribute");
+				}
+			}
+		}
+
+		for (auto iter = prim.attributes.begin(); iter != prim.attributes.end(); iter++)
+		{
+			if (!valid_accessor(iter->second))
+			{
+				errors.push_back(prefix + iter->first + " accessor " + std::to_string(iter->second) + " does not exist");
+				continue;
+			}
+			size_t count = model.accessors[iter->second].count;
+			if (count != num_verts)
+			{
+				errors.push_back(prefix + iter->first + " has " + std::to_string(count) + " elements, POSITION has " + std::to_string(num_verts));
+			}
+		}
+
+		for (size_t t = 0; t < prim.targets.size(); t++)
+		{
+			for (auto iter = prim.targets[t].begin(); iter != prim.targets[t].end(); iter++)
+			{
+				if (!valid_accessor(iter->second) || model.accessors[iter->second].count != num_verts)
+				{
+					errors.push_back(prefix + "target " + std::to_string(t) + " " + iter->first + " does not match the vertex count");
+				}
+			}
+		}
+
+		if (prim.indices >= 0)
+		{
+			if (!valid_accessor(prim.indices))
+			{
+				errors.push_back(prefix + "indices accessor " + std::to_string(prim.indices) + " does not exist");
+			}
+			else
+			{
+				const tinygltf::Accessor& acc = model.accessors[prim.indices];
+				bool triangles = prim.mode == -1 || prim.mode == TINYGLTF_MODE_TRIANGLES;
+				if (acc.type != TINYGLTF_TYPE_SCALAR || (acc.componentType != TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE &&
+					acc.componentType != TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT && acc.componentType != TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT))
+				{
+					errors.push_back(prefix + "indices are not unsigned integer scalars");
+				}
+				else if (triangles && acc.count % 3 != 0)
+				{
+					errors.push_back(prefix + "triangle index count " + std::to_string(acc.count) + " is not a multiple of 3");
+				}
+				else if (!compressed && acc.count > 0 && MaxIndex(model, acc) >= num_verts)
+				{
+					errors.push_back(prefix + "index " + std::to_string(MaxIndex(model, acc)) + " is past vertex count " + std::to_string(num_verts));
+				}
+			}
+		}
+
+		std::vector<float> weight_sums;
+		for (int set = 0; !compressed; set++)
+		{
+			auto joints_iter = prim.attributes.find("JOINTS_" + std::to_string(set));
+			auto weights_iter = prim.attributes.find("WEIGHTS_" + std::to_string(set));
+			if (joints_iter == prim.attributes.end() && weights_iter == prim.attributes.end())
+				break;
+			if (joints_iter == prim.attributes.end() || weights_iter == prim.attributes.end())
+			{
+				errors.push_back(prefix + "JOINTS_" + std::to_string(set) + " and WEIGHTS_" + std::to_string(set) + " are not paired");
+				break;
+			}
+			if (!valid_accessor(joints_iter->second) || !valid_accessor(weights_iter->second) ||
+				model.accessors[joints_iter->second].count != num_verts || model.accessors[weights_iter->second].count != num_verts)
+				break;
+
+			if (num_joints < 0)
+			{
+				errors.push_back(prefix + "has JOINTS_" + std::to_string(set) + " but no node binds it to a skin");
+			}
+			else
+			{
+				std::vector<float> joints = ReadAccessor(model, joints_iter->second);
+				for (size_t i = 0; i < joints.size(); i++)
+				{
+					if (joints[i] >= (float)num_joints)
+					{
+						errors.push_back(prefix + "joint index " + std::to_string((int)joints[i]) + " at vertex " + std::to_string(i / 4) + " is past the skin's " + std::to_string(num_joints) + " joints");
+						break;
+					}
+				}
+			}
+
+			std::vector<float> weights = ReadAccessor(model, weights_iter->second);
+			weight_sums.resize(num_verts, 0.0f);
+			for (size_t i = 0; i < weights.size(); i++)
+			{
+				weight_sums[i / 4] += weights[i];
+			}
+		}
+		for (size_t i = 0; i < weight_sums.size(); i++)
+		{
+			if (!(std::fabs(weight_sums[i] - 1.0f) <= weight_sum_epsilon))
+			{
+				errors.push_back(prefix + "joint weights of vertex " + std::to_string(i) + " sum to " + std::to_string(weight_sums[i]));
+				break;
+			}
+		}
+	}
+
+	// Checks buffer views, accessors (ranges, alignment, sparse ordering, finite floats), primitives
+	// (attribute counts, index ranges, joint indices and weight sums) and the indices the scene
+	// graph, skins and animations refer to. Each object is checked in parallel; problems are
+	// appended to errors in model order. Returns true when nothing was found.
+	inline bool ValidateModel(const tinygltf::Model& model, ThreadPool& pool, std::vector<std::string>& errors)
+	{
+		std::vector<std::vector<std::string>> view_errors(model.bufferViews.size());
+		pool.parallel_for(model.bufferViews.size(), [&](size_t i)
+			{
+				ValidateBufferView(model, (int)i, view_errors[i]);
+			}, 64);
+
+		std::vector<std::vector<std::string>> acc_errors(model.accessors.size());
+		pool.parallel_for(model.accessors.size(), [&](size_t i)
+			{
+				ValidateAccessor(model, (int)i, acc_errors[i]);
+			});
+
+		// a mesh instanced under several skins must fit the smallest of them
+		std::vector<int> mesh_joints(model.meshes.size(), -1);
+		std::vector<std::string> graph_errors;
+		for (size_t i = 0; i < model.nodes.size(); i++)
+		{
+			const tinygltf::Node& node = model.nodes[i];
+			std::string prefix = "node " + std::to_string(i) + ": ";
+			if (node.mesh >= (int)model.meshes.size())
+				graph_errors.push_back(prefix + "mesh " + std::to_string(node.mesh) + " does not exist");
+			if (node.skin >= (int)model.skins.size())
+				graph_errors.push_back(prefix + "skin " + std::to_string(node.skin) + " does not exist");
+			for (size_t j = 0; j < node.children.size(); j++)
+			{
+				if (node.children[j] < 0 || node.children[j] >= (int)model.nodes.size())
+					graph_errors.push_back(prefix + "child " + std::to_string(node.children[j]) + " does not exist");
+			}
+			if (node.mesh >= 0 && node.mesh < (int)model.meshes.size() && node.skin >= 0 && node.skin < (int)model.skins.size())
+			{
+				int num_joints = (int)model.skins[node.skin].joints.size();
+				int& joints = mesh_joints[node.mesh];
+				joints = joints < 0 ? num_joints : std::min(joints, num_joints);
+			}
+		}
+		for (size_t i = 0; i < model.skins.size(); i++)
+		{
+			const tinygltf::Skin& skin = model.skins[i];
+			std::string prefix = "skin " + std::to_string(i) + ": ";
+			for (size_t j = 0; j < skin.joints.size(); j++)
+			{
+				if (skin.joints[j] < 0 || skin.joints[j] >= (int)model.nodes.size())
+					graph_errors.push_back(prefix + "joint node " + std::to_string(skin.joints[j]) + " does not exist");
+			}
+			if (skin.inverseBindMatrices >= (int)model.accessors.size() ||
+				(skin.inverseBindMatrices >= 0 && model.accessors[skin.inverseBindMatrices].count < skin.joints.size()))
+				graph_errors.push_back(prefix + "inverseBindMatrices do not cover every joint");
+		}
+		for (size_t i = 0; i < model.animations.size(); i++)
+		{
+			const tinygltf::Animation& anim = model.animations[i];
+			std::string prefix = "animation " + std::to_string(i) + ": ";
+			for (size_t j = 0; j < anim.channels.size(); j++)
+			{
+				const tinygltf::AnimationChannel& channel = anim.channels[j];
+				if (channel.sampler < 0 || channel.sampler >= (int)anim.samplers.size())
+					graph_errors.push_back(prefix + "channel " + std::to_string(j) + " sampler does not exist");
+				if (channel.target_node < 0 || channel.target_node >= (int)model.nodes.size())
+					graph_errors.push_back(prefix + "channel " + std::to_string(j) + " target node does not exist");
+			}
+			for (size_t j = 0; j < anim.samplers.size(); j++)
+			{
+				const tinygltf::AnimationSampler& sampler = anim.samplers[j];
+				if (sampler.input < 0 || sampler.input >= (int)model.accessors.size() || sampler.output < 0 || sampler.output >= (int)model.accessors.size())
+					graph_errors.push_back(prefix + "sampler " + std::to_string(j) + " accessor does not exist");
+			}
+		}
+
+		std::vector<std::vector<std::string>> mesh_errors(model.meshes.size());
+		pool.parallel_for(model.meshes.size(), [&](size_t i)
+			{
+				const tinygltf::Mesh& mesh = model.meshes[i];
+				for (size_t j = 0; j < mesh.primitives.size(); j++)
+				{
+					std::string prefix = "mesh " + std::to_string(i) + " primitive " + std::to_string(j) + ": ";
+					ValidatePrimitive(model, prefix, mesh.primitives[j], mesh_joints[i], mesh_errors[i]);
+				}
+			});
+
+		size_t num_errors = errors.size();
+		for (auto* lst : { &view_errors, &acc_errors, &mesh_errors })
+		{
+			for (size_t i = 0; i < lst->size(); i++)
+			{
+				errors.insert(errors.end(), (*lst)[i].begin(), (*lst)[i].end());
+			}
+		}
+		errors.insert(errors.end(), graph_errors.begin(), graph_errors.end());
+		return errors.size() == num_errors;
+	}
+}
@@ -0,0 +1,404 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <glm.hpp>
+#include <tiny_gltf.h>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#define MID_WATCH_INOTIFY 1
+#endif
+
+#include "BufferWriter.h"
+#include "Image.h"
+#include "Simd.h"
+
+// Incremental reconversion for --watch. The converter keeps the work of the last run (each mesh's
+// finished primitive and each encoded texture) and a later run over an edited stage only redoes
+// what its inputs changed.
+namespace Mid
+{
+	// crc64 over a sequence of values; vectors are hashed with their size, so that the
+	// boundaries between them count.
+	class ContentHash
+	{
+	public:
+		template<typename T>
+		void add(const T& value)
+		{
+			static_assert(std::is_trivially_copyable<T>::value, "only plain values are hashed by their bytes");
+			bytes(&value, sizeof(T));
+		}
+
+		template<typename T>
+		void add(const std::vector<T>& values)
+		{
+			add((uint64_t)values.size());
+			if constexpr (std::is_trivially_copyable<T>::value)
+			{
+				bytes(values.data(), values.size() * sizeof(T));
+			}
+			else
+			{
+				for (size_t i = 0; i < values.size(); i++) add(values[i]);
+			}
+		}
+
+		void add(const std::vector<bool>& values)
+		{
+			std::vector<uint8_t> packed((values.size() + 7) / 8, 0);
+			for (size_t i = 0; i < values.size(); i++)
+			{
+				if (values[i]) packed[i / 8] |= (uint8_t)(1 << (i % 8));
+			}
+			add(packed);
+		}
+
+		uint64_t value() const { return hash; }
+
+	private:
+		uint64_t hash = 0;
+
+		void bytes(const void* data, size_t length)
+		{
+			if (length > 0) hash = Simd().crc64(hash, (const unsigned char*)data, length);
+		}
+	};
+
+	// The primitive of one converted mesh, detached from its model: the accessors it references
+	// (sparse morph targets included) in creation order, and a copy of the bytes of their views.
+	// Accessor and view ids inside are indices into these two lists.
+	struct CachedMesh
+	{
+		struct View
+		{
+			int target = 0;
+			int stride = 0;
+			std::vector<uint8_t> bytes;
+		};
+
+		tinygltf::Primitive primitive;
+		std::vector<tinygltf::Accessor> accessors;
+		std::vector<View> views;
+		// skinned meshes: the bind-pose points and weights the skin bounds are computed from
+		std::vector<glm::vec3> skin_points;
+		std::vector<glm::u16vec4> skin_joints;
+		std::vector<glm::vec4> skin_weights;
+	};
+
+	inline CachedMesh CaptureMesh(const tinygltf::Model& model, const tinygltf::Primitive& primitive)
+	{
+		CachedMesh mesh;
+		mesh.primitive = primitive;
+
+		std::vector<int> acc_ids;
+		for (auto& attrib : primitive.attributes) acc_ids.push_back(attrib.second);
+		if (primitive.indices >= 0) acc_ids.push_back(primitive.indices);
+		for (auto& target : primitive.targets)
+		{
+			for (auto& attrib : target) acc_ids.push_back(attrib.second);
+		}
+		std::sort(acc_ids.begin(), acc_ids.end());
+		acc_ids.erase(std::unique(acc_ids.begin(), acc_ids.end()), acc_ids.end());
+
+		std::vector<int> view_ids;
+		for (int id : acc_ids)
+		{
+			const tinygltf::Accessor& acc = model.accessors[id];
+			if (acc.bufferView >= 0) view_ids.push_back(acc.bufferView);
+			if (acc.sparse.isSparse)
+			{
+				view_ids.push_back(acc.sparse.indices.bufferView);
+				view_ids.push_back(acc.sparse.values.bufferView);
+			}
+		}
+		std::sort(view_ids.begin(), view_ids.end());
+		view_ids.erase(std::unique(view_ids.begin(), view_ids.end()), view_ids.end());
+
+		// views and accessors keep their original order, so a replay lays the buffer out the
+		// same way as the conversion that produced them
+		std::unordered_map<int, int> view_map;
+		for (int id : view_ids)
+		{
+			const tinygltf::BufferView& view = model.bufferViews[id];
+			const std::vector<unsigned char>& data = model.buffers[view.buffer].data;
+			CachedMesh::View cached;
+			cached.target = view.target;
+			cached.stride = (int)view.byteStride;
+			cached.bytes.assign(data.begin() + view.byteOffset, data.begin() + view.byteOffset + view.byteLength);
+			view_map[id] = (int)mesh.views.size();
+			mesh.views.push_back(std::move(cached));
+		}
+
+		std::unordered_map<int, int> acc_map;
+		for (int id : acc_ids)
+		{
+			tinygltf::Accessor acc = model.accessors[id];
+			if (acc.bufferView >= 0) acc.bufferView = view_map[acc.bufferView];
+			if (acc.sparse.isSparse)
+			{
+				acc.sparse.indices.bufferView = view_map[acc.sparse.indices.bufferView];
+				acc.sparse.values.bufferView = view_map[acc.sparse.values.bufferView];
+			}
+			acc_map[id] = (int)mesh.accessors.size();
+			mesh.accessors.push_back(acc);
+		}
+
+		for (auto& attrib : mesh.primitive.attributes) attrib.second = acc_map[attrib.second];
+		if (mesh.primitive.indices >= 0) mesh.primitive.indices = acc_map[mesh.primitive.indices];
+		for (auto& target : mesh.primitive.targets)
+		{
+			for (auto& attrib : target) attrib.second = acc_map[attrib.second];
+		}
+		return mesh;
+	}
+
+	// Emits a captured mesh into the model through writer and returns its primitive.
+	inline tinygltf::Primitive ReplayMesh(BufferWriter& writer, tinygltf::Model& model, const CachedMesh& mesh)
+	{
+		std::vector<int> view_ids(mesh.views.size());
+		for (size_t i = 0; i < mesh.views.size(); i++)
+		{
+			const CachedMesh::View& view = mesh.views[i];
+			view_ids[i] = writer.emit_view(view.bytes.data(), view.bytes.size(), view.target, view.stride);
+		}
+
+		std::vector<int> acc_ids(mesh.accessors.size());
+		for (size_t i = 0; i < mesh.accessors.size(); i++)
+		{
+			tinygltf::Accessor acc = mesh.accessors[i];
+			if (acc.bufferView >= 0) acc.bufferView = view_ids[acc.bufferView];
+			if (acc.sparse.isSparse)
+			{
+				acc.sparse.indices.bufferView = view_ids[acc.sparse.indices.bufferView];
+				acc.sparse.values.bufferView = view_ids[acc.sparse.values.bufferView];
+			}
+			acc_ids[i] = (int)model.accessors.size();
+			model.accessors.push_back(acc);
+		}
+
+		tinygltf::Primitive primitive = mesh.primitive;
+		for (auto& attrib : primitive.attributes) attrib.second = acc_ids[attrib.second];
+		if (primitive.indices >= 0) primitive.indices = acc_ids[primitive.indices];
+		for (auto& target : primitive.targets)
+		{
+			for (auto& attrib : target) attrib.second = acc_ids[attrib.second];
+		}
+		return primitive;
+	}
+
+	// Meshes by a hash of everything their conversion reads, and encoded textures by the recipe
+	// key of the converter (packing plus source paths). Entries are only valid for the options
+	// they were made with; a watch session converts with one set throughout.
+	class ConvertCache
+	{
+	public:
+		size_t mesh_hits = 0;
+		size_t mesh_misses = 0;
+		size_t texture_hits = 0;
+		size_t texture_misses = 0;
+
+		// Starts a conversion: counters restart and every entry is unused until it is found or
+		// stored again.
+		void begin()
+		{
+			mesh_hits = mesh_misses = texture_hits = texture_misses = 0;
+			for (auto& entry : meshes) entry.second.used = false;
+			for (auto& entry : textures) entry.second.used = false;
+		}
+
+		// Drops what the last conversion did not use (deleted meshes, edited ones' old versions).
+		void sweep()
+		{
+			for (auto iter = meshes.begin(); iter != meshes.end();)
+			{
+				iter = iter->second.used ? std::next(iter) : meshes.erase(iter);
+			}
+			for (auto iter = textures.begin(); iter != textures.end();)
+			{
+				iter = iter->second.used ? std::next(iter) : textures.erase(iter);
+			}
+		}
+
+		const CachedMesh* find_mesh(uint64_t key)
+		{
+			auto iter = meshes.find(key);
+			if (iter == meshes.end())
+			{
+				mesh_misses++;
+				return nullptr;
+			}
+			mesh_hits++;
+			iter->second.used = true;
+			return &iter->second.mesh;
+		}
+
+		void store_mesh(uint64_t key, CachedMesh mesh)
+		{
+			MeshEntry& entry = meshes[key];
+			entry.mesh = std::move(mesh);
+			entry.used = true;
+		}
+
+		// The encoded texture of key, without pixels.
+		bool find_texture(const std::string& key, Image& img)
+		{
+			auto iter = textures.find(key);
+			if (iter == textures.end())
+			{
+				texture_misses++;
+				return false;
+			}
+			texture_hits++;
+			iter->second.used = true;
+			img = iter->second.image;
+			return true;
+		}
+
+		void store_texture(const std::string& key, const Image& img)
+		{
+			TextureEntry& entry = textures[key];
+			entry.image.mimeType = img.mimeType;
+			entry.image.width = img.width;
+			entry.image.height = img.height;
+			entry.image.code = img.code;
+			entry.image.webp = img.webp;
+			entry.image.source = img.source;
+			entry.used = true;
+		}
+
+		// Forgets the textures built from the file at path; keys list their sources one per line.
+		void invalidate(const std::string& path)
+		{
+			std::string line = "\n" + path + "\n";
+			for (auto iter = textures.begin(); iter != textures.end();)
+			{
+				bool uses = ("\n" + iter->first + "\n").find(line) != std::string::npos;
+				iter = uses ? textures.erase(iter) : std::next(iter);
+			}
+		}
+
+	private:
+		struct MeshEntry
+		{
+			CachedMesh mesh;
+			bool used = false;
+		};
+		struct TextureEntry
+		{
+			Image image;
+			bool used = false;
+		};
+
+		std::unordered_map<uint64_t, MeshEntry> meshes;
+		std::unordered_map<std::string, TextureEntry> textures;
+	};
+
+	// Reports writes to a set of files through inotify. The directories are watched rather than
+	// the files, so that an editor saving through a temporary file and a rename is seen too.
+	// Without inotify valid() is false and nothing is reported.
+	class FileWatcher
+	{
+	public:
+		FileWatcher()
+		{
+#ifdef MID_WATCH_INOTIFY
+			fd = inotify_init1(IN_CLOEXEC);
+#endif
+		}
+
+		~FileWatcher()
+		{
+#ifdef MID_WATCH_INOTIFY
+			if (fd >= 0) close(fd);
+#endif
+		}
+
+		FileWatcher(const FileWatcher&) = delete;
+		FileWatcher& operator=(const FileWatcher&) = delete;
+
+		bool valid() const { return fd >= 0; }
+
+		// Adding a file twice is harmless. Returns false if its directory cannot be watched.
+		bool add(const std::string& path)
+		{
+#ifdef MID_WATCH_INOTIFY
+			if (fd < 0) return false;
+			std::error_code ec;
+			std::filesystem::path full = std::filesystem::absolute(path, ec).lexically_normal();
+			if (ec) return false;
+			std::string dir = full.parent_path().u8string();
+			if (dir_ids.find(dir) == dir_ids.end())
+			{
+				int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+				if (wd < 0) return false;
+				dir_ids[dir] = wd;
+				dirs[wd] = dir;
+			}
+			files[full.u8string()] = path;
+			return true;
+#else
+			(void)path;
+			return false;
+#endif
+		}
+
+		// Blocks until a watched file is written or replaced, then keeps collecting until no event
+		// came for quiet_ms, so that a save touching several files gives one rebuild. Returns the
+		// changed files as they were passed to add(), or nothing if waiting failed.
+		std::vector<std::string> wait(int quiet_ms = 50)
+		{
+			std::vector<std::string> changed;
+#ifdef MID_WATCH_INOTIFY
+			int timeout = -1;
+			while (fd >= 0)
+			{
+				pollfd pfd = { fd, POLLIN, 0 };
+				int ready = poll(&pfd, 1, timeout);
+				if (ready < 0 && errno == EINTR) continue;
+				if (ready <= 0) break;
+
+				alignas(inotify_event) char buf[16384];
+				ssize_t length = read(fd, buf, sizeof(buf));
+				if (length < 0 && errno == EINTR) continue;
+				if (length <= 0) break;
+
+				for (char* p = buf; p < buf + length;)
+				{
+					const inotify_event* ev = (const inotify_event*)p;
+					p += sizeof(inotify_event) + ev->len;
+					auto dir = dirs.find(ev->wd);
+					if (ev->len == 0 || dir == dirs.end()) continue;
+					std::string full = (std::filesystem::path(dir->second) / ev->name).u8string();
+					auto file = files.find(full);
+					if (file != files.end() && std::find(changed.begin(), changed.end(), file->second) == changed.end())
+					{
+						changed.push_back(file->second);
+					}
+				}
+				if (!changed.empty()) timeout = quiet_ms;
+			}
+#else
+			(void)quiet_ms;
+#endif
+			return changed;
+		}
+
+	private:
+		int fd = -1;
+		std::unordered_map<std::string, int> dir_ids;
+		std::unordered_map<int, std::string> dirs;
+		// normalized absolute path -> path as added
+		std::unordered_map<std::string, std::string> files;
+	};
+}
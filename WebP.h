@@ -0,0 +1,1297 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "Huffman.h"
+
+// EXT_texture_webp encoder. Quality 100 writes lossless WebP (VP8L): subtract-green and spatial
+// predictor transforms, LZ77 backward references and one group of canonical prefix codes. Lower
+// qualities write a lossy VP8 key frame, with alpha stored losslessly in an ALPH chunk.
+namespace Mid
+{
+	struct WebPOptions
+	{
+		// per texture role: -1 keeps PNG/JPEG, 100 is lossless, lower values are lossy (VP8, with
+		// chroma at half resolution, so data textures usually want 100)
+		int color = -1;
+		int emissive = -1;
+		int metallic_roughness = -1;
+		int specular_glossiness = -1;
+		// also store the PNG/JPEG image for viewers without EXT_texture_webp
+		bool fallback = false;
+	};
+
+	// "90" for every role, or "color:90,mr:100,..." with roles color, emissive, mr, sg and all.
+	inline bool ParseWebPOptions(const std::string& spec, WebPOptions& options)
+	{
+		size_t pos = 0;
+		while (pos <= spec.size())
+		{
+			size_t end = spec.find(',', pos);
+			if (end == std::string::npos) end = spec.size();
+			std::string item = spec.substr(pos, end - pos);
+			pos = end + 1;
+
+			std::string role = "all";
+			size_t colon = item.find(':');
+			if (colon != std::string::npos)
+			{
+				role = item.substr(0, colon);
+				item = item.substr(colon + 1);
+			}
+			if (item.empty()) return false;
+			int quality = std::min(std::max(atoi(item.c_str()), 0), 100);
+
+			if (role == "color" || role == "all") options.color = quality;
+			if (role == "emissive" || role == "all") options.emissive = quality;
+			if (role == "mr" || role == "all") options.metallic_roughness = quality;
+			if (role == "sg" || role == "all") options.specular_glossiness = quality;
+			if (role != "color" && role != "emissive" && role != "mr" && role != "sg" && role != "all") return false;
+		}
+		return true;
+	}
+
+	// LSB-first bit sink of the VP8L bitstream.
+	struct VP8LBitWriter
+	{
+		std::vector<uint8_t> data;
+		uint64_t acc = 0;
+		int used = 0;
+
+		void put(uint32_t bits, int count)
+		{
+			acc |= (uint64_t)bits << used;
+			used += count;
+			while (used >= 8)
+			{
+				data.push_back((uint8_t)acc);
+				acc >>= 8;
+				used -= 8;
+			}
+		}
+
+		void flush()
+		{
+			if (used > 0) data.push_back((uint8_t)acc);
+			acc = 0;
+			used = 0;
+		}
+	};
+
+	// Canonical prefix code, with the codes bit-reversed for the LSB-first writer.
+	struct VP8LPrefixCode
+	{
+		std::vector<uint8_t> lengths;
+		std::vector<uint16_t> codes;
+
+		void write(VP8LBitWriter& bw, uint32_t symbol) const { bw.put(codes[symbol], lengths[symbol]); }
+	};
+
+	inline void VP8LCanonicalCodes(VP8LPrefixCode& code)
+	{
+		int bl_count[16] = {};
+		for (size_t i = 0; i < code.lengths.size(); i++) bl_count[code.lengths[i]]++;
+		bl_count[0] = 0;
+		int next_code[16] = {};
+		int value = 0;
+		for (int bits = 1; bits < 16; bits++)
+		{
+			value = (value + bl_count[bits - 1]) << 1;
+			next_code[bits] = value;
+		}
+
+		code.codes.assign(code.lengths.size(), 0);
+		for (size_t i = 0; i < code.lengths.size(); i++)
+		{
+			int length = code.lengths[i];
+			if (length == 0) continue;
+			int c = next_code[length]++;
+			uint16_t reversed = 0;
+			for (int b = 0; b < length; b++) reversed |= (uint16_t)(((c >> b) & 1) << (length - 1 - b));
+			code.codes[i] = reversed;
+		}
+	}
+
+	// Writes the code for the symbol counts to the stream and returns it in code.
+	inline void VP8LWritePrefixCode(VP8LBitWriter& bw, const std::vector<uint32_t>& counts, VP8LPrefixCode& code)
+	{
+		std::vector<int> used;
+		for (size_t i = 0; i < counts.size(); i++)
+		{
+			if (counts[i] > 0) used.push_back((int)i);
+		}
+
+		// simple code: a single symbol costs no bits per occurrence, two symbols one bit each
+		if (used.size() <= 2 && (used.empty() || used.back() < 256))
+		{
+			if (used.empty()) used.push_back(0);
+			code.lengths.assign(counts.size(), 0);
+			code.codes.assign(counts.size(), 0);
+			bw.put(1, 1);
+			bw.put((uint32_t)used.size() - 1, 1);
+			if (used[0] < 2)
+			{
+				bw.put(0, 1);
+				bw.put(used[0], 1);
+			}
+			else
+			{
+				bw.put(1, 1);
+				bw.put(used[0], 8);
+			}
+			if (used.size() == 2)
+			{
+				bw.put(used[1], 8);
+				code.lengths[used[0]] = 1;
+				code.lengths[used[1]] = 1;
+				code.codes[used[1]] = 1;
+			}
+			return;
+		}
+
+		HuffmanCodeLengths(counts, 15, code.lengths);
+		VP8LCanonicalCodes(code);
+
+		// code lengths as literals 0-15, 16 repeating the previous non-zero length 3-6 times, and
+		// 17/18 for runs of 3-10 and 11-138 zeros
+		std::vector<std::pair<uint8_t, uint8_t>> tokens;
+		size_t n = code.lengths.size();
+		uint8_t prev = 8;
+		for (size_t i = 0; i < n;)
+		{
+			uint8_t length = code.lengths[i];
+			size_t run = 1;
+			while (i + run < n && code.lengths[i + run] == length) run++;
+			i += run;
+			if (length == 0)
+			{
+				while (run >= 3)
+				{
+					size_t r = std::min(run, (size_t)138);
+					if (r >= 11) tokens.push_back({ 18, (uint8_t)(r - 11) });
+					else tokens.push_back({ 17, (uint8_t)(r - 3) });
+					run -= r;
+				}
+			}
+			else
+			{
+				if (length != prev)
+				{
+					tokens.push_back({ length, 0 });
+					prev = length;
+					run--;
+				}
+				while (run >= 3)
+				{
+					size_t r = std::min(run, (size_t)6);
+					tokens.push_back({ 16, (uint8_t)(r - 3) });
+					run -= r;
+				}
+			}
+			for (; run > 0; run--) tokens.push_back({ length, 0 });
+		}
+
+		std::vector<uint32_t> token_counts(19, 0);
+		for (size_t i = 0; i < tokens.size(); i++) token_counts[tokens[i].first]++;
+		VP8LPrefixCode length_code;
+		HuffmanCodeLengths(token_counts, 7, length_code.lengths);
+		VP8LCanonicalCodes(length_code);
+
+		static const uint8_t order[19] = { 17, 18, 0, 1, 2, 3, 4, 5, 16, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+		int num_lengths = 19;
+		while (num_lengths > 4 && length_code.lengths[order[num_lengths - 1]] == 0) num_lengths--;
+
+		bw.put(0, 1);
+		bw.put(num_lengths - 4, 4);
+		for (int i = 0; i < num_lengths; i++) bw.put(length_code.lengths[order[i]], 3);
+		// lengths cover the whole alphabet
+		bw.put(0, 1);
+		for (size_t i = 0; i < tokens.size(); i++)
+		{
+			length_code.write(bw, tokens[i].first);
+			if (tokens[i].first == 16) bw.put(tokens[i].second, 2);
+			else if (tokens[i].first == 17) bw.put(tokens[i].second, 3);
+			else if (tokens[i].first == 18) bw.put(tokens[i].second, 7);
+		}
+	}
+
+	// VP8L prefix coding of backward reference lengths and distances (value >= 1).
+	inline void VP8LPrefixEncode(uint32_t value, int& prefix, int& extra_bits, uint32_t& extra)
+	{
+		uint32_t v = value - 1;
+		if (v < 4)
+		{
+			prefix = (int)v;
+			extra_bits = 0;
+			extra = 0;
+			return;
+		}
+		int high = 31;
+		while (!(v >> high)) high--;
+		int second = (v >> (high - 1)) & 1;
+		prefix = 2 * high + second;
+		extra_bits = high - 1;
+		extra = v & ((1u << extra_bits) - 1);
+	}
+
+	struct VP8LToken
+	{
+		// pixel for literals, length for backward references
+		uint32_t value;
+		// pixel distance, 0 for literals
+		uint32_t distance;
+	};
+
+	// Greedy LZ77 over a hash chain of pixel pairs.
+	inline std::vector<VP8LToken> VP8LBackwardRefs(const std::vector<uint32_t>& argb, int xsize, int max_chain)
+	{
+		const int hash_bits = 16;
+		const uint32_t max_length = 4096;
+		// distance codes stay below 40 prefix symbols
+		const size_t max_distance = (1u << 20) - 120;
+		size_t n = argb.size();
+		std::vector<int32_t> head((size_t)1 << hash_bits, -1);
+		std::vector<int32_t> chain(n, -1);
+		auto hash = [&](size_t i)
+		{
+			uint64_t key = ((uint64_t)argb[i] << 32) | argb[i + 1];
+			return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> (64 - hash_bits));
+		};
+		auto insert = [&](size_t i)
+		{
+			if (i + 1 >= n) return;
+			uint32_t h = hash(i);
+			chain[i] = head[h];
+			head[h] = (int32_t)i;
+		};
+		auto match_length = [&](size_t i, size_t j)
+		{
+			uint32_t length = 0;
+			while (i + length < n && length < max_length && argb[j + length] == argb[i + length]) length++;
+			return length;
+		};
+
+		std::vector<VP8LToken> tokens;
+		tokens.reserve(n / 2);
+		for (size_t i = 0; i < n;)
+		{
+			uint32_t best_length = 0;
+			size_t best_distance = 0;
+			// the pixel above and the one to the left have the cheapest distance codes
+			size_t shortcuts[2] = { (size_t)xsize, 1 };
+			for (size_t d : shortcuts)
+			{
+				if (d > i) continue;
+				uint32_t length = match_length(i, i - d);
+				if (length > best_length)
+				{
+					best_length = length;
+					best_distance = d;
+				}
+			}
+			if (i + 1 < n)
+			{
+				int32_t j = head[hash(i)];
+				for (int k = 0; k < max_chain && j >= 0 && i - j <= max_distance; k++, j = chain[j])
+				{
+					uint32_t length = match_length(i, j);
+					if (length > best_length)
+					{
+						best_length = length;
+						best_distance = i - j;
+					}
+				}
+			}
+
+			if (best_length >= 3)
+			{
+				tokens.push_back({ best_length, (uint32_t)best_distance });
+				for (uint32_t k = 0; k < best_length; k++) insert(i + k);
+				i += best_length;
+			}
+			else
+			{
+				tokens.push_back({ argb[i], 0 });
+				insert(i);
+				i++;
+			}
+		}
+		return tokens;
+	}
+
+	// Entropy-coded image without color cache; only the main image signals its (single) prefix
+	// code group.
+	inline void VP8LWriteImageData(VP8LBitWriter& bw, const std::vector<uint32_t>& argb, int xsize, bool is_main, int max_chain)
+	{
+		std::vector<VP8LToken> tokens = VP8LBackwardRefs(argb, xsize, max_chain);
+
+		// green + length prefixes, red, blue, alpha, distance prefixes
+		std::vector<uint32_t> counts[5] = {
+			std::vector<uint32_t>(256 + 24, 0), std::vector<uint32_t>(256, 0), std::vector<uint32_t>(256, 0),
+			std::vector<uint32_t>(256, 0), std::vector<uint32_t>(40, 0) };
+		auto distance_code = [&](uint32_t distance) -> uint32_t
+		{
+			if (distance == (uint32_t)xsize) return 1;
+			if (distance == 1) return 2;
+			return distance + 120;
+		};
+		for (size_t i = 0; i < tokens.size(); i++)
+		{
+			const VP8LToken& t = tokens[i];
+			int prefix, extra_bits;
+			uint32_t extra;
+			if (t.distance == 0)
+			{
+				counts[0][(t.value >> 8) & 0xff]++;
+				counts[1][(t.value >> 16) & 0xff]++;
+				counts[2][t.value & 0xff]++;
+				counts[3][t.value >> 24]++;
+				continue;
+			}
+			VP8LPrefixEncode(t.value, prefix, extra_bits, extra);
+			counts[0][256 + prefix]++;
+			VP8LPrefixEncode(distance_code(t.distance), prefix, extra_bits, extra);
+			counts[4][prefix]++;
+		}
+
+		bw.put(0, 1);
+		if (is_main) bw.put(0, 1);
+		VP8LPrefixCode codes[5];
+		for (int i = 0; i < 5; i++) VP8LWritePrefixCode(bw, counts[i], codes[i]);
+
+		for (size_t i = 0; i < tokens.size(); i++)
+		{
+			const VP8LToken& t = tokens[i];
+			int prefix, extra_bits;
+			uint32_t extra;
+			if (t.distance == 0)
+			{
+				codes[0].write(bw, (t.value >> 8) & 0xff);
+				codes[1].write(bw, (t.value >> 16) & 0xff);
+				codes[2].write(bw, t.value & 0xff);
+				codes[3].write(bw, t.value >> 24);
+				continue;
+			}
+			VP8LPrefixEncode(t.value, prefix, extra_bits, extra);
+			codes[0].write(bw, 256 + prefix);
+			bw.put(extra, extra_bits);
+			VP8LPrefixEncode(distance_code(t.distance), prefix, extra_bits, extra);
+			codes[4].write(bw, prefix);
+			bw.put(extra, extra_bits);
+		}
+	}
+
+	inline uint32_t VP8LAverage2(uint32_t a, uint32_t b)
+	{
+		return (((a ^ b) & 0xfefefefeu) >> 1) + (a & b);
+	}
+
+	inline uint32_t VP8LSelect(uint32_t L, uint32_t T, uint32_t TL)
+	{
+		int dist_l = 0, dist_t = 0;
+		for (int s = 0; s < 32; s += 8)
+		{
+			int l = (L >> s) & 0xff, t = (T >> s) & 0xff, tl = (TL >> s) & 0xff;
+			dist_l += abs(t - tl);
+			dist_t += abs(l - tl);
+		}
+		return dist_l < dist_t ? L : T;
+	}
+
+	inline uint32_t VP8LClampAddSubtractFull(uint32_t a, uint32_t b, uint32_t c)
+	{
+		uint32_t out = 0;
+		for (int s = 0; s < 32; s += 8)
+		{
+			int v = (int)((a >> s) & 0xff) + (int)((b >> s) & 0xff) - (int)((c >> s) & 0xff);
+			out |= (uint32_t)std::min(std::max(v, 0), 255) << s;
+		}
+		return out;
+	}
+
+	inline uint32_t VP8LClampAddSubtractHalf(uint32_t a, uint32_t b)
+	{
+		uint32_t out = 0;
+		for (int s = 0; s < 32; s += 8)
+		{
+			int va = (a >> s) & 0xff, vb = (b >> s) & 0xff;
+			int v = va + (va - vb) / 2;
+			out |= (uint32_t)std::min(std::max(v, 0), 255) << s;
+		}
+		return out;
+	}
+
+	// Predictor of pixel (x, y) from already decoded pixels, including the border rules.
+	inline uint32_t VP8LPredict(int mode, const uint32_t* image, int x, int y, int xsize)
+	{
+		if (x == 0 && y == 0) return 0xff000000u;
+		const uint32_t* p = image + (size_t)y * xsize + x;
+		if (y == 0) return p[-1];
+		if (x == 0) return p[-xsize];
+
+		uint32_t L = p[-1], T = p[-xsize], TL = p[-xsize - 1];
+		// on the rightmost column this is the leftmost pixel of the current row
+		uint32_t TR = p[-xsize + 1];
+		switch (mode)
+		{
+		case 0: return 0xff000000u;
+		case 1: return L;
+		case 2: return T;
+		case 3: return TR;
+		case 4: return TL;
+		case 5: return VP8LAverage2(VP8LAverage2(L, TR), T);
+		case 6: return VP8LAverage2(L, TL);
+		case 7: return VP8LAverage2(L, T);
+		case 8: return VP8LAverage2(TL, T);
+		case 9: return VP8LAverage2(T, TR);
+		case 10: return VP8LAverage2(VP8LAverage2(L, TL), VP8LAverage2(T, TR));
+		case 11: return VP8LSelect(L, T, TL);
+		case 12: return VP8LClampAddSubtractFull(L, T, TL);
+		default: return VP8LClampAddSubtractHalf(VP8LAverage2(L, T), TL);
+		}
+	}
+
+	// VP8L bitstream of RGBA8 pixels.
+	inline std::vector<uint8_t> EncodeVP8L(const uint8_t* rgba, int width, int height)
+	{
+		const int block_bits = 4;
+		const int max_chain = 32;
+
+		size_t n = (size_t)width * height;
+		std::vector<uint32_t> subtracted(n);
+		bool has_alpha = false;
+		for (size_t i = 0; i < n; i++)
+		{
+			const uint8_t* p = rgba + i * 4;
+			subtracted[i] = ((uint32_t)p[3] << 24) | ((uint32_t)(uint8_t)(p[0] - p[1]) << 16) | ((uint32_t)p[1] << 8) | (uint8_t)(p[2] - p[1]);
+			has_alpha = has_alpha || p[3] != 255;
+		}
+
+		// per block, the mode with the smallest sum of absolute residuals
+		int bs = 1 << block_bits;
+		int blocks_x = (width + bs - 1) / bs, blocks_y = (height + bs - 1) / bs;
+		std::vector<uint32_t> modes((size_t)blocks_x * blocks_y);
+		for (int by = 0; by < blocks_y; by++)
+		{
+			for (int bx = 0; bx < blocks_x; bx++)
+			{
+				int best_mode = 0;
+				int64_t best_cost = INT64_MAX;
+				for (int mode = 0; mode < 14; mode++)
+				{
+					int64_t cost = 0;
+					for (int y = by * bs; y < std::min((by + 1) * bs, height); y++)
+					{
+						for (int x = bx * bs; x < std::min((bx + 1) * bs, width); x++)
+						{
+							uint32_t pred = VP8LPredict(mode, subtracted.data(), x, y, width);
+							uint32_t pix = subtracted[(size_t)y * width + x];
+							for (int s = 0; s < 32; s += 8)
+								cost += abs((int)(int8_t)(uint8_t)((pix >> s) - (pred >> s)));
+						}
+					}
+					if (cost < best_cost)
+					{
+						best_cost = cost;
+						best_mode = mode;
+					}
+				}
+				modes[(size_t)by * blocks_x + bx] = 0xff000000u | ((uint32_t)best_mode << 8);
+			}
+		}
+
+		std::vector<uint32_t> residuals(n);
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				size_t i = (size_t)y * width + x;
+				int mode = (modes[(size_t)(y >> block_bits) * blocks_x + (x >> block_bits)] >> 8) & 0xf;
+				uint32_t pred = VP8LPredict(mode, subtracted.data(), x, y, width);
+				uint32_t residual = 0;
+				for (int s = 0; s < 32; s += 8) residual |= (((subtracted[i] >> s) - (pred >> s)) & 0xff) << s;
+				residuals[i] = residual;
+			}
+		}
+
+		VP8LBitWriter bw;
+		bw.put(0x2f, 8);
+		bw.put(width - 1, 14);
+		bw.put(height - 1, 14);
+		bw.put(has_alpha ? 1 : 0, 1);
+		bw.put(0, 3);
+
+		// transforms in the order they were applied: subtract green, then the predictor
+		bw.put(1, 1);
+		bw.put(2, 2);
+		bw.put(1, 1);
+		bw.put(0, 2);
+		bw.put(block_bits - 2, 3);
+		VP8LWriteImageData(bw, modes, blocks_x, false, max_chain);
+		bw.put(0, 1);
+
+		VP8LWriteImageData(bw, residuals, width, true, max_chain);
+		bw.flush();
+		return bw.data;
+	}
+
+	// RFC 6386 tables: default token probabilities (13.5) and the probabilities of updating them
+	// in the frame header (13.4), indexed [block type][band][context][tree node]
+	static const uint8_t vp8_coeff_probs[4 * 8 * 3 * 11] = {
+		128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+		253, 136, 254, 255, 228, 219, 128, 128, 128, 128, 128,  189, 129, 242, 255, 227, 213, 255, 219, 128, 128, 128,  106, 126, 227, 252, 214, 209, 255, 255, 128, 128, 128,
+		1, 98, 248, 255, 236, 226, 255, 255, 128, 128, 128,  181, 133, 238, 254, 221, 234, 255, 154, 128, 128, 128,  78, 134, 202, 247, 198, 180, 255, 219, 128, 128, 128,
+		1, 185, 249, 255, 243, 255, 128, 128, 128, 128, 128,  184, 150, 247, 255, 236, 224, 128, 128, 128, 128, 128,  77, 110, 216, 255, 236, 230, 128, 128, 128, 128, 128,
+		1, 101, 251, 255, 241, 255, 128, 128, 128, 128, 128,  170, 139, 241, 252, 236, 209, 255, 255, 128, 128, 128,  37, 116, 196, 243, 228, 255, 255, 255, 128, 128, 128,
+		1, 204, 254, 255, 245, 255, 128, 128, 128, 128, 128,  207, 160, 250, 255, 238, 128, 128, 128, 128, 128, 128,  102, 103, 231, 255, 211, 171, 128, 128, 128, 128, 128,
+		1, 152, 252, 255, 240, 255, 128, 128, 128, 128, 128,  177, 135, 243, 255, 234, 225, 128, 128, 128, 128, 128,  80, 129, 211, 255, 194, 224, 128, 128, 128, 128, 128,
+		1, 1, 255, 128, 128, 128, 128, 128, 128, 128, 128,  246, 1, 255, 128, 128, 128, 128, 128, 128, 128, 128,  255, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+		198, 35, 237, 223, 193, 187, 162, 160, 145, 155, 62,  131, 45, 198, 221, 172, 176, 220, 157, 252, 221, 1,  68, 47, 146, 208, 149, 167, 221, 162, 255, 223, 128,
+		1, 149, 241, 255, 221, 224, 255, 255, 128, 128, 128,  184, 141, 234, 253, 222, 220, 255, 199, 128, 128, 128,  81, 99, 181, 242, 176, 190, 249, 202, 255, 255, 128,
+		1, 129, 232, 253, 214, 197, 242, 196, 255, 255, 128,  99, 121, 210, 250, 201, 198, 255, 202, 128, 128, 128,  23, 91, 163, 242, 170, 187, 247, 210, 255, 255, 128,
+		1, 200, 246, 255, 234, 255, 128, 128, 128, 128, 128,  109, 178, 241, 255, 231, 245, 255, 255, 128, 128, 128,  44, 130, 201, 253, 205, 192, 255, 255, 128, 128, 128,
+		1, 132, 239, 251, 219, 209, 255, 165, 128, 128, 128,  94, 136, 225, 251, 218, 190, 255, 255, 128, 128, 128,  22, 100, 174, 245, 186, 161, 255, 199, 128, 128, 128,
+		1, 182, 249, 255, 232, 235, 128, 128, 128, 128, 128,  124, 143, 241, 255, 227, 234, 128, 128, 128, 128, 128,  35, 77, 181, 251, 193, 211, 255, 205, 128, 128, 128,
+		1, 157, 247, 255, 236, 231, 255, 255, 128, 128, 128,  121, 141, 235, 255, 225, 227, 255, 255, 128, 128, 128,  45, 99, 188, 251, 195, 217, 255, 224, 128, 128, 128,
+		1, 1, 251, 255, 213, 255, 128, 128, 128, 128, 128,  203, 1, 248, 255, 255, 128, 128, 128, 128, 128, 128,  137, 1, 177, 255, 224, 255, 128, 128, 128, 128, 128,
+		253, 9, 248, 251, 207, 208, 255, 192, 128, 128, 128,  175, 13, 224, 243, 193, 185, 249, 198, 255, 255, 128,  73, 17, 171, 221, 161, 179, 236, 167, 255, 234, 128,
+		1, 95, 247, 253, 212, 183, 255, 255, 128, 128, 128,  239, 90, 244, 250, 211, 209, 255, 255, 128, 128, 128,  155, 77, 195, 248, 188, 195, 255, 255, 128, 128, 128,
+		1, 24, 239, 251, 218, 219, 255, 205, 128, 128, 128,  201, 51, 219, 255, 196, 186, 128, 128, 128, 128, 128,  69, 46, 190, 239, 201, 218, 255, 228, 128, 128, 128,
+		1, 191, 251, 255, 255, 128, 128, 128, 128, 128, 128,  223, 165, 249, 255, 213, 255, 128, 128, 128, 128, 128,  141, 124, 248, 255, 255, 128, 128, 128, 128, 128, 128,
+		1, 16, 248, 255, 255, 128, 128, 128, 128, 128, 128,  190, 36, 230, 255, 236, 255, 128, 128, 128, 128, 128,  149, 1, 255, 128, 128, 128, 128, 128, 128, 128, 128,
+		1, 226, 255, 128, 128, 128, 128, 128, 128, 128, 128,  247, 192, 255, 128, 128, 128, 128, 128, 128, 128, 128,  240, 128, 255, 128, 128, 128, 128, 128, 128, 128, 128,
+		1, 134, 252, 255, 255, 128, 128, 128, 128, 128, 128,  213, 62, 250, 255, 255, 128, 128, 128, 128, 128, 128,  55, 93, 255, 128, 128, 128, 128, 128, 128, 128, 128,
+		128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+		202, 24, 213, 235, 186, 191, 220, 160, 240, 175, 255,  126, 38, 182, 232, 169, 184, 228, 174, 255, 187, 128,  61, 46, 138, 219, 151, 178, 240, 170, 255, 216, 128,
+		1, 112, 230, 250, 199, 191, 247, 159, 255, 255, 128,  166, 109, 228, 252, 211, 215, 255, 174, 128, 128, 128,  39, 77, 162, 232, 172, 180, 245, 178, 255, 255, 128,
+		1, 52, 220, 246, 198, 199, 249, 220, 255, 255, 128,  124, 74, 191, 243, 183, 193, 250, 221, 255, 255, 128,  24, 71, 130, 219, 154, 170, 243, 182, 255, 255, 128,
+		1, 182, 225, 249, 219, 240, 255, 224, 128, 128, 128,  149, 150, 226, 252, 216, 205, 255, 171, 128, 128, 128,  28, 108, 170, 242, 183, 194, 254, 223, 255, 255, 128,
+		1, 81, 230, 252, 204, 203, 255, 192, 128, 128, 128,  123, 102, 209, 247, 188, 196, 255, 233, 128, 128, 128,  20, 95, 153, 243, 164, 173, 255, 203, 128, 128, 128,
+		1, 222, 248, 255, 216, 213, 128, 128, 128, 128, 128,  168, 175, 246, 252, 235, 205, 255, 255, 128, 128, 128,  47, 116, 215, 255, 211, 212, 255, 255, 128, 128, 128,
+		1, 121, 236, 253, 212, 214, 255, 255, 128, 128, 128,  141, 84, 213, 252, 201, 202, 255, 219, 128, 128, 128,  42, 80, 160, 240, 162, 185, 255, 205, 128, 128, 128,
+		1, 1, 255, 128, 128, 128, 128, 128, 128, 128, 128,  244, 1, 255, 128, 128, 128, 128, 128, 128, 128, 128,  238, 1, 255, 128, 128, 128, 128, 128, 128, 128, 128 };
+	static const uint8_t vp8_coeff_update_probs[4 * 8 * 3 * 11] = {
+		255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		176, 246, 255, 255, 255, 255, 255, 255, 255, 255, 255,  223, 241, 252, 255, 255, 255, 255, 255, 255, 255, 255,  249, 253, 253, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 244, 252, 255, 255, 255, 255, 255, 255, 255, 255,  234, 254, 254, 255, 255, 255, 255, 255, 255, 255, 255,  253, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 246, 254, 255, 255, 255, 255, 255, 255, 255, 255,  239, 253, 254, 255, 255, 255, 255, 255, 255, 255, 255,  254, 255, 254, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 248, 254, 255, 255, 255, 255, 255, 255, 255, 255,  251, 255, 254, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 253, 254, 255, 255, 255, 255, 255, 255, 255, 255,  251, 254, 254, 255, 255, 255, 255, 255, 255, 255, 255,  254, 255, 254, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 254, 253, 255, 254, 255, 255, 255, 255, 255, 255,  250, 255, 254, 255, 254, 255, 255, 255, 255, 255, 255,  254, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		217, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  225, 252, 241, 253, 255, 255, 254, 255, 255, 255, 255,  234, 250, 241, 250, 253, 255, 253, 254, 255, 255, 255,
+		255, 254, 255, 255, 255, 255, 255, 255, 255, 255, 255,  223, 254, 254, 255, 255, 255, 255, 255, 255, 255, 255,  238, 253, 254, 254, 255, 255, 255, 255, 255, 255, 255,
+		255, 248, 254, 255, 255, 255, 255, 255, 255, 255, 255,  249, 254, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 253, 255, 255, 255, 255, 255, 255, 255, 255, 255,  247, 254, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 253, 254, 255, 255, 255, 255, 255, 255, 255, 255,  252, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 254, 254, 255, 255, 255, 255, 255, 255, 255, 255,  253, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 254, 253, 255, 255, 255, 255, 255, 255, 255, 255,  250, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  254, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		186, 251, 250, 255, 255, 255, 255, 255, 255, 255, 255,  234, 251, 244, 254, 255, 255, 255, 255, 255, 255, 255,  251, 251, 243, 253, 254, 255, 254, 255, 255, 255, 255,
+		255, 253, 254, 255, 255, 255, 255, 255, 255, 255, 255,  236, 253, 254, 255, 255, 255, 255, 255, 255, 255, 255,  251, 253, 253, 254, 254, 255, 255, 255, 255, 255, 255,
+		255, 254, 254, 255, 255, 255, 255, 255, 255, 255, 255,  254, 254, 254, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 254, 255, 255, 255, 255, 255, 255, 255, 255, 255,  254, 254, 255, 255, 255, 255, 255, 255, 255, 255, 255,  254, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  254, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		248, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  250, 254, 252, 254, 255, 255, 255, 255, 255, 255, 255,  248, 254, 249, 253, 255, 255, 255, 255, 255, 255, 255,
+		255, 253, 253, 255, 255, 255, 255, 255, 255, 255, 255,  246, 253, 253, 255, 255, 255, 255, 255, 255, 255, 255,  252, 254, 251, 254, 254, 255, 255, 255, 255, 255, 255,
+		255, 254, 252, 255, 255, 255, 255, 255, 255, 255, 255,  248, 254, 253, 255, 255, 255, 255, 255, 255, 255, 255,  253, 255, 254, 254, 255, 255, 255, 255, 255, 255, 255,
+		255, 251, 254, 255, 255, 255, 255, 255, 255, 255, 255,  245, 251, 254, 255, 255, 255, 255, 255, 255, 255, 255,  253, 253, 254, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 251, 253, 255, 255, 255, 255, 255, 255, 255, 255,  252, 253, 254, 255, 255, 255, 255, 255, 255, 255, 255,  255, 254, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 252, 255, 255, 255, 255, 255, 255, 255, 255, 255,  249, 255, 254, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 254, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 253, 255, 255, 255, 255, 255, 255, 255, 255,  250, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  254, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255 };
+
+	// quantizer steps per index (RFC 6386 14.1)
+	static const uint8_t vp8_dc_quant[128] = {
+		4, 5, 6, 7, 8, 9, 10, 10, 11, 12, 13, 14, 15, 16, 17, 17,
+		18, 19, 20, 20, 21, 21, 22, 22, 23, 23, 24, 25, 25, 26, 27, 28,
+		29, 30, 31, 32, 33, 34, 35, 36, 37, 37, 38, 39, 40, 41, 42, 43,
+		44, 45, 46, 46, 47, 48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58,
+		59, 60, 61, 62, 63, 64, 65, 66, 67, 68, 69, 70, 71, 72, 73, 74,
+		75, 76, 76, 77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 88, 89,
+		91, 93, 95, 96, 98, 100, 101, 102, 104, 106, 108, 110, 112, 114, 116, 118,
+		122, 124, 126, 128, 130, 132, 134, 136, 138, 140, 143, 145, 148, 151, 154, 157 };
+	static const uint16_t vp8_ac_quant[128] = {
+		4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19,
+		20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35,
+		36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51,
+		52, 53, 54, 55, 56, 57, 58, 60, 62, 64, 66, 68, 70, 72, 74, 76,
+		78, 80, 82, 84, 86, 88, 90, 92, 94, 96, 98, 100, 102, 104, 106, 108,
+		110, 112, 114, 116, 119, 122, 125, 128, 131, 134, 137, 140, 143, 146, 149, 152,
+		155, 158, 161, 164, 167, 170, 173, 177, 181, 185, 189, 193, 197, 201, 205, 209,
+		213, 217, 221, 225, 229, 234, 239, 245, 249, 254, 259, 264, 269, 274, 279, 284 };
+
+	static const uint8_t vp8_zigzag[16] = { 0, 1, 4, 8, 5, 2, 3, 6, 9, 12, 13, 10, 7, 11, 14, 15 };
+	// band of each coefficient position; the extra entry is the position after the last
+	static const uint8_t vp8_bands[17] = { 0, 1, 2, 3, 6, 4, 5, 6, 6, 6, 6, 6, 6, 6, 6, 7, 0 };
+
+	// Boolean entropy encoder of RFC 6386 section 7; prob is the probability of a 0 in 1/256.
+	struct VP8BoolWriter
+	{
+		std::vector<uint8_t> data;
+		uint32_t range = 255;
+		uint32_t bottom = 0;
+		int bit_count = 24;
+
+		void carry()
+		{
+			size_t i = data.size();
+			while (i > 0 && data[i - 1] == 255) data[--i] = 0;
+			if (i > 0) data[i - 1]++;
+		}
+
+		void put(int bit, int prob)
+		{
+			uint32_t split = 1 + (((range - 1) * (uint32_t)prob) >> 8);
+			if (bit)
+			{
+				bottom += split;
+				range -= split;
+			}
+			else range = split;
+			while (range < 128)
+			{
+				range <<= 1;
+				if (bottom & (1u << 31)) carry();
+				bottom <<= 1;
+				if (!--bit_count)
+				{
+					data.push_back((uint8_t)(bottom >> 24));
+					bottom &= (1u << 24) - 1;
+					bit_count = 8;
+				}
+			}
+		}
+
+		// most significant bit first, each with probability 1/2
+		void put_literal(uint32_t value, int bits)
+		{
+			for (int b = bits - 1; b >= 0; b--) put((value >> b) & 1, 128);
+		}
+
+		void flush()
+		{
+			int c = bit_count;
+			uint32_t v = bottom;
+			if (v & (1u << (32 - c))) carry();
+			v <<= c & 7;
+			for (c >>= 3; c > 0; c--) v <<= 8;
+			for (int i = 0; i < 4; i++, v <<= 8) data.push_back((uint8_t)(v >> 24));
+		}
+	};
+
+	// Token sink counting the branches taken at each adaptive probability.
+	struct VP8TokenStats
+	{
+		std::vector<uint32_t> counts = std::vector<uint32_t>(4 * 8 * 3 * 11 * 2, 0);
+
+		void put(int bit, int index) { counts[index * 2 + (bit ? 1 : 0)]++; }
+		void put_fixed(int, int) {}
+	};
+
+	// Token sink coding into the token partition with the frame's probabilities.
+	struct VP8TokenWriter
+	{
+		VP8BoolWriter& bw;
+		const uint8_t* probs;
+
+		void put(int bit, int index) { bw.put(bit, probs[index]); }
+		void put_fixed(int bit, int prob) { bw.put(bit, prob); }
+	};
+
+	// Codes the zigzag levels of one 4x4 block from position first with the token tree of RFC 6386
+	// section 13.2. ctx is the number of neighbouring blocks (above, left) with non-zero levels;
+	// returns whether this one has any.
+	template<typename Sink>
+	inline bool VP8PutCoeffs(Sink& sink, int type, int ctx, const int16_t* levels, int first)
+	{
+		int last = -1;
+		for (int n = first; n < 16; n++)
+		{
+			if (levels[n] != 0) last = n;
+		}
+		auto node = [&](int n, int c) { return ((type * 8 + vp8_bands[n]) * 3 + c) * 11; };
+
+		int p = node(first, ctx);
+		sink.put(last >= 0, p);
+		if (last < 0) return false;
+		for (int n = first; n < 16;)
+		{
+			int level = levels[n++];
+			int v = abs(level);
+			sink.put(v != 0, p + 1);
+			if (v == 0)
+			{
+				// no end of block after a zero
+				p = node(n, 0);
+				continue;
+			}
+			sink.put(v > 1, p + 2);
+			if (v == 1) p = node(n, 1);
+			else
+			{
+				sink.put(v > 4, p + 3);
+				if (v <= 4)
+				{
+					sink.put(v != 2, p + 4);
+					if (v != 2) sink.put(v == 4, p + 5);
+				}
+				else
+				{
+					sink.put(v > 10, p + 6);
+					if (v <= 10)
+					{
+						sink.put(v > 6, p + 7);
+						if (v <= 6) sink.put_fixed(v == 6, 159);
+						else
+						{
+							sink.put_fixed(v >= 9, 165);
+							sink.put_fixed(!(v & 1), 145);
+						}
+					}
+					else
+					{
+						// categories 3 to 6 start at 11, 19, 35 and 67 with 3, 4, 5 and 11 extra bits
+						static const uint8_t extra_probs[4][11] = {
+							{ 173, 148, 140 }, { 176, 155, 140, 135 }, { 180, 157, 141, 134, 130 },
+							{ 254, 254, 243, 230, 196, 177, 153, 140, 133, 130, 129 } };
+						static const int extra_bits[4] = { 3, 4, 5, 11 };
+						int cat = v < 19 ? 0 : v < 35 ? 1 : v < 67 ? 2 : 3;
+						sink.put(cat >= 2, p + 8);
+						sink.put(cat & 1, p + 9 + (cat >> 1));
+						int extra = v - (3 + (8 << cat));
+						for (int b = 0; b < extra_bits[cat]; b++)
+							sink.put_fixed((extra >> (extra_bits[cat] - 1 - b)) & 1, extra_probs[cat][b]);
+					}
+				}
+				p = node(n, 2);
+			}
+			sink.put_fixed(level < 0, 128);
+			if (n == 16) break;
+			sink.put(n <= last, p);
+			if (n > last) break;
+		}
+		return true;
+	}
+
+	// Forward 4x4 DCT of src - pred (both with stride 16), scaled for VP8InverseTransform.
+	inline void VP8ForwardTransform(const uint8_t* src, const uint8_t* pred, int stride, int16_t* out)
+	{
+		int tmp[16];
+		for (int i = 0; i < 4; i++, src += stride, pred += stride)
+		{
+			int d0 = src[0] - pred[0], d1 = src[1] - pred[1], d2 = src[2] - pred[2], d3 = src[3] - pred[3];
+			int a0 = d0 + d3, a1 = d1 + d2, a2 = d1 - d2, a3 = d0 - d3;
+			tmp[0 + i * 4] = (a0 + a1) * 8;
+			tmp[1 + i * 4] = (a2 * 2217 + a3 * 5352 + 1812) >> 9;
+			tmp[2 + i * 4] = (a0 - a1) * 8;
+			tmp[3 + i * 4] = (a3 * 2217 - a2 * 5352 + 937) >> 9;
+		}
+		for (int i = 0; i < 4; i++)
+		{
+			int a0 = tmp[0 + i] + tmp[12 + i], a1 = tmp[4 + i] + tmp[8 + i];
+			int a2 = tmp[4 + i] - tmp[8 + i], a3 = tmp[0 + i] - tmp[12 + i];
+			out[0 + i] = (int16_t)((a0 + a1 + 7) >> 4);
+			out[4 + i] = (int16_t)(((a2 * 2217 + a3 * 5352 + 12000) >> 16) + (a3 != 0));
+			out[8 + i] = (int16_t)((a0 - a1 + 7) >> 4);
+			out[12 + i] = (int16_t)((a3 * 2217 - a2 * 5352 + 51000) >> 16);
+		}
+	}
+
+	// The decoder's inverse DCT, adding the result to dst in place.
+	inline void VP8InverseTransform(const int16_t* in, uint8_t* dst, int stride)
+	{
+		auto mul1 = [](int a) { return ((a * 20091) >> 16) + a; };
+		auto mul2 = [](int a) { return (a * 35468) >> 16; };
+		int tmp[16];
+		for (int i = 0; i < 4; i++)
+		{
+			int a = in[i] + in[8 + i], b = in[i] - in[8 + i];
+			int c = mul2(in[4 + i]) - mul1(in[12 + i]), d = mul1(in[4 + i]) + mul2(in[12 + i]);
+			tmp[i * 4 + 0] = a + d;
+			tmp[i * 4 + 1] = b + c;
+			tmp[i * 4 + 2] = b - c;
+			tmp[i * 4 + 3] = a - d;
+		}
+		for (int i = 0; i < 4; i++, dst += stride)
+		{
+			int dc = tmp[i] + 4;
+			int a = dc + tmp[8 + i], b = dc - tmp[8 + i];
+			int c = mul2(tmp[4 + i]) - mul1(tmp[12 + i]), d = mul1(tmp[4 + i]) + mul2(tmp[12 + i]);
+			int v[4] = { a + d, b + c, b - c, a - d };
+			for (int x = 0; x < 4; x++) dst[x] = (uint8_t)std::min(std::max(dst[x] + (v[x] >> 3), 0), 255);
+		}
+	}
+
+	// Walsh-Hadamard transform of the 16 luma DCs (in[16 * k] for block k) and its decoder-side
+	// inverse writing out[16 * k].
+	inline void VP8ForwardWHT(const int16_t* in, int16_t* out)
+	{
+		int tmp[16];
+		for (int i = 0; i < 4; i++, in += 64)
+		{
+			int a0 = in[0] + in[32], a1 = in[16] + in[48], a2 = in[16] - in[48], a3 = in[0] - in[32];
+			tmp[0 + i * 4] = a0 + a1;
+			tmp[1 + i * 4] = a3 + a2;
+			tmp[2 + i * 4] = a3 - a2;
+			tmp[3 + i * 4] = a0 - a1;
+		}
+		for (int i = 0; i < 4; i++)
+		{
+			int a0 = tmp[0 + i] + tmp[8 + i], a1 = tmp[4 + i] + tmp[12 + i];
+			int a2 = tmp[4 + i] - tmp[12 + i], a3 = tmp[0 + i] - tmp[8 + i];
+			out[0 + i] = (int16_t)((a0 + a1) >> 1);
+			out[4 + i] = (int16_t)((a3 + a2) >> 1);
+			out[8 + i] = (int16_t)((a3 - a2) >> 1);
+			out[12 + i] = (int16_t)((a0 - a1) >> 1);
+		}
+	}
+
+	inline void VP8InverseWHT(const int16_t* in, int16_t* out)
+	{
+		int tmp[16];
+		for (int i = 0; i < 4; i++)
+		{
+			int a0 = in[0 + i] + in[12 + i], a1 = in[4 + i] + in[8 + i];
+			int a2 = in[4 + i] - in[8 + i], a3 = in[0 + i] - in[12 + i];
+			tmp[0 + i] = a0 + a1;
+			tmp[8 + i] = a0 - a1;
+			tmp[4 + i] = a3 + a2;
+			tmp[12 + i] = a3 - a2;
+		}
+		for (int i = 0; i < 4; i++, out += 64)
+		{
+			int dc = tmp[0 + i * 4] + 3;
+			int a0 = dc + tmp[3 + i * 4], a1 = tmp[1 + i * 4] + tmp[2 + i * 4];
+			int a2 = tmp[1 + i * 4] - tmp[2 + i * 4], a3 = dc - tmp[3 + i * 4];
+			out[0] = (int16_t)((a0 + a1) >> 3);
+			out[16] = (int16_t)((a3 + a2) >> 3);
+			out[32] = (int16_t)((a0 - a1) >> 3);
+			out[48] = (int16_t)((a3 - a2) >> 3);
+		}
+	}
+
+	// Quantizer of one coefficient type: steps and rounding biases (1/256 of a step) for DC and AC.
+	struct VP8Quantizer
+	{
+		int step[2];
+		int bias[2];
+
+		// zigzag levels from raster coefficients, and the dequantized raster coefficients back
+		void quantize(const int16_t* coeffs, int first, int16_t* levels, int16_t* dequantized) const
+		{
+			for (int n = first; n < 16; n++)
+			{
+				int j = vp8_zigzag[n];
+				int q = step[n > 0];
+				int v = std::min((abs(coeffs[j]) * 256 + bias[n > 0] * q) / (q * 256), 2048);
+				levels[n] = (int16_t)(coeffs[j] < 0 ? -v : v);
+				dequantized[j] = (int16_t)(levels[n] * q);
+			}
+		}
+	};
+
+	// 16x16 (luma) or 8x8 (chroma) intra prediction from the row above and the column to the
+	// left. Missing neighbours are 127 above and 129 to the left, as the decoder assumes; mode is
+	// DC, vertical, horizontal or TrueMotion.
+	inline void VP8Predict(int mode, int size, const uint8_t* top, const uint8_t* left, int top_left, bool has_top, bool has_left, uint8_t* out)
+	{
+		if (mode == 0)
+		{
+			int shift = size == 16 ? 4 : 3;
+			int sum = 0;
+			for (int i = 0; i < size; i++) sum += (has_top ? top[i] : 0) + (has_left ? left[i] : 0);
+			int dc = has_top && has_left ? (sum + size) >> (shift + 1)
+				: has_top || has_left ? (sum + size / 2) >> shift : 128;
+			memset(out, dc, (size_t)size * size);
+			return;
+		}
+		for (int y = 0; y < size; y++)
+		{
+			for (int x = 0; x < size; x++)
+			{
+				int v = mode == 1 ? top[x] : mode == 2 ? left[y] : top[x] + left[y] - top_left;
+				out[y * size + x] = (uint8_t)std::min(std::max(v, 0), 255);
+			}
+		}
+	}
+
+	// Per macroblock decisions and levels, in the order the token partition codes them: the luma
+	// DC block, 16 luma blocks, 4 U and 4 V blocks.
+	struct VP8Macroblock
+	{
+		uint8_t luma_mode;
+		uint8_t chroma_mode;
+		bool skip;
+		int16_t levels[25][16];
+	};
+
+	// Codes the residual tokens of all macroblocks, tracking which neighbouring blocks have
+	// non-zero levels; skipped macroblocks code none.
+	template<typename Sink>
+	inline void VP8PutTokens(Sink& sink, const std::vector<VP8Macroblock>& mbs, int mb_w, bool use_skip)
+	{
+		// per macroblock column and row: 4 luma, 2 U and 2 V block flags and the luma DC flag
+		std::vector<uint8_t> top((size_t)mb_w * 9, 0);
+		uint8_t left[9] = {};
+		for (size_t i = 0; i < mbs.size(); i++)
+		{
+			const VP8Macroblock& mb = mbs[i];
+			uint8_t* above = &top[(i % mb_w) * 9];
+			if (i % mb_w == 0) memset(left, 0, sizeof(left));
+			if (use_skip && mb.skip)
+			{
+				memset(above, 0, 9);
+				memset(left, 0, sizeof(left));
+				continue;
+			}
+
+			bool nz = VP8PutCoeffs(sink, 1, above[8] + left[8], mb.levels[0], 0);
+			above[8] = left[8] = nz;
+			for (int y = 0; y < 4; y++)
+			{
+				for (int x = 0; x < 4; x++)
+				{
+					nz = VP8PutCoeffs(sink, 0, above[x] + left[y], mb.levels[1 + y * 4 + x], 1);
+					above[x] = left[y] = nz;
+				}
+			}
+			for (int plane = 0; plane < 2; plane++)
+			{
+				int col = 4 + plane * 2;
+				for (int y = 0; y < 2; y++)
+				{
+					for (int x = 0; x < 2; x++)
+					{
+						nz = VP8PutCoeffs(sink, 2, above[col + x] + left[col + y], mb.levels[17 + plane * 4 + y * 2 + x], 0);
+						above[col + x] = left[col + y] = nz;
+					}
+				}
+			}
+		}
+	}
+
+	// Lossy VP8 key frame of the RGB channels: BT.601 YCbCr 4:2:0, 16x16 luma and 8x8 chroma
+	// intra prediction picked by prediction error, and token probabilities adapted to the image.
+	// Prediction runs on the reconstruction the decoder will see, so errors do not accumulate.
+	// Returns an empty vector if the mode partition outgrows its 19-bit size field.
+	inline std::vector<uint8_t> EncodeVP8(const uint8_t* rgba, int width, int height, int quality)
+	{
+		int mb_w = (width + 15) / 16, mb_h = (height + 15) / 16;
+		int y_stride = mb_w * 16, uv_stride = mb_w * 8;
+
+		// planes padded to whole macroblocks by repeating the last row and column
+		std::vector<uint8_t> src_y((size_t)y_stride * mb_h * 16), src_u((size_t)uv_stride * mb_h * 8), src_v(src_u.size());
+		auto pixel = [&](int x, int y) { return rgba + ((size_t)std::min(y, height - 1) * width + std::min(x, width - 1)) * 4; };
+		for (int y = 0; y < mb_h * 16; y++)
+		{
+			for (int x = 0; x < y_stride; x++)
+			{
+				const uint8_t* p = pixel(x, y);
+				src_y[(size_t)y * y_stride + x] = (uint8_t)(((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16);
+			}
+		}
+		for (int y = 0; y < mb_h * 8; y++)
+		{
+			for (int x = 0; x < uv_stride; x++)
+			{
+				int r = 0, g = 0, b = 0;
+				for (int k = 0; k < 4; k++)
+				{
+					const uint8_t* p = pixel(x * 2 + (k & 1), y * 2 + (k >> 1));
+					r += p[0];
+					g += p[1];
+					b += p[2];
+				}
+				// from the sum of the 2x2 pixels, hence the extra shift by 2
+				src_u[(size_t)y * uv_stride + x] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 512) >> 10) + 128);
+				src_v[(size_t)y * uv_stride + x] = (uint8_t)(((112 * r - 94 * g - 18 * b + 512) >> 10) + 128);
+			}
+		}
+
+		// quality to quantizer index on a cube-root curve, so the steps below 75 stay gentle
+		double c = std::min(std::max(quality, 0), 100) / 100.0;
+		double linear = c < 0.75 ? c * 2.0 / 3.0 : 2.0 * c - 1.0;
+		int qi = std::min(std::max((int)(127.0 * (1.0 - std::cbrt(linear)) + 0.5), 0), 127);
+		// DC and AC steps as the decoder derives them, with rounding biases towards zero
+		VP8Quantizer y1 = { { vp8_dc_quant[qi], vp8_ac_quant[qi] }, { 96, 110 } };
+		VP8Quantizer y2 = { { vp8_dc_quant[qi] * 2, std::max((vp8_ac_quant[qi] * 101581) >> 16, 8) }, { 96, 108 } };
+		VP8Quantizer uv = { { vp8_dc_quant[std::min(qi, 117)], vp8_ac_quant[qi] }, { 110, 115 } };
+		// the decoder deblocks after prediction, so the strength only follows the AC step
+		int filter_level = std::min(vp8_ac_quant[qi] / 4 * 300 / 256, 63);
+		if (filter_level < 2) filter_level = 0;
+
+		std::vector<uint8_t> rec_y(src_y.size()), rec_u(src_u.size()), rec_v(src_v.size());
+		std::vector<VP8Macroblock> mbs((size_t)mb_w * mb_h);
+		size_t num_skipped = 0;
+		for (int mb_y = 0; mb_y < mb_h; mb_y++)
+		{
+			for (int mb_x = 0; mb_x < mb_w; mb_x++)
+			{
+				VP8Macroblock& mb = mbs[(size_t)mb_y * mb_w + mb_x];
+				memset(mb.levels, 0, sizeof(mb.levels));
+
+				// the size x size block of a plane at this macroblock, its prediction and its
+				// reconstructed neighbours
+				struct Block
+				{
+					uint8_t src[256], pred[256], top[16], left[16];
+					int top_left;
+				};
+				auto load = [&](Block& block, const std::vector<uint8_t>& src, const std::vector<uint8_t>& rec, int stride, int size)
+				{
+					int x0 = mb_x * size, y0 = mb_y * size;
+					for (int y = 0; y < size; y++) memcpy(block.src + y * size, &src[(size_t)(y0 + y) * stride + x0], size);
+					for (int i = 0; i < size; i++)
+					{
+						block.top[i] = mb_y > 0 ? rec[(size_t)(y0 - 1) * stride + x0 + i] : 127;
+						block.left[i] = mb_x > 0 ? rec[(size_t)(y0 + i) * stride + x0 - 1] : 129;
+					}
+					block.top_left = mb_y == 0 ? 127 : mb_x == 0 ? 129 : rec[(size_t)(y0 - 1) * stride + x0 - 1];
+				};
+				auto store = [&](const Block& block, std::vector<uint8_t>& rec, int stride, int size)
+				{
+					for (int y = 0; y < size; y++) memcpy(&rec[((size_t)mb_y * size + y) * stride + mb_x * size], block.pred + y * size, size);
+				};
+				// picks the mode with the smallest squared error over the blocks, leaving its
+				// prediction in each
+				auto choose_mode = [&](Block* blocks, int count, int size)
+				{
+					int64_t best_error = INT64_MAX;
+					int best_mode = 0;
+					for (int mode = 0; mode < 4; mode++)
+					{
+						int64_t error = 0;
+						for (int k = 0; k < count; k++)
+						{
+							Block& block = blocks[k];
+							VP8Predict(mode, size, block.top, block.left, block.top_left, mb_y > 0, mb_x > 0, block.pred);
+							for (int i = 0; i < size * size; i++) error += (block.src[i] - block.pred[i]) * (block.src[i] - block.pred[i]);
+						}
+						if (error < best_error)
+						{
+							best_error = error;
+							best_mode = mode;
+						}
+					}
+					for (int k = 0; k < count; k++)
+					{
+						Block& block = blocks[k];
+						VP8Predict(best_mode, size, block.top, block.left, block.top_left, mb_y > 0, mb_x > 0, block.pred);
+					}
+					return (uint8_t)best_mode;
+				};
+
+				// luma: the DCs of the 16 blocks go through the Walsh-Hadamard transform
+				Block luma;
+				load(luma, src_y, rec_y, y_stride, 16);
+				mb.luma_mode = choose_mode(&luma, 1, 16);
+				int16_t coeffs[16][16], dequantized[16][16] = {}, dc[16], dc_dequantized[16] = {};
+				for (int k = 0; k < 16; k++)
+				{
+					int offset = (k / 4) * 64 + (k % 4) * 4;
+					VP8ForwardTransform(luma.src + offset, luma.pred + offset, 16, coeffs[k]);
+				}
+				VP8ForwardWHT(&coeffs[0][0], dc);
+				y2.quantize(dc, 0, mb.levels[0], dc_dequantized);
+				VP8InverseWHT(dc_dequantized, &dequantized[0][0]);
+				for (int k = 0; k < 16; k++)
+				{
+					y1.quantize(coeffs[k], 1, mb.levels[1 + k], dequantized[k]);
+					VP8InverseTransform(dequantized[k], luma.pred + (k / 4) * 64 + (k % 4) * 4, 16);
+				}
+				store(luma, rec_y, y_stride, 16);
+
+				// chroma: one mode for both planes
+				Block chroma[2];
+				load(chroma[0], src_u, rec_u, uv_stride, 8);
+				load(chroma[1], src_v, rec_v, uv_stride, 8);
+				mb.chroma_mode = choose_mode(chroma, 2, 8);
+				for (int plane = 0; plane < 2; plane++)
+				{
+					for (int k = 0; k < 4; k++)
+					{
+						int offset = (k / 2) * 32 + (k % 2) * 4;
+						int16_t block_coeffs[16], block_dequantized[16];
+						VP8ForwardTransform(chroma[plane].src + offset, chroma[plane].pred + offset, 8, block_coeffs);
+						uv.quantize(block_coeffs, 0, mb.levels[17 + plane * 4 + k], block_dequantized);
+						VP8InverseTransform(block_dequantized, chroma[plane].pred + offset, 8);
+					}
+				}
+				store(chroma[0], rec_u, uv_stride, 8);
+				store(chroma[1], rec_v, uv_stride, 8);
+
+				mb.skip = true;
+				for (int i = 0; i < 25 * 16 && mb.skip; i++) mb.skip = mb.levels[i / 16][i % 16] == 0;
+				num_skipped += mb.skip;
+			}
+		}
+
+		// token probabilities: update the defaults where the saving outweighs the update's cost
+		bool use_skip = num_skipped > 0;
+		VP8TokenStats stats;
+		VP8PutTokens(stats, mbs, mb_w, use_skip);
+		auto cost = [](int prob, uint64_t zeros, uint64_t ones)
+		{
+			return -(zeros * std::log2(prob / 256.0) + ones * std::log2((256 - prob) / 256.0));
+		};
+		std::vector<uint8_t> probs(vp8_coeff_probs, vp8_coeff_probs + sizeof(vp8_coeff_probs));
+		std::vector<bool> updated(probs.size(), false);
+		for (size_t i = 0; i < probs.size(); i++)
+		{
+			uint64_t zeros = stats.counts[i * 2], ones = stats.counts[i * 2 + 1], total = zeros + ones;
+			if (total == 0) continue;
+			int prob = (int)std::min(std::max((zeros * 255 + total / 2) / total, (uint64_t)1), (uint64_t)255);
+			double saving = cost(probs[i], zeros, ones) - cost(prob, zeros, ones);
+			double update_cost = 8 + cost(vp8_coeff_update_probs[i], 0, 1) - cost(vp8_coeff_update_probs[i], 1, 0);
+			if (saving > update_cost)
+			{
+				probs[i] = (uint8_t)prob;
+				updated[i] = true;
+			}
+		}
+		size_t num_mbs = mbs.size();
+		int skip_prob = (int)std::min(std::max((num_mbs - num_skipped) * 255 / num_mbs, (size_t)1), (size_t)254);
+
+		// first partition: frame header and the modes of all macroblocks
+		VP8BoolWriter header;
+		header.put_literal(0, 1); // color space
+		header.put_literal(0, 1); // clamping required
+		header.put_literal(0, 1); // no segmentation
+		header.put_literal(0, 1); // normal loop filter
+		header.put_literal(filter_level, 6);
+		header.put_literal(0, 3); // sharpness
+		header.put_literal(0, 1); // no per-mode filter deltas
+		header.put_literal(0, 2); // one token partition
+		header.put_literal(qi, 7);
+		header.put_literal(0, 5); // no quantizer deltas for y1 dc, y2 dc/ac and uv dc/ac
+		header.put_literal(0, 1); // refresh entropy probabilities
+		for (size_t i = 0; i < probs.size(); i++)
+		{
+			header.put(updated[i], vp8_coeff_update_probs[i]);
+			if (updated[i]) header.put_literal(probs[i], 8);
+		}
+		header.put_literal(use_skip, 1);
+		if (use_skip) header.put_literal(skip_prob, 8);
+		for (const VP8Macroblock& mb : mbs)
+		{
+			if (use_skip) header.put(mb.skip, skip_prob);
+			// key frame mode trees of RFC 6386 section 11.2 without the 4x4 modes: DC, V, H, TM
+			header.put(1, 145);
+			header.put(mb.luma_mode >= 2, 156);
+			header.put(mb.luma_mode & 1, mb.luma_mode >= 2 ? 128 : 163);
+			header.put(mb.chroma_mode != 0, 142);
+			if (mb.chroma_mode != 0)
+			{
+				header.put(mb.chroma_mode != 1, 114);
+				if (mb.chroma_mode != 1) header.put(mb.chroma_mode == 3, 183);
+			}
+		}
+		header.flush();
+		if (header.data.size() >= (1u << 19)) return {};
+
+		VP8BoolWriter tokens;
+		VP8TokenWriter writer = { tokens, probs.data() };
+		VP8PutTokens(writer, mbs, mb_w, use_skip);
+		tokens.flush();
+
+		// frame tag of a shown key frame, start code and dimensions without upscaling
+		uint32_t tag = (1u << 4) | ((uint32_t)header.data.size() << 5);
+		std::vector<uint8_t> frame = {
+			(uint8_t)tag, (uint8_t)(tag >> 8), (uint8_t)(tag >> 16), 0x9d, 0x01, 0x2a,
+			(uint8_t)width, (uint8_t)(width >> 8), (uint8_t)height, (uint8_t)(height >> 8) };
+		frame.insert(frame.end(), header.data.begin(), header.data.end());
+		frame.insert(frame.end(), tokens.data.begin(), tokens.data.end());
+		return frame;
+	}
+
+	// ALPH chunk payload: a header byte, then the alpha plane as a VP8L image without the size
+	// header, alpha in green, through whichever of the chunk's spatial filters (none, left, above,
+	// gradient) gives the smallest stream.
+	inline std::vector<uint8_t> EncodeWebPAlpha(const uint8_t* rgba, int width, int height)
+	{
+		auto alpha = [&](int x, int y) { return (int)rgba[((size_t)y * width + x) * 4 + 3]; };
+		std::vector<uint8_t> best;
+		std::vector<uint32_t> argb((size_t)width * height);
+		for (int filter = 0; filter < 4; filter++)
+		{
+			for (int y = 0; y < height; y++)
+			{
+				for (int x = 0; x < width; x++)
+				{
+					// edges predict along the one available direction
+					int pred = 0;
+					if (filter == 0 || (x == 0 && y == 0)) pred = 0;
+					else if (y == 0) pred = alpha(x - 1, 0);
+					else if (x == 0) pred = alpha(0, y - 1);
+					else if (filter == 1) pred = alpha(x - 1, y);
+					else if (filter == 2) pred = alpha(x, y - 1);
+					else pred = std::min(std::max(alpha(x - 1, y) + alpha(x, y - 1) - alpha(x - 1, y - 1), 0), 255);
+					argb[(size_t)y * width + x] = (uint32_t)((alpha(x, y) - pred) & 0xff) << 8;
+				}
+			}
+
+			VP8LBitWriter bw;
+			bw.put(0, 1);
+			VP8LWriteImageData(bw, argb, width, true, 32);
+			bw.flush();
+			if (best.empty() || bw.data.size() + 1 < best.size())
+			{
+				// lossless compression, no preprocessing
+				best.assign(1, (uint8_t)((filter << 2) | 1));
+				best.insert(best.end(), bw.data.begin(), bw.data.end());
+			}
+		}
+		return best;
+	}
+
+	// Encodes RGBA8 pixels as a WebP file: lossless VP8L at quality 100, otherwise lossy VP8 with
+	// any alpha kept lossless in an ALPH chunk. Returns an empty vector for images larger than the
+	// format's 16384 x 16384 limit.
+	inline std::vector<uint8_t> EncodeWebP(const uint8_t* rgba, int width, int height, int quality)
+	{
+		if (width <= 0 || height <= 0 || width > 16384 || height > 16384) return {};
+
+		std::vector<uint8_t> out = { 'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'E', 'B', 'P' };
+		auto put_u32 = [&](uint32_t v) { for (int i = 0; i < 4; i++) out.push_back((uint8_t)(v >> (i * 8))); };
+		auto put_chunk = [&](const char* fourcc, const std::vector<uint8_t>& data)
+		{
+			out.insert(out.end(), fourcc, fourcc + 4);
+			put_u32((uint32_t)data.size());
+			out.insert(out.end(), data.begin(), data.end());
+			if (data.size() & 1) out.push_back(0);
+		};
+
+		std::vector<uint8_t> vp8;
+		if (quality < 100) vp8 = EncodeVP8(rgba, width, height, quality);
+		if (vp8.empty()) put_chunk("VP8L", EncodeVP8L(rgba, width, height));
+		else
+		{
+			bool has_alpha = false;
+			for (size_t i = 0; i < (size_t)width * height && !has_alpha; i++) has_alpha = rgba[i * 4 + 3] != 255;
+			if (has_alpha)
+			{
+				// extended format: alpha flag and the canvas size minus one in 24 bits each
+				std::vector<uint8_t> header = { 0x10, 0, 0, 0,
+					(uint8_t)(width - 1), (uint8_t)((width - 1) >> 8), (uint8_t)((width - 1) >> 16),
+					(uint8_t)(height - 1), (uint8_t)((height - 1) >> 8), (uint8_t)((height - 1) >> 16) };
+				put_chunk("VP8X", header);
+				put_chunk("ALPH", EncodeWebPAlpha(rgba, width, height));
+			}
+			put_chunk("VP8 ", vp8);
+		}
+
+		uint32_t riff_size = (uint32_t)(out.size() - 8);
+		for (int i = 0; i < 4; i++) out[4 + i] = (uint8_t)(riff_size >> (i * 8));
+		return out;
+	}
+}
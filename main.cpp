@@ -12,16 +12,37 @@
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 
+#include <chrono>
 #include <crc64.h>
 #include <filesystem>
 #include <glm.hpp>
 #include <gtc/quaternion.hpp>
 #include <gtx/matrix_decompose.hpp>
+#include <map>
+#include <memory>
 #include <queue>
+#include <sstream>
 #include <unordered_map>
 #include <vector>
 
+#include "Batch.h"
+#include "Bounds.h"
+#include "BufferWriter.h"
+#include "Curves.h"
+#include "Diff.h"
+#include "Draco.h"
 #include "Image.h"
+#include "Jpeg.h"
+#include "MeshOps.h"
+#include "ModelOps.h"
+#include "PointCloud.h"
+#include "Simd.h"
+#include "Subdiv.h"
+#include "TextureFiles.h"
+#include "ThreadPool.h"
+#include "Validate.h"
+#include "Watch.h"
+#include "WebP.h"
 
 namespace Mid {
 struct Material {
@@ -55,6 +76,40 @@ struct Material {
     int idx_metallic_roughness = -1;
     int idx_specular_glossiness = -1;
 };
+
+struct ConvertOptions {
+    // position weld tolerance for vertex-interpolated meshes, negative to disable
+    float weld_epsilon = -1.0f;
+    // run the structural checks on the model before writing it
+    bool validate = false;
+    // KHR_draco_mesh_compression for eligible primitives
+    bool draco = false;
+    DracoOptions draco_options;
+    // EXT_texture_webp quality per texture role
+    WebPOptions webp_options;
+    // quality, or a PSNR/SSIM/size target, of the JPEG textures
+    JpegOptions jpeg_options;
+    // write textures as files beside the output instead of into its buffer
+    bool external_textures = false;
+    // largest octree cell of a GeomPoints cloud, one POINTS primitive per cell
+    size_t point_cell_size = 1 << 18;
+    // tessellation and line/ribbon output of BasisCurves
+    CurveOptions curve_options;
+    // Catmull-Clark levels for meshes whose subdivisionScheme asks for it
+    SubdivOptions subdiv_options;
+    // triangles of the whole scene, shared by the meshes in proportion to their size; 0 keeps all
+    size_t triangle_budget = 0;
+    // longest texture side, reached by halving; 0 keeps the source size
+    int max_texture_size = 0;
+    bool animation = true;
+    bool morphs = true;
+};
+
+// Another file converted from the same loaded stage with its own options (--also).
+struct OutputProfile {
+    std::string path;
+    ConvertOptions options;
+};
 }
 
 inline glm::mat4 mat_convert(const tinyusdz::value::matrix4d& mat)
@@ -63,38 +118,68 @@ inline glm::mat4 mat_convert(const tinyusdz::value::matrix4d& mat)
     return glm::transpose(mat_row);
 }
 
-#if 1
-int main(int argc, char* argv[])
+inline tinygltf::Value aabb_value(const Mid::AABB& box)
 {
-    std::string inputPath = "C:\\Users\\zhanx0o\\OneDrive - KAUST\\WorkingInProcess\\Usd\\assets\\Orc\\Orc.usd";
-    std::string outputPath = "C:\\Users\\zhanx0o\\OneDrive - KAUST\\WorkingInProcess\\Usd\\assets\\Orc\\Orc.gltf";
+    tinygltf::Value::Object obj;
+    std::vector<tinygltf::Value> min_v = { tinygltf::Value(box.min_v.x), tinygltf::Value(box.min_v.y), tinygltf::Value(box.min_v.z) };
+    std::vector<tinygltf::Value> max_v = { tinygltf::Value(box.max_v.x), tinygltf::Value(box.max_v.y), tinygltf::Value(box.max_v.z) };
+    obj["min"] = tinygltf::Value(min_v);
+    obj["max"] = tinygltf::Value(max_v);
+    return tinygltf::Value(obj);
+}
 
-    if (argc < 3) {
-        printf("Usage: usd2glb input.usdc output.glb\n");
-        // return 0;
-    } else {
-        inputPath = argv[1];
-        outputPath = argv[2];
+// Morph target stream; sparse targets only store the vertices the blend shape moves.
+template<typename VecT>
+inline int emit_morph_target(Mid::BufferWriter& writer, const std::vector<VecT>& offsets, const std::vector<bool>& non_zeros, size_t num_pos, bool is_sparse, bool bounds)
+{
+    if (!is_sparse) {
+        std::vector<glm::vec3> deltas(num_pos, glm::vec3(0.0f));
+        for (size_t k = 0; k < num_pos; k++) {
+            if (non_zeros[k]) deltas[k] = { offsets[k].x, offsets[k].y, offsets[k].z };
+        }
+        return writer.emit_accessor<float, 3>(deltas, 0, bounds);
     }
 
-    std::string path_model
-        = std::filesystem::path(inputPath).parent_path().u8string();
-
-    std::string warn;
-    std::string err;
-
-    tinyusdz::Stage stage;
-    tinyusdz::USDLoadOptions options;
-    options.load_assets = false;
-    bool ret = tinyusdz::LoadUSDFromFile(inputPath, &stage, &warn, &err, options);
-    if (!ret) {
-        printf("%s\n", warn.c_str());
-        printf("%s\n", err.c_str());
-        return 0;
+    std::vector<uint32_t> indices;
+    std::vector<glm::vec3> deltas;
+    for (size_t k = 0; k < num_pos; k++) {
+        if (non_zeros[k]) {
+            indices.push_back((uint32_t)k);
+            deltas.push_back({ offsets[k].x, offsets[k].y, offsets[k].z });
+        }
     }
+    if (indices.size() < 1) {
+        indices.push_back(0);
+        deltas.push_back(glm::vec3(0.0f));
+    }
+    return writer.emit_sparse_accessor<float, 3>(num_pos, indices, deltas, bounds);
+}
 
-    // tinyusdz::usda::SaveAsUSDA("output.usda", stage, &warn, &err);
+// JOINTS_0 as unsigned bytes when every index fits, as unsigned shorts otherwise.
+inline int emit_joints(Mid::BufferWriter& writer, const std::vector<glm::u16vec4>& joints)
+{
+    uint16_t max_joint = 0;
+    for (size_t i = 0; i < joints.size(); i++) {
+        for (int j = 0; j < 4; j++) {
+            max_joint = std::max(max_joint, joints[i][j]);
+        }
+    }
+    if (max_joint > 255) {
+        return writer.emit_accessor<uint16_t, 4>(joints, TINYGLTF_TARGET_ARRAY_BUFFER);
+    }
+    std::vector<glm::u8vec4> narrow(joints.size());
+    for (size_t i = 0; i < joints.size(); i++) {
+        narrow[i] = glm::u8vec4(joints[i]);
+    }
+    return writer.emit_accessor<uint8_t, 4>(narrow, TINYGLTF_TARGET_ARRAY_BUFFER);
+}
 
+// Converts a loaded stage into one glTF file. main runs it once, or a second time after a cheaper
+// --preview pass over the same stage. --watch passes a cache that keeps meshes and encoded
+// textures from one run to the next.
+inline int ConvertStage(tinyusdz::Stage& stage, const std::string& path_model, const std::string& outputPath,
+    const Mid::ConvertOptions& options, Mid::ThreadPool& pool, Mid::ImageCache& image_cache, Mid::ConvertCache* cache = nullptr)
+{
     double time_codes_per_sec = stage.metas().timeCodesPerSecond.get_value();
     auto upAxis = stage.metas().upAxis.get_value();
 
@@ -118,11 +203,8 @@ int main(int argc, char* argv[])
     m_out.asset.generator = "tinygltf";
 
     m_out.buffers.resize(1);
-    tinygltf::Buffer& buf_out = m_out.buffers[0];
+    Mid::BufferWriter writer(m_out);
 
-    size_t offset = 0;
-    size_t length = 0;
-    size_t view_id = 0;
     size_t acc_id = 0;
 
     std::vector<Mid::Material> material_lst;
@@ -134,18 +216,70 @@ int main(int argc, char* argv[])
         std::string base_path;
         int idx_material = -1;
         std::string skel_path;
+        // material of each KHR_materials_variants variant, -1 where it keeps idx_material
+        std::vector<int> variant_materials;
     };
 
     std::queue<Prim> queue_prim;
 
     bool specular_used = false;
 
+    // Variant sets whose variants only rebind materials become KHR_materials_variants: the
+    // geometry is converted once with the composed binding and every variant's material is
+    // mapped onto its primitives. Sets that change anything else are left to composition.
+    struct VariantBinding {
+        int variant;
+        std::string material_path;
+    };
+    std::vector<std::string> variant_names;
+    std::unordered_map<std::string, std::vector<VariantBinding>> variant_bindings;
+
+    // triangles of all meshes, which a triangle_budget is split over
+    size_t total_triangles = 0;
+
     queue_prim.push({ root_prim, -1, "" });
     while (!queue_prim.empty()) {
         Prim prim = queue_prim.front();
         queue_prim.pop();
         std::string path = prim.base_path + "/" + prim.prim->element_path().full_path_name();
 
+        for (const auto& set_iter : prim.prim->variantSets()) {
+            const tinyusdz::VariantSet& set_in = set_iter.second;
+            bool bindings_only = !set_in.variantSet.empty();
+            for (const auto& variant_iter : set_in.variantSet) {
+                if (!variant_iter.second.primChildren().empty()) {
+                    bindings_only = false;
+                }
+                // only the all-purpose binding, the one meshes are converted with; a variant that
+                // binds through material:binding:full or :preview is left to composition
+                for (const auto& prop_iter : variant_iter.second.properties()) {
+                    if (prop_iter.first != "material:binding" || !prop_iter.second.is_relationship()) {
+                        bindings_only = false;
+                    }
+                }
+            }
+            if (!bindings_only) {
+                continue;
+            }
+            for (const auto& variant_iter : set_in.variantSet) {
+                int variant_idx = (int)variant_names.size();
+                variant_names.push_back(variant_iter.first);
+                const auto& props = variant_iter.second.properties();
+                auto prop_iter = props.find("material:binding");
+                if (prop_iter != props.end()) {
+                    variant_bindings[path].push_back({ variant_idx, prop_iter->second.get_relationship().targetPath.full_path_name() });
+                }
+            }
+        }
+
+        if (prim.prim->data().type_id() == tinyusdz::value::TYPE_ID_GEOM_MESH && options.triangle_budget > 0) {
+            std::vector<int> counts;
+            prim.prim->data().as<tinyusdz::GeomMesh>()->faceVertexCounts.get_value().value().get_scalar(&counts);
+            for (size_t i = 0; i < counts.size(); i++) {
+                total_triangles += (size_t)std::max(counts[i] - 2, 0);
+            }
+        }
+
         if (prim.prim->data().type_id() == tinyusdz::value::TYPE_ID_MATERIAL) {
             Mid::Material material_mid;
 
@@ -358,6 +492,55 @@ int main(int argc, char* argv[])
         m_out.extensionsUsed.push_back("KHR_materials_pbrSpecularGlossiness");
     }
 
+    // a direct binding hides the variants inherited from above, as it hides the inherited binding
+    auto bind_variants = [&](Prim& prim, const std::string& path, bool bound) {
+        if (bound || prim.variant_materials.size() != variant_names.size()) {
+            prim.variant_materials.assign(variant_names.size(), -1);
+        }
+        auto iter = variant_bindings.find(path);
+        if (iter == variant_bindings.end()) {
+            return;
+        }
+        for (const VariantBinding& binding : iter->second) {
+            auto material_iter = material_map.find(binding.material_path);
+            if (material_iter != material_map.end()) {
+                prim.variant_materials[binding.variant] = material_iter->second;
+            }
+        }
+    };
+
+    // variants that swap the material of a primitive, grouped per material
+    bool variants_used = false;
+    auto map_variants = [&](const Prim& prim, tinygltf::Primitive& prim_out) {
+        std::vector<tinygltf::Value> mappings;
+        std::vector<bool> mapped(prim.variant_materials.size(), false);
+        for (size_t i = 0; i < prim.variant_materials.size(); i++) {
+            int idx_material = prim.variant_materials[i];
+            if (mapped[i] || idx_material < 0 || idx_material == prim_out.material) {
+                continue;
+            }
+            std::vector<tinygltf::Value> variants;
+            for (size_t j = i; j < prim.variant_materials.size(); j++) {
+                if (prim.variant_materials[j] == idx_material) {
+                    variants.push_back(tinygltf::Value((int)j));
+                    mapped[j] = true;
+                }
+            }
+            material_lst[idx_material].double_sided = material_lst[idx_material].double_sided || material_lst[prim_out.material].double_sided;
+
+            tinygltf::Value::Object mapping;
+            mapping["material"] = tinygltf::Value(idx_material);
+            mapping["variants"] = tinygltf::Value(variants);
+            mappings.push_back(tinygltf::Value(mapping));
+        }
+        if (mappings.size() > 0) {
+            tinygltf::Value::Object ext;
+            ext["mappings"] = tinygltf::Value(mappings);
+            prim_out.extensions["KHR_materials_variants"] = tinygltf::Value(ext);
+            variants_used = true;
+        }
+    };
+
     std::unordered_map<std::string, int> joint_map;
     std::unordered_map<int, std::string> node_skin_map;
     std::unordered_map<std::string, int> skin_map;
@@ -370,6 +553,36 @@ int main(int argc, char* argv[])
     std::unordered_map<std::string, std::vector<MorphIdx>> morph_map;
     std::unordered_map<int, int> target_counts;
 
+    // skinning data kept around for the culling bounds written to skin/animation extras
+    const float joint_weight_epsilon = 1e-4f;
+
+    struct SkelInfo {
+        std::vector<int> parents;
+        std::vector<glm::mat4> rest_local;
+        std::vector<glm::mat4> inv_bind;
+        std::vector<Mid::AABB> joint_bounds;
+    };
+
+    struct JointRef {
+        int skin_idx;
+        int joint_idx;
+    };
+
+    struct SkinnedMesh {
+        int node_id;
+        std::vector<glm::vec3> points;
+        std::vector<glm::u16vec4> joints;
+        std::vector<glm::vec4> weights;
+    };
+
+    int default_materials[2] = { -1, -1 };
+
+    std::vector<SkelInfo> skel_lst;
+    std::unordered_map<int, JointRef> joint_skin_map;
+    // quantized GeomPoints positions were written
+    bool points_quantized = false;
+    std::vector<SkinnedMesh> skinned_mesh_lst;
+
     queue_prim.push({ root_prim, -1, "" });
     while (!queue_prim.empty()) {
         Prim prim = queue_prim.front();
@@ -382,6 +595,7 @@ int main(int argc, char* argv[])
                 std::string material_path = node_in->materialBinding.value().targetPath.full_path_name();
                 prim.idx_material = material_map[material_path];
             }
+            bind_variants(prim, path, node_in->materialBinding.has_value());
 
             int node_id = (int)m_out.nodes.size();
 
@@ -416,6 +630,7 @@ int main(int argc, char* argv[])
         } else if (prim.prim->data().type_id() == tinyusdz::value::TYPE_ID_SKEL_ROOT) {
             auto* node_in = prim.prim->data().as<tinyusdz::SkelRoot>();
             int node_id = (int)m_out.nodes.size();
+            bind_variants(prim, path, false);
 
             {
                 auto iter = node_in->props.find("skel:skeleton");
@@ -466,6 +681,7 @@ int main(int argc, char* argv[])
                 std::string material_path = mesh_in->materialBinding.value().targetPath.full_path_name();
                 prim.idx_material = material_map[material_path];
             }
+            bind_variants(prim, path, mesh_in->materialBinding.has_value());
 
             int node_id = (int)m_out.nodes.size();
             int mesh_id = (int)m_out.meshes.size();
@@ -497,7 +713,7 @@ int main(int argc, char* argv[])
             std::vector<bool> target_sparse;
             std::vector<std::vector<bool>> non_zeros_in;
 
-            std::vector<glm::u8vec4> conv_ji_in;
+            std::vector<glm::u16vec4> conv_ji_in;
             std::vector<glm::vec4> conv_jw_in;
 
             std::vector<int> faceVertexIndices;
@@ -509,27 +725,21 @@ int main(int argc, char* argv[])
             std::vector<tinyusdz::value::float2> uv_in;
             std::vector<int> uv_indices_in;
 
+            // unbound meshes share one white material per sidedness; their displayColor,
+            // like a material's diffuse primvar, is exported as COLOR_0
             int idx_material = prim.idx_material;
+            std::string color_varname = "displayColor";
             if (idx_material == -1) {
-                idx_material = (int)material_lst.size();
-                Mid::Material material_mid;
-                auto iter = mesh_in->props.find("primvars:displayColor");
-                if (iter != mesh_in->props.end()) {
-                    auto col = iter->second.get_attribute().get_value<std::vector<tinyusdz::value::float3>>().value()[0];
-                    material_mid.diffuse_color = { col[0], col[1], col[2] };
+                int& idx_default = default_materials[mesh_in->doubleSided.get_value() ? 1 : 0];
+                if (idx_default == -1) {
+                    idx_default = (int)material_lst.size();
+                    Mid::Material material_mid;
+                    material_lst.push_back(material_mid);
                 }
-                material_lst.push_back(material_mid);
+                idx_material = idx_default;
                 prim.idx_material = idx_material;
             } else {
-                Mid::Material material_mid = material_lst[idx_material];
-                auto iter = mesh_in->props.find("primvars:" + material_mid.diffuse_varname);
-                if (iter != mesh_in->props.end()) {
-                    auto col = iter->second.get_attribute().get_value<std::vector<tinyusdz::value::float3>>().value()[0];
-                    material_mid.diffuse_color = { col[0], col[1], col[2] };
-                    idx_material = (int)material_lst.size();
-                    material_lst.push_back(material_mid);
-                    prim.idx_material = idx_material;
-                }
+                color_varname = material_lst[idx_material].diffuse_varname;
             }
 
             Mid::Material& material_mid = material_lst[idx_material];
@@ -539,8 +749,6 @@ int main(int argc, char* argv[])
 
             mesh_in->points.get_value().value().get_scalar(&points_in);
 
-            tinyusdz::Extent extent;
-            mesh_in->extent.get_value().value().get_scalar(&extent);
 
             if (mesh_in->normals.get_value().has_value()) {
                 mesh_in->normals.get_value().value().get_scalar(&norms_in);
@@ -549,6 +757,65 @@ int main(int argc, char* argv[])
             mesh_in->faceVertexIndices.get_value().value().get_scalar(&faceVertexIndices);
             mesh_in->faceVertexCounts.get_value().value().get_scalar(&faceVertexCounts);
 
+            std::vector<glm::u8vec4> colors_in;
+            std::vector<glm::u8vec4> colors_fv;
+            if (color_varname != "") {
+                auto iter = mesh_in->props.find("primvars:" + color_varname);
+                if (iter != mesh_in->props.end()) {
+                    auto attr = iter->second.get_attribute();
+                    auto cols = attr.get_value<std::vector<tinyusdz::value::float3>>().value();
+
+                    std::vector<int> col_indices;
+                    auto iter2 = mesh_in->props.find("primvars:" + color_varname + ":indices");
+                    if (iter2 != mesh_in->props.end()) {
+                        col_indices = iter2->second.get_attribute().get_value<std::vector<int>>().value();
+                    }
+
+                    tinyusdz::Interpolation interpo = tinyusdz::Interpolation::Constant;
+                    if (attr.metas().interpolation.has_value()) {
+                        interpo = attr.metas().interpolation.value();
+                    }
+
+                    auto get_color = [&](size_t idx) {
+                        if (col_indices.size() > 0) {
+                            idx = idx < col_indices.size() ? col_indices[idx] : 0;
+                        }
+                        if (idx >= cols.size()) {
+                            idx = 0;
+                        }
+                        auto col = cols[idx];
+                        glm::vec4 v = glm::clamp(glm::vec4(col[0], col[1], col[2], 1.0f), 0.0f, 1.0f);
+                        return glm::u8vec4(v * 255.0f + 0.5f);
+                    };
+
+                    if (cols.size() > 0) {
+                        if (interpo == tinyusdz::Interpolation::FaceVarying) {
+                            colors_fv.resize(faceVertexIndices.size());
+                            for (size_t i = 0; i < colors_fv.size(); i++) {
+                                colors_fv[i] = get_color(i);
+                            }
+                        } else if (interpo == tinyusdz::Interpolation::Uniform) {
+                            colors_fv.resize(faceVertexIndices.size());
+                            size_t idx_ind = 0;
+                            for (size_t i = 0; i < faceVertexCounts.size(); i++) {
+                                glm::u8vec4 col = get_color(i);
+                                for (int j = 0; j < faceVertexCounts[i] && idx_ind < colors_fv.size(); j++) {
+                                    colors_fv[idx_ind] = col;
+                                    idx_ind++;
+                                }
+                            }
+                        } else if (interpo == tinyusdz::Interpolation::Vertex || interpo == tinyusdz::Interpolation::Varying) {
+                            colors_in.resize(points_in.size());
+                            for (size_t i = 0; i < colors_in.size(); i++) {
+                                colors_in[i] = get_color(i);
+                            }
+                        } else {
+                            colors_in.resize(points_in.size(), get_color(0));
+                        }
+                    }
+                }
+            }
+
             {
                 std::string var_name_uvset = std::string("primvars:") + material_mid.uvset;
                 auto iter = mesh_in->props.find(var_name_uvset);
@@ -580,6 +847,18 @@ int main(int argc, char* argv[])
                     auto jw = iter_jw->second.get_attribute().get_value<std::vector<float>>().value();
                     size_t count = ji.size() / elem_size;
 
+                    // indices past 16 bits cannot be stored in JOINTS_0; their influence is dropped
+                    // (and the validator reports the weights that no longer sum to 1)
+                    size_t dropped = 0;
+                    auto set_influence = [&](size_t i, unsigned j, int index, float weight) {
+                        if (index < 0 || index > 0xFFFF) {
+                            dropped++;
+                            return;
+                        }
+                        conv_ji_in[i][j] = (uint16_t)index;
+                        conv_jw_in[i][j] = weight;
+                    };
+
                     if (constant_joints) {
                         count = points_in.size();
                         conv_ji_in.resize(count, { 0, 0, 0, 0 });
@@ -590,8 +869,7 @@ int main(int argc, char* argv[])
                             if (elem_size < elems)
                                 elems = elem_size;
                             for (unsigned j = 0; j < elems; j++) {
-                                conv_ji_in[i][j] = (uint8_t)ji[j];
-                                conv_jw_in[i][j] = jw[j];
+                                set_influence(i, j, ji[j], jw[j]);
                             }
                         }
                     } else {
@@ -605,17 +883,19 @@ int main(int argc, char* argv[])
                                 elems = elem_size;
                             for (unsigned j = 0; j < elems; j++) {
                                 size_t idx = elem_size * i + j;
-                                conv_ji_in[i][j] = (uint8_t)ji[idx];
-                                conv_jw_in[i][j] = jw[idx];
+                                set_influence(i, j, ji[idx], jw[idx]);
                             }
                         }
                     }
+                    if (dropped > 0) {
+                        printf("%s: dropped %zu joint influences with indices outside 0-65535\n", path.c_str(), dropped);
+                    }
                 }
             }
 
             {
                 auto iter = mesh_in->props.find("skel:blendShapeTargets");
-                if (iter != mesh_in->props.end()) {
+                if (iter != mesh_in->props.end() && options.morphs) {
                     auto paths = iter->second.get_relationship().targetPathVector;
                     auto iter2 = mesh_in->props.find("skel:blendShapes");
                     auto names = iter2->second.get_attribute().get_value<std::vector<tinyusdz::Token>>().value();
@@ -672,10 +952,111 @@ int main(int argc, char* argv[])
                 }
             }
 
-            if (uv_indp_indices) {
+            // a mesh whose inputs are unchanged since the last --watch run is copied from the cache
+            // instead of being subdivided, welded and emitted again
+            uint64_t mesh_key = 0;
+            if (cache != nullptr) {
+                Mid::ContentHash hash;
+                hash.add(points_in);
+                hash.add(norms_in);
+                hash.add(faceVertexIndices);
+                hash.add(faceVertexCounts);
+                hash.add(uv_in);
+                hash.add(uv_indices_in);
+                hash.add(uv_indp_indices);
+                hash.add(colors_in);
+                hash.add(colors_fv);
+                hash.add(conv_ji_in);
+                hash.add(conv_jw_in);
+                hash.add(offsets_in);
+                hash.add(norm_offsets_in);
+                hash.add(target_sparse);
+                hash.add(non_zeros_in);
+                hash.add(leftHand);
+                hash.add(mesh_in->subdivisionScheme.get_value() == tinyusdz::GeomMesh::SubdivisionScheme::CatmullClark);
+                // the mesh's share of a triangle budget depends on the whole scene
+                hash.add(total_triangles);
+                mesh_key = hash.value();
+
+                const Mid::CachedMesh* cached = cache->find_mesh(mesh_key);
+                if (cached != nullptr) {
+                    prim_out = Mid::ReplayMesh(writer, m_out, *cached);
+                    prim_out.material = idx_material;
+                    if (!cached->skin_points.empty()) {
+                        skinned_mesh_lst.push_back({ node_id, cached->skin_points, cached->skin_joints, cached->skin_weights });
+                    }
+                    map_variants(prim, prim_out);
+                    m_out.meshes.push_back(mesh_out);
+                    continue;
+                }
+            }
+
+            int subdiv_levels = 0;
+            if (mesh_in->subdivisionScheme.get_value() == tinyusdz::GeomMesh::SubdivisionScheme::CatmullClark) {
+                subdiv_levels = Mid::SubdivLevels(options.subdiv_options, faceVertexCounts);
+            }
+            if (subdiv_levels > 0) {
+                // indexed UVs are expanded to a plain vertex or face-varying stream first
+                std::vector<tinyusdz::value::float2> uv_stream;
+                if (uv_in.size() > 0) {
+                    uv_stream.resize(uv_indp_indices ? faceVertexIndices.size() : points_in.size());
+                    for (size_t i = 0; i < uv_stream.size(); i++) {
+                        uv_stream[i] = uv_in[uv_indices_in.size() > 0 ? uv_indices_in[i] : i];
+                    }
+                }
+
+                for (int level_idx = 0; level_idx < subdiv_levels; level_idx++) {
+                    Mid::SubdivLevel level;
+                    Mid::BuildSubdivLevel(pool, points_in.size(), faceVertexCounts, faceVertexIndices, level);
+                    Mid::RefineVertexStream(pool, level, points_in);
+                    Mid::RefineVertexStream(pool, level, norms_in);
+                    Mid::RefineVertexStream(pool, level, colors_in);
+                    Mid::RefineFaceVaryingStream(pool, level, colors_fv);
+                    if (uv_indp_indices) {
+                        Mid::RefineFaceVaryingStream(pool, level, uv_stream);
+                    } else {
+                        Mid::RefineVertexStream(pool, level, uv_stream);
+                    }
+                    for (size_t j = 0; j < offsets_in.size(); j++) {
+                        Mid::RefineVertexStream(pool, level, offsets_in[j]);
+                        Mid::RefineVertexStream(pool, level, norm_offsets_in[j]);
+                        Mid::RefineVertexFlags(pool, level, non_zeros_in[j]);
+                    }
+                    if (conv_ji_in.size() > 0) {
+                        Mid::RefineSkinWeights(pool, level, conv_ji_in, conv_jw_in);
+                    }
+                    faceVertexCounts.swap(level.face_counts);
+                    faceVertexIndices.swap(level.face_indices);
+                }
+
+                for (size_t i = 0; i < norms_in.size(); i++) {
+                    glm::vec3 n = { norms_in[i][0], norms_in[i][1], norms_in[i][2] };
+                    float len = glm::length(n);
+                    if (len > 0.0f) {
+                        norms_in[i] = { n.x / len, n.y / len, n.z / len };
+                    }
+                }
+                uv_in.swap(uv_stream);
+                uv_indices_in.clear();
+            }
+
+            // this mesh's share of a preview's triangle budget. Clustering a small mesh down to a
+            // few triangles collapses it to a single cell, so shares below the floor keep that many.
+            const size_t min_triangle_limit = 32;
+            size_t triangle_limit = 0;
+            if (options.triangle_budget > 0 && total_triangles > 0) {
+                size_t mesh_triangles = 0;
+                for (size_t i = 0; i < faceVertexCounts.size(); i++) {
+                    mesh_triangles += (size_t)std::max(faceVertexCounts[i] - 2, 0);
+                }
+                triangle_limit = std::max((size_t)((double)options.triangle_budget * mesh_triangles / total_triangles), min_triangle_limit);
+            }
+
+            if (uv_indp_indices || colors_fv.size() > 0) {
                 struct PointIn {
                     int ind_pnt;
                     tinyusdz::value::float2 uv;
+                    glm::u8vec4 color;
                 };
 
                 std::vector<tinyusdz::value::point3f> points_out;
@@ -685,9 +1066,11 @@ int main(int argc, char* argv[])
                 std::vector<std::vector<tinyusdz::value::vector3f>> norm_offsets_out;
                 std::vector<std::vector<bool>> non_zeros_out;
 
-                std::vector<glm::u8vec4> conv_ji_out;
+                std::vector<glm::u16vec4> conv_ji_out;
                 std::vector<glm::vec4> conv_jw_out;
                 std::vector<tinyusdz::value::float2> uv_out;
+                std::vector<glm::u8vec4> colors_out;
+                bool has_colors = colors_in.size() > 0 || colors_fv.size() > 0;
                 std::unordered_map<uint64_t, int> points_map;
                 std::vector<int> faceVertexIndices_out(faceVertexIndices.size());
 
@@ -701,13 +1084,25 @@ int main(int argc, char* argv[])
                 for (size_t i = 0; i < faceVertexIndices.size(); i++) {
                     PointIn pnt;
                     pnt.ind_pnt = faceVertexIndices[i];
-                    if (uv_indices_in.size() > 0) {
-                        int idx_uv = uv_indices_in[i];
+                    pnt.uv = { 0.0f, 0.0f };
+                    if (uv_indp_indices) {
+                        if (uv_indices_in.size() > 0) {
+                            int idx_uv = uv_indices_in[i];
+                            pnt.uv = uv_in[idx_uv];
+                        } else {
+                            pnt.uv = uv_in[i];
+                        }
+                    } else if (uv_in.size() > 0) {
+                        int idx_uv = uv_indices_in.size() > 0 ? uv_indices_in[pnt.ind_pnt] : pnt.ind_pnt;
                         pnt.uv = uv_in[idx_uv];
-                    } else {
-                        pnt.uv = uv_in[i];
                     }
-                    uint64_t hash = crc64(0, (unsigned char*)&pnt, sizeof(pnt));
+                    pnt.color = glm::u8vec4(255, 255, 255, 255);
+                    if (colors_fv.size() > 0) {
+                        pnt.color = colors_fv[i];
+                    } else if (colors_in.size() > 0) {
+                        pnt.color = colors_in[pnt.ind_pnt];
+                    }
+                    uint64_t hash = Mid::Simd().crc64(0, (unsigned char*)&pnt, sizeof(pnt));
 
                     auto iter = points_map.find(hash);
                     if (iter != points_map.end()) {
@@ -734,6 +1129,9 @@ int main(int argc, char* argv[])
                             conv_jw_out.push_back(conv_jw_in[pnt.ind_pnt]);
                         }
                         uv_out.push_back(pnt.uv);
+                        if (has_colors) {
+                            colors_out.push_back(pnt.color);
+                        }
                         faceVertexIndices_out[i] = idx_out;
                     }
                 }
@@ -787,405 +1185,84 @@ int main(int argc, char* argv[])
                     }
                 }
 
-                offset = buf_out.data.size();
-                length = points_out.size() * sizeof(glm::vec3);
-                buf_out.data.resize(offset + length);
-                memcpy(buf_out.data.data() + offset, points_out.data(), length);
-
-                view_id = m_out.bufferViews.size();
-                {
-                    tinygltf::BufferView view;
-                    view.buffer = 0;
-                    view.byteOffset = offset;
-                    view.byteLength = length;
-                    view.target = TINYGLTF_TARGET_ARRAY_BUFFER;
-                    m_out.bufferViews.push_back(view);
+                std::vector<glm::ivec3> unclustered;
+                if (triangle_limit > 0 && faces.size() > triangle_limit) {
+                    unclustered = faces;
+                    std::vector<int> rep = Mid::ClusterVertices(pool, (const glm::vec3*)points_out.data(), points_out.size(), faces, triangle_limit);
+                    for (size_t i = 0; i < faces.size(); i++) {
+                        faces[i] = { rep[faces[i].x], rep[faces[i].y], rep[faces[i].z] };
+                    }
                 }
 
-                acc_id = m_out.accessors.size();
-                {
-                    tinygltf::Accessor acc;
-                    acc.bufferView = view_id;
-                    acc.byteOffset = 0;
-                    acc.type = TINYGLTF_TYPE_VEC3;
-                    acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                    acc.count = points_out.size();
-                    acc.minValues = { extent.lower[0], extent.lower[1], extent.lower[2] };
-                    acc.maxValues = { extent.upper[0], extent.upper[1], extent.upper[2] };
-                    m_out.accessors.push_back(acc);
+                Mid::RemoveDegenerateFaces(pool, faces, (const glm::vec3*)points_out.data(), points_out.size());
+                if (faces.empty() && !unclustered.empty()) {
+                    // clustering collapsed the whole mesh; a preview keeps it unsimplified instead
+                    faces.swap(unclustered);
+                    Mid::RemoveDegenerateFaces(pool, faces, (const glm::vec3*)points_out.data(), points_out.size());
                 }
-
-                prim_out.attributes["POSITION"] = acc_id;
-
-                if (norms_out.size() > 0) {
-                    offset = buf_out.data.size();
-                    length = norms_out.size() * sizeof(glm::vec3);
-                    buf_out.data.resize(offset + length);
-                    memcpy(buf_out.data.data() + offset, norms_out.data(), length);
-
-                    view_id = m_out.bufferViews.size();
-                    {
-                        tinygltf::BufferView view;
-                        view.buffer = 0;
-                        view.byteOffset = offset;
-                        view.byteLength = length;
-                        view.target = TINYGLTF_TARGET_ARRAY_BUFFER;
-                        m_out.bufferViews.push_back(view);
-                    }
-
-                    acc_id = m_out.accessors.size();
-                    {
-                        tinygltf::Accessor acc;
-                        acc.bufferView = view_id;
-                        acc.byteOffset = 0;
-                        acc.type = TINYGLTF_TYPE_VEC3;
-                        acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                        acc.count = norms_out.size();
-                        m_out.accessors.push_back(acc);
+                {
+                    std::vector<int> new_to_old;
+                    size_t num_verts = points_out.size();
+                    if (Mid::CompactVertices(faces, num_verts, new_to_old)) {
+                        Mid::GatherStream(points_out, new_to_old, num_verts);
+                        Mid::GatherStream(norms_out, new_to_old, num_verts);
+                        for (size_t j = 0; j < num_targets; j++) {
+                            Mid::GatherStream(offsets_out[j], new_to_old, num_verts);
+                            Mid::GatherStream(norm_offsets_out[j], new_to_old, num_verts);
+                            Mid::GatherStream(non_zeros_out[j], new_to_old, num_verts);
+                        }
+                        Mid::GatherStream(conv_ji_out, new_to_old, num_verts);
+                        Mid::GatherStream(conv_jw_out, new_to_old, num_verts);
+                        Mid::GatherStream(uv_out, new_to_old, num_verts);
+                        Mid::GatherStream(colors_out, new_to_old, num_verts);
                     }
-
-                    prim_out.attributes["NORMAL"] = acc_id;
                 }
 
-                offset = buf_out.data.size();
-                length = faces.size() * sizeof(glm::ivec3);
-                buf_out.data.resize(offset + length);
-                memcpy(buf_out.data.data() + offset, faces.data(), length);
-
-                view_id = m_out.bufferViews.size();
-                {
-                    tinygltf::BufferView view;
-                    view.buffer = 0;
-                    view.byteOffset = offset;
-                    view.byteLength = length;
-                    view.target = TINYGLTF_TARGET_ELEMENT_ARRAY_BUFFER;
-                    m_out.bufferViews.push_back(view);
+                if (faces.empty()) {
+                    // every triangle was degenerate: keep the node for its transform, but without a mesh
+                    m_out.nodes[node_id].mesh = -1;
+                    continue;
                 }
 
-                acc_id = m_out.accessors.size();
-                {
-                    tinygltf::Accessor acc;
-                    acc.bufferView = view_id;
-                    acc.byteOffset = 0;
-                    acc.type = TINYGLTF_TYPE_SCALAR;
-                    acc.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT;
-                    acc.count = faces.size() * 3;
-                    m_out.accessors.push_back(acc);
-                }
+                prim_out.attributes["POSITION"] = writer.emit_accessor<float, 3>(points_out, TINYGLTF_TARGET_ARRAY_BUFFER, true);
 
-                prim_out.indices = acc_id;
+                if (norms_out.size() > 0) {
+                    prim_out.attributes["NORMAL"] = writer.emit_accessor<float, 3>(norms_out, TINYGLTF_TARGET_ARRAY_BUFFER);
+                }
 
+                prim_out.indices = writer.emit_accessor<uint32_t, 1>((const uint32_t*)faces.data(), faces.size() * 3, TINYGLTF_TARGET_ELEMENT_ARRAY_BUFFER);
                 if (num_targets > 0) {
                     prim_out.targets.resize(num_targets);
                     for (int lChannelIndex = 0; lChannelIndex < num_targets; ++lChannelIndex) {
                         bool is_sparse = target_sparse[lChannelIndex];
-                        auto& offsets = offsets_out[lChannelIndex];
-                        auto& norm_offsets = norm_offsets_out[lChannelIndex];
                         auto& non_zeros = non_zeros_out[lChannelIndex];
-
                         size_t num_pos = points_out.size();
 
-                        {
-                            std::vector<int> indices;
-                            std::vector<glm::vec3> delta_pos;
-                            glm::vec3 min_pos = { 0.0f, 0.0f, 0.0f };
-                            glm::vec3 max_pos = { 0.0f, 0.0f, 0.0f };
-
-                            for (int k = 0; k < num_pos; k++) {
-                                if (non_zeros[k]) {
-                                    auto pos_offset = offsets[k];
-                                    if (pos_offset.x < min_pos.x)
-                                        min_pos.x = pos_offset.x;
-                                    if (pos_offset.x > max_pos.x)
-                                        max_pos.x = pos_offset.x;
-                                    if (pos_offset.y < min_pos.y)
-                                        min_pos.y = pos_offset.y;
-                                    if (pos_offset.y > max_pos.y)
-                                        max_pos.y = pos_offset.y;
-                                    if (pos_offset.z < min_pos.z)
-                                        min_pos.z = pos_offset.z;
-                                    if (pos_offset.z > max_pos.z)
-                                        max_pos.z = pos_offset.z;
-
-                                    indices.push_back(k);
-                                    delta_pos.push_back({ pos_offset.x, pos_offset.y, pos_offset.z });
-                                }
-                            }
-
-                            if (indices.size() < 1) {
-                                indices.push_back(0);
-                                delta_pos.push_back(glm::vec3(0.0f));
-                            }
-
-                            int num_verts = (int)indices.size();
-                            acc_id = m_out.accessors.size();
-                            if (is_sparse) {
-                                tinygltf::Accessor acc;
-                                acc.byteOffset = 0;
-                                acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                                acc.count = (size_t)(num_pos);
-                                acc.type = TINYGLTF_TYPE_VEC3;
-                                acc.sparse.isSparse = true;
-                                acc.sparse.count = num_verts;
-
-                                acc.maxValues = { max_pos.x, max_pos.y, max_pos.z };
-                                acc.minValues = { min_pos.x, min_pos.y, min_pos.z };
-
-                                offset = buf_out.data.size();
-                                length = sizeof(int) * num_verts;
-                                buf_out.data.resize(offset + length);
-                                memcpy(buf_out.data.data() + offset, indices.data(), length);
-
-                                view_id = m_out.bufferViews.size();
-                                {
-                                    tinygltf::BufferView view;
-                                    view.buffer = 0;
-                                    view.byteOffset = offset;
-                                    view.byteLength = length;
-                                    m_out.bufferViews.push_back(view);
-                                }
-
-                                acc.sparse.indices.bufferView = view_id;
-                                acc.sparse.indices.byteOffset = 0;
-                                acc.sparse.indices.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT;
-
-                                offset = buf_out.data.size();
-                                length = sizeof(glm::vec3) * num_verts;
-                                buf_out.data.resize(offset + length);
-                                memcpy(buf_out.data.data() + offset, delta_pos.data(), length);
-
-                                view_id = m_out.bufferViews.size();
-                                {
-                                    tinygltf::BufferView view;
-                                    view.buffer = 0;
-                                    view.byteOffset = offset;
-                                    view.byteLength = length;
-                                    m_out.bufferViews.push_back(view);
-                                }
-
-                                acc.sparse.values.bufferView = view_id;
-                                acc.sparse.values.byteOffset = 0;
-
-                                m_out.accessors.push_back(acc);
-                            } else {
-                                tinygltf::Accessor acc;
-                                acc.byteOffset = 0;
-                                acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                                acc.count = (size_t)(num_pos);
-                                acc.type = TINYGLTF_TYPE_VEC3;
-
-                                acc.maxValues = { max_pos.x, max_pos.y, max_pos.z };
-                                acc.minValues = { min_pos.x, min_pos.y, min_pos.z };
-
-                                offset = buf_out.data.size();
-                                length = sizeof(glm::vec3) * num_pos;
-                                buf_out.data.resize(offset + length);
-                                memcpy(buf_out.data.data() + offset, delta_pos.data(), length);
-
-                                view_id = m_out.bufferViews.size();
-                                {
-                                    tinygltf::BufferView view;
-                                    view.buffer = 0;
-                                    view.byteOffset = offset;
-                                    view.byteLength = length;
-                                    m_out.bufferViews.push_back(view);
-                                }
-
-                                acc.bufferView = view_id;
-                                acc.byteOffset = 0;
-                                m_out.accessors.push_back(acc);
-                            }
-
-                            prim_out.targets[lChannelIndex]["POSITION"] = acc_id;
-                        }
-
-                        if (norm_offsets.size() > 0) {
-                            std::vector<int> indices;
-                            std::vector<glm::vec3> delta_norm;
-
-                            for (int k = 0; k < num_pos; k++) {
-                                if (non_zeros[k]) {
-                                    auto norm_offset = norm_offsets[k];
-                                    indices.push_back(k);
-                                    delta_norm.push_back({ norm_offset.x, norm_offset.y, norm_offset.z });
-                                }
-                            }
-
-                            if (indices.size() < 1) {
-                                indices.push_back(0);
-                                delta_norm.push_back(glm::vec3(0.0f));
-                            }
-
-                            int num_verts = (int)indices.size();
-                            acc_id = m_out.accessors.size();
-                            if (is_sparse) {
-                                tinygltf::Accessor acc;
-                                acc.byteOffset = 0;
-                                acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                                acc.count = (size_t)(num_pos);
-                                acc.type = TINYGLTF_TYPE_VEC3;
-                                acc.sparse.isSparse = true;
-                                acc.sparse.count = num_verts;
-
-                                offset = buf_out.data.size();
-                                length = sizeof(int) * num_verts;
-                                buf_out.data.resize(offset + length);
-                                memcpy(buf_out.data.data() + offset, indices.data(), length);
-
-                                view_id = m_out.bufferViews.size();
-                                {
-                                    tinygltf::BufferView view;
-                                    view.buffer = 0;
-                                    view.byteOffset = offset;
-                                    view.byteLength = length;
-                                    m_out.bufferViews.push_back(view);
-                                }
-
-                                acc.sparse.indices.bufferView = view_id;
-                                acc.sparse.indices.byteOffset = 0;
-                                acc.sparse.indices.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT;
-
-                                offset = buf_out.data.size();
-                                length = sizeof(glm::vec3) * num_verts;
-                                buf_out.data.resize(offset + length);
-                                memcpy(buf_out.data.data() + offset, delta_norm.data(), length);
-
-                                view_id = m_out.bufferViews.size();
-                                {
-                                    tinygltf::BufferView view;
-                                    view.buffer = 0;
-                                    view.byteOffset = offset;
-                                    view.byteLength = length;
-                                    m_out.bufferViews.push_back(view);
-                                }
-
-                                acc.sparse.values.bufferView = view_id;
-                                acc.sparse.values.byteOffset = 0;
-
-                                m_out.accessors.push_back(acc);
-                            } else {
-                                tinygltf::Accessor acc;
-                                acc.byteOffset = 0;
-                                acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                                acc.count = (size_t)(num_pos);
-                                acc.type = TINYGLTF_TYPE_VEC3;
-
-                                offset = buf_out.data.size();
-                                length = sizeof(glm::vec3) * num_pos;
-                                buf_out.data.resize(offset + length);
-                                memcpy(buf_out.data.data() + offset, delta_norm.data(), length);
-
-                                view_id = m_out.bufferViews.size();
-                                {
-                                    tinygltf::BufferView view;
-                                    view.buffer = 0;
-                                    view.byteOffset = offset;
-                                    view.byteLength = length;
-                                    m_out.bufferViews.push_back(view);
-                                }
-
-                                acc.bufferView = view_id;
-                                acc.byteOffset = 0;
-
-                                m_out.accessors.push_back(acc);
-                            }
-
-                            prim_out.targets[lChannelIndex]["NORMAL"] = acc_id;
+                        prim_out.targets[lChannelIndex]["POSITION"] = emit_morph_target(writer, offsets_out[lChannelIndex], non_zeros, num_pos, is_sparse, true);
+                        if (norm_offsets_out[lChannelIndex].size() > 0) {
+                            prim_out.targets[lChannelIndex]["NORMAL"] = emit_morph_target(writer, norm_offsets_out[lChannelIndex], non_zeros, num_pos, is_sparse, false);
                         }
                     }
                 }
 
-                size_t uv_count = uv_out.size();
-                offset = buf_out.data.size();
-                length = uv_count * sizeof(glm::vec2);
-                buf_out.data.resize(offset + length);
-                float* p_uv = (float*)(buf_out.data.data() + offset);
-                for (size_t i = 0; i < uv_count; i++) {
-                    p_uv[i * 2] = uv_out[i][0];
-                    p_uv[i * 2 + 1] = 1.0f - uv_out[i][1];
-                }
-
-                view_id = m_out.bufferViews.size();
-                {
-                    tinygltf::BufferView view;
-                    view.buffer = 0;
-                    view.byteOffset = offset;
-                    view.byteLength = length;
-                    view.target = TINYGLTF_TARGET_ARRAY_BUFFER;
-                    m_out.bufferViews.push_back(view);
+                if (uv_in.size() > 0) {
+                    std::vector<glm::vec2> uv_flipped(uv_out.size());
+                    for (size_t i = 0; i < uv_out.size(); i++) {
+                        uv_flipped[i] = { uv_out[i][0], 1.0f - uv_out[i][1] };
+                    }
+                    prim_out.attributes["TEXCOORD_0"] = writer.emit_accessor<float, 2>(uv_flipped, TINYGLTF_TARGET_ARRAY_BUFFER);
                 }
 
-                acc_id = m_out.accessors.size();
-                {
-                    tinygltf::Accessor acc;
-                    acc.bufferView = view_id;
-                    acc.byteOffset = 0;
-                    acc.type = TINYGLTF_TYPE_VEC2;
-                    acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                    acc.count = uv_count;
-                    m_out.accessors.push_back(acc);
+                if (colors_out.size() > 0) {
+                    prim_out.attributes["COLOR_0"] = writer.emit_accessor<uint8_t, 4, true>(colors_out, TINYGLTF_TARGET_ARRAY_BUFFER);
                 }
 
-                prim_out.attributes["TEXCOORD_0"] = acc_id;
-
                 if (conv_ji_out.size() > 0) {
-                    size_t count = conv_ji_out.size();
-
-                    offset = buf_out.data.size();
-                    length = sizeof(glm::u8vec4) * count;
-                    buf_out.data.resize(offset + length);
-                    memcpy(buf_out.data.data() + offset, conv_ji_out.data(), length);
-
-                    view_id = m_out.bufferViews.size();
-                    {
-                        tinygltf::BufferView view;
-                        view.buffer = 0;
-                        view.byteOffset = offset;
-                        view.byteLength = length;
-                        view.target = TINYGLTF_TARGET_ARRAY_BUFFER;
-                        m_out.bufferViews.push_back(view);
-                    }
-
-                    acc_id = m_out.accessors.size();
-                    {
-                        tinygltf::Accessor acc;
-                        acc.bufferView = view_id;
-                        acc.byteOffset = 0;
-                        acc.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE;
-                        acc.count = count;
-                        acc.type = TINYGLTF_TYPE_VEC4;
-                        m_out.accessors.push_back(acc);
-                    }
-
-                    prim_out.attributes["JOINTS_0"] = acc_id;
-
-                    offset = buf_out.data.size();
-                    length = sizeof(glm::vec4) * count;
-                    buf_out.data.resize(offset + length);
-                    memcpy(buf_out.data.data() + offset, conv_jw_out.data(), length);
-
-                    view_id = m_out.bufferViews.size();
-                    {
-                        tinygltf::BufferView view;
-                        view.buffer = 0;
-                        view.byteOffset = offset;
-                        view.byteLength = length;
-                        view.target = TINYGLTF_TARGET_ARRAY_BUFFER;
-                        m_out.bufferViews.push_back(view);
-                    }
-
-                    acc_id = m_out.accessors.size();
-                    {
-                        tinygltf::Accessor acc;
-                        acc.bufferView = view_id;
-                        acc.byteOffset = 0;
-                        acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                        acc.count = count;
-                        acc.type = TINYGLTF_TYPE_VEC4;
-                        m_out.accessors.push_back(acc);
-                    }
+                    prim_out.attributes["JOINTS_0"] = emit_joints(writer, conv_ji_out);
+                    prim_out.attributes["WEIGHTS_0"] = writer.emit_accessor<float, 4>(conv_jw_out, TINYGLTF_TARGET_ARRAY_BUFFER);
 
-                    prim_out.attributes["WEIGHTS_0"] = acc_id;
+                    glm::vec3* p_points = (glm::vec3*)points_out.data();
+                    skinned_mesh_lst.push_back({ node_id, std::vector<glm::vec3>(p_points, p_points + points_out.size()), conv_ji_out, conv_jw_out });
                 }
             } else {
                 size_t idx_ind = 0;
@@ -1237,428 +1314,423 @@ int main(int argc, char* argv[])
                     }
                 }
 
-                offset = buf_out.data.size();
-                length = points_in.size() * sizeof(glm::vec3);
-                buf_out.data.resize(offset + length);
-                memcpy(buf_out.data.data() + offset, points_in.data(), length);
+                if (options.weld_epsilon >= 0.0f) {
+                    size_t num_verts = points_in.size();
+                    std::vector<glm::vec2> uv_vert;
+                    if (uv_in.size() > 0) {
+                        uv_vert.resize(num_verts);
+                        for (size_t i = 0; i < num_verts; i++) {
+                            size_t idx = uv_indices_in.size() > 0 ? uv_indices_in[i] : i;
+                            uv_vert[i] = { uv_in[idx][0], uv_in[idx][1] };
+                        }
+                    }
 
-                view_id = m_out.bufferViews.size();
-                {
-                    tinygltf::BufferView view;
-                    view.buffer = 0;
-                    view.byteOffset = offset;
-                    view.byteLength = length;
-                    view.target = TINYGLTF_TARGET_ARRAY_BUFFER;
-                    m_out.bufferViews.push_back(view);
-                }
+                    // exact compare of everything but the position; the hash only narrows candidates
+                    auto same_attribs = [&](int a, int b) {
+                        if (norms_in.size() == num_verts && memcmp(&norms_in[a], &norms_in[b], sizeof(glm::vec3)) != 0)
+                            return false;
+                        if (uv_vert.size() > 0 && uv_vert[a] != uv_vert[b])
+                            return false;
+                        if (colors_in.size() > 0 && colors_in[a] != colors_in[b])
+                            return false;
+                        if (conv_ji_in.size() == num_verts && (conv_ji_in[a] != conv_ji_in[b] || conv_jw_in[a] != conv_jw_in[b]))
+                            return false;
+                        for (size_t j = 0; j < offsets_in.size(); j++) {
+                            if (non_zeros_in[j][a] != non_zeros_in[j][b])
+                                return false;
+                            if (memcmp(&offsets_in[j][a], &offsets_in[j][b], sizeof(glm::vec3)) != 0)
+                                return false;
+                            if (norm_offsets_in[j].size() == num_verts && memcmp(&norm_offsets_in[j][a], &norm_offsets_in[j][b], sizeof(glm::vec3)) != 0)
+                                return false;
+                        }
+                        return true;
+                    };
+
+                    std::vector<uint64_t> attrib_hashes(num_verts);
+                    pool.parallel_for(num_verts, [&](size_t i) {
+                        uint64_t hash = 0;
+                        if (norms_in.size() == num_verts)
+                            hash = Mid::HashBytes(&norms_in[i], sizeof(glm::vec3), hash);
+                        if (uv_vert.size() > 0)
+                            hash = Mid::HashBytes(&uv_vert[i], sizeof(glm::vec2), hash);
+                        if (colors_in.size() > 0)
+                            hash = Mid::HashBytes(&colors_in[i], sizeof(glm::u8vec4), hash);
+                        if (conv_ji_in.size() == num_verts) {
+                            hash = Mid::HashBytes(&conv_ji_in[i], sizeof(glm::u16vec4), hash);
+                            hash = Mid::HashBytes(&conv_jw_in[i], sizeof(glm::vec4), hash);
+                        }
+                        for (size_t j = 0; j < offsets_in.size(); j++) {
+                            hash = Mid::HashBytes(&offsets_in[j][i], sizeof(glm::vec3), hash);
+                        }
+                        attrib_hashes[i] = hash;
+                    }, 1024);
 
-                acc_id = m_out.accessors.size();
-                {
-                    tinygltf::Accessor acc;
-                    acc.bufferView = view_id;
-                    acc.byteOffset = 0;
-                    acc.type = TINYGLTF_TYPE_VEC3;
-                    acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                    acc.count = points_in.size();
-                    acc.minValues = { extent.lower[0], extent.lower[1], extent.lower[2] };
-                    acc.maxValues = { extent.upper[0], extent.upper[1], extent.upper[2] };
-                    m_out.accessors.push_back(acc);
+                    std::vector<int> rep = Mid::WeldVertices(pool, (const glm::vec3*)points_in.data(), num_verts, attrib_hashes.data(), options.weld_epsilon, same_attribs);
+                    for (size_t i = 0; i < faces.size(); i++) {
+                        faces[i] = { rep[faces[i].x], rep[faces[i].y], rep[faces[i].z] };
+                    }
                 }
 
-                prim_out.attributes["POSITION"] = acc_id;
-
-                if (norms_in.size() > 0) {
-                    offset = buf_out.data.size();
-                    length = norms_in.size() * sizeof(glm::vec3);
-                    buf_out.data.resize(offset + length);
-                    memcpy(buf_out.data.data() + offset, norms_in.data(), length);
-
-                    view_id = m_out.bufferViews.size();
-                    {
-                        tinygltf::BufferView view;
-                        view.buffer = 0;
-                        view.byteOffset = offset;
-                        view.byteLength = length;
-                        view.target = TINYGLTF_TARGET_ARRAY_BUFFER;
-                        m_out.bufferViews.push_back(view);
+                std::vector<glm::ivec3> unclustered;
+                if (triangle_limit > 0 && faces.size() > triangle_limit) {
+                    unclustered = faces;
+                    std::vector<int> rep = Mid::ClusterVertices(pool, (const glm::vec3*)points_in.data(), points_in.size(), faces, triangle_limit);
+                    for (size_t i = 0; i < faces.size(); i++) {
+                        faces[i] = { rep[faces[i].x], rep[faces[i].y], rep[faces[i].z] };
                     }
+                }
 
-                    acc_id = m_out.accessors.size();
-                    {
-                        tinygltf::Accessor acc;
-                        acc.bufferView = view_id;
-                        acc.byteOffset = 0;
-                        acc.type = TINYGLTF_TYPE_VEC3;
-                        acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                        acc.count = norms_in.size();
-                        m_out.accessors.push_back(acc);
+                Mid::RemoveDegenerateFaces(pool, faces, (const glm::vec3*)points_in.data(), points_in.size());
+                if (faces.empty() && !unclustered.empty()) {
+                    // clustering collapsed the whole mesh; a preview keeps it unsimplified instead
+                    faces.swap(unclustered);
+                    Mid::RemoveDegenerateFaces(pool, faces, (const glm::vec3*)points_in.data(), points_in.size());
+                }
+                {
+                    std::vector<int> new_to_old;
+                    size_t num_verts = points_in.size();
+                    if (Mid::CompactVertices(faces, num_verts, new_to_old)) {
+                        Mid::GatherStream(points_in, new_to_old, num_verts);
+                        Mid::GatherStream(norms_in, new_to_old, num_verts);
+                        for (size_t j = 0; j < offsets_in.size(); j++) {
+                            Mid::GatherStream(offsets_in[j], new_to_old, num_verts);
+                            Mid::GatherStream(norm_offsets_in[j], new_to_old, num_verts);
+                            Mid::GatherStream(non_zeros_in[j], new_to_old, num_verts);
+                        }
+                        Mid::GatherStream(conv_ji_in, new_to_old, num_verts);
+                        Mid::GatherStream(conv_jw_in, new_to_old, num_verts);
+                        if (uv_indices_in.size() > 0) {
+                            Mid::GatherStream(uv_indices_in, new_to_old, num_verts);
+                        } else {
+                            Mid::GatherStream(uv_in, new_to_old, num_verts);
+                        }
+                        Mid::GatherStream(colors_in, new_to_old, num_verts);
                     }
-
-                    prim_out.attributes["NORMAL"] = acc_id;
                 }
 
-                offset = buf_out.data.size();
-                length = faces.size() * sizeof(glm::ivec3);
-                buf_out.data.resize(offset + length);
-                memcpy(buf_out.data.data() + offset, faces.data(), length);
-
-                view_id = m_out.bufferViews.size();
-                {
-                    tinygltf::BufferView view;
-                    view.buffer = 0;
-                    view.byteOffset = offset;
-                    view.byteLength = length;
-                    view.target = TINYGLTF_TARGET_ELEMENT_ARRAY_BUFFER;
-                    m_out.bufferViews.push_back(view);
+                if (faces.empty()) {
+                    // every triangle was degenerate: keep the node for its transform, but without a mesh
+                    m_out.nodes[node_id].mesh = -1;
+                    continue;
                 }
 
-                acc_id = m_out.accessors.size();
-                {
-                    tinygltf::Accessor acc;
-                    acc.bufferView = view_id;
-                    acc.byteOffset = 0;
-                    acc.type = TINYGLTF_TYPE_SCALAR;
-                    acc.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT;
-                    acc.count = faces.size() * 3;
-                    m_out.accessors.push_back(acc);
+                prim_out.attributes["POSITION"] = writer.emit_accessor<float, 3>(points_in, TINYGLTF_TARGET_ARRAY_BUFFER, true);
+
+                if (norms_in.size() > 0) {
+                    prim_out.attributes["NORMAL"] = writer.emit_accessor<float, 3>(norms_in, TINYGLTF_TARGET_ARRAY_BUFFER);
                 }
 
-                prim_out.indices = acc_id;
+                prim_out.indices = writer.emit_accessor<uint32_t, 1>((const uint32_t*)faces.data(), faces.size() * 3, TINYGLTF_TARGET_ELEMENT_ARRAY_BUFFER);
 
                 int num_targets = offsets_in.size();
                 if (num_targets > 0) {
                     prim_out.targets.resize(num_targets);
                     for (int lChannelIndex = 0; lChannelIndex < num_targets; ++lChannelIndex) {
                         bool is_sparse = target_sparse[lChannelIndex];
-                        auto& offsets = offsets_in[lChannelIndex];
-                        auto& norm_offsets = norm_offsets_in[lChannelIndex];
                         auto& non_zeros = non_zeros_in[lChannelIndex];
-
                         size_t num_pos = points_in.size();
 
-                        {
-                            std::vector<int> indices;
-                            std::vector<glm::vec3> delta_pos;
-                            glm::vec3 min_pos = { 0.0f, 0.0f, 0.0f };
-                            glm::vec3 max_pos = { 0.0f, 0.0f, 0.0f };
-
-                            for (int k = 0; k < num_pos; k++) {
-                                if (non_zeros[k]) {
-                                    auto pos_offset = offsets[k];
-                                    if (pos_offset.x < min_pos.x)
-                                        min_pos.x = pos_offset.x;
-                                    if (pos_offset.x > max_pos.x)
-                                        max_pos.x = pos_offset.x;
-                                    if (pos_offset.y < min_pos.y)
-                                        min_pos.y = pos_offset.y;
-                                    if (pos_offset.y > max_pos.y)
-                                        max_pos.y = pos_offset.y;
-                                    if (pos_offset.z < min_pos.z)
-                                        min_pos.z = pos_offset.z;
-                                    if (pos_offset.z > max_pos.z)
-                                        max_pos.z = pos_offset.z;
-
-                                    indices.push_back(k);
-                                    delta_pos.push_back({ pos_offset.x, pos_offset.y, pos_offset.z });
-                                }
-                            }
-
-                            if (indices.size() < 1) {
-                                indices.push_back(0);
-                                delta_pos.push_back(glm::vec3(0.0f));
-                            }
-
-                            int num_verts = (int)indices.size();
-                            acc_id = m_out.accessors.size();
-                            if (is_sparse) {
-                                tinygltf::Accessor acc;
-                                acc.byteOffset = 0;
-                                acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                                acc.count = (size_t)(num_pos);
-                                acc.type = TINYGLTF_TYPE_VEC3;
-                                acc.sparse.isSparse = true;
-                                acc.sparse.count = num_verts;
-
-                                acc.maxValues = { max_pos.x, max_pos.y, max_pos.z };
-                                acc.minValues = { min_pos.x, min_pos.y, min_pos.z };
-
-                                offset = buf_out.data.size();
-                                length = sizeof(int) * num_verts;
-                                buf_out.data.resize(offset + length);
-                                memcpy(buf_out.data.data() + offset, indices.data(), length);
-
-                                view_id = m_out.bufferViews.size();
-                                {
-                                    tinygltf::BufferView view;
-                                    view.buffer = 0;
-                                    view.byteOffset = offset;
-                                    view.byteLength = length;
-                                    m_out.bufferViews.push_back(view);
-                                }
-
-                                acc.sparse.indices.bufferView = view_id;
-                                acc.sparse.indices.byteOffset = 0;
-                                acc.sparse.indices.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT;
-
-                                offset = buf_out.data.size();
-                                length = sizeof(glm::vec3) * num_verts;
-                                buf_out.data.resize(offset + length);
-                                memcpy(buf_out.data.data() + offset, delta_pos.data(), length);
-
-                                view_id = m_out.bufferViews.size();
-                                {
-                                    tinygltf::BufferView view;
-                                    view.buffer = 0;
-                                    view.byteOffset = offset;
-                                    view.byteLength = length;
-                                    m_out.bufferViews.push_back(view);
-                                }
-
-                                acc.sparse.values.bufferView = view_id;
-                                acc.sparse.values.byteOffset = 0;
-
-                                m_out.accessors.push_back(acc);
-                            } else {
-                                tinygltf::Accessor acc;
-                                acc.byteOffset = 0;
-                                acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                                acc.count = (size_t)(num_pos);
-                                acc.type = TINYGLTF_TYPE_VEC3;
-
-                                acc.maxValues = { max_pos.x, max_pos.y, max_pos.z };
-                                acc.minValues = { min_pos.x, min_pos.y, min_pos.z };
-
-                                offset = buf_out.data.size();
-                                length = sizeof(glm::vec3) * num_pos;
-                                buf_out.data.resize(offset + length);
-                                memcpy(buf_out.data.data() + offset, delta_pos.data(), length);
-
-                                view_id = m_out.bufferViews.size();
-                                {
-                                    tinygltf::BufferView view;
-                                    view.buffer = 0;
-                                    view.byteOffset = offset;
-                                    view.byteLength = length;
-                                    m_out.bufferViews.push_back(view);
-                                }
-
-                                acc.bufferView = view_id;
-                                acc.byteOffset = 0;
-                                m_out.accessors.push_back(acc);
-                            }
-
-                            prim_out.targets[lChannelIndex]["POSITION"] = acc_id;
-                        }
-
-                        if (norm_offsets.size() > 0) {
-                            std::vector<int> indices;
-                            std::vector<glm::vec3> delta_norm;
-
-                            for (int k = 0; k < num_pos; k++) {
-                                if (non_zeros[k]) {
-                                    auto norm_offset = norm_offsets[k];
-                                    indices.push_back(k);
-                                    delta_norm.push_back({ norm_offset.x, norm_offset.y, norm_offset.z });
-                                }
-                            }
-
-                            if (indices.size() < 1) {
-                                indices.push_back(0);
-                                delta_norm.push_back(glm::vec3(0.0f));
-                            }
-
-                            int num_verts = (int)indices.size();
-                            acc_id = m_out.accessors.size();
-                            if (is_sparse) {
-                                tinygltf::Accessor acc;
-                                acc.byteOffset = 0;
-                                acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                                acc.count = (size_t)(num_pos);
-                                acc.type = TINYGLTF_TYPE_VEC3;
-                                acc.sparse.isSparse = true;
-                                acc.sparse.count = num_verts;
-
-                                offset = buf_out.data.size();
-                                length = sizeof(int) * num_verts;
-                                buf_out.data.resize(offset + length);
-                                memcpy(buf_out.data.data() + offset, indices.data(), length);
-
-                                view_id = m_out.bufferViews.size();
-                                {
-                                    tinygltf::BufferView view;
-                                    view.buffer = 0;
-                                    view.byteOffset = offset;
-                                    view.byteLength = length;
-                                    m_out.bufferViews.push_back(view);
-                                }
-
-                                acc.sparse.indices.bufferView = view_id;
-                                acc.sparse.indices.byteOffset = 0;
-                                acc.sparse.indices.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT;
-
-                                offset = buf_out.data.size();
-                                length = sizeof(glm::vec3) * num_verts;
-                                buf_out.data.resize(offset + length);
-                                memcpy(buf_out.data.data() + offset, delta_norm.data(), length);
-
-                                view_id = m_out.bufferViews.size();
-                                {
-                                    tinygltf::BufferView view;
-                                    view.buffer = 0;
-                                    view.byteOffset = offset;
-                                    view.byteLength = length;
-                                    m_out.bufferViews.push_back(view);
-                                }
-
-                                acc.sparse.values.bufferView = view_id;
-                                acc.sparse.values.byteOffset = 0;
-
-                                m_out.accessors.push_back(acc);
-                            } else {
-                                tinygltf::Accessor acc;
-                                acc.byteOffset = 0;
-                                acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                                acc.count = (size_t)(num_pos);
-                                acc.type = TINYGLTF_TYPE_VEC3;
-
-                                offset = buf_out.data.size();
-                                length = sizeof(glm::vec3) * num_pos;
-                                buf_out.data.resize(offset + length);
-                                memcpy(buf_out.data.data() + offset, delta_norm.data(), length);
-
-                                view_id = m_out.bufferViews.size();
-                                {
-                                    tinygltf::BufferView view;
-                                    view.buffer = 0;
-                                    view.byteOffset = offset;
-                                    view.byteLength = length;
-                                    m_out.bufferViews.push_back(view);
-                                }
-
-                                acc.bufferView = view_id;
-                                acc.byteOffset = 0;
-
-                                m_out.accessors.push_back(acc);
-                            }
-
-                            prim_out.targets[lChannelIndex]["NORMAL"] = acc_id;
+                        prim_out.targets[lChannelIndex]["POSITION"] = emit_morph_target(writer, offsets_in[lChannelIndex], non_zeros, num_pos, is_sparse, true);
+                        if (norm_offsets_in[lChannelIndex].size() > 0) {
+                            prim_out.targets[lChannelIndex]["NORMAL"] = emit_morph_target(writer, norm_offsets_in[lChannelIndex], non_zeros, num_pos, is_sparse, false);
                         }
                     }
                 }
 
                 if (uv_in.size() > 0) {
-                    size_t uv_count;
+                    std::vector<glm::vec2> uv_flipped;
                     if (uv_indices_in.size() > 0) {
-                        uv_count = uv_indices_in.size();
-                        offset = buf_out.data.size();
-                        length = uv_count * sizeof(glm::vec2);
-                        buf_out.data.resize(offset + length);
-                        float* p_uv = (float*)(buf_out.data.data() + offset);
-                        for (size_t i = 0; i < uv_count; i++) {
+                        uv_flipped.resize(uv_indices_in.size());
+                        for (size_t i = 0; i < uv_indices_in.size(); i++) {
                             int idx = uv_indices_in[i];
-                            p_uv[i * 2] = uv_in[idx][0];
-                            p_uv[i * 2 + 1] = 1.0f - uv_in[idx][1];
+                            uv_flipped[i] = { uv_in[idx][0], 1.0f - uv_in[idx][1] };
                         }
-
                     } else {
-                        uv_count = uv_in.size();
-                        offset = buf_out.data.size();
-                        length = uv_count * sizeof(glm::vec2);
-                        buf_out.data.resize(offset + length);
-                        float* p_uv = (float*)(buf_out.data.data() + offset);
-                        for (size_t i = 0; i < uv_count; i++) {
-                            p_uv[i * 2] = uv_in[i][0];
-                            p_uv[i * 2 + 1] = 1.0f - uv_in[i][1];
+                        uv_flipped.resize(uv_in.size());
+                        for (size_t i = 0; i < uv_in.size(); i++) {
+                            uv_flipped[i] = { uv_in[i][0], 1.0f - uv_in[i][1] };
                         }
                     }
+                    prim_out.attributes["TEXCOORD_0"] = writer.emit_accessor<float, 2>(uv_flipped, TINYGLTF_TARGET_ARRAY_BUFFER);
+                }
 
-                    view_id = m_out.bufferViews.size();
-                    {
-                        tinygltf::BufferView view;
-                        view.buffer = 0;
-                        view.byteOffset = offset;
-                        view.byteLength = length;
-                        view.target = TINYGLTF_TARGET_ARRAY_BUFFER;
-                        m_out.bufferViews.push_back(view);
-                    }
+                if (colors_in.size() > 0) {
+                    prim_out.attributes["COLOR_0"] = writer.emit_accessor<uint8_t, 4, true>(colors_in, TINYGLTF_TARGET_ARRAY_BUFFER);
+                }
 
-                    acc_id = m_out.accessors.size();
-                    {
-                        tinygltf::Accessor acc;
-                        acc.bufferView = view_id;
-                        acc.byteOffset = 0;
-                        acc.type = TINYGLTF_TYPE_VEC2;
-                        acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                        acc.count = uv_count;
-                        m_out.accessors.push_back(acc);
-                    }
+                if (conv_ji_in.size() > 0) {
+                    prim_out.attributes["JOINTS_0"] = emit_joints(writer, conv_ji_in);
+                    prim_out.attributes["WEIGHTS_0"] = writer.emit_accessor<float, 4>(conv_jw_in, TINYGLTF_TARGET_ARRAY_BUFFER);
 
-                    prim_out.attributes["TEXCOORD_0"] = acc_id;
+                    glm::vec3* p_points = (glm::vec3*)points_in.data();
+                    skinned_mesh_lst.push_back({ node_id, std::vector<glm::vec3>(p_points, p_points + points_in.size()), conv_ji_in, conv_jw_in });
                 }
+            }
 
-                if (conv_ji_in.size() > 0) {
-                    size_t count = conv_ji_in.size();
-
-                    offset = buf_out.data.size();
-                    length = sizeof(glm::u8vec4) * count;
-                    buf_out.data.resize(offset + length);
-                    memcpy(buf_out.data.data() + offset, conv_ji_in.data(), length);
-
-                    view_id = m_out.bufferViews.size();
-                    {
-                        tinygltf::BufferView view;
-                        view.buffer = 0;
-                        view.byteOffset = offset;
-                        view.byteLength = length;
-                        view.target = TINYGLTF_TARGET_ARRAY_BUFFER;
-                        m_out.bufferViews.push_back(view);
-                    }
+            prim_out.mode = TINYGLTF_MODE_TRIANGLES;
+            if (cache != nullptr) {
+                Mid::CachedMesh cached = Mid::CaptureMesh(m_out, prim_out);
+                if (!skinned_mesh_lst.empty() && skinned_mesh_lst.back().node_id == node_id) {
+                    cached.skin_points = skinned_mesh_lst.back().points;
+                    cached.skin_joints = skinned_mesh_lst.back().joints;
+                    cached.skin_weights = skinned_mesh_lst.back().weights;
+                }
+                cache->store_mesh(mesh_key, std::move(cached));
+            }
+            map_variants(prim, prim_out);
+            m_out.meshes.push_back(mesh_out);
+
+        } else if (prim.prim->data().type_id() == tinyusdz::value::TYPE_ID_GEOM_POINTS) {
+            auto* points_in = prim.prim->data().as<tinyusdz::GeomPoints>();
+
+            int idx_material = prim.idx_material;
+            std::string color_varname = "displayColor";
+            if (points_in->materialBinding.has_value()) {
+                std::string material_path = points_in->materialBinding.value().targetPath.full_path_name();
+                idx_material = material_map[material_path];
+            }
+            bind_variants(prim, path, points_in->materialBinding.has_value());
+            if (idx_material == -1) {
+                int& idx_default = default_materials[0];
+                if (idx_default == -1) {
+                    idx_default = (int)material_lst.size();
+                    Mid::Material material_mid;
+                    material_lst.push_back(material_mid);
+                }
+                idx_material = idx_default;
+            } else {
+                color_varname = material_lst[idx_material].diffuse_varname;
+            }
+            prim.idx_material = idx_material;
 
-                    acc_id = m_out.accessors.size();
-                    {
-                        tinygltf::Accessor acc;
-                        acc.bufferView = view_id;
-                        acc.byteOffset = 0;
-                        acc.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE;
-                        acc.count = count;
-                        acc.type = TINYGLTF_TYPE_VEC4;
-                        m_out.accessors.push_back(acc);
+            int node_id = (int)m_out.nodes.size();
+            tinygltf::Node node_out;
+            node_out.name = points_in->name;
+            if (prim.id_node_base < 0) {
+                node_out.rotation = { axis_rot.x, axis_rot.y, axis_rot.z, axis_rot.w };
+                scene_out.nodes.push_back(node_id);
+            }
+            m_out.nodes.push_back(node_out);
+            if (prim.id_node_base >= 0) {
+                m_out.nodes[prim.id_node_base].children.push_back(node_id);
+            }
+            prim.id_node_base = node_id;
+
+            std::vector<tinyusdz::value::point3f> positions;
+            points_in->points.get_value().value().get_scalar(&positions);
+            const glm::vec3* p_points = (const glm::vec3*)positions.data();
+            size_t num_points = positions.size();
+
+            // per-point widths, or one for the whole cloud
+            std::vector<float> widths;
+            if (points_in->widths.get_value().has_value()) {
+                points_in->widths.get_value().value().get_scalar(&widths);
+            }
+            if (widths.size() != num_points && widths.size() != 1) {
+                widths.clear();
+            }
+
+            // per-point colors, or one for the whole cloud
+            std::vector<tinyusdz::value::float3> colors;
+            if (color_varname != "") {
+                auto iter = points_in->props.find("primvars:" + color_varname);
+                if (iter != points_in->props.end()) {
+                    auto attr = iter->second.get_attribute();
+                    colors = attr.get_value<std::vector<tinyusdz::value::float3>>().value();
+                    tinyusdz::Interpolation interpo = tinyusdz::Interpolation::Constant;
+                    if (attr.metas().interpolation.has_value()) {
+                        interpo = attr.metas().interpolation.value();
                     }
+                    bool per_point = interpo == tinyusdz::Interpolation::Vertex || interpo == tinyusdz::Interpolation::Varying;
+                    if (per_point ? colors.size() != num_points : colors.empty()) {
+                        colors.clear();
+                    } else if (!per_point) {
+                        colors.resize(1);
+                    }
+                }
+            }
 
-                    prim_out.attributes["JOINTS_0"] = acc_id;
-
-                    offset = buf_out.data.size();
-                    length = sizeof(glm::vec4) * count;
-                    buf_out.data.resize(offset + length);
-                    memcpy(buf_out.data.data() + offset, conv_jw_in.data(), length);
-
-                    view_id = m_out.bufferViews.size();
-                    {
-                        tinygltf::BufferView view;
-                        view.buffer = 0;
-                        view.byteOffset = offset;
-                        view.byteLength = length;
-                        view.target = TINYGLTF_TARGET_ARRAY_BUFFER;
-                        m_out.bufferViews.push_back(view);
+            std::vector<uint32_t> order;
+            std::vector<Mid::PointCell> cells;
+            Mid::BuildPointOctree(pool, p_points, num_points, options.point_cell_size, 21, order, cells);
+
+            // cells are converted a batch at a time and emitted in order, so only one batch of
+            // per-cell arrays exists besides the source arrays
+            struct PointCellOut {
+                Mid::QuantizedPoints quantized;
+                std::vector<glm::u8vec4> colors;
+                std::vector<float> widths;
+            };
+            size_t batch = (size_t)pool.num_threads() * 2;
+            std::vector<PointCellOut> cell_out(std::min(batch, cells.size()));
+            for (size_t c0 = 0; c0 < cells.size(); c0 += batch) {
+                size_t c1 = std::min(cells.size(), c0 + batch);
+                pool.parallel_for(c1 - c0, [&](size_t k) {
+                    const Mid::PointCell& cell = cells[c0 + k];
+                    const uint32_t* indices = order.data() + cell.begin;
+                    size_t count = cell.end - cell.begin;
+                    PointCellOut& out = cell_out[k];
+                    Mid::QuantizePoints(p_points, indices, count, out.quantized);
+                    out.colors.clear();
+                    if (colors.size() > 0) {
+                        out.colors.resize(count);
+                        for (size_t i = 0; i < count; i++) {
+                            auto col = colors[colors.size() == 1 ? 0 : indices[i]];
+                            glm::vec4 v = glm::clamp(glm::vec4(col[0], col[1], col[2], 1.0f), 0.0f, 1.0f);
+                            out.colors[i] = glm::u8vec4(v * 255.0f + 0.5f);
+                        }
                     }
+                    out.widths.clear();
+                    if (widths.size() == num_points && num_points > 1) {
+                        out.widths.resize(count);
+                        for (size_t i = 0; i < count; i++) {
+                            out.widths[i] = widths[indices[i]];
+                        }
+                    }
+                });
+
+                for (size_t k = 0; k < c1 - c0; k++) {
+                    PointCellOut& out = cell_out[k];
+                    size_t count = cells[c0 + k].end - cells[c0 + k].begin;
+
+                    tinygltf::Mesh mesh_out;
+                    mesh_out.name = node_out.name;
+                    mesh_out.primitives.resize(1);
+                    auto& prim_out = mesh_out.primitives[0];
+                    prim_out.mode = TINYGLTF_MODE_POINTS;
+                    prim_out.material = idx_material;
+                    prim_out.attributes["POSITION"] = writer.emit_padded_accessor<uint16_t, 3, 4>(out.quantized.positions.data(), count, TINYGLTF_TARGET_ARRAY_BUFFER, true);
+                    if (out.colors.size() > 0) {
+                        prim_out.attributes["COLOR_0"] = writer.emit_accessor<uint8_t, 4, true>(out.colors, TINYGLTF_TARGET_ARRAY_BUFFER);
+                    }
+                    if (out.widths.size() > 0) {
+                        prim_out.attributes["_WIDTH"] = writer.emit_accessor<float, 1>(out.widths, TINYGLTF_TARGET_ARRAY_BUFFER);
+                    } else if (widths.size() > 0) {
+                        tinygltf::Value::Object extras;
+                        extras["width"] = tinygltf::Value((double)widths[0]);
+                        mesh_out.extras = tinygltf::Value(extras);
+                    }
+                    map_variants(prim, prim_out);
+
+                    int cell_node_id = (int)m_out.nodes.size();
+                    tinygltf::Node cell_node;
+                    cell_node.name = node_out.name + "_" + std::to_string(c0 + k);
+                    cell_node.mesh = (int)m_out.meshes.size();
+                    cell_node.translation = { out.quantized.translation.x, out.quantized.translation.y, out.quantized.translation.z };
+                    cell_node.scale = { out.quantized.scale.x, out.quantized.scale.y, out.quantized.scale.z };
+                    m_out.meshes.push_back(mesh_out);
+                    m_out.nodes.push_back(cell_node);
+                    m_out.nodes[node_id].children.push_back(cell_node_id);
+                }
+            }
+            points_quantized = points_quantized || cells.size() > 0;
+
+        } else if (prim.prim->data().type_id() == tinyusdz::value::TYPE_ID_GEOM_BASIS_CURVES) {
+            auto* curves_in = prim.prim->data().as<tinyusdz::GeomBasisCurves>();
 
-                    acc_id = m_out.accessors.size();
-                    {
-                        tinygltf::Accessor acc;
-                        acc.bufferView = view_id;
-                        acc.byteOffset = 0;
-                        acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                        acc.count = count;
-                        acc.type = TINYGLTF_TYPE_VEC4;
-                        m_out.accessors.push_back(acc);
+            // ribbons are seen from both sides, so unbound ones take the double-sided default
+            int idx_material = prim.idx_material;
+            std::string color_varname = "displayColor";
+            if (curves_in->materialBinding.has_value()) {
+                std::string material_path = curves_in->materialBinding.value().targetPath.full_path_name();
+                idx_material = material_map[material_path];
+            }
+            bind_variants(prim, path, curves_in->materialBinding.has_value());
+            if (idx_material == -1) {
+                int& idx_default = default_materials[options.curve_options.ribbons ? 1 : 0];
+                if (idx_default == -1) {
+                    idx_default = (int)material_lst.size();
+                    Mid::Material material_mid;
+                    material_mid.double_sided = options.curve_options.ribbons;
+                    material_lst.push_back(material_mid);
+                }
+                idx_material = idx_default;
+            } else {
+                color_varname = material_lst[idx_material].diffuse_varname;
+            }
+            prim.idx_material = idx_material;
+
+            Mid::CurveBasis basis = Mid::CurveBasis::Linear;
+            if (!curves_in->type.has_value() || curves_in->type.value() == tinyusdz::GeomBasisCurves::Type::Cubic) {
+                basis = Mid::CurveBasis::Bezier;
+                if (curves_in->basis.has_value()) {
+                    if (curves_in->basis.value() == tinyusdz::GeomBasisCurves::Basis::Bspline) {
+                        basis = Mid::CurveBasis::Bspline;
+                    } else if (curves_in->basis.value() == tinyusdz::GeomBasisCurves::Basis::CatmullRom) {
+                        basis = Mid::CurveBasis::CatmullRom;
                     }
+                }
+            }
+            Mid::CurveWrap wrap = Mid::CurveWrap::Nonperiodic;
+            if (curves_in->wrap.has_value()) {
+                if (curves_in->wrap.value() == tinyusdz::GeomBasisCurves::Wrap::Periodic) {
+                    wrap = Mid::CurveWrap::Periodic;
+                } else if (curves_in->wrap.value() == tinyusdz::GeomBasisCurves::Wrap::Pinned) {
+                    wrap = Mid::CurveWrap::Pinned;
+                }
+            }
 
-                    prim_out.attributes["WEIGHTS_0"] = acc_id;
+            std::vector<tinyusdz::value::point3f> positions;
+            std::vector<int> counts;
+            curves_in->points.get_value().value().get_scalar(&positions);
+            curves_in->curveVertexCounts.get_value().value().get_scalar(&counts);
+
+            std::vector<float> widths;
+            if (curves_in->widths.get_value().has_value()) {
+                curves_in->widths.get_value().value().get_scalar(&widths);
+            }
+            std::vector<tinyusdz::value::float3> colors;
+            if (color_varname != "") {
+                auto iter = curves_in->props.find("primvars:" + color_varname);
+                if (iter != curves_in->props.end()) {
+                    colors = iter->second.get_attribute().get_value<std::vector<tinyusdz::value::float3>>().value();
                 }
             }
+            Mid::CurvePrimvar width_var, color_var;
+            if (widths.size() > 0) {
+                width_var = { widths.data(), widths.size(), 1 };
+            }
+            if (colors.size() > 0) {
+                color_var = { colors[0].data(), colors.size(), 3 };
+            }
 
-            prim_out.mode = TINYGLTF_MODE_TRIANGLES;
-            m_out.meshes.push_back(mesh_out);
+            glm::vec3 up = upAxis == tinyusdz::Axis::X ? glm::vec3(1.0f, 0.0f, 0.0f) : (upAxis == tinyusdz::Axis::Z ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f));
+            Mid::CurveBatch batch;
+            Mid::TessellateCurves(pool, basis, wrap, (const glm::vec3*)positions.data(), positions.size(), counts, width_var, color_var, up, options.curve_options, batch);
+
+            int node_id = (int)m_out.nodes.size();
+            tinygltf::Node node_out;
+            node_out.name = curves_in->name;
+            if (prim.id_node_base < 0) {
+                node_out.rotation = { axis_rot.x, axis_rot.y, axis_rot.z, axis_rot.w };
+                scene_out.nodes.push_back(node_id);
+            }
+            if (batch.positions.size() > 0) {
+                tinygltf::Mesh mesh_out;
+                mesh_out.name = node_out.name;
+                mesh_out.primitives.resize(1);
+                auto& prim_out = mesh_out.primitives[0];
+                prim_out.mode = batch.mode;
+                prim_out.material = idx_material;
+                prim_out.attributes["POSITION"] = writer.emit_accessor<float, 3>(batch.positions, TINYGLTF_TARGET_ARRAY_BUFFER, true);
+                if (batch.normals.size() > 0) {
+                    prim_out.attributes["NORMAL"] = writer.emit_accessor<float, 3>(batch.normals, TINYGLTF_TARGET_ARRAY_BUFFER);
+                }
+                if (batch.colors.size() > 0) {
+                    prim_out.attributes["COLOR_0"] = writer.emit_accessor<uint8_t, 4, true>(batch.colors, TINYGLTF_TARGET_ARRAY_BUFFER);
+                }
+                if (batch.indices.size() > 0) {
+                    prim_out.indices = writer.emit_accessor<uint32_t, 1>(batch.indices, TINYGLTF_TARGET_ELEMENT_ARRAY_BUFFER);
+                }
+                map_variants(prim, prim_out);
+                node_out.mesh = (int)m_out.meshes.size();
+                m_out.meshes.push_back(mesh_out);
+            }
+            m_out.nodes.push_back(node_out);
+            if (prim.id_node_base >= 0) {
+                m_out.nodes[prim.id_node_base].children.push_back(node_id);
+            }
+            prim.id_node_base = node_id;
 
         } else if (prim.prim->data().type_id() == tinyusdz::value::TYPE_ID_SKELETON) {
             int skin_idx = (int)m_out.skins.size();
@@ -1674,6 +1746,11 @@ int main(int argc, char* argv[])
 
             std::vector<glm::mat4> inv_binding_matrices(bindTrans.size());
 
+            SkelInfo skel_info;
+            skel_info.parents.resize(joints.size(), -1);
+            skel_info.rest_local.resize(joints.size());
+            std::unordered_map<std::string, int> joint_idx_map;
+
             for (size_t i = 0; i < joints.size(); i++) {
                 int node_id = (int)m_out.nodes.size();
 
@@ -1681,6 +1758,8 @@ int main(int argc, char* argv[])
 
                 std::string path = joints[i].str();
                 joint_map[path] = node_id;
+                joint_idx_map[path] = (int)i;
+                joint_skin_map[node_id] = { skin_idx, (int)i };
 
                 auto bind = bindTrans[i];
                 glm::mat4 bindMat;
@@ -1697,6 +1776,8 @@ int main(int argc, char* argv[])
                 tinygltf::Node node_out;
 
                 glm::mat4 mat = *(glm::dmat4*)(&rest);
+                skel_info.rest_local[i] = mat;
+
                 glm::vec3 scale;
                 glm::quat rotation;
                 glm::vec3 translation;
@@ -1721,34 +1802,15 @@ int main(int argc, char* argv[])
                     node_out.name = path.substr(pos + 1);
                     int id_parent = joint_map[path.substr(0, pos)];
                     m_out.nodes[id_parent].children.push_back(node_id);
+                    skel_info.parents[i] = joint_idx_map[path.substr(0, pos)];
                 }
                 m_out.nodes.push_back(node_out);
             }
 
-            offset = buf_out.data.size();
-            length = sizeof(glm::mat4) * inv_binding_matrices.size();
-            buf_out.data.resize(offset + length);
-            memcpy(buf_out.data.data() + offset, inv_binding_matrices.data(), length);
-
-            view_id = m_out.bufferViews.size();
-            {
-                tinygltf::BufferView view;
-                view.buffer = 0;
-                view.byteOffset = offset;
-                view.byteLength = length;
-                m_out.bufferViews.push_back(view);
-            }
+            skel_info.inv_bind = inv_binding_matrices;
+            skel_lst.push_back(skel_info);
 
-            acc_id = m_out.accessors.size();
-            {
-                tinygltf::Accessor acc;
-                acc.bufferView = view_id;
-                acc.byteOffset = 0;
-                acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                acc.count = inv_binding_matrices.size();
-                acc.type = TINYGLTF_TYPE_MAT4;
-                m_out.accessors.push_back(acc);
-            }
+            acc_id = writer.emit_accessor<float, 16>(inv_binding_matrices);
 
             skin_out.inverseBindMatrices = acc_id;
         }
@@ -1757,22 +1819,72 @@ int main(int argc, char* argv[])
             && prim.prim->data().type_id() != tinyusdz::value::TYPE_ID_GEOM_MESH) {
             size_t num_children = prim.prim->children().size();
             for (size_t i = 0; i < num_children; i++) {
-                queue_prim.push({ &prim.prim->children()[i], prim.id_node_base, path, prim.idx_material, prim.skel_path });
+                queue_prim.push({ &prim.prim->children()[i], prim.id_node_base, path, prim.idx_material, prim.skel_path, prim.variant_materials });
             }
         }
     }
 
+    if (points_quantized) {
+        m_out.extensionsUsed.push_back("KHR_mesh_quantization");
+        m_out.extensionsRequired.push_back("KHR_mesh_quantization");
+    }
+    if (variants_used) {
+        std::vector<tinygltf::Value> variants;
+        for (size_t i = 0; i < variant_names.size(); i++) {
+            tinygltf::Value::Object variant;
+            variant["name"] = tinygltf::Value(variant_names[i]);
+            variants.push_back(tinygltf::Value(variant));
+        }
+        tinygltf::Value::Object ext;
+        ext["variants"] = tinygltf::Value(variants);
+        m_out.extensions["KHR_materials_variants"] = tinygltf::Value(ext);
+        m_out.extensionsUsed.push_back("KHR_materials_variants");
+    }
+
     std::vector<Mid::Image> tex_lst;
+    // WebP quality of each texture, -1 for none
+    std::vector<int> tex_webp;
+
+    // materials packing the same maps the same way (the variants of one product, typically)
+    // share the texture, so it is loaded and encoded once; with a cache, a texture whose sources
+    // did not change since the last --watch run is not built at all
+    std::unordered_map<std::string, int> tex_map;
+    std::vector<std::string> tex_keys;
+    std::vector<bool> tex_cached;
+    auto shared_texture = [&](const std::string& key, int& idx_tex, int webp_quality) {
+        auto iter = tex_map.find(key);
+        if (iter != tex_map.end()) {
+            idx_tex = iter->second;
+            return true;
+        }
+        tex_map[key] = (int)tex_lst.size();
+        tex_keys.push_back(key);
+        Mid::Image img;
+        if (cache != nullptr && cache->find_texture(key, img)) {
+            idx_tex = (int)tex_lst.size();
+            tex_lst.push_back(img);
+            tex_webp.push_back(webp_quality);
+            tex_cached.push_back(true);
+            return true;
+        }
+        tex_cached.push_back(false);
+        return false;
+    };
+    // source file of a material map, as loaded and as listed in the texture keys
+    auto source = [&](const std::string& tex) {
+        return tex.empty() ? tex : path_model + "/" + tex;
+    };
 
     for (size_t i = 0; i < material_lst.size(); i++) {
         auto& material = material_lst[i];
-        if (material.diffuse_tex != "" || material.opacity_tex != "") {
+        if ((material.diffuse_tex != "" || material.opacity_tex != "")
+            && !shared_texture("rgba\n" + source(material.diffuse_tex) + "\n" + source(material.opacity_tex), material.idx_diffuse_alpha, options.webp_options.color)) {
             Mid::Image img_diffuse, img_opacity;
             if (material.diffuse_tex != "") {
-                img_diffuse.Load((path_model + "/" + material.diffuse_tex).c_str());
+                img_diffuse = image_cache.load(source(material.diffuse_tex));
             }
             if (material.opacity_tex != "") {
-                img_opacity.Load((path_model + "/" + material.opacity_tex).c_str());
+                img_opacity = image_cache.load(source(material.opacity_tex));
             }
 
             int idx = (int)tex_lst.size();
@@ -1781,25 +1893,29 @@ int main(int argc, char* argv[])
             Mid::Image& img = tex_lst[idx];
             img.CreateRGBA(img_diffuse, img_opacity);
             material.idx_diffuse_alpha = idx;
+            tex_webp.push_back(options.webp_options.color);
         }
-        if (material.emissive_tex != "") {
+        if (material.emissive_tex != "" && !shared_texture("emissive\n" + source(material.emissive_tex), material.idx_emissive, options.webp_options.emissive)) {
             int idx = (int)tex_lst.size();
             tex_lst.resize(idx + 1);
 
             Mid::Image& img = tex_lst[idx];
-            img.Load((path_model + "/" + material.emissive_tex).c_str());
+            img = image_cache.load(source(material.emissive_tex));
 
             material.idx_emissive = idx;
+            tex_webp.push_back(options.webp_options.emissive);
         }
 
         if (material.useSpecularWorkflow) {
-            if (material.specular_tex != "" || material.roughness_tex != "") {
+            // glossiness falls back to the roughness factor when there is no roughness map
+            if ((material.specular_tex != "" || material.roughness_tex != "")
+                && !shared_texture("sg\n" + source(material.specular_tex) + "\n" + source(material.roughness_tex) + "\n" + std::to_string(material.roughness), material.idx_specular_glossiness, options.webp_options.specular_glossiness)) {
                 Mid::Image img_specular, img_roughness;
                 if (material.specular_tex != "") {
-                    img_specular.Load((path_model + "/" + material.specular_tex).c_str());
+                    img_specular = image_cache.load(source(material.specular_tex));
                 }
                 if (material.roughness_tex != "") {
-                    img_roughness.Load((path_model + "/" + material.roughness_tex).c_str());
+                    img_roughness = image_cache.load(source(material.roughness_tex));
                 }
 
                 int idx = (int)tex_lst.size();
@@ -1808,15 +1924,17 @@ int main(int argc, char* argv[])
                 Mid::Image& img = tex_lst[idx];
                 img.CreateSG(img_specular, img_roughness, material.roughness);
                 material.idx_specular_glossiness = idx;
+                tex_webp.push_back(options.webp_options.specular_glossiness);
             }
         } else {
-            if (material.metallic_tex != "" || material.roughness_tex != "") {
+            if ((material.metallic_tex != "" || material.roughness_tex != "")
+                && !shared_texture("mr\n" + source(material.metallic_tex) + "\n" + source(material.roughness_tex), material.idx_metallic_roughness, options.webp_options.metallic_roughness)) {
                 Mid::Image img_metallic, img_roughness;
                 if (material.metallic_tex != "") {
-                    img_metallic.Load((path_model + "/" + material.metallic_tex).c_str());
+                    img_metallic = image_cache.load(source(material.metallic_tex));
                 }
                 if (material.roughness_tex != "") {
-                    img_roughness.Load((path_model + "/" + material.roughness_tex).c_str());
+                    img_roughness = image_cache.load(source(material.roughness_tex));
                 }
 
                 int idx = (int)tex_lst.size();
@@ -1825,6 +1943,7 @@ int main(int argc, char* argv[])
                 Mid::Image& img = tex_lst[idx];
                 img.CreateMR(img_metallic, img_roughness);
                 material.idx_metallic_roughness = idx;
+                tex_webp.push_back(options.webp_options.metallic_roughness);
             }
         }
     }
@@ -1834,37 +1953,87 @@ int main(int argc, char* argv[])
     sampler.minFilter = TINYGLTF_TEXTURE_FILTER_LINEAR_MIPMAP_LINEAR;
     sampler.magFilter = TINYGLTF_TEXTURE_FILTER_LINEAR;
 
-    m_out.images.resize(tex_lst.size());
-    m_out.textures.resize(tex_lst.size());
-    for (size_t i = 0; i < tex_lst.size(); i++) {
-        Mid::Image& img_mid = tex_lst[i];
-        tinygltf::Image& img_out = m_out.images[i];
-        tinygltf::Texture& tex_out = m_out.textures[i];
-
-        length = img_mid.code.size();
-        offset = buf_out.data.size();
-        buf_out.data.resize((offset + length + 3) / 4 * 4);
-        memcpy(buf_out.data.data() + offset, img_mid.code.data(), length);
+    // encode from the packed pixels, one texture per task; the PNG/JPEG (or the loaded file) is
+    // only kept when there is no WebP or a fallback was asked for
+    pool.parallel_for(tex_lst.size(), [&](size_t i) {
+        if (tex_cached[i]) {
+            return;
+        }
+        if (options.max_texture_size > 0) {
+            tex_lst[i].Downsample(options.max_texture_size);
+        }
+        if (tex_webp[i] >= 0) {
+            tex_lst[i].encode_webp(tex_webp[i]);
+        }
+        if (tex_lst[i].webp.empty() || options.webp_options.fallback) {
+            tex_lst[i].encode(options.jpeg_options, pool);
+        } else {
+            tex_lst[i].code.clear();
+        }
+    });
+    if (cache != nullptr) {
+        for (size_t i = 0; i < tex_lst.size(); i++) {
+            if (!tex_cached[i]) {
+                cache->store_texture(tex_keys[i], tex_lst[i]);
+            }
+        }
+    }
 
+    Mid::TextureFileSet texture_files;
+    auto add_image = [&](const Mid::Image& img_mid, const std::vector<uint8_t>& code, const std::string& mime_type) {
+        tinygltf::Image img_out;
         img_out.width = img_mid.width;
         img_out.height = img_mid.height;
         img_out.component = 4;
         img_out.bits = 8;
         img_out.pixel_type = TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE;
-        img_out.mimeType = img_mid.mimeType;
-
-        view_id = m_out.bufferViews.size();
-        {
-            tinygltf::BufferView view;
-            view.buffer = 0;
-            view.byteOffset = offset;
-            view.byteLength = length;
-            m_out.bufferViews.push_back(view);
+        img_out.mimeType = mime_type;
+        if (options.external_textures) {
+            // only the loaded bytes may be linked, never the WebP made from them
+            bool pass_through = &code == &img_mid.code;
+            img_out.uri = texture_files.add(code, mime_type, pass_through ? img_mid.source : std::string());
+        } else {
+            img_out.bufferView = writer.emit_view(code.data(), code.size());
         }
-        img_out.bufferView = view_id;
+        m_out.images.push_back(img_out);
+        return (int)m_out.images.size() - 1;
+    };
+
+    bool webp_used = false;
+    bool webp_required = false;
+    m_out.textures.resize(tex_lst.size());
+    for (size_t i = 0; i < tex_lst.size(); i++) {
+        Mid::Image& img_mid = tex_lst[i];
+        tinygltf::Texture& tex_out = m_out.textures[i];
 
         tex_out.sampler = 0;
-        tex_out.source = i;
+        if (!img_mid.webp.empty()) {
+            tinygltf::Value::Object ext;
+            ext["source"] = tinygltf::Value(add_image(img_mid, img_mid.webp, "image/webp"));
+            tex_out.extensions["EXT_texture_webp"] = tinygltf::Value(ext);
+            webp_used = true;
+        }
+        if (!img_mid.code.empty()) {
+            tex_out.source = add_image(img_mid, img_mid.code, img_mid.mimeType);
+        } else {
+            webp_required = true;
+        }
+    }
+    if (webp_used) {
+        m_out.extensionsUsed.push_back("EXT_texture_webp");
+    }
+    if (webp_required) {
+        m_out.extensionsRequired.push_back("EXT_texture_webp");
+    }
+    if (options.external_textures) {
+        std::vector<std::string> errors;
+        std::string output_dir = std::filesystem::path(outputPath).parent_path().u8string();
+        if (!texture_files.write(output_dir.empty() ? "." : output_dir, pool, errors)) {
+            for (size_t i = 0; i < errors.size(); i++) {
+                printf("%s\n", errors[i].c_str());
+            }
+            return 1;
+        }
     }
 
     m_out.materials.resize(material_lst.size());
@@ -1945,439 +2114,769 @@ int main(int argc, char* argv[])
         iter++;
     }
 
-    queue_prim.push({ root_prim, -1, "" });
+    for (size_t i = 0; i < skinned_mesh_lst.size(); i++) {
+        auto& mesh = skinned_mesh_lst[i];
+        int skin_idx = m_out.nodes[mesh.node_id].skin;
+        if (skin_idx < 0 || skin_idx >= (int)skel_lst.size())
+            continue;
+        SkelInfo& skel = skel_lst[skin_idx];
+        size_t count = std::min(mesh.points.size(), mesh.joints.size());
+        Mid::ComputeJointBounds(pool, mesh.points.data(), count, mesh.joints.data(), mesh.weights.data(), skel.inv_bind, joint_weight_epsilon, skel.joint_bounds);
+    }
+
+    for (size_t i = 0; i < skel_lst.size(); i++) {
+        auto& skel = skel_lst[i];
+        std::vector<tinygltf::Value> joint_bounds;
+        for (size_t j = 0; j < skel.joint_bounds.size(); j++) {
+            if (!skel.joint_bounds[j].valid())
+                continue;
+            tinygltf::Value::Object bounds = aabb_value(skel.joint_bounds[j]).Get<tinygltf::Value::Object>();
+            bounds["joint"] = tinygltf::Value((int)j);
+            joint_bounds.push_back(tinygltf::Value(bounds));
+        }
+        if (joint_bounds.size() > 0) {
+            tinygltf::Value::Object extras;
+            extras["jointBounds"] = tinygltf::Value(joint_bounds);
+            m_out.skins[i].extras = tinygltf::Value(extras);
+        }
+    }
+
+    // SkelAnimation prims in traversal order. Each clip is converted on its own task into a
+    // ClipOutput, then the clips are emitted in this order so accessor and bufferView numbering
+    // does not depend on scheduling.
+    std::vector<const tinyusdz::SkelAnimation*> anim_lst;
+    if (options.animation) {
+        queue_prim.push({ root_prim, -1, "" });
+    }
     while (!queue_prim.empty()) {
         Prim prim = queue_prim.front();
         queue_prim.pop();
         std::string path = prim.base_path + "/" + prim.prim->element_path().full_path_name();
 
         if (prim.prim->data().type_id() == tinyusdz::value::TYPE_ID_SKELANIMATION) {
-            auto* anim_in = prim.prim->data().as<tinyusdz::SkelAnimation>();
-            int id_anim = (int)m_out.animations.size();
-            m_out.animations.resize(id_anim + 1);
-
-            tinygltf::Animation& anim_out = m_out.animations[id_anim];
-            anim_out.name = anim_in->name;
+            anim_lst.push_back(prim.prim->data().as<tinyusdz::SkelAnimation>());
+        }
 
-            bool has_translations = anim_in->translations.get_value().has_value();
-            bool has_rotations = anim_in->rotations.get_value().has_value();
-            bool has_scales = anim_in->scales.get_value().has_value();
+        if (prim.prim->data().type_id() != tinyusdz::value::TYPE_ID_MATERIAL
+            && prim.prim->data().type_id() != tinyusdz::value::TYPE_ID_GEOM_MESH) {
+            int id_node_base = (int)(m_out.nodes.size() - 1);
+            size_t num_children = prim.prim->children().size();
+            for (size_t i = 0; i < num_children; i++) {
+                queue_prim.push({ &prim.prim->children()[i], id_node_base, path });
+            }
+        }
+    }
 
-            auto joints = anim_in->joints.get_value().value();
-            for (size_t i = 0; i < joints.size(); i++) {
-                std::string joint_path = joints[i].str();
-                auto iter = joint_map.find(joint_path);
-                if (iter == joint_map.end())
-                    continue;
-                int id_node = joint_map[joint_path];
+    // sampler.input/output index arrays until the clip is emitted
+    struct ClipArray {
+        std::vector<float> data;
+        int components;
+        bool bounds;
+    };
 
-                if (has_translations) {
-                    auto translations = anim_in->translations.get_value().value().get_timesamples().get_samples();
+    struct ClipOutput {
+        tinygltf::Animation anim;
+        std::vector<ClipArray> arrays;
 
-                    int id_channel = (int)anim_out.channels.size();
-                    anim_out.channels.resize(id_channel + 1);
-                    tinygltf::AnimationChannel& channel = anim_out.channels[id_channel];
-                    channel.target_node = id_node;
-                    channel.target_path = "translation";
+        int add(const float* data, size_t count, int components, bool bounds)
+        {
+            arrays.push_back({ std::vector<float>(data, data + count * components), components, bounds });
+            return (int)arrays.size() - 1;
+        }
+    };
 
-                    int id_sampler = (int)anim_out.samplers.size();
-                    channel.sampler = id_sampler;
+    std::vector<ClipOutput> clip_outputs(anim_lst.size());
+    pool.parallel_for(anim_lst.size(), [&](size_t c) {
+        const tinyusdz::SkelAnimation* anim_in = anim_lst[c];
+        ClipOutput& clip_out = clip_outputs[c];
+        tinygltf::Animation& anim_out = clip_out.anim;
+        anim_out.name = anim_in->name;
 
-                    anim_out.samplers.resize(id_sampler + 1);
-                    tinygltf::AnimationSampler& sampler = anim_out.samplers[id_sampler];
+        bool has_translations = anim_in->translations.get_value().has_value();
+        bool has_rotations = anim_in->rotations.get_value().has_value();
+        bool has_scales = anim_in->scales.get_value().has_value();
 
-                    std::vector<float> times(translations.size());
-                    std::vector<glm::vec3> values(translations.size());
+        auto joints = anim_in->joints.get_value().value();
+        for (size_t i = 0; i < joints.size(); i++) {
+            std::string joint_path = joints[i].str();
+            auto iter = joint_map.find(joint_path);
+            if (iter == joint_map.end())
+                continue;
+            int id_node = iter->second;
 
-                    for (size_t j = 0; j < translations.size(); j++) {
-                        times[j] = (float)(translations[j].t / time_codes_per_sec);
-                        auto tran_in = translations[j].value[i];
-                        values[j] = glm::vec3(tran_in[0], tran_in[1], tran_in[2]);
-                    }
+            if (has_translations) {
+                auto translations = anim_in->translations.get_value().value().get_timesamples().get_samples();
 
-                    float t0 = times[0];
-                    float t1 = times[times.size() - 1];
-
-                    offset = buf_out.data.size();
-                    length = sizeof(float) * times.size();
-                    buf_out.data.resize(offset + length);
-                    memcpy(buf_out.data.data() + offset, times.data(), length);
-
-                    view_id = m_out.bufferViews.size();
-                    {
-                        tinygltf::BufferView view;
-                        view.buffer = 0;
-                        view.byteOffset = offset;
-                        view.byteLength = length;
-                        m_out.bufferViews.push_back(view);
-                    }
+                int id_channel = (int)anim_out.channels.size();
+                anim_out.channels.resize(id_channel + 1);
+                tinygltf::AnimationChannel& channel = anim_out.channels[id_channel];
+                channel.target_node = id_node;
+                channel.target_path = "translation";
 
-                    acc_id = m_out.accessors.size();
-                    {
-                        tinygltf::Accessor acc;
-                        acc.bufferView = view_id;
-                        acc.byteOffset = 0;
-                        acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                        acc.count = times.size();
-                        acc.type = TINYGLTF_TYPE_SCALAR;
-                        acc.minValues = { t0 };
-                        acc.maxValues = { t1 };
-                        m_out.accessors.push_back(acc);
-                    }
+                int id_sampler = (int)anim_out.samplers.size();
+                channel.sampler = id_sampler;
 
-                    sampler.input = acc_id;
+                anim_out.samplers.resize(id_sampler + 1);
+                tinygltf::AnimationSampler& sampler = anim_out.samplers[id_sampler];
 
-                    offset = buf_out.data.size();
-                    length = sizeof(glm::vec3) * values.size();
-                    buf_out.data.resize(offset + length);
-                    memcpy(buf_out.data.data() + offset, values.data(), length);
+                std::vector<float> times(translations.size());
+                std::vector<glm::vec3> values(translations.size());
 
-                    view_id = m_out.bufferViews.size();
-                    {
-                        tinygltf::BufferView view;
-                        view.buffer = 0;
-                        view.byteOffset = offset;
-                        view.byteLength = length;
-                        m_out.bufferViews.push_back(view);
-                    }
+                for (size_t j = 0; j < translations.size(); j++) {
+                    times[j] = (float)(translations[j].t / time_codes_per_sec);
+                    auto tran_in = translations[j].value[i];
+                    values[j] = glm::vec3(tran_in[0], tran_in[1], tran_in[2]);
+                }
 
-                    acc_id = m_out.accessors.size();
-                    {
-                        tinygltf::Accessor acc;
-                        acc.bufferView = view_id;
-                        acc.byteOffset = 0;
-                        acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                        acc.count = values.size();
-                        acc.type = TINYGLTF_TYPE_VEC3;
-                        m_out.accessors.push_back(acc);
-                    }
+                sampler.input = clip_out.add(times.data(), times.size(), 1, true);
+                sampler.output = clip_out.add(&values.data()->x, values.size(), 3, false);
+            }
 
-                    sampler.output = acc_id;
-                }
+            if (has_rotations) {
+                auto rotations = anim_in->rotations.get_value().value().get_timesamples().get_samples();
 
-                if (has_rotations) {
-                    auto rotations = anim_in->rotations.get_value().value().get_timesamples().get_samples();
+                int id_channel = (int)anim_out.channels.size();
+                anim_out.channels.resize(id_channel + 1);
+                tinygltf::AnimationChannel& channel = anim_out.channels[id_channel];
+                channel.target_node = id_node;
+                channel.target_path = "rotation";
 
-                    int id_channel = (int)anim_out.channels.size();
-                    anim_out.channels.resize(id_channel + 1);
-                    tinygltf::AnimationChannel& channel = anim_out.channels[id_channel];
-                    channel.target_node = id_node;
-                    channel.target_path = "rotation";
+                int id_sampler = (int)anim_out.samplers.size();
+                channel.sampler = id_sampler;
 
-                    int id_sampler = (int)anim_out.samplers.size();
-                    channel.sampler = id_sampler;
+                anim_out.samplers.resize(id_sampler + 1);
+                tinygltf::AnimationSampler& sampler = anim_out.samplers[id_sampler];
 
-                    anim_out.samplers.resize(id_sampler + 1);
-                    tinygltf::AnimationSampler& sampler = anim_out.samplers[id_sampler];
+                std::vector<float> times(rotations.size());
+                std::vector<glm::quat> values(rotations.size());
 
-                    std::vector<float> times(rotations.size());
-                    std::vector<glm::quat> values(rotations.size());
+                for (size_t j = 0; j < rotations.size(); j++) {
+                    times[j] = (float)(rotations[j].t / time_codes_per_sec);
+                    auto rot_in = rotations[j].value[i];
+                    values[j] = glm::quat(rot_in.real, rot_in.imag[0], rot_in.imag[1], rot_in.imag[2]);
+                }
 
-                    for (size_t j = 0; j < rotations.size(); j++) {
-                        times[j] = (float)(rotations[j].t / time_codes_per_sec);
-                        auto rot_in = rotations[j].value[i];
-                        values[j] = glm::quat(rot_in.real, rot_in.imag[0], rot_in.imag[1], rot_in.imag[2]);
-                    }
+                sampler.input = clip_out.add(times.data(), times.size(), 1, true);
 
-                    float t0 = times[0];
-                    float t1 = times[times.size() - 1];
-
-                    offset = buf_out.data.size();
-                    length = sizeof(float) * times.size();
-                    buf_out.data.resize(offset + length);
-                    memcpy(buf_out.data.data() + offset, times.data(), length);
-
-                    view_id = m_out.bufferViews.size();
-                    {
-                        tinygltf::BufferView view;
-                        view.buffer = 0;
-                        view.byteOffset = offset;
-                        view.byteLength = length;
-                        m_out.bufferViews.push_back(view);
-                    }
+                std::vector<glm::vec4> rot_xyzw(values.size());
+                for (size_t k = 0; k < values.size(); k++) {
+                    rot_xyzw[k] = glm::vec4(values[k].x, values[k].y, values[k].z, values[k].w);
+                }
+                sampler.output = clip_out.add(&rot_xyzw.data()->x, rot_xyzw.size(), 4, false);
+            }
 
-                    acc_id = m_out.accessors.size();
-                    {
-                        tinygltf::Accessor acc;
-                        acc.bufferView = view_id;
-                        acc.byteOffset = 0;
-                        acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                        acc.count = times.size();
-                        acc.type = TINYGLTF_TYPE_SCALAR;
-                        acc.minValues = { t0 };
-                        acc.maxValues = { t1 };
-                        m_out.accessors.push_back(acc);
-                    }
-                    sampler.input = acc_id;
-
-                    offset = buf_out.data.size();
-                    length = sizeof(float) * 4 * values.size();
-                    buf_out.data.resize(offset + length);
-                    for (size_t k = 0; k < values.size(); k++) {
-                        float* p_out = (float*)(buf_out.data.data() + offset) + k * 4;
-                        glm::quat rot = values[k];
-                        p_out[0] = rot.x;
-                        p_out[1] = rot.y;
-                        p_out[2] = rot.z;
-                        p_out[3] = rot.w;
-                    }
+            if (has_scales) {
+                auto scales = anim_in->scales.get_value().value().get_timesamples().get_samples();
 
-                    view_id = m_out.bufferViews.size();
-                    {
-                        tinygltf::BufferView view;
-                        view.buffer = 0;
-                        view.byteOffset = offset;
-                        view.byteLength = length;
-                        m_out.bufferViews.push_back(view);
-                    }
+                int id_channel = (int)anim_out.channels.size();
+                anim_out.channels.resize(id_channel + 1);
+                tinygltf::AnimationChannel& channel = anim_out.channels[id_channel];
+                channel.target_node = id_node;
+                channel.target_path = "scale";
 
-                    acc_id = m_out.accessors.size();
-                    {
-                        tinygltf::Accessor acc;
-                        acc.bufferView = view_id;
-                        acc.byteOffset = 0;
-                        acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                        acc.count = values.size();
-                        acc.type = TINYGLTF_TYPE_VEC4;
-                        m_out.accessors.push_back(acc);
-                    }
+                int id_sampler = (int)anim_out.samplers.size();
+                channel.sampler = id_sampler;
 
-                    sampler.output = acc_id;
-                }
-
-#if 0
-				if (has_scales)
-				{
-					auto scales = anim_in->scales.GetValue().value().ts.GetSamples();
-
-					int id_channel = (int)anim_out.channels.size();
-					anim_out.channels.resize(id_channel + 1);
-					tinygltf::AnimationChannel& channel = anim_out.channels[id_channel];
-					channel.target_node = id_node;
-					channel.target_path = "scale";
-
-					int id_sampler = (int)anim_out.samplers.size();
-					channel.sampler = id_sampler;
-
-					anim_out.samplers.resize(id_sampler + 1);
-					tinygltf::AnimationSampler& sampler = anim_out.samplers[id_sampler];
-
-					std::vector<float> times(scales.size());
-					std::vector<glm::vec3> values(scales.size());
-
-					for (size_t j = 0; j < scales.size(); j++)
-					{
-						times[j] = (float)(scales[j].t / time_codes_per_sec);
-						auto scale_in = scales[j].value[i];
-						values[j] = glm::vec3(half_to_float(scale_in[0]), half_to_float(scale_in[1]), half_to_float(scale_in[2]));
-					}
-
-					float t0 = times[0];
-					float t1 = times[times.size() - 1];
-
-					offset = buf_out.data.size();
-					length = sizeof(float) * times.size();
-					buf_out.data.resize(offset + length);
-					memcpy(buf_out.data.data() + offset, times.data(), length);
-
-					view_id = m_out.bufferViews.size();
-					{
-						tinygltf::BufferView view;
-						view.buffer = 0;
-						view.byteOffset = offset;
-						view.byteLength = length;
-						m_out.bufferViews.push_back(view);
-					}
-
-					acc_id = m_out.accessors.size();
-					{
-						tinygltf::Accessor acc;
-						acc.bufferView = view_id;
-						acc.byteOffset = 0;
-						acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-						acc.count = times.size();
-						acc.type = TINYGLTF_TYPE_SCALAR;
-						acc.minValues = { t0 };
-						acc.maxValues = { t1 };
-						m_out.accessors.push_back(acc);
-					}
-
-					sampler.input = acc_id;
-
-					offset = buf_out.data.size();
-					length = sizeof(glm::vec3) * values.size();
-					buf_out.data.resize(offset + length);
-					memcpy(buf_out.data.data() + offset, values.data(), length);
-
-					view_id = m_out.bufferViews.size();
-					{
-						tinygltf::BufferView view;
-						view.buffer = 0;
-						view.byteOffset = offset;
-						view.byteLength = length;
-						m_out.bufferViews.push_back(view);
-					}
-
-					acc_id = m_out.accessors.size();
-					{
-						tinygltf::Accessor acc;
-						acc.bufferView = view_id;
-						acc.byteOffset = 0;
-						acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-						acc.count = values.size();
-						acc.type = TINYGLTF_TYPE_VEC3;
-						m_out.accessors.push_back(acc);
-					}
-
-					sampler.output = acc_id;
-				}
+                anim_out.samplers.resize(id_sampler + 1);
+                tinygltf::AnimationSampler& sampler = anim_out.samplers[id_sampler];
 
-#endif
-            }
+                std::vector<float> times(scales.size());
+                std::vector<glm::vec3> values(scales.size());
 
-            if (anim_in->blendShapes.get_value().has_value()) {
-                auto bs_names = anim_in->blendShapes.get_value().value();
-                std::vector<std::vector<MorphIdx>> morphIdx(bs_names.size());
-                for (size_t i = 0; i < bs_names.size(); i++) {
-                    auto iter = morph_map.find(bs_names[i].str());
-                    if (iter != morph_map.end()) {
-                        morphIdx[i] = iter->second;
-                    }
+                for (size_t j = 0; j < scales.size(); j++) {
+                    times[j] = (float)(scales[j].t / time_codes_per_sec);
+                    auto scale_in = scales[j].value[i];
+                    values[j] = glm::vec3(tinyusdz::value::half_to_float(scale_in[0]), tinyusdz::value::half_to_float(scale_in[1]), tinyusdz::value::half_to_float(scale_in[2]));
                 }
 
-                struct MorphChannel {
-                    std::vector<float> times;
-                    std::vector<float> weights;
-                };
+                sampler.input = clip_out.add(times.data(), times.size(), 1, true);
+                sampler.output = clip_out.add(&values.data()->x, values.size(), 3, false);
+            }
+        }
 
-                std::unordered_map<int, MorphChannel> mchans;
+        {
+            int skin_idx = -1;
+            for (size_t i = 0; i < joints.size() && skin_idx < 0; i++) {
+                auto iter = joint_map.find(joints[i].str());
+                if (iter != joint_map.end()) {
+                    skin_idx = joint_skin_map.at(iter->second).skin_idx;
+                }
+            }
 
-                auto weights = anim_in->blendShapeWeights.get_value().value().get_timesamples().get_samples();
-                size_t num_time_samples = weights.size();
+            if (skin_idx >= 0 && (has_translations || has_rotations || has_scales)) {
+                SkelInfo& skel = skel_lst[skin_idx];
+
+                Mid::ClipSamples clip;
+                clip.track_of_joint.resize(skel.parents.size(), -1);
+                for (size_t i = 0; i < joints.size(); i++) {
+                    auto iter = joint_map.find(joints[i].str());
+                    if (iter == joint_map.end())
+                        continue;
+                    JointRef ref = joint_skin_map.at(iter->second);
+                    if (ref.skin_idx == skin_idx) {
+                        clip.track_of_joint[ref.joint_idx] = (int)i;
+                    }
+                }
 
-                for (size_t i = 0; i < morphIdx.size(); i++) {
-                    auto targets = morphIdx[i];
-                    for (size_t j = 0; j < targets.size(); j++) {
-                        auto target = targets[j];
-                        auto iter = mchans.find(target.node_idx);
-                        if (iter == mchans.end()) {
-                            int num_targets = target_counts[target.node_idx];
-                            mchans[target.node_idx] = { std::vector<float>(num_time_samples), std::vector<float>(num_time_samples * num_targets) };
+                if (has_translations) {
+                    auto translations = anim_in->translations.get_value().value().get_timesamples().get_samples();
+                    clip.trans_times.resize(translations.size());
+                    clip.translations.resize(translations.size());
+                    for (size_t j = 0; j < translations.size(); j++) {
+                        clip.trans_times[j] = translations[j].t;
+                        auto& values = clip.translations[j];
+                        values.resize(translations[j].value.size());
+                        for (size_t k = 0; k < values.size(); k++) {
+                            auto tran_in = translations[j].value[k];
+                            values[k] = glm::vec3(tran_in[0], tran_in[1], tran_in[2]);
                         }
                     }
                 }
 
-                for (size_t i = 0; i < weights.size(); i++) {
-                    float t = (float)(weights[i].t / time_codes_per_sec);
-                    auto v = weights[i].value;
-                    for (size_t j = 0; j < v.size(); j++) {
-                        float w = v[j];
-                        auto targets = morphIdx[j];
-                        for (size_t k = 0; k < targets.size(); k++) {
-                            auto target = targets[k];
-                            auto& mchan = mchans[target.node_idx];
-                            int num_targets = target_counts[target.node_idx];
-                            mchan.times[i] = t;
-                            mchan.weights[i * num_targets + target.morph_idx] = w;
+                if (has_rotations) {
+                    auto rotations = anim_in->rotations.get_value().value().get_timesamples().get_samples();
+                    clip.rot_times.resize(rotations.size());
+                    clip.rotations.resize(rotations.size());
+                    for (size_t j = 0; j < rotations.size(); j++) {
+                        clip.rot_times[j] = rotations[j].t;
+                        auto& values = clip.rotations[j];
+                        values.resize(rotations[j].value.size());
+                        for (size_t k = 0; k < values.size(); k++) {
+                            auto rot_in = rotations[j].value[k];
+                            values[k] = glm::quat(rot_in.real, rot_in.imag[0], rot_in.imag[1], rot_in.imag[2]);
                         }
                     }
                 }
 
-                int id_channel = (int)anim_out.channels.size();
-                anim_out.channels.resize(id_channel + mchans.size());
-
-                auto iter = mchans.begin();
-                while (iter != mchans.end()) {
-                    tinygltf::AnimationChannel& channel = anim_out.channels[id_channel];
-                    int id_node = iter->first;
-                    MorphChannel& mchan = iter->second;
-
-                    channel.target_node = id_node;
-                    channel.target_path = "weights";
-
-                    int id_sampler = (int)anim_out.samplers.size();
-                    channel.sampler = id_sampler;
-
-                    anim_out.samplers.resize(id_sampler + 1);
-                    tinygltf::AnimationSampler& sampler = anim_out.samplers[id_sampler];
-
-                    float t0 = mchan.times[0];
-                    float t1 = mchan.times[mchan.times.size() - 1];
-
-                    offset = buf_out.data.size();
-                    length = sizeof(float) * mchan.times.size();
-                    buf_out.data.resize(offset + length);
-                    memcpy(buf_out.data.data() + offset, mchan.times.data(), length);
-
-                    view_id = m_out.bufferViews.size();
-                    {
-                        tinygltf::BufferView view;
-                        view.buffer = 0;
-                        view.byteOffset = offset;
-                        view.byteLength = length;
-                        m_out.bufferViews.push_back(view);
+                if (has_scales) {
+                    auto scales = anim_in->scales.get_value().value().get_timesamples().get_samples();
+                    clip.scale_times.resize(scales.size());
+                    clip.scales.resize(scales.size());
+                    for (size_t j = 0; j < scales.size(); j++) {
+                        clip.scale_times[j] = scales[j].t;
+                        auto& values = clip.scales[j];
+                        values.resize(scales[j].value.size());
+                        for (size_t k = 0; k < values.size(); k++) {
+                            auto scale_in = scales[j].value[k];
+                            values[k] = glm::vec3(tinyusdz::value::half_to_float(scale_in[0]), tinyusdz::value::half_to_float(scale_in[1]), tinyusdz::value::half_to_float(scale_in[2]));
+                        }
                     }
+                }
 
-                    acc_id = m_out.accessors.size();
-                    {
-                        tinygltf::Accessor acc;
-                        acc.bufferView = view_id;
-                        acc.byteOffset = 0;
-                        acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                        acc.count = mchan.times.size();
-                        acc.type = TINYGLTF_TYPE_SCALAR;
-                        acc.minValues = { t0 };
-                        acc.maxValues = { t1 };
-                        m_out.accessors.push_back(acc);
-                    }
-                    sampler.input = acc_id;
-
-                    offset = buf_out.data.size();
-                    length = sizeof(float) * mchan.weights.size();
-                    buf_out.data.resize(offset + length);
-                    memcpy(buf_out.data.data() + offset, mchan.weights.data(), length);
-
-                    view_id = m_out.bufferViews.size();
-                    {
-                        tinygltf::BufferView view;
-                        view.buffer = 0;
-                        view.byteOffset = offset;
-                        view.byteLength = length;
-                        m_out.bufferViews.push_back(view);
+                Mid::AABB clip_bounds = Mid::ComputeClipBounds(pool, clip, skel.parents, skel.rest_local, skel.joint_bounds);
+                if (clip_bounds.valid()) {
+                    tinygltf::Value::Object extras;
+                    extras["skin"] = tinygltf::Value(skin_idx);
+                    extras["bounds"] = aabb_value(clip_bounds);
+                    anim_out.extras = tinygltf::Value(extras);
+                }
+            }
+        }
+
+        if (anim_in->blendShapes.get_value().has_value()) {
+            auto bs_names = anim_in->blendShapes.get_value().value();
+            std::vector<std::vector<MorphIdx>> morphIdx(bs_names.size());
+            for (size_t i = 0; i < bs_names.size(); i++) {
+                auto iter = morph_map.find(bs_names[i].str());
+                if (iter != morph_map.end()) {
+                    morphIdx[i] = iter->second;
+                }
+            }
+
+            struct MorphChannel {
+                std::vector<float> times;
+                std::vector<float> weights;
+            };
+
+            // ordered by node so the channel, sampler and accessor order does not depend on hashing
+            std::map<int, MorphChannel> mchans;
+
+            auto weights = anim_in->blendShapeWeights.get_value().value().get_timesamples().get_samples();
+            size_t num_time_samples = weights.size();
+
+            for (size_t i = 0; i < morphIdx.size(); i++) {
+                auto targets = morphIdx[i];
+                for (size_t j = 0; j < targets.size(); j++) {
+                    auto target = targets[j];
+                    auto iter = mchans.find(target.node_idx);
+                    if (iter == mchans.end()) {
+                        int num_targets = target_counts.at(target.node_idx);
+                        mchans[target.node_idx] = { std::vector<float>(num_time_samples), std::vector<float>(num_time_samples * num_targets) };
                     }
+                }
+            }
 
-                    acc_id = m_out.accessors.size();
-                    {
-                        tinygltf::Accessor acc;
-                        acc.bufferView = view_id;
-                        acc.byteOffset = 0;
-                        acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
-                        acc.count = mchan.weights.size();
-                        acc.type = TINYGLTF_TYPE_SCALAR;
-                        m_out.accessors.push_back(acc);
+            for (size_t i = 0; i < weights.size(); i++) {
+                float t = (float)(weights[i].t / time_codes_per_sec);
+                auto v = weights[i].value;
+                for (size_t j = 0; j < v.size(); j++) {
+                    float w = v[j];
+                    auto targets = morphIdx[j];
+                    for (size_t k = 0; k < targets.size(); k++) {
+                        auto target = targets[k];
+                        auto& mchan = mchans[target.node_idx];
+                        int num_targets = target_counts.at(target.node_idx);
+                        mchan.times[i] = t;
+                        mchan.weights[i * num_targets + target.morph_idx] = w;
                     }
+                }
+            }
 
-                    sampler.output = acc_id;
+            int id_channel = (int)anim_out.channels.size();
+            anim_out.channels.resize(id_channel + mchans.size());
 
-                    id_channel++;
-                    iter++;
-                }
+            auto iter = mchans.begin();
+            while (iter != mchans.end()) {
+                tinygltf::AnimationChannel& channel = anim_out.channels[id_channel];
+                int id_node = iter->first;
+                MorphChannel& mchan = iter->second;
+
+                channel.target_node = id_node;
+                channel.target_path = "weights";
+
+                int id_sampler = (int)anim_out.samplers.size();
+                channel.sampler = id_sampler;
+
+                anim_out.samplers.resize(id_sampler + 1);
+                tinygltf::AnimationSampler& sampler = anim_out.samplers[id_sampler];
+
+                sampler.input = clip_out.add(mchan.times.data(), mchan.times.size(), 1, true);
+                sampler.output = clip_out.add(mchan.weights.data(), mchan.weights.size(), 1, false);
+
+                id_channel++;
+                iter++;
             }
         }
+    });
+
+    for (size_t c = 0; c < clip_outputs.size(); c++) {
+        ClipOutput& clip_out = clip_outputs[c];
+        std::vector<int> acc_ids(clip_out.arrays.size());
+        for (size_t k = 0; k < clip_out.arrays.size(); k++) {
+            const ClipArray& arr = clip_out.arrays[k];
+            size_t count = arr.data.size() / arr.components;
+            if (arr.components == 4) {
+                acc_ids[k] = writer.emit_accessor<float, 4>((const glm::vec4*)arr.data.data(), count, 0, arr.bounds);
+            } else if (arr.components == 3) {
+                acc_ids[k] = writer.emit_accessor<float, 3>((const glm::vec3*)arr.data.data(), count, 0, arr.bounds);
+            } else {
+                acc_ids[k] = writer.emit_accessor<float, 1>(arr.data.data(), count, 0, arr.bounds);
+            }
+        }
+        for (size_t k = 0; k < clip_out.anim.samplers.size(); k++) {
+            tinygltf::AnimationSampler& sampler = clip_out.anim.samplers[k];
+            sampler.input = acc_ids[sampler.input];
+            sampler.output = acc_ids[sampler.output];
+        }
+        m_out.animations.push_back(std::move(clip_out.anim));
+    }
 
-        if (prim.prim->data().type_id() != tinyusdz::value::TYPE_ID_MATERIAL
-            && prim.prim->data().type_id() != tinyusdz::value::TYPE_ID_GEOM_MESH) {
-            int id_node_base = (int)(m_out.nodes.size() - 1);
-            size_t num_children = prim.prim->children().size();
-            for (size_t i = 0; i < num_children; i++) {
-                queue_prim.push({ &prim.prim->children()[i], id_node_base, path });
+    Mid::BakeStaticDeformers(m_out, writer, pool);
+    // the validator only checks the layout of Draco streams, so the contents they compress
+    // (index ranges, joints, weights) are validated before compression
+    std::vector<std::string> errors;
+    if (options.validate && options.draco) {
+        Mid::ValidateModel(m_out, pool, errors);
+    }
+    if (options.draco) {
+        Mid::CompressDraco(m_out, writer, pool, options.draco_options);
+    }
+    Mid::PruneUnusedData(m_out);
+
+    int exit_code = 0;
+    if (options.validate) {
+        std::vector<std::string> final_errors;
+        Mid::ValidateModel(m_out, pool, final_errors);
+        for (size_t i = 0; i < final_errors.size(); i++) {
+            if (std::find(errors.begin(), errors.end(), final_errors[i]) == errors.end()) {
+                errors.push_back(final_errors[i]);
             }
         }
+        for (size_t i = 0; i < errors.size(); i++) {
+            printf("validate: %s\n", errors[i].c_str());
+        }
+        if (!errors.empty()) {
+            exit_code = 1;
+        }
     }
 
+    // written under a temporary name and renamed, so an interrupted run never leaves a partial
+    // file where a finished one is expected
+    std::string tmp_path = outputPath + ".tmp";
+    std::error_code ec;
     tinygltf::TinyGLTF gltf;
-    gltf.WriteGltfSceneToFile(&m_out, outputPath, true, true, false, false);
+    if (!gltf.WriteGltfSceneToFile(&m_out, tmp_path, true, true, false, false)) {
+        std::filesystem::remove(tmp_path, ec);
+        printf("cannot write %s\n", outputPath.c_str());
+        return 1;
+    }
+    std::filesystem::rename(tmp_path, outputPath, ec);
+    if (ec) {
+        std::filesystem::remove(tmp_path, ec);
+        printf("cannot write %s\n", outputPath.c_str());
+        return 1;
+    }
+
+    return exit_code;
+}
+
+inline bool LoadStage(const std::string& inputPath, tinyusdz::Stage& stage)
+{
+    std::string warn;
+    std::string err;
+
+    tinyusdz::USDLoadOptions options;
+    options.load_assets = false;
+    bool ret = tinyusdz::LoadUSDFromFile(inputPath, &stage, &warn, &err, options);
+    if (!ret) {
+        printf("%s\n", warn.c_str());
+        printf("%s\n", err.c_str());
+        return false;
+    }
 
-    return 0;
+    // tinyusdz::usda::SaveAsUSDA("output.usda", stage, &warn, &err);
+    return true;
+}
+
+// Loads one USD file and converts it, after writing the preview when preview_path is set. Every
+// extra output is converted from the same stage afterwards, so the file is parsed once however
+// many option sets it is exported with.
+inline int ConvertFile(const std::string& inputPath, const std::string& outputPath, const Mid::ConvertOptions& convert_options,
+    const std::string& preview_path, const Mid::ConvertOptions& preview_options, const std::vector<Mid::OutputProfile>& extra_outputs,
+    Mid::ThreadPool& pool, Mid::ImageCache& image_cache)
+{
+    std::string path_model
+        = std::filesystem::path(inputPath).parent_path().u8string();
+
+    tinyusdz::Stage stage;
+    if (!LoadStage(inputPath, stage)) {
+        return 1;
+    }
+
+    int exit_code = 0;
+    if (!preview_path.empty()) {
+        if (ConvertStage(stage, path_model, preview_path, preview_options, pool, image_cache) != 0) {
+            printf("Failed to write preview %s\n", preview_path.c_str());
+            exit_code = 1;
+        } else {
+            printf("Preview written to %s\n", preview_path.c_str());
+        }
+        fflush(stdout);
+    }
+
+    if (ConvertStage(stage, path_model, outputPath, convert_options, pool, image_cache) != 0) {
+        exit_code = 1;
+    }
+    for (size_t i = 0; i < extra_outputs.size(); i++) {
+        if (ConvertStage(stage, path_model, extra_outputs[i].path, extra_outputs[i].options, pool, image_cache) != 0) {
+            exit_code = 1;
+        }
+    }
+    return exit_code;
+}
+
+// --watch: converts once, then again every time the input or one of the textures it loaded is
+// saved. A texture edit keeps the stage and only rebuilds the textures made from that file; a
+// USD edit reloads the stage, and meshes whose inputs are unchanged are taken from the cache.
+// The output is replaced by a rename, so a viewer never reads a partial file.
+inline int WatchFile(const std::string& inputPath, const std::string& outputPath, const Mid::ConvertOptions& convert_options,
+    const std::string& preview_path, const Mid::ConvertOptions& preview_options, Mid::ThreadPool& pool, Mid::ImageCache& image_cache)
+{
+    Mid::FileWatcher watcher;
+    if (!watcher.valid() || !watcher.add(inputPath)) {
+        printf("--watch is not supported here (needs inotify)\n");
+        return 1;
+    }
+
+    std::string path_model
+        = std::filesystem::path(inputPath).parent_path().u8string();
+
+    Mid::ConvertCache cache;
+    auto stage = std::make_unique<tinyusdz::Stage>();
+    bool loaded = LoadStage(inputPath, *stage);
+    for (;;) {
+        if (loaded) {
+            auto start = std::chrono::steady_clock::now();
+            if (!preview_path.empty() && ConvertStage(*stage, path_model, preview_path, preview_options, pool, image_cache) != 0) {
+                printf("Failed to write preview %s\n", preview_path.c_str());
+            }
+            cache.begin();
+            int exit_code = ConvertStage(*stage, path_model, outputPath, convert_options, pool, image_cache, &cache);
+            cache.sweep();
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            printf("%s %s in %.0f ms (meshes %zu reused, %zu converted; textures %zu reused, %zu encoded)\n",
+                exit_code == 0 ? "Wrote" : "Failed to write", outputPath.c_str(), ms,
+                cache.mesh_hits, cache.mesh_misses, cache.texture_hits, cache.texture_misses);
+        }
+        fflush(stdout);
+
+        std::vector<std::string> textures = image_cache.paths();
+        for (size_t i = 0; i < textures.size(); i++) {
+            watcher.add(textures[i]);
+        }
+
+        std::vector<std::string> changed = watcher.wait();
+        if (changed.empty()) {
+            printf("--watch: waiting for changes failed\n");
+            return 1;
+        }
+        bool reload = false;
+        for (size_t i = 0; i < changed.size(); i++) {
+            if (changed[i] == inputPath) {
+                reload = true;
+            } else {
+                image_cache.invalidate(changed[i]);
+                cache.invalidate(changed[i]);
+            }
+        }
+        if (reload) {
+            stage = std::make_unique<tinyusdz::Stage>();
+            loaded = LoadStage(inputPath, *stage);
+        }
+    }
+}
+
+// Reads the conversion option at argv[i], moving i past its value. Returns 1 if it was one, 0 if
+// argv[i] is something else, and -1 (after printing why) if its value is invalid.
+inline int ParseConvertOption(int argc, char* argv[], int& i, Mid::ConvertOptions& options)
+{
+    std::string arg = argv[i];
+    if (arg == "--weld" && i + 1 < argc) {
+        options.weld_epsilon = (float)atof(argv[++i]);
+    } else if (arg == "--draco" && i + 1 < argc) {
+        options.draco = true;
+        options.draco_options.level = std::min(std::max(atoi(argv[++i]), 0), 10);
+    } else if (arg == "--draco-bits" && i + 1 < argc) {
+        sscanf(argv[++i], "%d,%d,%d,%d", &options.draco_options.position_bits, &options.draco_options.normal_bits, &options.draco_options.texcoord_bits, &options.draco_options.generic_bits);
+    } else if (arg == "--webp" && i + 1 < argc) {
+        if (!Mid::ParseWebPOptions(argv[++i], options.webp_options)) {
+            printf("Invalid --webp value: %s (quality, or role:quality,... with roles color, emissive, mr, sg, all)\n", argv[i]);
+            return -1;
+        }
+    } else if (arg == "--webp-fallback") {
+        options.webp_options.fallback = true;
+    } else if (arg == "--jpeg-quality" && i + 1 < argc) {
+        options.jpeg_options.quality = std::min(std::max(atoi(argv[++i]), 1), 100);
+    } else if (arg == "--jpeg-target" && i + 1 < argc) {
+        if (!Mid::ParseJpegTarget(argv[++i], options.jpeg_options)) {
+            printf("Invalid --jpeg-target value: %s (psnr:db, ssim:value or bytes:size)\n", argv[i]);
+            return -1;
+        }
+    } else if (arg == "--jpeg-subsampling" && i + 1 < argc) {
+        options.jpeg_options.subsampling = atoi(argv[++i]);
+        if (options.jpeg_options.subsampling != 444 && options.jpeg_options.subsampling != 422 && options.jpeg_options.subsampling != 420) {
+            printf("Invalid --jpeg-subsampling value: %s (444, 422 or 420)\n", argv[i]);
+            return -1;
+        }
+    } else if (arg == "--point-cell" && i + 1 < argc) {
+        options.point_cell_size = (size_t)std::max(atoll(argv[++i]), 1LL);
+    } else if (arg == "--curve-segments" && i + 1 < argc) {
+        options.curve_options.segments = std::min(std::max(atoi(argv[++i]), 1), 256);
+    } else if (arg == "--curve-ribbons") {
+        options.curve_options.ribbons = true;
+    } else if (arg == "--subdivide" && i + 1 < argc) {
+        options.subdiv_options.levels = atoi(argv[++i]);
+    } else if (arg == "--subdivide-target" && i + 1 < argc) {
+        options.subdiv_options.target_triangles = (size_t)std::max(atoll(argv[++i]), 0LL);
+    } else if (arg == "--external-textures") {
+        options.external_textures = true;
+    } else if (arg == "--validate") {
+        options.validate = true;
+    } else if (arg == "--triangles" && i + 1 < argc) {
+        options.triangle_budget = (size_t)std::max(atoll(argv[++i]), 0LL);
+    } else if (arg == "--max-texture" && i + 1 < argc) {
+        options.max_texture_size = std::max(atoi(argv[++i]), 0);
+    } else if (arg == "--no-animation") {
+        options.animation = false;
+    } else if (arg == "--no-morphs") {
+        options.morphs = false;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+inline void PrintUsage()
+{
+    printf("Usage: usd2glb input.usdc output.glb [--weld epsilon] [--threads n] [--jitter seed] [--validate]\n");
+    printf("               [--draco level] [--draco-bits position,normal,texcoord,generic] [--isa=scalar|sse4|avx2|avx512] [--isa-check] [--draco-check]\n");
+    printf("               [--webp [role:]quality,...] [--webp-fallback]\n");
+    printf("               [--jpeg-quality q] [--jpeg-target psnr:db|ssim:value|bytes:size] [--jpeg-subsampling 444|422|420]\n");
+    printf("               [--external-textures] [--point-cell max_points] [--curve-segments n] [--curve-ribbons]\n");
+    printf("               [--subdivide levels] [--subdivide-target triangles]\n");
+    printf("               [--triangles n] [--max-texture size] [--no-animation] [--no-morphs]\n");
+    printf("               [--preview preview.glb] [--preview-triangles n] [--preview-texture size] [--watch]\n");
+    printf("               [--also output.glb \"options\"]...\n");
+    printf("       usd2glb --batch jobs.txt [--workers n] [--batch-attempts n] [--batch-cache MB] [--journal path] [options]\n");
+    printf("       usd2glb --diff a.glb b.glb [--tolerance t]\n");
+}
+
+#if 1
+int main(int argc, char* argv[])
+{
+    std::string inputPath = "C:\\Users\\zhanx0o\\OneDrive - KAUST\\WorkingInProcess\\Usd\\assets\\Orc\\Orc.usd";
+    std::string outputPath = "C:\\Users\\zhanx0o\\OneDrive - KAUST\\WorkingInProcess\\Usd\\assets\\Orc\\Orc.gltf";
+
+    Mid::Isa isa = Mid::DetectIsa();
+    // worker count, 0 for one per hardware thread
+    int num_threads = 0;
+    // seed for randomized task delays in the thread pool, 0 for none
+    unsigned int jitter_seed = 0;
+    // compare two existing files instead of converting
+    bool diff = false;
+    double diff_tolerance = 1e-5;
+    Mid::ConvertOptions convert_options;
+    // --preview output, written first from the same stage with preview_options
+    std::string preview_path;
+    Mid::ConvertOptions preview_options;
+    // list of "input output" lines converted by forked workers instead of a single file
+    std::string batch_path;
+    Mid::BatchOptions batch_options;
+    // convert again whenever the input or its textures change
+    bool watch = false;
+    // --also output and its options, applied over convert_options once all of them are read
+    std::vector<std::pair<std::string, std::string>> also_args;
+    preview_options.triangle_budget = 100000;
+    preview_options.max_texture_size = 256;
+    preview_options.animation = false;
+    preview_options.morphs = false;
+
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        int parsed = ParseConvertOption(argc, argv, i, convert_options);
+        if (parsed < 0) {
+            return 1;
+        } else if (parsed > 0) {
+            continue;
+        }
+        std::string arg = argv[i];
+        if (arg.compare(0, 6, "--isa=") == 0) {
+            if (!Mid::ParseIsa(arg.substr(6), isa)) {
+                printf("Unknown --isa value: %s (scalar, sse4, avx2 or avx512)\n", arg.c_str() + 6);
+                return 1;
+            }
+        } else if (arg == "--threads" && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (arg == "--jitter" && i + 1 < argc) {
+            jitter_seed = (unsigned int)strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--diff") {
+            diff = true;
+        } else if (arg == "--tolerance" && i + 1 < argc) {
+            diff_tolerance = atof(argv[++i]);
+        } else if (arg == "--preview" && i + 1 < argc) {
+            preview_path = argv[++i];
+        } else if (arg == "--preview-triangles" && i + 1 < argc) {
+            preview_options.triangle_budget = (size_t)std::max(atoll(argv[++i]), 1LL);
+        } else if (arg == "--preview-texture" && i + 1 < argc) {
+            preview_options.max_texture_size = std::max(atoi(argv[++i]), 1);
+        } else if (arg == "--watch") {
+            watch = true;
+        } else if (arg == "--also" && i + 2 < argc) {
+            also_args.push_back({ argv[i + 1], argv[i + 2] });
+            i += 2;
+        } else if (arg == "--batch" && i + 1 < argc) {
+            batch_path = argv[++i];
+        } else if (arg == "--workers" && i + 1 < argc) {
+            batch_options.workers = atoi(argv[++i]);
+        } else if (arg == "--batch-attempts" && i + 1 < argc) {
+            batch_options.attempts = std::max(atoi(argv[++i]), 1);
+        } else if (arg == "--journal" && i + 1 < argc) {
+            batch_options.journal = argv[++i];
+        } else if (arg == "--batch-cache" && i + 1 < argc) {
+            batch_options.cache_bytes = (size_t)std::max(atoll(argv[++i]), 0LL) << 20;
+        } else if (arg == "--isa-check") {
+            return Mid::CheckKernels(stdout) ? 0 : 1;
+        } else if (arg == "--draco-check") {
+            return Mid::CheckDracoRoundTrip(stdout) ? 0 : 1;
+        } else {
+            args.push_back(arg);
+        }
+    }
+
+    Mid::Isa requested_isa = isa;
+    isa = Mid::SelectIsa(isa);
+    if (isa != requested_isa) {
+        printf("Requested %s is not supported on this machine, using %s\n", Mid::IsaName(requested_isa), Mid::IsaName(isa));
+    }
+
+    if (diff) {
+        if (args.size() < 2) {
+            printf("Usage: usd2glb --diff a.glb b.glb [--tolerance t] [--threads n]\n");
+            return 2;
+        }
+        Mid::ThreadPool diff_pool(num_threads);
+        return Mid::DiffFiles(args[0], args[1], diff_pool, diff_tolerance);
+    }
+
+    if (args.size() < 2 && batch_path.empty()) {
+        PrintUsage();
+        // return 0;
+    } else if (args.size() >= 2) {
+        inputPath = args[0];
+        outputPath = args[1];
+    }
+
+    // the preview keeps how curves and point clouds are laid out, everything that only adds
+    // fidelity or size (welding, subdivision, WebP, JPEG searches, Draco) stays off
+    preview_options.point_cell_size = convert_options.point_cell_size;
+    preview_options.curve_options = convert_options.curve_options;
+    preview_options.jpeg_options.subsampling = convert_options.jpeg_options.subsampling;
+
+    // each --also output starts from the main options and applies its own on top
+    std::vector<Mid::OutputProfile> also_outputs;
+    for (size_t i = 0; i < also_args.size(); i++) {
+        Mid::OutputProfile profile;
+        profile.path = also_args[i].first;
+        profile.options = convert_options;
+
+        std::vector<std::string> words;
+        std::istringstream tokens(also_args[i].second);
+        std::string word;
+        while (tokens >> word) {
+            words.push_back(word);
+        }
+        std::vector<char*> profile_argv = { argv[0] };
+        for (size_t j = 0; j < words.size(); j++) {
+            profile_argv.push_back(&words[j][0]);
+        }
+        for (int j = 1; j < (int)profile_argv.size(); j++) {
+            int parsed = ParseConvertOption((int)profile_argv.size(), profile_argv.data(), j, profile.options);
+            if (parsed < 0) {
+                return 1;
+            } else if (parsed == 0) {
+                printf("Unknown --also option: %s\n", profile_argv[j]);
+                return 1;
+            }
+        }
+        also_outputs.push_back(profile);
+    }
+    if (!also_outputs.empty() && (watch || !batch_path.empty())) {
+        printf("--also is only used for a single conversion, not with --watch or --batch\n");
+        PrintUsage();
+        return 2;
+    }
+
+    if (!batch_path.empty()) {
+        std::vector<Mid::BatchJob> jobs;
+        std::string err;
+        if (!Mid::ReadBatchJobs(batch_path, jobs, err)) {
+            printf("batch: %s\n", err.c_str());
+            return 1;
+        }
+        batch_options.threads = num_threads;
+        return Mid::RunBatch(jobs, batch_path, batch_options, [&](const Mid::BatchJob& job, Mid::ThreadPool& pool, Mid::ImageCache& image_cache) {
+            pool.set_jitter(jitter_seed);
+            return ConvertFile(job.input, job.output, convert_options, "", preview_options, {}, pool, image_cache);
+        });
+    }
+
+    Mid::ThreadPool pool(num_threads);
+    pool.set_jitter(jitter_seed);
+    // decoded source textures, shared by the preview, the full conversion and the --also outputs
+    Mid::ImageCache image_cache;
+    if (watch) {
+        return WatchFile(inputPath, outputPath, convert_options, preview_path, preview_options, pool, image_cache);
+    }
+    return ConvertFile(inputPath, outputPath, convert_options, preview_path, preview_options, also_outputs, pool, image_cache);
 }
 #endif
@@ -0,0 +1,45 @@
+# Converts every file of the synthetic corpus with --threads 1 and again with --threads THREADS
+# under randomized task delays (--jitter), and fails unless the outputs are byte-identical.
+#   cmake -DUSD2GLB=<exe> -DCORPUS=<dir> -DOUT=<dir> [-DTHREADS=n] -P determinism.cmake
+if(NOT THREADS)
+    set(THREADS 8)
+endif()
+
+file(GLOB inputs "${CORPUS}/*.usda")
+if(NOT inputs)
+    message(FATAL_ERROR "no .usda files in ${CORPUS}")
+endif()
+file(MAKE_DIRECTORY "${OUT}")
+
+# plain conversion, and one through the optional encoders with small point cells
+set(configs "default" "encoded")
+set(args_default "")
+set(args_encoded --draco 7 --webp 80 --point-cell 64 --weld 0.0001)
+
+function(convert input output)
+    execute_process(COMMAND "${USD2GLB}" "${input}" "${output}" ${ARGN}
+        RESULT_VARIABLE result OUTPUT_VARIABLE log ERROR_VARIABLE log)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "${USD2GLB} ${input} ${output} ${ARGN} failed (${result}):\n${log}")
+    endif()
+endfunction()
+
+foreach(input ${inputs})
+    get_filename_component(name "${input}" NAME_WE)
+    foreach(config ${configs})
+        set(serial "${OUT}/${name}_${config}_serial.glb")
+        convert("${input}" "${serial}" ${args_${config}} --threads 1)
+        file(SHA256 "${serial}" serial_hash)
+
+        foreach(seed 1 2 3)
+            set(parallel "${OUT}/${name}_${config}_jitter${seed}.glb")
+            convert("${input}" "${parallel}" ${args_${config}} --threads ${THREADS} --jitter ${seed})
+            file(SHA256 "${parallel}" parallel_hash)
+            if(NOT serial_hash STREQUAL parallel_hash)
+                message(FATAL_ERROR "${name} (${config}): --threads ${THREADS} --jitter ${seed} differs from --threads 1\n"
+                    "  ${serial}: ${serial_hash}\n  ${parallel}: ${parallel_hash}")
+            endif()
+        endforeach()
+        message(STATUS "${name} (${config}): ${serial_hash}")
+    endforeach()
+endforeach()
@@ -0,0 +1,46 @@
+# Runs --diff on real converter outputs: two conversions of the same file must match, a
+# Draco-compressed conversion must match the plain one within quantization tolerance, and two
+# different files must be reported as different.
+#   cmake -DUSD2GLB=<exe> -DCORPUS=<dir> -DOUT=<dir> -P diff.cmake
+file(GLOB inputs "${CORPUS}/*.usda")
+list(LENGTH inputs num_inputs)
+if(num_inputs LESS 2)
+    message(FATAL_ERROR "need at least two .usda files in ${CORPUS}")
+endif()
+file(MAKE_DIRECTORY "${OUT}")
+
+function(convert input output)
+    execute_process(COMMAND "${USD2GLB}" "${input}" "${output}" ${ARGN}
+        RESULT_VARIABLE result OUTPUT_VARIABLE log ERROR_VARIABLE log)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "${USD2GLB} ${input} ${output} ${ARGN} failed (${result}):\n${log}")
+    endif()
+endfunction()
+
+# expected is the --diff exit code: 0 same, 1 different
+function(expect_diff expected a b)
+    execute_process(COMMAND "${USD2GLB}" --diff "${a}" "${b}" ${ARGN}
+        RESULT_VARIABLE result OUTPUT_VARIABLE log ERROR_VARIABLE log)
+    if(NOT result EQUAL expected)
+        message(FATAL_ERROR "--diff ${a} ${b} ${ARGN} returned ${result}, expected ${expected}:\n${log}")
+    endif()
+endfunction()
+
+set(plain_outputs "")
+foreach(input ${inputs})
+    get_filename_component(name "${input}" NAME_WE)
+    set(plain "${OUT}/${name}_plain.gltf")
+    set(again "${OUT}/${name}_again.gltf")
+    set(draco "${OUT}/${name}_draco.gltf")
+    convert("${input}" "${plain}" --threads 1)
+    convert("${input}" "${again}" --threads 4)
+    convert("${input}" "${draco}" --draco 7 --draco-bits 14,12,12,10)
+    expect_diff(0 "${plain}" "${again}")
+    expect_diff(0 "${plain}" "${draco}" --tolerance 0.001)
+    list(APPEND plain_outputs "${plain}")
+    message(STATUS "${name}: plain, parallel and Draco outputs compare equal")
+endforeach()
+
+list(GET plain_outputs 0 first)
+list(GET plain_outputs 1 second)
+expect_diff(1 "${first}" "${second}")
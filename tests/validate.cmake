@@ -0,0 +1,26 @@
+# Converts every file of the synthetic corpus with --validate, which fails the conversion on any
+# structural problem of the written model (empty accessors, missing POSITION bounds, ...).
+#   cmake -DUSD2GLB=<exe> -DCORPUS=<dir> -DOUT=<dir> -P validate.cmake
+file(GLOB inputs "${CORPUS}/*.usda")
+if(NOT inputs)
+    message(FATAL_ERROR "no .usda files in ${CORPUS}")
+endif()
+file(MAKE_DIRECTORY "${OUT}")
+
+# full conversion, and a preview-sized triangle budget that has to simplify every mesh
+set(configs "full" "preview")
+set(args_full "")
+set(args_preview --triangles 8)
+
+foreach(input ${inputs})
+    get_filename_component(name "${input}" NAME_WE)
+    foreach(config ${configs})
+        set(output "${OUT}/${name}_${config}.glb")
+        execute_process(COMMAND "${USD2GLB}" "${input}" "${output}" --validate ${args_${config}}
+            RESULT_VARIABLE result OUTPUT_VARIABLE log ERROR_VARIABLE log)
+        if(NOT result EQUAL 0)
+            message(FATAL_ERROR "${name} (${config}): --validate failed (${result}):\n${log}")
+        endif()
+        message(STATUS "${name} (${config}): valid")
+    endforeach()
+endforeach()